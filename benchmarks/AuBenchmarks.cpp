@@ -1,12 +1,15 @@
 #include "au/AuEncoder.h"
 #include "au/AuDecoder.h"
+#include "au/BufferByteSource.h"
 #include "au/FileByteSource.h"
+#include "Dictionary.h"
 
 #include <benchmark/benchmark.h>
 
 #include <random>
 #include <sstream>
 #include <string.h>
+#include <unistd.h>
 
 static void BM_FileByteSource(benchmark::State &state) {
   size_t buffSz = state.range(0);
@@ -125,6 +128,43 @@ BENCHMARK_CAPTURE(BM_StringInternLookup, Forced_Long,    true,  25)->Range(1, 1<
 BENCHMARK_CAPTURE(BM_StringInternLookup, Unforced_Short, false,  1)->Range(1, 1<<16);
 BENCHMARK_CAPTURE(BM_StringInternLookup, Unforced_Long,  false, 25)->Range(1, 1<<16);
 
+// recycles a dictionary and fills it with range(0) entries too long for the
+// small string optimization, then looks each one up, as tail/grep do after
+// every dictionary reset.
+static void BM_DictionaryFill(benchmark::State &state) {
+  size_t entries = static_cast<size_t>(state.range(0));
+  std::vector<std::string> words;
+  for (size_t i = 0; i < entries; ++i)
+    words.push_back("a_fairly_long_dictionary_key_" + std::to_string(i));
+
+  au::Dictionary dictionary(2);
+  size_t sor = 0;
+  size_t total = 0;
+  for (auto _ : state) {
+    auto &dict = dictionary.clear(sor);
+    for (auto &word : words) dict.add(++sor, word);
+    for (size_t i = 0; i < entries; ++i) total += dict.at(i).size();
+    ++sor;
+  }
+  benchmark::DoNotOptimize(total);
+}
+BENCHMARK(BM_DictionaryFill)->Range(1<<4, 1<<12);
+
+// looks up a dictionary by position, among the 32 grep keeps around.
+static void BM_DictionarySearch(benchmark::State &state) {
+  au::Dictionary dictionary(32);
+  for (size_t i = 0; i < 32; ++i) {
+    auto &dict = dictionary.clear(i * 1000);
+    dict.add(i * 1000 + 500, "x");
+  }
+  size_t pos = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(dictionary.search(pos));
+    pos = (pos + 7919) % 32000;
+  }
+}
+BENCHMARK(BM_DictionarySearch);
+
 struct BM_AuWriter : au::AuWriter {
   au::AuVectorBuffer bmMsgBuf_;
   au::AuStringIntern bmStringIntern_;
@@ -175,8 +215,147 @@ static void BM_valueInt(benchmark::State &state) {
   }
 }
 
-// last iteration should fall off a 'cliff' because we switch to the general
-// formula
+// the last iteration used to fall off a 'cliff' when valueInt switched to the
+// general formula for 8+ byte varints. encode and decode now share the
+// varint::encode/decode codec, which doesn't special case any length.
 BENCHMARK(BM_valueInt)->RangeMultiplier(2)->Range(1ul<<0, 1ul<<7);
 
+struct BM_VarintReader : au::BaseParser<au::BufferByteSource> {
+  explicit BM_VarintReader(au::BufferByteSource &source)
+      : BaseParser(source) {}
+
+  using BaseParser::readVarint;
+};
+
+static void BM_valueInt_decode(benchmark::State &state) {
+  BM_AuWriter writer;
+
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<uint64_t> distrib(
+      0, 1ul << ((32 - uint64_t(__builtin_clz(state.range(0)))) * 7));
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    uint64_t val = distrib(gen);
+    writer.bmMsgBuf_.clear();
+    for (int i = 0; i < 1000; ++i) {
+      writer.valueInt(val);
+    }
+    au::BufferByteSource source(writer.bmMsgBuf_.str());
+    BM_VarintReader reader(source);
+    state.ResumeTiming();
+
+    for (int i = 0; i < 1000; ++i) {
+      benchmark::DoNotOptimize(reader.readVarint());
+    }
+  }
+}
+BENCHMARK(BM_valueInt_decode)->RangeMultiplier(2)->Range(1ul<<0, 1ul<<7);
+
+namespace {
+
+/// A few thousand smallish records, roughly the shape of a typical log line.
+const std::string &encodedRecords() {
+  static const std::string encoded = [] {
+    std::string result;
+    au::AuEncoder encoder;
+    auto write = [&](std::string_view s1, std::string_view s2) {
+      result.append(s1);
+      result.append(s2);
+      return s1.size() + s2.size();
+    };
+    for (int i = 0; i < 10000; ++i) {
+      encoder.encode([&](au::AuWriter &writer) {
+        writer.map(
+            "id", i,
+            "level", i % 7 ? "info" : "warn",
+            "latency", 0.25 * i,
+            "big", uint64_t(1) << 40 | uint64_t(i),
+            "message", "the quick brown fox jumps over the lazy dog",
+            "tags", [&writer]() { writer.array("a", "b", -3, true); });
+      }, write);
+    }
+    return result;
+  }();
+  return encoded;
+}
+
+/// Decodes every value, but does as little as possible with it.
+struct DecodeCounter final : au::NoopValueHandler {
+  size_t values = 0;
+
+  void onInt(size_t, int64_t) override { values++; }
+  void onUint(size_t, uint64_t) override { values++; }
+  void onDouble(size_t, double) override { values++; }
+  void onDictRef(size_t, size_t) override { values++; }
+  void onStringFragment(std::string_view sv) override { values += sv.size(); }
+
+  void onRecordStart(size_t) {}
+  void onHeader(uint64_t, const std::string &) {}
+  void onDictClear() {}
+  void onDictAddStart(size_t) {}
+  void onStringStart(size_t, size_t) override {}
+  void onStringEnd() override {}
+
+  template <typename Source>
+  void onValue(size_t, size_t, Source &source) {
+    au::ValueParser(source, *this).value();
+  }
+};
+
+template <typename Source>
+void decodeAll(Source &source) {
+  DecodeCounter counter;
+  au::RecordParser(source, counter).parseStream();
+  benchmark::DoNotOptimize(counter.values);
+}
+
+}
+
+// the "Virtual" variants parse through an AuByteSource &, as the decoder did
+// before it was templated on the source type. on a 1-core x86-64 box with
+// gcc 12 -O2, buffer decode went from ~167MB/s (virtual) to ~288MB/s
+// (concrete), and mmap decode from ~151MB/s to ~273MB/s.
+static void BM_DecodeBuffer(benchmark::State &state, bool virtualSource) {
+  const auto &encoded = encodedRecords();
+  for (auto _ : state) {
+    au::BufferByteSource source(encoded);
+    if (virtualSource) {
+      decodeAll(static_cast<au::AuByteSource &>(source));
+    } else {
+      decodeAll(source);
+    }
+  }
+  state.SetBytesProcessed(
+      static_cast<int64_t>(state.iterations() * encoded.size()));
+}
+BENCHMARK_CAPTURE(BM_DecodeBuffer, Virtual, true);
+BENCHMARK_CAPTURE(BM_DecodeBuffer, Concrete, false);
+
+static void BM_DecodeMmap(benchmark::State &state, bool virtualSource) {
+  char fname[] = "/tmp/aubenchXXXXXX";
+  int fd = ::mkstemp(fname);
+  const auto &encoded = encodedRecords();
+  if (fd < 0 || ::write(fd, encoded.data(), encoded.size()) < 0) {
+    state.SkipWithError("failed to write temp file");
+    return;
+  }
+  ::close(fd);
+
+  for (auto _ : state) {
+    au::MmapByteSource source(fname);
+    if (virtualSource) {
+      decodeAll(static_cast<au::AuByteSource &>(source));
+    } else {
+      decodeAll(source);
+    }
+  }
+  state.SetBytesProcessed(
+      static_cast<int64_t>(state.iterations() * encoded.size()));
+  ::unlink(fname);
+}
+BENCHMARK_CAPTURE(BM_DecodeMmap, Virtual, true);
+BENCHMARK_CAPTURE(BM_DecodeMmap, Concrete, false);
+
 BENCHMARK_MAIN();
@@ -40,8 +40,7 @@ class AuOutputHandler {
       writer_.value(nanos);
     }
     void onDictRef(size_t, size_t idx) {
-      const auto &v = dictionary_.at(idx);
-      writer_.value(v);
+      writer_.value(dictionary_.at(idx));
     }
     void onStringStart(size_t, size_t len) {
       str_.clear();
@@ -61,7 +60,8 @@ public:
     str_.reserve(1u << 16);
   }
 
-  void onValue(AuByteSource &source, Dictionary::Dict &dictionary) {
+  template <typename Source>
+  void onValue(Source &source, Dictionary::Dict &dictionary) {
     encoder_.encode([&] (AuWriter &writer) {
       ValueHandler handler(writer, str_, dictionary);
       ValueParser parser(source, handler);
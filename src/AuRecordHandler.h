@@ -1,13 +1,27 @@
 #pragma once
 
 #include "Dictionary.h"
+#include "au/BlockSummary.h"
 #include "au/ParseError.h"
 
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace au {
 
-class AuByteSource;
+/// Value handlers may provide
+///   bool skipValue(const Dictionary::Dict &, std::string_view raw)
+/// If it returns true, the value record is skipped without being parsed. raw
+/// holds the encoded bytes of the value if they're already in memory, and is
+/// empty otherwise.
+template <typename H, typename = void>
+struct CanSkipValues : std::false_type {};
+template <typename H>
+struct CanSkipValues<H, std::void_t<decltype(std::declval<H &>().skipValue(
+    std::declval<const Dictionary::Dict &>(), std::string_view()))>>
+    : std::true_type {};
 
 template<typename ValueHandler>
 class AuRecordHandler {
@@ -40,11 +54,29 @@ public:
       dict_ = &dictionary;
   }
 
-  void onValue(size_t relDictPos, size_t, AuByteSource &source) {
+  /// Source is the concrete type of the byte source, which is passed along to
+  /// the value handler so it can instantiate a ValueParser for that type.
+  template <typename Source>
+  void onValue(size_t relDictPos, size_t len, Source &source) {
     auto &dictionary = dictionary_.findDictionary(sor_, relDictPos);
+    if constexpr (CanSkipValues<ValueHandler>::value) {
+      auto raw = source.buffered();
+      raw = raw.size() >= len ? raw.substr(0, len) : std::string_view();
+      if (valueHandler_.skipValue(dictionary, raw)) {
+        source.skip(len);
+        return;
+      }
+    }
     valueHandler_.onValue(source, dictionary);
   }
 
+  /// Passed along to value handlers which provide it; see CanSkipBlocks.
+  template <typename VH = ValueHandler>
+  auto skipBlock(const BlockSummary &summary)
+      -> decltype(std::declval<VH &>().skipBlock(summary)) {
+    return valueHandler_.skipBlock(summary);
+  }
+
   void onStringStart(size_t, size_t len) {
     str_.clear();
     str_.reserve(len);
@@ -2,10 +2,15 @@
 #include "AuRecordHandler.h"
 #include "Dictionary.h"
 #include "JsonOutputHandler.h"
+#include "ParallelScan.h"
 #include "StreamDetection.h"
 #include "TclapHelper.h"
 #include "au/AuDecoder.h"
 
+#include <sstream>
+#include <thread>
+#include <type_traits>
+
 namespace au {
 
 namespace {
@@ -18,17 +23,46 @@ void usage(const char *cmd) {
       << " stdout. Any <path> may be \"-\" for stdin.\n"
       << "\n"
       << "  -h --help        show usage and exit\n"
-      << "  -e --encode      output au-encoded records rather than json\n";
+      << "  -e --encode      output au-encoded records rather than json\n"
+      << "  -j --threads <n> decode with <n> threads (default: number of cores).\n"
+      << "                   uncompressed files are split between threads, and\n"
+      << "                   indexed gzipped files are decompressed in parallel\n";
+}
+
+/// Decodes source to json on several threads. See ParallelScan.h.
+void parallelCat(MmapByteSource &source, size_t threads) {
+  parallelScan<std::ostringstream>(
+      source, threads,
+      [](MmapByteSource &src, ChunkRange &range, std::ostringstream &out) {
+        Dictionary dictionary;
+        JsonOutputHandler handler(out);
+        AuRecordHandler recordHandler(dictionary, handler);
+        if (!range.sync(src, dictionary)) return;
+        RecordParser parser(src, recordHandler);
+        while (range.nextValue(src, recordHandler)) parser.record();
+      },
+      [](std::ostringstream &out) { std::cout << out.str(); });
+  std::cout.flush();
 }
 
 template<typename H>
-int doCat(const std::string &fileName, H &handler, bool compressed) {
+int doCat(const std::string &fileName, H &handler, bool compressed,
+          size_t threads) {
   Dictionary dictionary;
   AuRecordHandler recordHandler(dictionary, handler);
   auto source = detectSource(fileName, std::nullopt, compressed);
   if (!checkAuFile(*source)) return 1;
   try {
-    RecordParser<AuRecordHandler<H>>(*source, recordHandler).parseStream();
+    visitSource(*source, [&](auto &concrete) {
+      if constexpr (std::is_same_v<H, JsonOutputHandler>
+                    && std::is_same_v<decltype(concrete), MmapByteSource &>) {
+        if (canScanInParallel(concrete, threads))
+          return parallelCat(concrete, threads);
+      }
+      if constexpr (std::is_same_v<decltype(concrete), ZipByteSource &>)
+        concrete.inflateAhead(threads);
+      RecordParser(concrete, recordHandler).parseStream();
+    });
   } catch (const std::exception &e) {
     std::cerr << e.what() << " while processing " << fileName << "\n";
     return 1;
@@ -36,15 +70,16 @@ int doCat(const std::string &fileName, H &handler, bool compressed) {
   return 0;
 }
 
-int catFile(const std::string &fileName, bool encodeOutput, bool compressed) {
+int catFile(const std::string &fileName, bool encodeOutput, bool compressed,
+            size_t threads) {
   if (encodeOutput) {
     AuOutputHandler handler(
         AU_STR("Re-encoded by au from original au file "
                 << (fileName == "-" ? "<stdin>" : fileName)));
-    return doCat(fileName, handler, compressed);
+    return doCat(fileName, handler, compressed, threads);
   } else {
     JsonOutputHandler handler;
-    return doCat(fileName, handler, compressed);
+    return doCat(fileName, handler, compressed, threads);
   }
 }
 
@@ -55,6 +90,9 @@ int catCmd(int argc, const char * const *argv, bool compressed) {
       "path", "", false, "path", tclap.cmd());
 
   TCLAP::SwitchArg encode("e", "encode", "encode", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
 
   if (!tclap.parse(argc, argv)) return 1;
 
@@ -62,7 +100,7 @@ int catCmd(int argc, const char * const *argv, bool compressed) {
   if (fileNames.isSet()) inputFiles = fileNames.getValue();
 
   for (const auto &f : inputFiles) {
-    auto result = catFile(f, encode.isSet(), compressed);
+    auto result = catFile(f, encode.isSet(), compressed, threads.getValue());
     if (result) return result;
   }
 
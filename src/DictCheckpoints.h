@@ -0,0 +1,242 @@
+#pragma once
+
+#include "au/AuCommon.h"
+#include "au/AuDecoder.h"
+#include "au/ParseError.h"
+#include "AuRecordHandler.h"
+#include "Dictionary.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/stat.h>
+
+namespace au {
+
+/// Snapshots of the dictionary at value records spread through an au file, so
+/// that a reader which seeks into the file can restore the dictionary it needs
+/// from memory, rather than by reading its way back through the dictionary
+/// records to the last clear (see DictionaryBuilder). In a gzipped file each of
+/// those reads may mean inflating another stretch of the file. Written by
+/// au index -c to a sidecar next to the file (see filenameFor()), where grep
+/// and tail find it.
+///
+/// The sidecar is a header, then the checkpoints in file order: each is four
+/// positions and sizes (see Checkpoint), then the entries which its dictionary
+/// has gained since the previous checkpoint of the same dictionary, each a
+/// length and the bytes.
+class DictCheckpoints {
+public:
+  struct Checkpoint {
+    /// The start of a value record.
+    size_t pos;
+    /// The dictionary the record refers to: where its clear record starts...
+    size_t dictStart;
+    /// ...and its last add record before pos.
+    size_t dictPos;
+    /// The number of entries in the dictionary at pos.
+    size_t size;
+  };
+
+private:
+  static constexpr char Magic[4] = {'A', 'U', 'D', 'X'};
+  static constexpr uint32_t Version = 1u;
+
+  struct Header {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    uint64_t fileModTime;
+    uint64_t numCheckpoints;
+  };
+  static_assert(sizeof(Header) == 32);
+
+  std::vector<Checkpoint> checkpoints_;
+  /// The entries of each dictionary as of its last checkpoint, by dictStart.
+  std::map<size_t, std::vector<std::string>> entries_;
+
+public:
+  static std::string filenameFor(const std::string &path) {
+    return path + ".audx";
+  }
+
+  const std::vector<Checkpoint> &checkpoints() const { return checkpoints_; }
+
+  /// Adds a checkpoint for the value record at pos, which refers to dict.
+  void add(size_t pos, const Dictionary::Dict &dict) {
+    auto &entries = entries_[dict.startPos_];
+    for (auto i = entries.size(); i < dict.size(); i++)
+      entries.emplace_back(dict.at(i));
+    checkpoints_.push_back(
+        Checkpoint{pos, dict.startPos_, dict.lastDictPos_, dict.size()});
+  }
+
+  /// Restores to dictionary as much as the checkpoints have of the dictionary
+  /// which includes dictPos, i.e., the dictionary as of the last checkpoint
+  /// before dictPos. DictionaryBuilder then only needs to read the dictionary
+  /// records between that checkpoint and dictPos. If there's a clear record in
+  /// between, the restored dictionary goes unused.
+  void restore(Dictionary &dictionary, size_t dictPos) const {
+    auto it = std::upper_bound(
+        checkpoints_.begin(), checkpoints_.end(), dictPos,
+        [](size_t p, const Checkpoint &cp) { return p < cp.dictPos; });
+    if (it == checkpoints_.begin()) return;
+    auto &cp = *--it;
+    auto &dict = dictionary.clear(cp.dictStart);
+    // the dictionary may have been partly built already. if so, what it has
+    // is the start of what the checkpoint has.
+    if (dict.size() >= cp.size) return;
+    auto &entries = entries_.at(cp.dictStart);
+    for (auto i = dict.size(); i < cp.size; i++)
+      dict.add(cp.dictPos, entries[i]);
+  }
+
+  /// fileStat describes the file which was checkpointed.
+  void write(const std::string &filename,
+             const struct stat &fileStat) const {
+    std::string out;
+    Header header;
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.fileSize = static_cast<uint64_t>(fileStat.st_size);
+    header.fileModTime = static_cast<uint64_t>(fileStat.st_mtime);
+    header.numCheckpoints = checkpoints_.size();
+    append(out, &header, sizeof(header));
+    std::map<size_t, size_t> written;
+    for (auto &cp : checkpoints_) {
+      append(out, static_cast<uint64_t>(cp.pos));
+      append(out, static_cast<uint64_t>(cp.dictStart));
+      append(out, static_cast<uint64_t>(cp.dictPos));
+      append(out, static_cast<uint64_t>(cp.size));
+      auto &entries = entries_.at(cp.dictStart);
+      for (auto &i = written[cp.dictStart]; i < cp.size; i++) {
+        append(out, static_cast<uint64_t>(entries[i].size()));
+        out.append(entries[i]);
+      }
+    }
+
+    std::ofstream file(filename, std::ios_base::binary | std::ios_base::trunc);
+    file.write(out.data(), static_cast<std::streamsize>(out.size()));
+    file.close();
+    if (!file) THROW_RT("Error writing dictionary checkpoints " << filename);
+  }
+
+  /// Loads the sidecar in filename for the file described by fileStat. Returns
+  /// null if there isn't one, or (with a warning) if the file has changed
+  /// since it was checkpointed, or the sidecar can't be read. The checkpoints
+  /// only save time, so a grep is better off without them than failing.
+  static std::unique_ptr<const DictCheckpoints> load(
+      const std::string &filename,
+      const struct stat &fileStat) {
+    std::ifstream file(filename, std::ios_base::binary);
+    if (!file) return nullptr;
+    std::string data((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    try {
+      return parse(data, fileStat);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Ignoring dictionary checkpoints " << filename << ": "
+                << e.what() << std::endl;
+      return nullptr;
+    }
+  }
+
+private:
+  /// @throws std::runtime_error, saying why, if data isn't a whole sidecar
+  /// for the file described by fileStat.
+  static std::unique_ptr<const DictCheckpoints> parse(
+      const std::string &data,
+      const struct stat &fileStat) {
+    size_t offset = 0;
+    auto take = [&](size_t len) {
+      if (len > data.size() - offset) THROW_RT("they're truncated");
+      offset += len;
+      return std::string_view(data.data() + offset - len, len);
+    };
+    auto read = [&]() {
+      uint64_t value;
+      memcpy(&value, take(sizeof(value)).data(), sizeof(value));
+      return static_cast<size_t>(value);
+    };
+
+    Header header;
+    memcpy(&header, take(sizeof(header)).data(), sizeof(header));
+    if (memcmp(header.magic, Magic, sizeof(Magic)) != 0)
+      THROW_RT("it's not a dictionary checkpoint file");
+    if (header.version != Version)
+      THROW_RT("it's version " << header.version << ", not " << Version);
+    if (header.fileSize != static_cast<uint64_t>(fileStat.st_size)
+        || header.fileModTime != static_cast<uint64_t>(fileStat.st_mtime))
+      THROW_RT("the file has changed since they were written");
+
+    auto result = std::make_unique<DictCheckpoints>();
+    for (uint64_t i = 0; i < header.numCheckpoints; i++) {
+      Checkpoint cp;
+      cp.pos = read();
+      cp.dictStart = read();
+      cp.dictPos = read();
+      cp.size = read();
+      if (cp.dictPos < cp.dictStart
+          || (!result->checkpoints_.empty()
+              && cp.dictPos < result->checkpoints_.back().dictPos))
+        THROW_RT("checkpoint " << i << " is out of order");
+      auto &entries = result->entries_[cp.dictStart];
+      while (entries.size() < cp.size)
+        entries.emplace_back(take(read()));
+      result->checkpoints_.push_back(cp);
+    }
+    return result;
+  }
+
+  static void append(std::string &out, const void *data, size_t len) {
+    out.append(static_cast<const char *>(data), len);
+  }
+
+  template <typename T>
+  static void append(std::string &out, T value) {
+    append(out, &value, sizeof(value));
+  }
+};
+
+/// A value handler which skips every value, noting the dictionary it refers
+/// to.
+struct DictTracker {
+  const Dictionary::Dict *dict = nullptr;
+
+  template <typename Source>
+  void onValue(Source &, const Dictionary::Dict &) {}
+
+  bool skipValue(const Dictionary::Dict &d, std::string_view) {
+    dict = &d;
+    return true;
+  }
+};
+
+/// Adds a checkpoint to checkpoints for the first value record after each
+/// stretch of every bytes of an au-encoded source.
+template <typename Source>
+void checkpointAu(Source &source, DictCheckpoints &checkpoints, size_t every) {
+  Dictionary dictionary;
+  DictTracker tracker;
+  AuRecordHandler<DictTracker> handler(dictionary, tracker);
+  // clang 10 and 11 erroneously warn here if "parser" is inlined.
+  auto parser = RecordParser(source, handler);
+  size_t next = every;
+  for (auto c = source.peek(); !c.isEof(); c = source.peek()) {
+    auto pos = source.pos();
+    parser.record();
+    if (c == 'V' && pos >= next) {
+      checkpoints.add(pos, *tracker.dict);
+      next = pos + every;
+    }
+  }
+}
+
+}
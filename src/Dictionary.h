@@ -2,66 +2,126 @@
 
 #include "au/ParseError.h"
 
+#include <algorithm>
+#include <cassert>
+#include <functional>
 #include <memory>
-#include <string>
+#include <string_view>
 #include <vector>
 
 namespace au {
 
 class Dictionary {
 public:
+  /// Optionally computes a few bits of per-entry information as each entry is
+  /// added to a dictionary (grep uses this to remember which entries match its
+  /// pattern). Only the low 8 bits are kept.
+  using Classifier = std::function<uint8_t(std::string_view)>;
+
+  /// The entries of a dictionary are packed end to end in a single arena of
+  /// bytes, with a table of end offsets. Adding an entry never allocates
+  /// (beyond the occasional growth of the arena), and reset() keeps the
+  /// capacity, so recycled dictionaries are cheap.
   struct Dict {
-    std::vector<std::string> dictionary_;
+    std::vector<char> arena_;
+    std::vector<size_t> ends_;
+    std::vector<uint8_t> flags_; //< populated only if there's a classifier
+    uint8_t allFlags_ = 0;       //< union of flags_
+    const Classifier &classifier_;
     size_t startPos_;
     size_t lastDictPos_;
 
-    Dict(size_t startPos)
-    : startPos_(startPos),
-      lastDictPos_(startPos) {
-      dictionary_.reserve(1u << 16u);
-    }
+    Dict(size_t startPos, const Classifier &classifier)
+    : classifier_(classifier),
+      startPos_(startPos),
+      lastDictPos_(startPos) {}
 
     Dict(const Dict &) = delete;
     Dict &operator=(const Dict &) = delete;
 
     void reset(size_t sor) {
-      dictionary_.clear();
+      arena_.clear();
+      ends_.clear();
+      flags_.clear();
+      allFlags_ = 0;
       startPos_ = sor;
       lastDictPos_ = sor;
     }
 
     void add(size_t sor, std::string_view value) {
-      dictionary_.emplace_back(value);
+      arena_.insert(arena_.end(), value.begin(), value.end());
+      ends_.push_back(arena_.size());
+      if (classifier_) classify(value);
       lastDictPos_ = sor;
     }
 
+    void classify(std::string_view value) {
+      flags_.push_back(classifier_(value));
+      allFlags_ |= flags_.back();
+    }
+
     bool includes(size_t sor) const {
       return startPos_ <= sor && sor <= lastDictPos_;
     }
 
-    const std::string &at(size_t idx) const {
-      if (idx >= dictionary_.size()) {
+    /// The returned view is invalidated by the next add() or reset().
+    std::string_view at(size_t idx) const {
+      if (idx >= ends_.size()) {
         AU_THROW("Dictionary reference index "
                   << idx << " out of range. Dictionary started at position "
                   << startPos_ << ", last add occurred at position "
                   << lastDictPos_ << ", and currently has "
-                  << dictionary_.size() << " entries.");
+                  << ends_.size() << " entries.");
       }
-      return dictionary_.at(idx);
+      auto start = idx ? ends_[idx - 1] : 0;
+      return std::string_view(arena_.data() + start, ends_[idx] - start);
     }
-    const std::vector<std::string> &entries() const { return dictionary_; }
-    size_t size() const { return dictionary_.size(); }
+    size_t size() const { return ends_.size(); }
+
+    /// Whether flags() is available, i.e., whether the owning Dictionary has
+    /// a classifier.
+    bool classified() const { return static_cast<bool>(classifier_); }
+    /// The classifier's result for the entry at idx. Only valid if
+    /// classified().
+    uint8_t flags(size_t idx) const {
+      assert(classified() && flags_.size() == ends_.size());
+      if (idx >= flags_.size()) at(idx); // throws
+      return flags_[idx];
+    }
+    /// The union of flags() over all the entries.
+    uint8_t allFlags() const { return allFlags_; }
   };
 
 private:
   // used as sort of a really dumb lru-cache
   std::vector<std::unique_ptr<Dict>> dictionaries_;
+  // the same dictionaries, ordered by startPos_. their ranges never overlap
+  // (clear() enforces that), so this is enough to binary search by position.
+  std::vector<Dict *> byPos_;
   uint32_t maxDicts_;
+  Classifier classifier_;
 
 public:
   Dictionary(uint32_t maxDicts = 1)
   : maxDicts_(maxDicts) {
     dictionaries_.reserve(maxDicts_);
+    byPos_.reserve(maxDicts_);
+  }
+
+  // the dicts refer back to classifier_
+  Dictionary(const Dictionary &) = delete;
+  Dictionary &operator=(const Dictionary &) = delete;
+
+  /// Installs classifier, and applies it to any existing entries.
+  void setClassifier(Classifier classifier) {
+    classifier_ = std::move(classifier);
+    for (auto &dict : dictionaries_) {
+      dict->flags_.clear();
+      dict->allFlags_ = 0;
+      if (!classifier_) continue;
+      for (size_t i = 0; i < dict->size(); i++)
+        dict->classify(dict->at(i));
+    }
   }
 
   Dict &clear(size_t sor) {
@@ -82,12 +142,15 @@ public:
     if (dictionaries_.size() == maxDicts_) {
       std::unique_ptr<Dict> recycle(std::move(dictionaries_.front()));
       dictionaries_.erase(dictionaries_.begin());
+      byPos_.erase(std::find(byPos_.begin(), byPos_.end(), recycle.get()));
       recycle->reset(sor);
       dictionaries_.emplace_back(std::move(recycle));
     } else {
-      dictionaries_.emplace_back(new Dict(sor));
+      dictionaries_.emplace_back(new Dict(sor, classifier_));
     }
-    return *dictionaries_.back();
+    auto *dict = dictionaries_.back().get();
+    byPos_.insert(firstAfter(sor), dict);
+    return *dict;
   }
 
   Dict &findDictionary(size_t sor, size_t relDictPos) {
@@ -109,12 +172,21 @@ public:
 
   Dict *search(size_t pos) {
     // usually the one we want is the most recently added one... the other
-    // case is something like a bisect, in which case we don't mind scanning.
-    for (auto i = dictionaries_.size(); i-- > 0;) {
-      if (dictionaries_[i]->includes(pos))
-        return dictionaries_[i].get();
-    }
-    return nullptr;
+    // case is something like a bisect, where we may have collected a number
+    // of dictionaries from all over the file.
+    if (auto *dict = latest(); dict && dict->includes(pos)) return dict;
+    auto it = firstAfter(pos);
+    if (it == byPos_.begin()) return nullptr;
+    auto *dict = *--it;
+    return dict->includes(pos) ? dict : nullptr;
+  }
+
+private:
+  /// The first dictionary in byPos_ that starts after pos.
+  std::vector<Dict *>::iterator firstAfter(size_t pos) {
+    return std::upper_bound(
+        byPos_.begin(), byPos_.end(), pos,
+        [](size_t p, const Dict *d) { return p < d->startPos_; });
   }
 };
 
@@ -48,8 +48,8 @@ class DocumentParser {
       THROW_RT("Timestamps not supported in rapidjson document parser!");
     }
     void onDictRef(size_t, size_t idx) {
-      const auto &v = dict.at(idx);
-      doc->String(v.c_str(), static_cast<rapidjson::SizeType>(v.size()), true);
+      auto v = dict.at(idx);
+      doc->String(v.data(), static_cast<rapidjson::SizeType>(v.size()), true);
       count.back()++;
     }
 
@@ -1,16 +1,22 @@
 #include "main.h"
 #include "AuOutputHandler.h"
 #include "JsonOutputHandler.h"
+#include "GrepCache.h"
 #include "GrepHandler.h"
+#include "Serve.h"
 #include "StreamDetection.h"
 #include "TclapHelper.h"
 #include "TimestampPattern.h"
 #include "au/AuDecoder.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <optional>
 #include <regex>
+#include <thread>
+#include <type_traits>
+#include <sys/stat.h>
 
 namespace au {
 
@@ -74,35 +80,131 @@ bool setAtomPattern(Pattern &pattern, std::string &atomPat) {
   return false;
 }
 
+/// Whether to index unindexed gzipped files in order to binary search them.
+enum class AutoIndex { No, InMemory, Save };
+
 bool setTimestampPattern(Pattern &pattern, const std::string &tsPat) {
   pattern.timestampPattern = parseFlexPattern(tsPat);
   return pattern.timestampPattern.has_value();
 }
 
-int grepFile(Pattern &pattern,
-             const std::string &fileName,
-             bool encodeOutput,
-             bool asciiLog,
-             bool compressed,
-             const std::optional<std::string> &indexFile) {
-  auto source = detectSource(fileName, indexFile, compressed);
+/// The kinds of value a pattern was said to be on the command line. With none
+/// of them, it's whatever it parses as.
+struct PatternTypes {
+  bool atom = false;
+  bool integer = false;
+  bool dbl = false;
+  bool timestamp = false;
+  bool string = false;
+  bool substring = false;
+  bool asciiLog = false;
+};
+
+/// Sets the value patterns of pattern from pat. Returns false (having said
+/// why) if pat isn't what it was said to be.
+bool setValuePatterns(Pattern &pattern, std::string pat,
+                      const PatternTypes &types) {
+  bool explicitTimestampMatch = types.asciiLog || types.timestamp;
+  bool explicitStringMatch = types.string || types.substring;
+  bool numericMatch = types.integer || types.dbl || types.timestamp
+                      || types.atom;
+  bool defaultMatch = !(numericMatch || explicitStringMatch);
+
+  if (types.substring && numericMatch) {
+    std::cerr << "-u (substring search) is not compatible with -i/-d/-t/-a."
+              << std::endl;
+    return false;
+  }
+
+  // by default, we'll try to match anything, but won't be upset if the
+  // pattern fails to parse as any particular thing...
+
+  if (defaultMatch || explicitStringMatch) {
+    pattern.strPattern = Pattern::StrPattern{pat, !types.substring};
+  }
+
+  if (defaultMatch || types.integer) {
+    bool success = setIntPattern(pattern, pat);
+    if (!success && types.integer) {
+      std::cerr << "-i specified, but pattern '"
+                << pat << "' is not an integer." << std::endl;
+      return false;
+    }
+  }
+
+  if (defaultMatch || types.dbl) {
+    bool success = setDoublePattern(pattern, pat);
+    if (!success && types.dbl) {
+      std::cerr << "-d specified, but pattern '"
+                << pat << "' is not a double-precision number."
+                << std::endl;
+      return false;
+    }
+  }
+
+  if (defaultMatch || explicitTimestampMatch) {
+    bool success = setTimestampPattern(pattern, pat);
+    if (!success && explicitTimestampMatch) {
+      std::cerr << "-t/-l specified, but pattern '"
+                << pat << "' is not a date/time."
+                << std::endl;
+      return false;
+    }
+  }
+
+  if (defaultMatch || types.atom) {
+    bool success = setAtomPattern(pattern, pat);
+    if (!success && types.atom) {
+      std::cerr << "-a specified, but pattern '"
+                << pat << "' is not true, false or null."
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
 
+template <typename Source>
+int grepSource(Pattern &pattern,
+               const std::string &fileName,
+               bool encodeOutput,
+               bool asciiLog,
+               size_t threads,
+               AutoIndex autoIndex,
+               Dictionary *dictionary,
+               Source &source) {
+  // a bisect only reads a little here and there
+  if constexpr (std::is_same_v<Source, ZipByteSource>) {
+    if (!pattern.bisect && !pattern.follow) source.inflateAhead(threads);
+    else if (autoIndex != AutoIndex::No)
+      source.autoIndex(threads, autoIndex == AutoIndex::Save);
+  }
   if (asciiLog) {
-    if (isAuFile(*source)) {
+    if (isAuFile(source)) {
       std::cerr << fileName << " appears to be au-encoded. -l is unlikely to"
         << " to do anything useful here!" << std::endl;
       return 1;
     }
-    return AsciiGrepper(pattern, *source).doGrep();
-  } else if (isAuFile(*source)) {
+    return AsciiGrepper(pattern, source).doGrep();
+  } else if (isAuFile(source)) {
     if (encodeOutput) {
       AuOutputHandler handler(
           AU_STR("Encoded by au: grep output from au file "
                  << (fileName == "-" ? "<stdin>" : fileName)));
-      return AuGrepper(pattern, *source, handler).doGrep();
+      if (dictionary)
+        return AuGrepper(pattern, source, handler, *dictionary).doGrep();
+      return AuGrepper(pattern, source, handler).doGrep();
     } else {
       JsonOutputHandler handler;
-      return AuGrepper(pattern, *source, handler).doGrep();
+      if (dictionary)
+        return AuGrepper(pattern, source, handler, *dictionary).doGrep();
+      AuGrepper grepper(pattern, source, handler);
+      if constexpr (std::is_same_v<Source, MmapByteSource>) {
+        if (pattern.needsDateScan()) grepper.performDateScan();
+        if (canGrepInParallel(pattern, source, threads))
+          return parallelGrep(pattern, source, threads);
+      }
+      return grepper.doGrep();
     }
   } else { // assume file is json
     if (encodeOutput) {
@@ -111,9 +213,61 @@ int grepFile(Pattern &pattern,
       return 1;
     } else {
       JsonOutputHandler handler;
-      return JsonGrepper(pattern, *source, handler).doGrep();
+      return JsonGrepper(pattern, source, handler).doGrep();
+    }
+  }
+}
+
+int grepFile(Pattern &pattern,
+             const std::string &fileName,
+             bool encodeOutput,
+             bool asciiLog,
+             bool compressed,
+             size_t threads,
+             AutoIndex autoIndex,
+             const std::optional<std::string> &indexFile,
+             GrepCache *cache) {
+  auto *cached = cache ? cache->open(fileName, indexFile, compressed)
+                       : nullptr;
+
+  pattern.keyIndex.reset();
+  pattern.learnedIndex.reset();
+  pattern.checkpoints.reset();
+  struct stat fileStat;
+  auto statted = fileName != "-" && ::stat(fileName.c_str(), &fileStat) == 0;
+  if (pattern.bisect && pattern.keyPattern && fileName != "-") {
+    auto sidecar = KeyIndex::filenameFor(fileName, *pattern.keyPattern);
+    if (cached) {
+      pattern.keyIndex = cached->sidecar(sidecar);
+      pattern.learnedIndex = cached->learned(*pattern.keyPattern);
+    } else if (statted) {
+      pattern.keyIndex = KeyIndex::load(sidecar, fileStat);
     }
   }
+
+  std::unique_ptr<FileByteSource> source;
+  if (!cached)
+    source = detectSource(fileName, indexFile, compressed, pattern.follow);
+  auto &opened = cached ? *cached->source : *source;
+
+  // only a bisect or a parallel grep syncs part way in, which is all the
+  // checkpoints are for, and a plain grep shouldn't pay to read them
+  if (pattern.bisect || canGrepInParallel(pattern, opened, threads)) {
+    if (cached) {
+      pattern.checkpoints = cached->checkpoints(
+          DictCheckpoints::filenameFor(fileName));
+    } else if (statted) {
+      pattern.checkpoints = DictCheckpoints::load(
+          DictCheckpoints::filenameFor(fileName), fileStat);
+    }
+  }
+
+  // the dictionaries only save anything when a bisect syncs part way in
+  auto *dictionary = cached && pattern.bisect ? &cached->dictionary : nullptr;
+  return visitSource(opened, [&](auto &concrete) {
+    return grepSource(pattern, fileName, encodeOutput, asciiLog, threads,
+                      autoIndex, dictionary, concrete);
+  });
 }
 
 void usage(const char *cmd) {
@@ -124,7 +278,8 @@ void usage(const char *cmd) {
       << "  -e --encode         output au-encoded records rather than json\n"
       << "  -k --key <key>      match pattern only in object values with key <key>\n"
       << "  -o --ordered <key>  like -k, but values for <key> are assumed to to be\n"
-      << "                      roughly ordered\n"
+      << "                      roughly ordered. uses the samples written by\n"
+      << "                      au index -k <key>, if there are any\n"
       << "  -g --or-greater     match any value equal to or greater than <pattern>\n"
       << "  -l --ascii-log      see below\n"
       << "  -i --integer        match <pattern> with integer values\n"
@@ -145,7 +300,19 @@ void usage(const char *cmd) {
       << "                      non-matching record (i.e., record with matching key\n"
       << "                      but non-matching value)\n"
       << "  -c --count          print count of matching records per file\n"
+      << "  -f --follow         at the end of the file, wait for more records to be\n"
+      << "                      appended, and grep those as they arrive. not\n"
+      << "                      compatible with -o, -l or -c\n"
       << "  -x --index <path>   use gzip index in <path> (only for zgrep)\n"
+      << "  -j --threads <n>    use <n> threads (default: number of cores). uncompressed\n"
+      << "                      au files are split between threads, and indexed\n"
+      << "                      gzipped files are decompressed in parallel\n"
+      << "  --auto-index        to binary search (-o or -l) in a gzipped file with no\n"
+      << "                      index, first build an index in memory. this means\n"
+      << "                      decompressing the whole file once\n"
+      << "  --save-index        like --auto-index, but also save the index (as\n"
+      << "                      au zindex would) for next time\n"
+      << "  --server            have au serve do the search (see au serve --help)\n"
       << "\n"
       << "  Timestamps may be specified without a date (e.g., 18:45:00.123), in which \n"
       << "  case the first few records of the stream will be scanned for timestamp matches.\n"
@@ -162,8 +329,13 @@ void usage(const char *cmd) {
       << "  are accepted in combination with -l.\n";
 }
 
-int grepCmd(int argc, const char * const *argv, bool compressed) {
-  TclapHelper tclap([compressed]() { usage(compressed ? "zgrep" : "grep"); });
+int grepCmd(int argc,
+            const char * const *argv,
+            bool compressed,
+            GrepCache *cache) {
+  // au serve has to stay up after --help or bad arguments
+  TclapHelper tclap([compressed]() { usage(compressed ? "zgrep" : "grep"); },
+                    !cache);
 
   TCLAP::ValueArg<std::string> key(
       "k", "key", "key", false, "", "string", tclap.cmd());
@@ -179,12 +351,19 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
       "m", "matches", "matches", false, 0, "uint32_t", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
   TCLAP::SwitchArg orGreater("g", "or-greater", "or-greater", tclap.cmd());
   TCLAP::SwitchArg followContext(
       "F", "follow-context", "follow-context", tclap.cmd());
   TCLAP::SwitchArg asciiLog("l", "ascii-log", "ascii-log", tclap.cmd());
   TCLAP::SwitchArg encode("e", "encode", "encode", tclap.cmd());
   TCLAP::SwitchArg count("c", "count", "count", tclap.cmd());
+  TCLAP::SwitchArg follow("f", "follow", "follow", tclap.cmd());
+  TCLAP::SwitchArg autoIndex("", "auto-index", "auto-index", tclap.cmd());
+  TCLAP::SwitchArg saveIndex("", "save-index", "save-index", tclap.cmd());
+  TCLAP::SwitchArg server("", "server", "server", tclap.cmd());
   TCLAP::SwitchArg matchAtom("a", "atom", "atom", tclap.cmd());
   TCLAP::SwitchArg matchInt("i", "integer", "integer", tclap.cmd());
   TCLAP::SwitchArg matchTimestamp("t", "timestamp", "timestamp", tclap.cmd());
@@ -196,7 +375,7 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
   TCLAP::UnlabeledMultiArg<std::string> fileNames(
       "path", "", false, "path", tclap.cmd());
 
-  if (!tclap.parse(argc, argv)) return 1;
+  if (!tclap.parse(argc, argv)) return tclap.status();
 
   {
     auto n = 0;
@@ -209,6 +388,23 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
     }
   }
 
+  if (follow.isSet()) {
+    if (ordered.isSet() || asciiLog.isSet() || count.isSet()) {
+      std::cerr << "-f may not be combined with -o, -l or -c." << std::endl;
+      return 1;
+    }
+    auto &files = fileNames.getValue();
+    if (files.empty()
+        || std::find(files.begin(), files.end(), "-") != files.end()) {
+      std::cerr << "-f can't follow stdin." << std::endl;
+      return 1;
+    }
+    if (files.size() > 1) {
+      std::cerr << "-f can only follow one file." << std::endl;
+      return 1;
+    }
+  }
+
   Pattern pattern;
   if (key.isSet()) pattern.keyPattern = key.getValue();
   if (ordered.isSet()) {
@@ -224,64 +420,15 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
   }
   if (matches.isSet()) pattern.numMatches = matches.getValue();
 
-  bool explicitTimestampMatch = asciiLog.isSet() || matchTimestamp.isSet();
-  bool explicitStringMatch = matchString.isSet() || matchSubstring.isSet();
-  bool numericMatch = matchInt.isSet() || matchDouble.isSet()
-                      || matchTimestamp.isSet() || matchAtom.isSet();
-  bool defaultMatch = !(numericMatch || explicitStringMatch);
-
-  if (matchSubstring.isSet() && numericMatch) {
-    std::cerr << "-u (substring search) is not compatible with -i/-d/-t/-a."
-              << std::endl;
-    return 1;
-  }
-
-  // by default, we'll try to match anything, but won't be upset if the
-  // pattern fails to parse as any particular thing...
-
-  if (defaultMatch || explicitStringMatch) {
-    pattern.strPattern = Pattern::StrPattern{
-        pat.getValue(), !matchSubstring.isSet()};
-  }
-
-  if (defaultMatch || matchInt.isSet()) {
-    bool success = setIntPattern(pattern, pat.getValue());
-    if (!success && matchInt.isSet()) {
-      std::cerr << "-i specified, but pattern '"
-                << pat.getValue() << "' is not an integer." << std::endl;
-      return 1;
-    }
-  }
-
-  if (defaultMatch || matchDouble.isSet()) {
-    bool success = setDoublePattern(pattern, pat.getValue());
-    if (!success && matchDouble.isSet()) {
-      std::cerr << "-d specified, but pattern '"
-                << pat.getValue() << "' is not a double-precision number."
-                << std::endl;
-      return 1;
-    }
-  }
-
-  if (defaultMatch || explicitTimestampMatch) {
-    bool success = setTimestampPattern(pattern, pat.getValue());
-    if (!success && explicitTimestampMatch) {
-      std::cerr << "-t/-l specified, but pattern '"
-                << pat.getValue() << "' is not a date/time."
-                << std::endl;
-      return 1;
-    }
-  }
-
-  if (defaultMatch || matchAtom.isSet()) {
-    bool success = setAtomPattern(pattern, pat.getValue());
-    if (!success && matchAtom.isSet()) {
-      std::cerr << "-a specified, but pattern '"
-                << pat.getValue() << "' is not true, false or null."
-                << std::endl;
-      return 1;
-    }
-  }
+  PatternTypes types;
+  types.atom = matchAtom.isSet();
+  types.integer = matchInt.isSet();
+  types.dbl = matchDouble.isSet();
+  types.timestamp = matchTimestamp.isSet();
+  types.string = matchString.isSet();
+  types.substring = matchSubstring.isSet();
+  types.asciiLog = asciiLog.isSet();
+  if (!setValuePatterns(pattern, pat.getValue(), types)) return 1;
 
   if (context.isSet())
     pattern.beforeContext = pattern.afterContext = context.getValue();
@@ -293,18 +440,40 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
     pattern.forceFollow = true;
 
   pattern.count = count.isSet();
+  pattern.follow = follow.isSet();
+  // json output is flushed record by record anyway
+  if (follow.isSet() && encode.isSet()) std::cout << std::unitbuf;
 
   std::optional<std::string> indexFile;
   if (index.isSet()) indexFile = index.getValue();
 
+  auto indexMode = AutoIndex::No;
+  if (autoIndex.isSet()) indexMode = AutoIndex::InMemory;
+  if (saveIndex.isSet()) indexMode = AutoIndex::Save;
+
+  if (server.isSet() || cache) {
+    auto &files = fileNames.getValue();
+    if (files.empty()
+        || std::find(files.begin(), files.end(), "-") != files.end()) {
+      std::cerr << "au serve can't search stdin." << std::endl;
+      return 1;
+    }
+    if (follow.isSet()) {
+      std::cerr << "au serve can't follow a file." << std::endl;
+      return 1;
+    }
+    // the arguments are known to be good now, so the server won't complain
+    if (server.isSet()) return grepViaServer(argc, argv);
+  }
+
   if (fileNames.getValue().empty()) {
     return grepFile(pattern, "-", encode.isSet(), asciiLog.isSet(), compressed,
-                    indexFile);
+                    threads.getValue(), indexMode, indexFile, cache);
   } else {
     for (auto &f : fileNames) {
       auto result =
           grepFile(pattern, f, encode.isSet(), asciiLog.isSet(), compressed,
-                   indexFile);
+                   threads.getValue(), indexMode, indexFile, cache);
       if (result) return result;
     }
   }
@@ -312,14 +481,128 @@ int grepCmd(int argc, const char * const *argv, bool compressed) {
   return 0;
 }
 
+void sliceUsage() {
+  std::cout
+      << "usage: au slice [options] [--] <from> <to> <path>...\n"
+      << "\n"
+      << " Outputs the records whose values of an ordered key are at least <from> and\n"
+      << " less than <to>. As with grep -o, the file is binary searched for <from>.\n"
+      << " Records are then read until the values are past <to>, allowing for them\n"
+      << " to be out of order by as much as grep -o does, so only a little more than\n"
+      << " the slice itself is read.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -e --encode         output au-encoded records rather than json\n"
+      << "  -k --key <key>      the ordered key. uses the samples written by\n"
+      << "                      au index -k <key>, if there are any\n"
+      << "  -l --ascii-log      slice a plain ASCII log by the timestamps at the\n"
+      << "                      beginning of its lines (see grep --help)\n"
+      << "  -i --integer        <from> and <to> are integers\n"
+      << "  -d --double         <from> and <to> are double-precision floats\n"
+      << "  -t --timestamp      <from> and <to> are timestamps, or prefixes thereof\n"
+      << "                      (see grep --help)\n"
+      << "  -s --string         <from> and <to> are strings\n"
+      << "  -m --matches <n>    show only the first <n> records\n"
+      << "  -c --count          print count of records per file\n"
+      << "  -x --index <path>   use gzip index in <path>\n"
+      << "  --auto-index        to slice a gzipped file with no index, first build an\n"
+      << "                      index in memory\n"
+      << "  --save-index        like --auto-index, but also save the index\n";
+}
+
+int sliceCmd(int argc, const char * const *argv) {
+  TclapHelper tclap(sliceUsage);
+
+  TCLAP::ValueArg<std::string> key(
+      "k", "key", "key", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<uint32_t> matches(
+      "m", "matches", "matches", false, 0, "uint32_t", tclap.cmd());
+  TCLAP::ValueArg<std::string> index(
+      "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::SwitchArg asciiLog("l", "ascii-log", "ascii-log", tclap.cmd());
+  TCLAP::SwitchArg encode("e", "encode", "encode", tclap.cmd());
+  TCLAP::SwitchArg count("c", "count", "count", tclap.cmd());
+  TCLAP::SwitchArg autoIndex("", "auto-index", "auto-index", tclap.cmd());
+  TCLAP::SwitchArg saveIndex("", "save-index", "save-index", tclap.cmd());
+  TCLAP::SwitchArg matchInt("i", "integer", "integer", tclap.cmd());
+  TCLAP::SwitchArg matchTimestamp("t", "timestamp", "timestamp", tclap.cmd());
+  TCLAP::SwitchArg matchDouble("d", "double", "double", tclap.cmd());
+  TCLAP::SwitchArg matchString("s", "string", "string", tclap.cmd());
+  TCLAP::UnlabeledValueArg<std::string> from(
+      "from", "", true, "", "from", tclap.cmd());
+  TCLAP::UnlabeledValueArg<std::string> to(
+      "to", "", true, "", "to", tclap.cmd());
+  TCLAP::UnlabeledMultiArg<std::string> fileNames(
+      "path", "", false, "path", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  if (key.isSet() == asciiLog.isSet()) {
+    std::cerr << "exactly one of -k or -l must be specified." << std::endl;
+    return 1;
+  }
+
+  PatternTypes types;
+  types.integer = matchInt.isSet();
+  types.dbl = matchDouble.isSet();
+  types.timestamp = matchTimestamp.isSet();
+  types.string = matchString.isSet();
+  types.asciiLog = asciiLog.isSet();
+
+  // a slice is a bisect for everything from <from> on, which stops at <to>
+  Pattern pattern;
+  if (key.isSet()) pattern.keyPattern = key.getValue();
+  pattern.bisect = true;
+  pattern.matchOrGreater = true;
+  if (!setValuePatterns(pattern, from.getValue(), types)) return 1;
+  auto upperBound = std::make_shared<Pattern>();
+  upperBound->keyPattern = pattern.keyPattern;
+  upperBound->matchOrGreater = true;
+  if (!setValuePatterns(*upperBound, to.getValue(), types)) return 1;
+  pattern.upperBound = std::move(upperBound);
+
+  if (matches.isSet()) pattern.numMatches = matches.getValue();
+  pattern.count = count.isSet();
+
+  std::optional<std::string> indexFile;
+  if (index.isSet()) indexFile = index.getValue();
+
+  auto indexMode = AutoIndex::No;
+  if (autoIndex.isSet()) indexMode = AutoIndex::InMemory;
+  if (saveIndex.isSet()) indexMode = AutoIndex::Save;
+
+  auto threads = std::thread::hardware_concurrency();
+  if (fileNames.getValue().empty()) {
+    return grepFile(pattern, "-", encode.isSet(), asciiLog.isSet(), false,
+                    threads, indexMode, indexFile, nullptr);
+  }
+  for (auto &f : fileNames) {
+    auto result = grepFile(pattern, f, encode.isSet(), asciiLog.isSet(), false,
+                           threads, indexMode, indexFile, nullptr);
+    if (result) return result;
+  }
+  return 0;
+}
+
 }
 
 int grep(int argc, const char * const *argv) {
-  return grepCmd(argc, argv, false);
+  return grepCmd(argc, argv, false, nullptr);
 }
 
 int zgrep(int argc, const char * const *argv) {
-  return grepCmd(argc, argv, true);
+  return grepCmd(argc, argv, true, nullptr);
+}
+
+int slice(int argc, const char * const *argv) {
+  return sliceCmd(argc, argv);
+}
+
+int grepServed(int argc,
+               const char * const *argv,
+               bool compressed,
+               GrepCache &cache) {
+  return grepCmd(argc, argv, compressed, &cache);
 }
 
 }
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "DictCheckpoints.h"
+#include "Dictionary.h"
+#include "KeyIndex.h"
+#include "LruList.h"
+#include "StreamDetection.h"
+#include "au/ParseError.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <sys/stat.h>
+
+namespace au {
+
+/// What au serve keeps between greps of each file it's asked about: the open
+/// source (and with it any zindex table, inflate contexts and windows), the
+/// dictionaries found while syncing in it, its dictionary checkpoints, and for
+/// each key, the samples in its au index sidecar and the samples learned by
+/// every bisect so far.
+/// Everything kept for a file is dropped once the file changes, and the least
+/// recently searched files are forgotten once there are too many of them.
+class GrepCache {
+public:
+  class File {
+    friend class GrepCache;
+
+    struct Sidecar {
+      struct stat stat;
+      std::shared_ptr<const KeyIndex> index;
+    };
+
+    struct stat stat_;
+    std::map<std::string, Sidecar> sidecars_;
+    std::optional<struct stat> checkpointsStat_;
+    std::shared_ptr<const DictCheckpoints> checkpoints_;
+    std::map<std::string, std::shared_ptr<KeyIndex>> learned_;
+
+  public:
+    std::unique_ptr<FileByteSource> source;
+    Dictionary dictionary{32};
+
+    /// The samples in the sidecar at filename (see KeyIndex::filenameFor()),
+    /// reloaded if the sidecar has been rewritten.
+    std::shared_ptr<const KeyIndex> sidecar(const std::string &filename) {
+      struct stat sidecarStat;
+      if (::stat(filename.c_str(), &sidecarStat) != 0) {
+        sidecars_.erase(filename);
+        return nullptr;
+      }
+      auto it = sidecars_.find(filename);
+      if (it == sidecars_.end() || !sameFile(it->second.stat, sidecarStat)) {
+        it = sidecars_.insert_or_assign(
+            filename,
+            Sidecar{sidecarStat, KeyIndex::load(filename, stat_)}).first;
+      }
+      return it->second.index;
+    }
+
+    /// The checkpoints in the sidecar at filename (see
+    /// DictCheckpoints::filenameFor()), reloaded if it has been rewritten.
+    std::shared_ptr<const DictCheckpoints> checkpoints(
+        const std::string &filename) {
+      struct stat sidecarStat;
+      if (::stat(filename.c_str(), &sidecarStat) != 0) {
+        checkpointsStat_.reset();
+        checkpoints_.reset();
+        return nullptr;
+      }
+      if (!checkpointsStat_ || !sameFile(*checkpointsStat_, sidecarStat)) {
+        checkpointsStat_ = sidecarStat;
+        checkpoints_ = DictCheckpoints::load(filename, stat_);
+      }
+      return checkpoints_;
+    }
+
+    /// The samples learned so far by bisecting for values of key.
+    std::shared_ptr<KeyIndex> learned(const std::string &key) {
+      auto &index = learned_[key];
+      if (!index) index = std::make_shared<KeyIndex>(key);
+      return index;
+    }
+  };
+
+  /// How many files are kept by default. Each can hold open a file, some
+  /// inflate windows and dictionaries, so this is a good deal more than are
+  /// likely to be searched over and over, but not unbounded.
+  static constexpr size_t DefaultMaxFiles = 64;
+
+private:
+  // keyed by path, index file and whether compressed
+  LruList<std::pair<std::string, std::unique_ptr<File>>> files_;
+
+  static bool sameFile(const struct stat &a, const struct stat &b) {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino
+           && a.st_size == b.st_size
+           && a.st_mtim.tv_sec == b.st_mtim.tv_sec
+           && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+  }
+
+public:
+  explicit GrepCache(size_t maxFiles = DefaultMaxFiles)
+      : files_(std::max<size_t>(maxFiles, 1)) {}
+
+  /// The state kept for fileName (opened as detectSource() would), with its
+  /// source back at the start, which lasts until the next call. Returns null
+  /// for stdin, which can't be kept, and for files which can't be found, so
+  /// that the caller reports them as usual.
+  File *open(const std::string &fileName,
+             const std::optional<std::string> &indexFile,
+             bool compressed) {
+    if (fileName == "-") return nullptr;
+    char resolved[PATH_MAX];
+    struct stat fileStat;
+    if (!::realpath(fileName.c_str(), resolved)
+        || ::stat(resolved, &fileStat) != 0)
+      return nullptr;
+
+    auto key = AU_STR(resolved << '\0' << indexFile.value_or("") << '\0'
+                      << compressed);
+    auto *cached = files_.find(
+        [&key](const auto &entry) { return entry.first == key; });
+    if (!cached) cached = &files_.add({key, nullptr});
+    auto &file = cached->second;
+    // a source which can't seek can't go back to the start, either
+    if (!file || !sameFile(file->stat_, fileStat)
+        || !file->source->isSeekable()) {
+      file = std::make_unique<File>();
+      file->stat_ = fileStat;
+      file->source = detectSource(fileName, indexFile, compressed);
+    } else {
+      file->source->clearPin();
+      file->source->seek(0);
+    }
+    return file.get();
+  }
+
+  /// How many files are being kept.
+  size_t size() const { return files_.size(); }
+};
+
+}
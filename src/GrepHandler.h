@@ -1,14 +1,27 @@
 #pragma once
 
 #include "au/AuDecoder.h"
+#include "au/BlockSummary.h"
 #include "AuRecordHandler.h"
+#include "DictCheckpoints.h"
+#include "JsonOutputHandler.h"
 #include "JsonProxies.h"
+#include "KeyIndex.h"
+#include "ParallelScan.h"
 #include "Tail.h"
 #include "TimestampPattern.h"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
 #include <optional>
+#include <sstream>
+#include <type_traits>
+#include <utility>
 #include <variant>
 
 namespace au {
@@ -39,9 +52,90 @@ struct Pattern {
   bool count = false;
   bool forceFollow = false;
   bool matchOrGreater = false;
+  /// Rather than stopping at eof, wait for more records to be appended to the
+  /// file, and grep those too.
+  bool follow = false;
+  /// Samples of keyPattern in the file being bisected, if it has them.
+  std::shared_ptr<const KeyIndex> keyIndex;
+  /// If set, each record a bisect lands on is added to this, and later
+  /// bisects of the same file start from what earlier ones found. See
+  /// GrepCache.
+  std::shared_ptr<KeyIndex> learnedIndex;
+  /// Dictionary checkpoints for the file being grepped, if it has them.
+  std::shared_ptr<const DictCheckpoints> checkpoints;
+  /// For au slice, the end of the slice, which is matched with matchOrGreater
+  /// set. A record only matches if its first value of keyPattern is below it,
+  /// and the scan stops a little past the records which aren't.
+  std::shared_ptr<Pattern> upperBound;
 
   bool requiresKeyMatch() const { return static_cast<bool>(keyPattern); }
 
+  /// True if a value can only match by being a string containing (or equal
+  /// to) strPattern, so that a record can only match if the pattern appears
+  /// in its raw bytes or it refers to a matching dictionary entry.
+  bool onlyMatchesStrings() const {
+    return strPattern && !strPattern->pattern.empty() && !matchOrGreater
+           && !atomPattern && !intPattern && !uintPattern && !doublePattern
+           && !timestampPattern;
+  }
+
+  /// The hashes (see BlockSummary) of the values the pattern matches exactly,
+  /// if those are the only values it can match (matchOrGreater aside). A
+  /// block whose summary has none of them has no match.
+  std::vector<uint64_t> summaryHashes() const {
+    if (forceFollow || atomPattern || timestampPattern
+        || (strPattern && !strPattern->fullMatch))
+      return {};
+    std::optional<std::string_view> key;
+    if (keyPattern) key = *keyPattern;
+    std::vector<uint64_t> hashes;
+    auto add = [&](BlockSummary::Type type, std::string_view bytes) {
+      hashes.push_back(BlockSummary::hash(key ? &*key : nullptr, type, bytes));
+    };
+    if (strPattern) add(BlockSummary::String, strPattern->pattern);
+    if (uintPattern) add(BlockSummary::Uint, BlockSummary::bytesOf(*uintPattern));
+    // non-negative ints are decoded as uints
+    if (intPattern && *intPattern < 0)
+      add(BlockSummary::Int, BlockSummary::bytesOf(*intPattern));
+    if (doublePattern) {
+      auto d = *doublePattern == 0.0 ? 0.0 : *doublePattern;
+      add(BlockSummary::Double, BlockSummary::bytesOf(d));
+    }
+    return hashes;
+  }
+
+  /// A value of an ordered key as a point on a line, for interpolating
+  /// between two of them. Only numbers and timestamps have one.
+  static std::optional<double> interpolationPoint(const KeyValue &val) {
+    return std::visit([](auto &v) -> std::optional<double> {
+      using T = std::decay_t<decltype(v)>;
+      if constexpr (std::is_same_v<T, std::string>)
+        return std::nullopt;
+      else if constexpr (std::is_same_v<T, time_point>)
+        return static_cast<double>(v.time_since_epoch().count());
+      else
+        return static_cast<double>(v);
+    }, val);
+  }
+
+  /// The pattern as a point on the same line as interpolationPoint(like),
+  /// if the pattern has a value of like's type.
+  std::optional<double> interpolationTarget(const KeyValue &like) const {
+    if (std::holds_alternative<time_point>(like)) {
+      if (!timestampPattern || timestampPattern->isRelativeTime) return {};
+      return static_cast<double>(
+          timestampPattern->start.time_since_epoch().count());
+    }
+    if (std::holds_alternative<double>(like)) {
+      if (doublePattern) return *doublePattern;
+      return {};
+    }
+    if (std::holds_alternative<std::string>(like)) return {};
+    if (uintPattern) return static_cast<double>(*uintPattern);
+    if (intPattern) return static_cast<double>(*intPattern);
+    return {};
+  }
+
   bool needsDateScan() const {
     return timestampPattern && timestampPattern->isRelativeTime;
   }
@@ -84,14 +178,28 @@ struct Pattern {
   }
 
   bool matchesValue(std::string_view sv) const {
+    return matchesString(sv, matchOrGreater);
+  }
+
+  /// Matches a sample from a KeyIndex.
+  bool matchesKeyValue(const KeyValue &val) {
+    return std::visit([this](auto &v) {
+      if constexpr (std::is_same_v<std::decay_t<decltype(v)>, std::string>)
+        return matchesValue(std::string_view(v));
+      else
+        return matchesValue(v);
+    }, val);
+  }
+
+  bool matchesString(std::string_view sv, bool orGreater) const {
     if (!strPattern) return false;
     if (strPattern->fullMatch) {
-      if (matchOrGreater) return sv >= strPattern->pattern;
+      if (orGreater) return sv >= strPattern->pattern;
       return strPattern->pattern == sv;
     }
 
     // substring search is incompatible with binary search...
-    if (matchOrGreater) return false;
+    if (orGreater) return false;
     return sv.find(strPattern->pattern) != std::string::npos;
   }
 
@@ -137,6 +245,23 @@ class GrepHandler {
   const Dictionary::Dict *dictionary_ = nullptr;
   bool attempted_;
   bool matched_;
+  /// Whether to keep the first value of the key pattern in keyValue_.
+  bool captureKeyValue_ = false;
+  std::optional<KeyValue> keyValue_;
+  bool allowBlockSkips_ = false;
+  std::optional<std::vector<uint64_t>> summaryHashes_;
+
+  /// The encodings of references to the dictionary entries that match the key
+  /// and value patterns, for the dictionary (and size) they were computed for.
+  struct RefNeedles {
+    const Dictionary::Dict *dict = nullptr;
+    size_t startPos = 0;
+    size_t size = 0;
+    std::vector<std::string> keyRefs;
+    std::vector<std::string> valueRefs;
+    bool tooManyValueRefs = false;
+  };
+  RefNeedles needles_;
 
   // Keeps track of the context we're in so we know if the string we're
   // constructing or reading is a key or a value
@@ -174,6 +299,13 @@ public:
   bool attemptedMatch() const { return attempted_; }
   bool matched() const { return matched_; }
 
+  /// While enabled, keyValue() is the first value of the key pattern in the
+  /// last record (or with no key pattern, its first value), if it had one.
+  void captureKeyValues(bool enable) {
+    captureKeyValue_ = enable;
+  }
+  const std::optional<KeyValue> &keyValue() const { return keyValue_; }
+
   bool isKey() const {
     auto &c = context_.back();
     return (c.context == Context::OBJECT) && (c.counter % 2 == 0);
@@ -183,9 +315,65 @@ public:
     context_.back().counter++;
   }
 
-  void onValue(AuByteSource &source, const Dictionary::Dict &dict) {
+  /// Flags computed by classify() for each dictionary entry.
+  enum DictFlags : uint8_t {
+    KeyMatch = 1,
+    ValueMatch = 2,
+    ValueMatchOrGreater = 4,
+  };
+
+  /// Evaluates the key and string patterns against a dictionary entry, once,
+  /// as it's added. Install this as the Dictionary's classifier. The value is
+  /// checked both ways since bisecting temporarily sets matchOrGreater.
+  uint8_t classify(std::string_view entry) {
+    uint8_t flags = 0;
+    if (pattern_.requiresKeyMatch() && pattern_.matchesKey(entry))
+      flags |= KeyMatch;
+    if (pattern_.matchesString(entry, false)) flags |= ValueMatch;
+    if (pattern_.matchesString(entry, true)) flags |= ValueMatchOrGreater;
+    return flags;
+  }
+
+  /// Checks whether a value record can possibly match without parsing it.
+  ///
+  /// When grepping for a key, a value record can only match if the key is
+  /// somewhere in it: inline in its raw bytes, or as a reference to a matching
+  /// dictionary entry. The encoder usually interns keys, but that can't be
+  /// relied on (tiny keys, AuWriter::value(), other writers), so both are
+  /// looked for.
+  ///
+  /// Similarly, for plain string patterns, a record can't match unless the
+  /// pattern appears inline in its raw bytes or the record refers to a
+  /// matching dictionary entry. This check doesn't hold up for -F, which needs
+  /// to know whether a match was attempted on every record.
+  bool skipValue(const Dictionary::Dict &dict, std::string_view raw) {
+    if (!cannotMatch(dict, raw)) return false;
     initializeForValue(&dict);
-    ValueParser<GrepHandler> parser(source, *this);
+    return true;
+  }
+
+  /// While enabled, blocks of records whose summaries show they have no
+  /// match are skipped. The grepper turns this off whenever it needs to see
+  /// every record, e.g. for context.
+  void allowBlockSkips(bool allow) { allowBlockSkips_ = allow; }
+
+  /// Checks the summary of the block that follows for the values the pattern
+  /// matches. Only exact matches can be ruled out this way, so nothing is
+  /// skipped when bisecting, or for substrings, atoms, timestamps or -F.
+  bool skipBlock(const BlockSummary &summary) {
+    if (!allowBlockSkips_ || pattern_.matchOrGreater) return false;
+    if (!summaryHashes_) summaryHashes_ = pattern_.summaryHashes();
+    if (summaryHashes_->empty()) return false;
+    for (auto hash : *summaryHashes_)
+      if (summary.mayContain(hash)) return false;
+    initializeForValue();
+    return true;
+  }
+
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dict) {
+    initializeForValue(&dict);
+    ValueParser<GrepHandler, Source> parser(source, *this);
     parser.value();
   }
 
@@ -195,6 +383,7 @@ public:
     context_.emplace_back(Context::BARE, 0, !pattern_.requiresKeyMatch());
     attempted_ = false;
     matched_ = false;
+    keyValue_.reset();
   }
 
   template<typename C, typename V>
@@ -222,6 +411,7 @@ public:
     attempted_ |= context_.back().checkVal;
     if (context_.back().checkVal && pattern_.matchesValue(value))
       matched_ = true;
+    capture(value);
     incrCounter();
   }
 
@@ -229,6 +419,7 @@ public:
     attempted_ |= context_.back().checkVal;
     if (context_.back().checkVal && pattern_.matchesValue(value))
       matched_ = true;
+    capture(value);
     incrCounter();
   }
 
@@ -236,6 +427,7 @@ public:
     attempted_ |= context_.back().checkVal;
     if (context_.back().checkVal && pattern_.matchesValue(value))
       matched_ = true;
+    capture(value);
     incrCounter();
   }
 
@@ -243,16 +435,25 @@ public:
     attempted_ |= context_.back().checkVal;
     if (context_.back().checkVal && pattern_.matchesValue(value))
       matched_ = true;
+    capture(value);
     incrCounter();
   }
 
   void onDictRef(size_t, size_t dictIdx) {
-    // this could perhaps be optimized by indexing the dictionary as things are
-    // added and then just checking whether dictIdx refers to a known matching
-    // value. but, particularly since most dictionary entries and most patterns
-    // are very short strings, it's not clear whether that would be worth it.
-    // probably worth a try someday, but not essential...
-    checkString(dictionary_->at(dictIdx));
+    if (!dictionary_->classified()) {
+      checkString(dictionary_->at(dictIdx));
+    } else if (auto flags = dictionary_->flags(dictIdx); isKey()) {
+      // the patterns were already evaluated when the entry was added
+      context_.back().checkVal = !pattern_.requiresKeyMatch()
+          || (flags & KeyMatch);
+    } else {
+      attempted_ |= context_.back().checkVal;
+      auto valueMatch = pattern_.matchOrGreater ? ValueMatchOrGreater
+                                                : ValueMatch;
+      if (context_.back().checkVal && (flags & valueMatch))
+        matched_ = true;
+      capture(dictionary_->at(dictIdx));
+    }
     incrCounter();
   }
 
@@ -275,7 +476,7 @@ public:
   }
 
   void onStringStart(size_t, size_t len) {
-    if (!pattern_.strPattern
+    if (!pattern_.strPattern && !captureKeyValue_
         && !(pattern_.requiresKeyMatch() && isKey()))
       return;
     str_.clear();
@@ -288,13 +489,74 @@ public:
   }
 
   void onStringFragment(std::string_view frag) {
-    if (!pattern_.strPattern
+    if (!pattern_.strPattern && !captureKeyValue_
         && !(pattern_.requiresKeyMatch() && isKey()))
       return;
     str_.insert(str_.end(), frag.data(), frag.data() + frag.size());
   }
 
 private:
+  bool cannotMatch(const Dictionary::Dict &dict, std::string_view raw) {
+    if (!dict.classified() || raw.empty()) return false;
+
+    auto &needles = refNeedles(dict);
+    if (pattern_.requiresKeyMatch()) {
+      auto &key = *pattern_.keyPattern;
+      if (!::memmem(raw.data(), raw.size(), key.data(), key.size())
+          && !containsAny(raw, needles.keyRefs))
+        return true;
+    }
+    if (pattern_.forceFollow || !pattern_.onlyMatchesStrings()
+        || needles.tooManyValueRefs)
+      return false;
+    auto &str = pattern_.strPattern->pattern;
+    return !::memmem(raw.data(), raw.size(), str.data(), str.size())
+           && !containsAny(raw, needles.valueRefs);
+  }
+
+  const RefNeedles &refNeedles(const Dictionary::Dict &dict) {
+    // dictionaries only grow until they're reset, so if it's the same one, we
+    // only need to look at the entries added since last time
+    if (needles_.dict != &dict || needles_.startPos != dict.startPos_
+        || needles_.size > dict.size())
+      needles_ = RefNeedles{&dict, dict.startPos_, 0, {}, {}, false};
+
+    // beyond this, it's a lot of searching for refs that are likely to turn
+    // up by chance anyway
+    constexpr size_t MAX_VALUE_REFS = 8;
+    for (auto idx = std::exchange(needles_.size, dict.size());
+         idx < dict.size(); idx++) {
+      auto flags = dict.flags(idx);
+      if (flags & KeyMatch) needles_.keyRefs.push_back(encodeRef(idx));
+      if (flags & ValueMatch) {
+        if (needles_.valueRefs.size() == MAX_VALUE_REFS)
+          needles_.tooManyValueRefs = true;
+        else
+          needles_.valueRefs.push_back(encodeRef(idx));
+      }
+    }
+    return needles_;
+  }
+
+  static std::string encodeRef(size_t idx) {
+    // see AuWriter::encodeStringIntern
+    if (idx < 0x80) return std::string(1, static_cast<char>(0x80 | idx));
+    char buf[varint::MAX_LEN + 1];
+    buf[0] = marker::DictRef;
+    return std::string(buf, varint::encode(idx, buf + 1) + 1);
+  }
+
+  static bool containsAny(std::string_view raw,
+                          const std::vector<std::string> &needles) {
+    for (auto &needle : needles) {
+      if (needle.size() == 1 ? ::memchr(raw.data(), needle[0], raw.size())
+                             : ::memmem(raw.data(), raw.size(),
+                                        needle.data(), needle.size()))
+        return true;
+    }
+    return false;
+  }
+
   void checkString(std::string_view sv) {
     if (isKey()) {
       context_.back().checkVal = pattern_.matchesKey(sv);
@@ -303,22 +565,33 @@ private:
       attempted_ |= context_.back().checkVal;
       if (context_.back().checkVal && pattern_.matchesValue(sv))
         matched_ = true;
+      capture(sv);
     }
   }
+
+  template <typename T>
+  void capture(const T &value) {
+    if (!captureKeyValue_ || keyValue_ || !context_.back().checkVal) return;
+    if constexpr (std::is_same_v<T, std::string_view>)
+      keyValue_ = std::string(value);
+    else
+      keyValue_ = value;
+  }
 };
 
 
 namespace {
 
-template <typename This>
+/// Source is the concrete byte source type. see BaseParser.
+template <typename This, typename Source>
 class Grepper {
 protected:
   Pattern &pattern;
-  AuByteSource &source;
+  Source &source;
   GrepHandler grepHandler;
 
 public:
-  Grepper(Pattern &pattern, AuByteSource &source)
+  Grepper(Pattern &pattern, Source &source)
   : pattern(pattern),
     source(source),
     grepHandler(pattern) {}
@@ -335,7 +608,8 @@ public:
     return reallyDoGrep();
   }
 
-private:
+  /// Settles the date of a time-only timestamp pattern from the first few
+  /// records of the file. doGrep() does this itself.
   void performDateScan() {
     constexpr size_t DATE_SCAN_RECORDS = 100;
     constexpr size_t DATE_SCAN_BYTES = 256 * 1024;
@@ -356,6 +630,7 @@ private:
     source.seek(pos);
   }
 
+private:
   int reallyDoGrep() {
     if (pattern.count) pattern.beforeContext = pattern.afterContext = 0;
 
@@ -370,9 +645,25 @@ private:
       if (pattern.numMatches) numMatches = *pattern.numMatches;
       size_t suffixLength = std::numeric_limits<size_t>::max();
       if (pattern.scanSuffixAmount) suffixLength = *pattern.scanSuffixAmount;
+      // a slice goes on until it's past its upper bound instead, i.e. until
+      // it's gone SUFFIX_AMOUNT since the first record at or above the upper
+      // bound without any record below it.
+      constexpr auto notPast = std::numeric_limits<size_t>::max();
+      size_t pastUpperBound = notPast;
+      if (pattern.upperBound) suffixLength = std::numeric_limits<size_t>::max();
+      grepHandler.captureKeyValues(pattern.upperBound != nullptr);
+      // only now, so that the date scan doesn't wait for records which are
+      // yet to be written
+      if (pattern.follow) source.setFollow(true);
 
       while (!source.peek().isEof()) {
         if (!force && source.pos() - suffixStartPos > suffixLength) break;
+        if (pattern.upperBound && total >= numMatches) break;
+        // once the matches have all been output, a follow would otherwise wait
+        // for more data forever
+        if (pattern.follow && total >= numMatches && !force
+            && !(pattern.forceFollow && inMatchRegion))
+          break;
 
         auto candidatePos = source.pos();
         if (!pattern.count) {
@@ -382,10 +673,24 @@ private:
           source.setPin(posBuffer.front());
         }
 
+        // context needs every record, so blocks can't be skipped for it
+        grepHandler.allowBlockSkips(!force && !pattern.beforeContext);
         if (!static_cast<This *>(this)->parseValue())
           break;
+        auto matched = grepHandler.matched();
+        if (pattern.upperBound && grepHandler.keyValue()) {
+          if (pattern.upperBound->matchesKeyValue(*grepHandler.keyValue())) {
+            matched = false;
+            if (pastUpperBound == notPast) pastUpperBound = candidatePos;
+          } else {
+            pastUpperBound = notPast;
+          }
+        }
+        if (pastUpperBound != notPast
+            && source.pos() - pastUpperBound > SUFFIX_AMOUNT)
+          break;
         auto matchedNow = false;
-        if (grepHandler.matched() && total < numMatches) {
+        if (matched && total < numMatches) {
           inMatchRegion = true;
           matchedNow = true;
           // we only want to count records with *actual* matches, not records
@@ -437,19 +742,70 @@ private:
       return 0;
   }
 
-  int doBisect() {
-    constexpr size_t SCAN_THRESHOLD = 256 * 1024;
-    constexpr size_t PREFIX_AMOUNT = 512 * 1024;
-    // it's important that the suffix amount be large enough to cover the entire
-    // scan length + the prefix buffer. this is to guarantee that we will search
-    // AT LEAST the entire scan region for the first match before giving up.
-    // after finding the first match, we'll keep scanning until we go
-    // SUFFIX_AMOUNT without seeing any matches. but we do want to make sure we
-    // look for the first match in the entire region where it could possibly be
-    // (and a bit beyond).
-    constexpr size_t SUFFIX_AMOUNT = SCAN_THRESHOLD + PREFIX_AMOUNT + 512 * 1024;
-    static_assert(SUFFIX_AMOUNT > PREFIX_AMOUNT + SCAN_THRESHOLD);
+  static constexpr size_t SCAN_THRESHOLD = 256 * 1024;
+  static constexpr size_t PREFIX_AMOUNT = 512 * 1024;
+  // it's important that the suffix amount be large enough to cover the entire
+  // scan length + the prefix buffer. this is to guarantee that we will search
+  // AT LEAST the entire scan region for the first match before giving up.
+  // after finding the first match, we'll keep scanning until we go
+  // SUFFIX_AMOUNT without seeing any matches. but we do want to make sure we
+  // look for the first match in the entire region where it could possibly be
+  // (and a bit beyond). a slice allows the same amount of disorder at its end.
+  static constexpr size_t SUFFIX_AMOUNT =
+      SCAN_THRESHOLD + PREFIX_AMOUNT + 512 * 1024;
+  static_assert(SUFFIX_AMOUNT > PREFIX_AMOUNT + SCAN_THRESHOLD);
+
+  /// What a bisect knows about the values of the key at either end of the
+  /// range it has narrowed the search to.
+  struct Bounds {
+    std::optional<KeyValue> start;
+    std::optional<KeyValue> end;
+    /// Whether the next estimate should fall short of the pattern, rather
+    /// than overshoot it: the opposite of the side the last probe moved.
+    bool aimLow = true;
+
+    int known() const { return start.has_value() + end.has_value(); }
+  };
+
+  /// Where to probe next, if the values of the key are numbers or timestamps:
+  /// an estimate of where the pattern is between start and end, assuming the
+  /// values grow about linearly with position. For timestamped logs this gets
+  /// there in a few probes rather than a couple of dozen, which matters most
+  /// in gzipped files, where each probe inflates a lot of data. Probes land
+  /// a little to one side of the estimate and then the other, so that the
+  /// range closes in from both ends. The first probe is a bisect, which finds
+  /// out what the values are. If they're numbers, the next one looks at
+  /// whichever end of the range it didn't. nullopt means to bisect.
+  std::optional<size_t> interpolate(size_t start, size_t end,
+                                    const Bounds &bounds) const {
+    // keep as far from the end of the range as a bisect would, so that there
+    // is a record after the probe to sync to
+    constexpr size_t margin = SCAN_THRESHOLD / 2;
+    constexpr double aim = SCAN_THRESHOLD / 4;
+    auto &like = bounds.start ? bounds.start : bounds.end;
+    if (!like) return std::nullopt;
+    auto target = pattern.interpolationTarget(*like);
+    if (!target) return std::nullopt;
+    if (!bounds.end) return end - margin;
+    if (!bounds.start) return start;
+
+    auto lo = Pattern::interpolationPoint(*bounds.start);
+    auto hi = Pattern::interpolationPoint(*bounds.end);
+    if (!lo || !hi || !(*hi > *lo)) return std::nullopt;
+    auto fraction = std::clamp((*target - *lo) / (*hi - *lo), 0.0, 1.0);
+    auto estimate = static_cast<double>(start)
+                    + fraction * static_cast<double>(end - start);
+    // landing on the end of the range it's aiming for wouldn't narrow it, so
+    // an estimate close to that end is aimed only part of the way there
+    estimate += bounds.aimLow
+        ? -std::min(aim, (estimate - static_cast<double>(start)) / 2)
+        : std::min(aim, (static_cast<double>(end) - estimate) / 2);
+    estimate = std::clamp(estimate, static_cast<double>(start),
+                          static_cast<double>(end - margin));
+    return static_cast<size_t>(estimate);
+  }
 
+  int doBisect() {
     if (!source.isSeekable()) {
       std::cerr << "Cannot binary search in non-seekable file '" << source.name()
         << "'" << std::endl;
@@ -462,16 +818,41 @@ private:
     try {
       size_t start = 0;
       size_t end = source.endPos();
-      while (end > start) {
+      auto matches = [&](const KeyValue &val) {
+        return pattern.matchesKeyValue(val);
+      };
+      if (pattern.keyIndex) pattern.keyIndex->narrow(matches, start, end);
+      if (pattern.learnedIndex)
+        pattern.learnedIndex->narrow(matches, start, end);
+      // the values at start and end, as far as the probes have found them
+      Bounds bounds;
+      auto interpolating = pattern.timestampPattern || pattern.uintPattern
+                           || pattern.intPattern || pattern.doublePattern;
+      grepHandler.captureKeyValues(interpolating
+                                   || pattern.learnedIndex != nullptr);
+      bool bisectNext = false;
+      // the range before the last probe, if it was an estimate between two
+      // known values
+      std::optional<size_t> lastRange;
+      // a record known to match, which the scan has to get as far as
+      size_t mustScanTo = 0;
+      while (true) {
         if (end - start <= SCAN_THRESHOLD) {
-          static_cast<This *>(this)->seekSync(
-                  start > PREFIX_AMOUNT ? start - PREFIX_AMOUNT : 0);
+          auto scanStart = start > PREFIX_AMOUNT ? start - PREFIX_AMOUNT : 0;
+          static_cast<This *>(this)->seekSync(scanStart);
           pattern.scanSuffixAmount = SUFFIX_AMOUNT;
+          if (mustScanTo > scanStart)
+            pattern.scanSuffixAmount = mustScanTo - scanStart + SUFFIX_AMOUNT;
           pattern.matchOrGreater = origMatchOrGreater;
           return reallyDoGrep();
         }
 
         size_t next = start + (end-start)/2;
+        auto range = end - start;
+        auto estimate = interpolating && !bisectNext
+                        ? interpolate(start, end, bounds) : std::nullopt;
+        auto between = estimate && bounds.known() == 2;
+        if (estimate) next = *estimate;
         static_cast<This *>(this)->seekSync(next);
 
         auto startOfScan = source.pos();
@@ -486,6 +867,8 @@ private:
           if (grepHandler.matched()) {
             if (startOfScan < end) {
               end = startOfScan;
+              bounds.end = grepHandler.keyValue();
+              bounds.aimLow = true;
             } else {
               // this is an indication that we've jumped back to bisect the range
               // (start, end) but that in scanning forward to find the first record,
@@ -493,13 +876,26 @@ private:
               // means the file contains a huge record.) if we update end
               // and bisect again, the same thing will happen again and we'll end
               // up doing this forever. in this case, we'll just set start and end
-              // in such a way as to force a scan on the next iteration.
+              // in such a way as to force a scan on the next iteration, one
+              // which goes on at least as far as this record.
               end = start + 1;
+              mustScanTo = startOfScan;
             }
           } else if (grepHandler.attemptedMatch()) {
             start = startOfScan;
+            bounds.start = grepHandler.keyValue();
+            bounds.aimLow = false;
           }
+          if (pattern.learnedIndex && grepHandler.keyValue())
+            pattern.learnedIndex->insert(startOfScan, *grepHandler.keyValue());
         } while (!grepHandler.attemptedMatch());
+        // a probe on one side of a good estimate may only trim the range a
+        // little, but the next one on the other side should finish it off. if
+        // the two of them didn't at least halve the range, they're doing
+        // worse than bisecting would, so make the next probe a bisect, to be
+        // sure of getting there
+        bisectNext = between && lastRange && end - start > *lastRange / 2;
+        lastRange = between ? std::optional(range) : std::nullopt;
       }
     } catch (parse_error &e) {
       std::cerr << e.what() << std::endl;
@@ -510,26 +906,126 @@ private:
   }
 };
 
-template <typename OutputHandler>
-class AuGrepper : public Grepper<AuGrepper<OutputHandler>> {
-  friend class Grepper<AuGrepper<OutputHandler>>;
-  Dictionary dictionary_;
+/// The output of grepping one chunk of a file in parallel.
+struct GrepChunk {
+  /// A rendered record: its position in the file, and its output in out.
+  struct Line {
+    size_t pos;
+    size_t offset;
+    size_t len;
+  };
+
+  std::ostringstream out;
+  /// Matches and their context, in file order.
+  std::vector<Line> lines;
+  /// The last few records of the chunk which aren't in lines.
+  std::vector<Line> tail;
+  size_t count = 0;
+  /// The number of records in the chunk before the first match.
+  size_t leading = 0;
+
+  size_t offset() { return static_cast<size_t>(std::streamoff(out.tellp())); }
+};
+
+template <typename OutputHandler, typename Source = AuByteSource>
+class AuGrepper : public Grepper<AuGrepper<OutputHandler, Source>, Source> {
+  friend class Grepper<AuGrepper<OutputHandler, Source>, Source>;
+  std::unique_ptr<Dictionary> ownDictionary_;
+  Dictionary &dictionary_;
   AuRecordHandler<OutputHandler> outputRecordHandler_;
   AuRecordHandler<GrepHandler> grepRecordHandler_;
 
 public:
   // clang warns too aggressively if the names of these arguments shadow the
   // base class member vars. hence "p" and "s"...
-  AuGrepper(Pattern &p, AuByteSource &s, OutputHandler &handler)
-  : Grepper<AuGrepper<OutputHandler>>(p, s),
-    dictionary_(32),
+  AuGrepper(Pattern &p, Source &s, OutputHandler &handler)
+  : AuGrepper(p, s, handler, std::make_unique<Dictionary>(32)) {}
+
+  /// Greps with a dictionary kept from an earlier grep of the same source, so
+  /// that syncing at a position it already covers needn't rebuild it. The
+  /// dictionary must outlive the grepper.
+  AuGrepper(Pattern &p, Source &s, OutputHandler &handler,
+            Dictionary &dictionary)
+  : Grepper<AuGrepper<OutputHandler, Source>, Source>(p, s),
+    dictionary_(dictionary),
     outputRecordHandler_(dictionary_, handler),
-    grepRecordHandler_(dictionary_, this->grepHandler) {}
+    grepRecordHandler_(dictionary_, this->grepHandler) {
+    dictionary_.setClassifier([this](std::string_view entry) {
+      return this->grepHandler.classify(entry);
+    });
+  }
+
+  AuGrepper(const AuGrepper &) = delete;
+  AuGrepper &operator=(const AuGrepper &) = delete;
+
+  ~AuGrepper() {
+    // the classifier refers to this grepper's handler
+    dictionary_.setClassifier(nullptr);
+  }
+
+  /// Greps the value records of one chunk of a parallel scan. See
+  /// parallelGrep(). The output handler must write to chunk.out. Matches are
+  /// output with their context, with after-context running on past the end of
+  /// the chunk if need be. The records at the end of the chunk which weren't
+  /// output are rendered too, in case the next chunk needs them as
+  /// before-context.
+  void scanChunk(ChunkRange &range, GrepChunk &chunk) {
+    auto render = [&](size_t pos, std::vector<GrepChunk::Line> &lines) {
+      auto offset = chunk.offset();
+      this->source.seek(pos);
+      outputValue();
+      lines.push_back({pos, offset, chunk.offset() - offset});
+    };
+
+    if (!range.sync(this->source, dictionary_, this->pattern.checkpoints.get()))
+      return;
+    // records since the last one output, up to beforeContext of them
+    std::vector<size_t> recent;
+    size_t seen = 0;
+    size_t force = 0;
+    while (true) {
+      this->grepHandler.allowBlockSkips(!force && !this->pattern.beforeContext);
+      if (!range.nextValue(this->source, grepRecordHandler_)) break;
+      auto pos = this->source.pos();
+      this->parseValue();
+      if (this->grepHandler.matched()) {
+        if (!chunk.count++) chunk.leading = seen;
+        if (!this->pattern.count) {
+          recent.push_back(pos);
+          for (auto p : recent) render(p, chunk.lines);
+          recent.clear();
+          force = this->pattern.afterContext;
+        }
+      } else if (force) {
+        render(pos, chunk.lines);
+        force--;
+      } else if (this->pattern.beforeContext) {
+        if (recent.size() == this->pattern.beforeContext)
+          recent.erase(recent.begin());
+        recent.push_back(pos);
+      }
+      seen++;
+    }
+
+    for (auto p : recent) render(p, chunk.tail);
+    this->source.seek(range.next);
+    this->grepHandler.allowBlockSkips(false);
+    // matches in the following chunks are theirs to deal with
+    for (; force && skipToValue(this->source, grepRecordHandler_); force--)
+      render(this->source.pos(), chunk.lines);
+  }
 
 private:
+  AuGrepper(Pattern &p, Source &s, OutputHandler &handler,
+            std::unique_ptr<Dictionary> dictionary)
+  : AuGrepper(p, s, handler, *dictionary) {
+    ownDictionary_ = std::move(dictionary);
+  }
+
   void seekSync(size_t pos) {
     this->source.seek(pos);
-    TailHandler tailHandler(dictionary_, this->source);
+    TailHandler tailHandler(dictionary_, this->source,
+                            this->pattern.checkpoints.get());
     if (!tailHandler.sync()) {
       AU_THROW("Failed to find record at position " << pos);
     }
@@ -548,21 +1044,21 @@ private:
   }
 };
 
-template <typename OutputHandler>
-class JsonGrepper : public Grepper<JsonGrepper<OutputHandler>> {
+template <typename OutputHandler, typename Source = AuByteSource>
+class JsonGrepper : public Grepper<JsonGrepper<OutputHandler, Source>, Source> {
   static constexpr auto parseOpt = rapidjson::kParseStopWhenDoneFlag +
                                     rapidjson::kParseFullPrecisionFlag +
                                     rapidjson::kParseNanAndInfFlag;
 
-  friend class Grepper<JsonGrepper<OutputHandler>>;
+  friend class Grepper<JsonGrepper<OutputHandler, Source>, Source>;
   rapidjson::Reader reader_;
   OutputHandler &handler_;
 
 public:
   // clang warns too aggressively if the names of these arguments shadow the
   // base class member vars. hence "p" and "s"...
-  JsonGrepper(Pattern &p, AuByteSource &s, OutputHandler &handler)
-  : Grepper<JsonGrepper<OutputHandler>>(p, s),
+  JsonGrepper(Pattern &p, Source &s, OutputHandler &handler)
+  : Grepper<JsonGrepper<OutputHandler, Source>, Source>(p, s),
     handler_(handler) {}
 
 private:
@@ -598,14 +1094,17 @@ private:
   }
 };
 
-class AsciiGrepper : public Grepper<AsciiGrepper> {
-  friend class Grepper<AsciiGrepper>;
+template <typename Source = AuByteSource>
+class AsciiGrepper : public Grepper<AsciiGrepper<Source>, Source> {
+  friend class Grepper<AsciiGrepper<Source>, Source>;
+  using Grepper<AsciiGrepper<Source>, Source>::source;
+  using Grepper<AsciiGrepper<Source>, Source>::grepHandler;
 
 public:
   // clang warns too aggressively if the names of these arguments shadow the
   // base class member vars. hence "p" and "s"...
-  AsciiGrepper(Pattern &p, AuByteSource &s)
-  : Grepper<AsciiGrepper>(p, s) {}
+  AsciiGrepper(Pattern &p, Source &s)
+  : Grepper<AsciiGrepper<Source>, Source>(p, s) {}
 
 private:
   void seekSync(size_t pos) {
@@ -662,10 +1161,92 @@ private:
   }
 };
 
-template <typename H>
-AuGrepper(Pattern &, AuByteSource &, H &) -> AuGrepper<H>;
-template <typename H>
-JsonGrepper(Pattern &, AuByteSource &, H &) -> JsonGrepper<H>;
+template <typename H, typename S>
+AuGrepper(Pattern &, S &, H &) -> AuGrepper<H, S>;
+template <typename H, typename S>
+AuGrepper(Pattern &, S &, H &, Dictionary &) -> AuGrepper<H, S>;
+template <typename H, typename S>
+JsonGrepper(Pattern &, S &, H &) -> JsonGrepper<H, S>;
+template <typename S>
+AsciiGrepper(Pattern &, S &) -> AsciiGrepper<S>;
+
+/// Whether an au file can be grepped with parallelGrep(). Things which carry
+/// state from one match to the next (-m, -F, and guessing the date of a
+/// time-only pattern) need a serial scan, as does bisection, and following
+/// the file as it grows.
+inline bool canGrepInParallel(const Pattern &pattern,
+                              FileByteSource &source,
+                              size_t threads) {
+  return !pattern.bisect && !pattern.numMatches && !pattern.forceFollow
+         && !pattern.follow
+         && !pattern.needsDateScan() && canScanInParallel(source, threads);
+}
+
+/// Greps an au file on several threads (see ParallelScan.h), writing json to
+/// stdout. The output is identical to that of AuGrepper::doGrep(): each chunk
+/// outputs its matches with their context, and as the chunks are put back in
+/// order, records already output by a previous chunk are dropped, and
+/// before-context is filled in from the end of the chunk(s) before.
+inline int parallelGrep(Pattern &pattern,
+                        MmapByteSource &source,
+                        size_t threads,
+                        size_t chunkSize = PARALLEL_CHUNK_SIZE) {
+  if (pattern.count) pattern.beforeContext = pattern.afterContext = 0;
+
+  struct Pending {
+    size_t pos;
+    std::string str;
+  };
+  // the last few records of the previous chunk(s) not yet output
+  std::deque<Pending> ring;
+  std::optional<size_t> lastPos;
+  size_t total = 0;
+  auto write = [&](size_t pos, std::string_view str) {
+    if (lastPos && pos <= *lastPos) return;
+    std::cout << str;
+    lastPos = pos;
+  };
+
+  try {
+    parallelScan<GrepChunk>(
+        source, threads,
+        [&](MmapByteSource &src, ChunkRange &range, GrepChunk &chunk) {
+          Pattern chunkPattern = pattern;
+          JsonOutputHandler handler(chunk.out);
+          AuGrepper(chunkPattern, src, handler).scanChunk(range, chunk);
+        },
+        [&](GrepChunk &chunk) {
+          auto out = chunk.out.str();
+          auto view = [&](const GrepChunk::Line &line) {
+            return std::string_view(out).substr(line.offset, line.len);
+          };
+          total += chunk.count;
+          if (chunk.count && chunk.leading < pattern.beforeContext) {
+            auto need = std::min<size_t>(
+                pattern.beforeContext - chunk.leading, ring.size());
+            for (auto it = ring.end() - static_cast<ptrdiff_t>(need);
+                 it != ring.end(); ++it)
+              write(it->pos, it->str);
+          }
+          for (auto &line : chunk.lines) write(line.pos, view(line));
+          if (chunk.count) ring.clear();
+          for (auto &line : chunk.tail)
+            ring.push_back({line.pos, std::string(view(line))});
+          while (ring.size() > pattern.beforeContext) ring.pop_front();
+        },
+        chunkSize);
+  } catch (parse_error &e) {
+    std::cout.flush();
+    std::cerr << e.what() << std::endl;
+    return -1;
+  }
+
+  if (pattern.count) {
+    std::cout << total << std::endl;
+  }
+  std::cout.flush();
+  return 0;
+}
 
 }
 
@@ -0,0 +1,68 @@
+#include "TclapHelper.h"
+#include "Zindex.h"
+
+#include <thread>
+
+namespace au {
+
+namespace {
+
+void usage() {
+  std::cout
+      << "usage: au gzip [options] [--] <path>\n"
+      << "\n"
+      << " Compresses an au or json file into a series of independent gzip\n"
+      << " members, on several threads, and writes an index of the members as it\n"
+      << " goes. The result can be read by gzip, and searched with grep -o without\n"
+      << " running zindex. <path> is left in place.\n"
+      << " <path> may be \"-\" for stdin, in which case -o must be given.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -o --output <path>  write to <path> (defaults to inputpath.gz). Existing\n"
+      << "                      files are never overwritten\n"
+      << "  -x --index <path>   write index to <path> (defaults to outputpath.auzx)\n"
+      << "  -j --threads <num>  compress on <num> threads (defaults to the number of\n"
+      << "                      cores)\n"
+      << "  -l --level <num>    compression level, 1-9 (default 6)\n";
+}
+
+}
+
+int gzip(int argc, const char * const *argv) {
+  TclapHelper tclap(usage);
+
+  TCLAP::UnlabeledValueArg<std::string> path(
+      "path", "", true, "", "path", tclap.cmd());
+  TCLAP::ValueArg<std::string> output(
+      "o", "output", "output", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<std::string> index(
+      "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
+  TCLAP::ValueArg<int> level(
+      "l", "level", "level", false, 6, "int", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  if (level.getValue() < 1 || level.getValue() > 9) {
+    std::cerr << "Compression level must be between 1 and 9\n";
+    return 1;
+  }
+
+  std::string outputFile = path.getValue() + ".gz";
+  if (output.isSet()) {
+    outputFile = output.getValue();
+  } else if (path.getValue() == "-") {
+    std::cerr << "Output path (-o) is required when compressing stdin\n";
+    return 1;
+  }
+
+  std::optional<std::string> indexFile;
+  if (index.isSet()) indexFile = index.getValue();
+
+  return gzipFile(path.getValue(), outputFile, indexFile, threads.getValue(),
+                  level.getValue());
+}
+
+}
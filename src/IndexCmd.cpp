@@ -0,0 +1,145 @@
+#include "main.h"
+#include "DictCheckpoints.h"
+#include "KeyIndex.h"
+#include "StreamDetection.h"
+#include "TclapHelper.h"
+
+#include <thread>
+#include <type_traits>
+
+namespace au {
+
+namespace {
+
+constexpr size_t DEFAULT_SAMPLE_EVERY = 1000;
+
+void usage() {
+  std::cout
+      << "usage: au index [options] [--] <path>\n"
+      << "\n"
+      << " Samples the values of a roughly ordered key in an au or json file, and\n"
+      << " writes them to <path>.<key>.auki. grep -o <key> then starts its binary\n"
+      << " search from the samples, rather than from the whole file. The file may be\n"
+      << " compressed, but gzipped files still need an index to be searched.\n"
+      << "\n"
+      << " With -c, saves the dictionary of an au file every so often to\n"
+      << " <path>.audx. After a seek, as in a binary search or a tail, the\n"
+      << " dictionary is then restored from there rather than rebuilt by reading\n"
+      << " back through the file, which saves a lot in gzipped files. Each\n"
+      << " checkpoint stores the entries added since the one before, so more\n"
+      << " frequent checkpoints cost little more space.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -k --key <key>      the key to sample\n"
+      << "  -n --every <n>      sample every <n> records (default "
+      << DEFAULT_SAMPLE_EVERY << ")\n"
+      << "  -c --checkpoints <mb>\n"
+      << "                      save the dictionary every <mb> megabytes\n"
+      << "  -j --threads <n>    decompress indexed gzipped files on <n> threads\n"
+      << "                      (default: number of cores)\n";
+}
+
+template <typename Source>
+void sample(Source &source, KeyIndex &index, size_t every, size_t threads) {
+  if constexpr (std::is_same_v<Source, ZipByteSource>)
+    source.inflateAhead(threads);
+  if (isAuFile(source))
+    sampleAuKey(source, index, every);
+  else
+    sampleJsonKey(source, index, every);
+}
+
+template <typename Source>
+bool checkpoint(Source &source,
+                DictCheckpoints &checkpoints,
+                size_t every,
+                size_t threads) {
+  if constexpr (std::is_same_v<Source, ZipByteSource>)
+    source.inflateAhead(threads);
+  if (!isAuFile(source)) return false;
+  checkpointAu(source, checkpoints, every);
+  return true;
+}
+
+}
+
+int keyIndex(int argc, const char * const *argv) {
+  TclapHelper tclap(usage);
+
+  TCLAP::UnlabeledValueArg<std::string> path(
+      "path", "", true, "", "path", tclap.cmd());
+  TCLAP::ValueArg<std::string> key(
+      "k", "key", "key", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<size_t> every(
+      "n", "every", "every", false, DEFAULT_SAMPLE_EVERY, "size_t",
+      tclap.cmd());
+  TCLAP::ValueArg<size_t> checkpointMb(
+      "c", "checkpoints", "checkpoints", false, 0, "size_t", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  if (!key.isSet() && !checkpointMb.isSet()) {
+    std::cerr << "Nothing to do: specify a key (-k) and/or checkpoints (-c)\n";
+    return 1;
+  }
+  if (checkpointMb.isSet() && checkpointMb.getValue() == 0) {
+    std::cerr << "Checkpoint interval (-c) must be positive\n";
+    return 1;
+  }
+  if (every.getValue() == 0) {
+    std::cerr << "Sampling interval (-n) must be positive\n";
+    return 1;
+  }
+  if (path.getValue() == "-") {
+    std::cerr << "Indexing stdin not supported\n";
+    return 1;
+  }
+
+  struct stat fileStat;
+  if (::stat(path.getValue().c_str(), &fileStat) != 0) {
+    std::cerr << "Could not open " << path.getValue() << " for reading\n";
+    return 1;
+  }
+
+  if (key.isSet()) {
+    auto filename = KeyIndex::filenameFor(path.getValue(), key.getValue());
+    std::cout << "Sampling " << key.getValue() << " in " << path.getValue()
+              << " to " << filename << "...\n";
+    KeyIndex index(key.getValue());
+    auto source = detectSource(path.getValue(), std::nullopt, false);
+    visitSource(*source, [&](auto &concrete) {
+      sample(concrete, index, every.getValue(), threads.getValue());
+    });
+    index.write(filename, fileStat);
+
+    std::cout << "Wrote " << index.samples().size() << " samples.\n";
+  }
+
+  if (checkpointMb.isSet()) {
+    auto filename = DictCheckpoints::filenameFor(path.getValue());
+    std::cout << "Checkpointing dictionaries in " << path.getValue()
+              << " to " << filename << "...\n";
+    DictCheckpoints checkpoints;
+    auto source = detectSource(path.getValue(), std::nullopt, false);
+    auto isAu = visitSource(*source, [&](auto &concrete) {
+      return checkpoint(concrete, checkpoints,
+                        checkpointMb.getValue() * 1024 * 1024,
+                        threads.getValue());
+    });
+    if (!isAu) {
+      std::cerr << path.getValue()
+                << " isn't au-encoded, so it has no dictionaries\n";
+      return 1;
+    }
+    checkpoints.write(filename, fileStat);
+
+    std::cout << "Wrote " << checkpoints.checkpoints().size()
+              << " checkpoints.\n";
+  }
+  return 0;
+}
+
+}
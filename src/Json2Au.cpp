@@ -8,6 +8,7 @@
 #include <rapidjson/filereadstream.h>
 #include <rapidjson/reader.h>
 
+#include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iostream>
@@ -142,6 +143,8 @@ public:
 ssize_t encodeFile(const std::string &inFName,
                    std::ostream &out,
                    size_t maxEntries,
+                   size_t summarize,
+                   const AuEncoder::SyncConfig &syncConfig,
                    bool quiet) {
   FILE *inF;
 
@@ -158,7 +161,18 @@ ssize_t encodeFile(const std::string &inFName,
   auto metadata = AU_STR("Encoded from json file "
                           << (inFName == "-" ? "<stdin>" : inFName )
                           << " by au");
-  AuEncoder au(metadata, 250'000, 100);
+  BlockSummary::Config summaryConfig;
+  summaryConfig.blockRecords = summarize;
+  // enough for a dozen or so values a record without too many false positives
+  summaryConfig.filterBytes = std::max<size_t>(64, summarize * 16);
+  AuEncoder au(metadata, 250'000, 100, 500'000, AuStringIntern::Config{},
+               summaryConfig, syncConfig);
+  size_t bytesWritten = 0;
+  auto write = [&](std::string_view dict, std::string_view value) {
+    out << dict << value; // TODO why use iostreams any longer?
+    bytesWritten += dict.size() + value.size();
+    return dict.size() + value.size();  // TODO need to check whether it was really written?
+  };
 
   char readBuffer[65536];
   FileReadStream in(inF, readBuffer, sizeof(readBuffer));
@@ -176,10 +190,7 @@ ssize_t encodeFile(const std::string &inFName,
                                        kParseFullPrecisionFlag +
                                        kParseNanAndInfFlag;
       res = reader.Parse<parseOpt>(in, handler);
-    }, [&](std::string_view dict, std::string_view value) {
-      out << dict << value; // TODO why use iostreams any longer?
-      return dict.size() + value.size();  // TODO need to check whether it was really written?
-    });
+    }, write);
 
     entriesProcessed++;
     if (!quiet && entriesProcessed % 10'000 == 0) {
@@ -199,6 +210,15 @@ ssize_t encodeFile(const std::string &inFName,
 
     if (entriesProcessed >= maxEntries) break;
   }
+  au.flush(write);
+  if (!quiet && au.syncPoints()) {
+    std::cerr << "Sync points: " << au.syncPoints() << ", costing "
+              << au.syncBytes() << " bytes ("
+              << (bytesWritten ? 100.0 * static_cast<double>(au.syncBytes())
+                                     / static_cast<double>(bytesWritten)
+                               : 0.0)
+              << "% of output)\n";
+  }
   if (!quiet && timeConversionAttempts) {
     std::cerr << "Time conversion attempts: " << timeConversionAttempts
               << " failures: " << timeConversionFailures << " ("
@@ -229,7 +249,24 @@ void usage() {
     << "  -h --help           show usage and exit\n"
     << "  -o --output <path>  output to file\n"
     << "  -q --quiet          do not print encoding statistics to stderr\n"
-    << "  -c --count <count>  stop after encoding <count> records.\n";
+    << "  -c --count <count>  stop after encoding <count> records.\n"
+    << "  -s --summarize <n>  write a summary of the values in each block of <n>\n"
+    << "                      records, which grep can use to skip the block\n"
+    << "                      when it's looking for a value the block doesn't\n"
+    << "                      have. Files with summaries can't be read by\n"
+    << "                      older versions of au.\n"
+    << "  --sync <mb>         start a new dictionary at least every <mb>\n"
+    << "                      megabytes, so that a reader which seeks into the\n"
+    << "                      file (as grep -o and tail do) never has to read\n"
+    << "                      back further than that to build it. the most used\n"
+    << "                      entries are carried over to the new dictionary.\n"
+    << "                      the bytes this costs are reported at the end\n"
+    << "  --sync-keep <n>     carry over entries used at least <n> times since\n"
+    << "                      the last sync point (default "
+    << AuEncoder::SyncConfig{}.keepThreshold << "). fewer entries\n"
+    << "                      make sync points\n"
+    << "                      smaller, but those left behind may have to be\n"
+    << "                      added again\n";
 }
 
 } // namespace
@@ -242,12 +279,23 @@ int json2au(int argc, const char * const *argv) {
   TCLAP::ValueArg<size_t> count(
       "c", "count", "count", false, std::numeric_limits<size_t>::max(),
       "size_t", tclap.cmd());
+  TCLAP::ValueArg<size_t> summarize(
+      "s", "summarize", "summarize", false, 0, "size_t", tclap.cmd());
+  TCLAP::ValueArg<size_t> sync(
+      "", "sync", "sync", false, 0, "size_t", tclap.cmd());
+  TCLAP::ValueArg<size_t> syncKeep(
+      "", "sync-keep", "sync-keep", false, AuEncoder::SyncConfig{}.keepThreshold,
+      "size_t", tclap.cmd());
   TCLAP::SwitchArg quiet("q", "quiet", "quiet", tclap.cmd(), false);
   TCLAP::UnlabeledMultiArg<std::string> fileNames(
       "fileNames", "", false, "filename", tclap.cmd());
 
   if (!tclap.parse(argc, argv)) return 1;
 
+  AuEncoder::SyncConfig syncConfig;
+  syncConfig.everyBytes = sync.getValue() * 1024 * 1024;
+  syncConfig.keepThreshold = syncKeep.getValue();
+
   auto maxEntries = count.getValue();
   auto outFName = outfile.getValue();
 
@@ -270,7 +318,8 @@ int json2au(int argc, const char * const *argv) {
   std::ostream out(outBuf);
 
   for (const auto &f : inputFiles) {
-    auto result = encodeFile(f, out, maxEntries, quiet.isSet());
+    auto result = encodeFile(f, out, maxEntries, summarize.getValue(),
+                             syncConfig, quiet.isSet());
     if (result < 0) break;
     maxEntries -= static_cast<size_t>(result);
   }
@@ -80,11 +80,12 @@ struct JsonSaxProxy
 template <typename Handler>
 JsonSaxProxy(Handler &handler) -> JsonSaxProxy<Handler>;
 
+template <typename Source = AuByteSource>
 struct AuByteSourceStream {
   typedef char Ch;
-  AuByteSource &source;
+  Source &source;
 
-  AuByteSourceStream(AuByteSource &source) : source(source) {}
+  AuByteSourceStream(Source &source) : source(source) {}
 
   Ch Peek() const {
     auto c = source.peek();
@@ -101,6 +102,9 @@ struct AuByteSourceStream {
   size_t PutEnd(Ch*) { assert(false); return 0; }
 };
 
+template <typename Source>
+AuByteSourceStream(Source &source) -> AuByteSourceStream<Source>;
+
 }
 
 }
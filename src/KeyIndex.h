@@ -0,0 +1,378 @@
+#pragma once
+
+#include "au/AuCommon.h"
+#include "au/AuDecoder.h"
+#include "au/ParseError.h"
+#include "AuRecordHandler.h"
+#include "Dictionary.h"
+#include "JsonProxies.h"
+
+#include <rapidjson/reader.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+#include <sys/stat.h>
+
+namespace au {
+
+/// A value of an ordered key, as sampled by au index.
+using KeyValue =
+    std::variant<int64_t, uint64_t, double, time_point, std::string>;
+
+/// Finds the first scalar value for a given key in a record, at any depth (as
+/// grep -k would): the key's value, or the first in an array (of arrays) which
+/// is its value, but nothing inside an object which is. This is a ValueHandler
+/// for au values, and a handler for JsonSaxProxy.
+class KeyCapture {
+  std::string key_;
+  const Dictionary::Dict *dictionary_ = nullptr;
+  struct Context {
+    bool object;
+    size_t counter;
+    bool wanted; //< an array whose elements belong to key_
+  };
+  std::vector<Context> context_;
+  std::string str_;
+  bool wanted_ = false; //< the next value belongs to key_
+  std::optional<KeyValue> value_;
+
+public:
+  explicit KeyCapture(std::string key) : key_(std::move(key)) {}
+
+  const std::optional<KeyValue> &value() const { return value_; }
+
+  void reset() {
+    context_.clear();
+    wanted_ = false;
+    value_.reset();
+  }
+
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dict) {
+    dictionary_ = &dict;
+    ValueParser<KeyCapture, Source> parser(source, *this);
+    parser.value();
+  }
+
+  void onNull(size_t) { scalar(std::nullopt); }
+  void onBool(size_t, bool) { scalar(std::nullopt); }
+  void onInt(size_t, int64_t value) { scalar(KeyValue(value)); }
+  void onUint(size_t, uint64_t value) { scalar(KeyValue(value)); }
+  void onDouble(size_t, double value) { scalar(KeyValue(value)); }
+  void onTime(size_t, time_point value) { scalar(KeyValue(value)); }
+
+  void onDictRef(size_t, size_t dictIdx) {
+    string(dictionary_->at(dictIdx));
+  }
+
+  void onObjectStart() { nest(true); }
+  void onObjectEnd() { unnest(); }
+  void onArrayStart() { nest(false); }
+  void onArrayEnd() { unnest(); }
+
+  void onStringStart(size_t, size_t len) {
+    str_.clear();
+    str_.reserve(len);
+  }
+
+  void onStringFragment(std::string_view frag) {
+    str_.append(frag.data(), frag.size());
+  }
+
+  void onStringEnd() { string(str_); }
+
+private:
+  bool isKey() const {
+    return !context_.empty() && context_.back().object
+           && context_.back().counter % 2 == 0;
+  }
+
+  void next() {
+    if (context_.empty()) return;
+    context_.back().counter++;
+    wanted_ = context_.back().wanted;
+  }
+
+  void scalar(std::optional<KeyValue> value) {
+    if (wanted_ && !value_) value_ = std::move(value);
+    next();
+  }
+
+  void string(std::string_view sv) {
+    if (isKey()) {
+      next();
+      wanted_ = sv == key_;
+    } else {
+      scalar(wanted_ && !value_ ? std::optional<KeyValue>(std::string(sv))
+                                : std::nullopt);
+    }
+  }
+
+  void nest(bool object) {
+    wanted_ = wanted_ && !object;
+    context_.push_back(Context{object, 0, wanted_});
+  }
+
+  void unnest() {
+    context_.pop_back();
+    next();
+  }
+};
+
+/// Sampled values of an ordered key, with the positions of the records they
+/// came from, so that a bisect for a value of that key can start out close to
+/// it. Written by au index to a sidecar next to the file (see filenameFor()),
+/// where grep -o finds it.
+///
+/// The sidecar is a header, the key, then the samples in file order: each is
+/// a position, the index of its type in KeyValue, and the value, either as 8
+/// bytes or (for strings) a length and the bytes.
+class KeyIndex {
+public:
+  struct Sample {
+    size_t pos;
+    KeyValue value;
+  };
+
+private:
+  static constexpr char Magic[4] = {'A', 'U', 'K', 'X'};
+  static constexpr uint32_t Version = 1u;
+
+  struct Header {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    uint64_t fileModTime;
+    uint64_t keyLength;
+    uint64_t numSamples;
+  };
+  static_assert(sizeof(Header) == 40);
+
+  std::string key_;
+  std::vector<Sample> samples_;
+
+public:
+  explicit KeyIndex(std::string key) : key_(std::move(key)) {}
+
+  static std::string filenameFor(const std::string &path,
+                                 const std::string &key) {
+    return path + "." + key + ".auki";
+  }
+
+  const std::string &key() const { return key_; }
+  const std::vector<Sample> &samples() const { return samples_; }
+
+  void add(size_t pos, KeyValue value) {
+    samples_.push_back(Sample{pos, std::move(value)});
+  }
+
+  /// As add(), but for samples which turn up out of order, as they do while
+  /// bisecting. A sample at a position already sampled is dropped.
+  void insert(size_t pos, KeyValue value) {
+    auto it = std::lower_bound(
+        samples_.begin(), samples_.end(), pos,
+        [](const Sample &sample, size_t p) { return sample.pos < p; });
+    if (it != samples_.end() && it->pos == pos) return;
+    samples_.insert(it, Sample{pos, std::move(value)});
+  }
+
+  /// Narrows [start, end) to the stretch between the last sample which
+  /// doesn't match and the first one which does, given that the values are
+  /// roughly ordered.
+  template <typename Matches>
+  void narrow(Matches &&matches, size_t &start, size_t &end) const {
+    size_t lo = 0;
+    size_t hi = samples_.size();
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      if (matches(samples_[mid].value))
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    if (lo > 0) start = std::max(start, samples_[lo - 1].pos);
+    if (lo < samples_.size()) end = std::min(end, samples_[lo].pos);
+    if (end < start) end = start;
+  }
+
+  /// fileStat describes the file which was sampled.
+  void write(const std::string &filename,
+             const struct stat &fileStat) const {
+    std::string out;
+    Header header;
+    memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.fileSize = static_cast<uint64_t>(fileStat.st_size);
+    header.fileModTime = static_cast<uint64_t>(fileStat.st_mtime);
+    header.keyLength = key_.size();
+    header.numSamples = samples_.size();
+    append(out, &header, sizeof(header));
+    out.append(key_);
+    for (auto &sample : samples_) {
+      append(out, static_cast<uint64_t>(sample.pos));
+      out.push_back(static_cast<char>(sample.value.index()));
+      std::visit([&](auto &value) {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, std::string>) {
+          append(out, static_cast<uint64_t>(value.size()));
+          out.append(value);
+        } else if constexpr (std::is_same_v<T, time_point>) {
+          append(out, static_cast<int64_t>(value.time_since_epoch().count()));
+        } else {
+          append(out, value);
+        }
+      }, sample.value);
+    }
+
+    std::ofstream file(filename, std::ios_base::binary | std::ios_base::trunc);
+    file.write(out.data(), static_cast<std::streamsize>(out.size()));
+    file.close();
+    if (!file) THROW_RT("Error writing key index " << filename);
+  }
+
+  /// Loads the sidecar in filename for the file described by fileStat. Returns
+  /// null if there isn't one, or (with a warning) if the file has changed
+  /// since it was sampled, or the sidecar can't be read. A grep is better off
+  /// bisecting without it than failing.
+  static std::unique_ptr<const KeyIndex> load(const std::string &filename,
+                                              const struct stat &fileStat) {
+    std::ifstream file(filename, std::ios_base::binary);
+    if (!file) return nullptr;
+    std::string data((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    try {
+      return parse(data, fileStat);
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Ignoring key index " << filename << ": " << e.what()
+                << std::endl;
+      return nullptr;
+    }
+  }
+
+private:
+  /// @throws std::runtime_error, saying why, if data isn't a whole sidecar
+  /// for the file described by fileStat.
+  static std::unique_ptr<const KeyIndex> parse(const std::string &data,
+                                               const struct stat &fileStat) {
+    size_t offset = 0;
+    auto take = [&](size_t len) {
+      if (len > data.size() - offset) THROW_RT("it's truncated");
+      offset += len;
+      return std::string_view(data.data() + offset - len, len);
+    };
+    auto read = [&](void *to, size_t len) {
+      memcpy(to, take(len).data(), len);
+    };
+
+    Header header;
+    read(&header, sizeof(header));
+    if (memcmp(header.magic, Magic, sizeof(Magic)) != 0)
+      THROW_RT("it's not a key index");
+    if (header.version != Version)
+      THROW_RT("it's version " << header.version << ", not " << Version);
+    if (header.fileSize != static_cast<uint64_t>(fileStat.st_size)
+        || header.fileModTime != static_cast<uint64_t>(fileStat.st_mtime))
+      THROW_RT("the file has changed since it was built");
+
+    auto index = std::make_unique<KeyIndex>(
+        std::string(take(header.keyLength)));
+    for (uint64_t i = 0; i < header.numSamples; i++) {
+      uint64_t pos;
+      read(&pos, sizeof(pos));
+      if (!index->samples_.empty() && pos <= index->samples_.back().pos)
+        THROW_RT("sample " << i << " is out of order");
+      uint8_t type;
+      read(&type, sizeof(type));
+      auto value = [&]() -> KeyValue {
+        switch (type) {
+          case 0: return readValue<int64_t>(read);
+          case 1: return readValue<uint64_t>(read);
+          case 2: return readValue<double>(read);
+          case 3:
+            return time_point(
+                std::chrono::nanoseconds(readValue<int64_t>(read)));
+          case 4: return std::string(take(readValue<uint64_t>(read)));
+          default:
+            THROW_RT("sample " << i << " has unknown type "
+                     << static_cast<int>(type));
+        }
+      }();
+      index->add(pos, std::move(value));
+    }
+    return index;
+  }
+
+  static void append(std::string &out, const void *data, size_t len) {
+    out.append(static_cast<const char *>(data), len);
+  }
+
+  template <typename T>
+  static void append(std::string &out, T value) {
+    append(out, &value, sizeof(value));
+  }
+
+  template <typename T, typename Read>
+  static T readValue(Read &read) {
+    T value;
+    read(&value, sizeof(value));
+    return value;
+  }
+};
+
+/// Adds a sample to index for the first record with its key after each
+/// stretch of every records of an au-encoded source.
+template <typename Source>
+void sampleAuKey(Source &source, KeyIndex &index, size_t every) {
+  Dictionary dictionary;
+  KeyCapture capture(index.key());
+  AuRecordHandler<KeyCapture> handler(dictionary, capture);
+  size_t sinceLast = every;
+  while (true) {
+    auto pos = source.pos();
+    capture.reset();
+    // clang 10 and 11 erroneously warn here if "parser" is inlined.
+    auto parser = RecordParser(source, handler);
+    if (!parser.parseUntilValue()) break;
+    if (sinceLast >= every && capture.value()) {
+      index.add(pos, *capture.value());
+      sinceLast = 0;
+    }
+    sinceLast++;
+  }
+}
+
+/// As sampleAuKey(), but for a source of json records.
+template <typename Source>
+void sampleJsonKey(Source &source, KeyIndex &index, size_t every) {
+  static constexpr auto parseOpt = rapidjson::kParseStopWhenDoneFlag +
+                                   rapidjson::kParseFullPrecisionFlag +
+                                   rapidjson::kParseNanAndInfFlag;
+  rapidjson::Reader reader;
+  KeyCapture capture(index.key());
+  JsonSaxProxy proxy(capture);
+  AuByteSourceStream wrappedSource(source);
+  size_t sinceLast = every;
+  while (!source.peek().isEof()) {
+    // this is the position of the newline before the record, which is where
+    // a bisect expects to sync from
+    auto pos = source.pos();
+    capture.reset();
+    if (!reader.Parse<parseOpt>(wrappedSource, proxy)) break;
+    if (sinceLast >= every && capture.value()) {
+      index.add(pos, *capture.value());
+      sinceLast = 0;
+    }
+    sinceLast++;
+  }
+}
+
+}
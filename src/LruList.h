@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <list>
+#include <optional>
+#include <utility>
+
+namespace au {
+
+/// A small collection which forgets its least recently used item when it's
+/// full.
+template <typename T>
+class LruList {
+  size_t capacity_;
+  std::list<T> items_; // most recently used first
+
+public:
+  explicit LruList(size_t capacity) : capacity_(capacity) {}
+
+  /// The first item satisfying pred, which becomes the most recently used.
+  template <typename Pred>
+  T *find(Pred &&pred) {
+    auto it = std::find_if(items_.begin(), items_.end(), pred);
+    if (it == items_.end()) return nullptr;
+    items_.splice(items_.begin(), items_, it);
+    return &items_.front();
+  }
+
+  /// Removes the first item satisfying pred, and returns it.
+  template <typename Pred>
+  std::optional<T> take(Pred &&pred) {
+    auto it = std::find_if(items_.begin(), items_.end(), pred);
+    if (it == items_.end()) return std::nullopt;
+    std::optional<T> result(std::move(*it));
+    items_.erase(it);
+    return result;
+  }
+
+  T &add(T item) {
+    items_.emplace_front(std::move(item));
+    if (items_.size() > capacity_) items_.pop_back();
+    return items_.front();
+  }
+
+  size_t size() const { return items_.size(); }
+};
+
+}
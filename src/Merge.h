@@ -0,0 +1,320 @@
+#pragma once
+
+#include "au/AuDecoder.h"
+#include "AuRecordHandler.h"
+#include "Dictionary.h"
+#include "JsonOutputHandler.h"
+#include "JsonProxies.h"
+#include "KeyIndex.h"
+
+#include <rapidjson/reader.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace au {
+
+/// Orders the values of the key a merge is by. Numbers are compared by value,
+/// whatever their type, and go before times, which go before strings.
+inline bool keyLess(const KeyValue &a, const KeyValue &b) {
+  return std::visit([&](const auto &x, const auto &y) -> bool {
+    using X = std::decay_t<decltype(x)>;
+    using Y = std::decay_t<decltype(y)>;
+    if constexpr (std::is_same_v<X, Y>) {
+      return x < y;
+    } else if constexpr (std::is_same_v<X, int64_t>
+                         && std::is_same_v<Y, uint64_t>) {
+      return x < 0 || static_cast<uint64_t>(x) < y;
+    } else if constexpr (std::is_same_v<X, uint64_t>
+                         && std::is_same_v<Y, int64_t>) {
+      return y >= 0 && x < static_cast<uint64_t>(y);
+    } else if constexpr (std::is_arithmetic_v<X> && std::is_arithmetic_v<Y>) {
+      return static_cast<double>(x) < static_cast<double>(y);
+    } else {
+      // the types in KeyValue are in the order they sort in
+      return a.index() < b.index();
+    }
+  }, a, b);
+}
+
+/// As above, where a missing key goes before any value.
+inline bool keyLess(const std::optional<KeyValue> &a,
+                    const std::optional<KeyValue> &b) {
+  if (!b) return false;
+  if (!a) return true;
+  return keyLess(*a, *b);
+}
+
+/// One of the inputs to a merge, which is in order by the key the merge is
+/// by. It's read a record at a time: next() finds the key of the next record,
+/// and output() writes the record out once it's that record's turn.
+class MergeInput {
+protected:
+  std::optional<KeyValue> key_;
+
+public:
+  virtual ~MergeInput() = default;
+
+  /// Moves on to the next record, returning false at the end of the input. A
+  /// record without the key keeps the key of the record before it, so that it
+  /// stays next to it in the output.
+  virtual bool next() = 0;
+
+  /// Writes out the record which next() moved on to.
+  virtual void output() = 0;
+
+  const std::optional<KeyValue> &key() const { return key_; }
+};
+
+/// An input of au records. next() only decodes the next value record as far as
+/// finding the key, and output() goes back and decodes it again to write it
+/// out, so the source holds on to the record in between (see setPin()).
+template <typename Source, typename OutputHandler>
+class AuMergeInput : public MergeInput {
+  Source &source_;
+  Dictionary dictionary_;
+  KeyCapture capture_;
+  AuRecordHandler<KeyCapture> keyHandler_;
+  AuRecordHandler<OutputHandler> outputHandler_;
+  size_t valuePos_ = 0;
+
+public:
+  AuMergeInput(Source &source, std::string key, OutputHandler &handler)
+      : source_(source),
+        capture_(std::move(key)),
+        keyHandler_(dictionary_, capture_),
+        outputHandler_(dictionary_, handler) {}
+
+  bool next() override {
+    capture_.reset();
+    // clang 10 and 11 erroneously warn here if "parser" is inlined.
+    auto parser = RecordParser(source_, keyHandler_);
+    while (!source_.peek().isEof()) {
+      auto pos = source_.pos();
+      source_.clearPin();
+      source_.setPin(pos);
+      if (parser.record()) {
+        valuePos_ = pos;
+        if (capture_.value()) key_ = capture_.value();
+        return true;
+      }
+    }
+    source_.clearPin();
+    return false;
+  }
+
+  void output() override {
+    // the dictionary records before the value have been read already
+    source_.clearPin();
+    source_.seek(valuePos_);
+    auto parser = RecordParser(source_, outputHandler_);
+    parser.record();
+  }
+};
+
+/// An input of json records, which are written out as json whatever the
+/// handler for the au inputs is.
+template <typename Source>
+class JsonMergeInput : public MergeInput {
+  static constexpr auto parseOpt = rapidjson::kParseStopWhenDoneFlag +
+                                   rapidjson::kParseFullPrecisionFlag +
+                                   rapidjson::kParseNanAndInfFlag;
+  Source &source_;
+  JsonOutputHandler &handler_;
+  rapidjson::Reader reader_;
+  KeyCapture capture_;
+  size_t pos_ = 0;
+
+public:
+  JsonMergeInput(Source &source, std::string key, JsonOutputHandler &handler)
+      : source_(source), handler_(handler), capture_(std::move(key)) {}
+
+  bool next() override {
+    source_.clearPin();
+    pos_ = source_.pos();
+    source_.setPin(pos_);
+    capture_.reset();
+    JsonSaxProxy proxy(capture_);
+    AuByteSourceStream wrappedSource(source_);
+    if (!reader_.Parse<parseOpt>(wrappedSource, proxy)) {
+      source_.clearPin();
+      // only whitespace was left
+      if (reader_.GetParseErrorCode() == rapidjson::kParseErrorDocumentEmpty)
+        return false;
+      THROW_RT("Error parsing json record at " << pos_ << " of "
+               << source_.name());
+    }
+    if (capture_.value()) key_ = capture_.value();
+    return true;
+  }
+
+  void output() override {
+    source_.clearPin();
+    source_.seek(pos_);
+    JsonSaxProxy proxy(handler_);
+    AuByteSourceStream wrappedSource(source_);
+    handler_.startJsonValue();
+    reader_.Parse<parseOpt>(wrappedSource, proxy);
+    handler_.endJsonValue();
+  }
+};
+
+/// Merges inputs, writing out their records in order by key. Records with the
+/// same key go in the order of their inputs.
+inline void mergeInputs(const std::vector<std::unique_ptr<MergeInput>> &inputs) {
+  // a heap of the inputs by the key of their next record
+  auto after = [&](size_t a, size_t b) {
+    auto &ka = inputs[a]->key();
+    auto &kb = inputs[b]->key();
+    if (keyLess(kb, ka)) return true;
+    if (keyLess(ka, kb)) return false;
+    return a > b;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heap(after);
+  for (size_t i = 0; i < inputs.size(); i++)
+    if (inputs[i]->next()) heap.push(i);
+  while (!heap.empty()) {
+    auto i = heap.top();
+    heap.pop();
+    inputs[i]->output();
+    if (inputs[i]->next()) heap.push(i);
+  }
+}
+
+/// Merges inputs which are being followed, as they grow. Reading the next
+/// record of an input which has nothing new waits for more to be written, so
+/// each input is read on a thread of its own, which decodes its records to
+/// json ahead of the merge. A record is written out once every input has a
+/// record to compare it with, except for inputs which have had nothing new for
+/// lag, so an input which has gone quiet doesn't hold up the rest for long. A
+/// record which arrives after that, but should have gone before records which
+/// have been written out already, is written out late.
+class FollowingMerge {
+  using Clock = std::chrono::steady_clock;
+  /// How many decoded records an input may get ahead of the merge.
+  static constexpr size_t MaxQueued = 4096;
+
+  struct Record {
+    std::optional<KeyValue> key;
+    std::string json;
+  };
+
+  using Open = std::function<std::unique_ptr<MergeInput>(JsonOutputHandler &)>;
+
+  struct Input {
+    std::string name;
+    Open open;
+    std::ostringstream out;
+    JsonOutputHandler handler{out};
+    std::unique_ptr<MergeInput> input;
+    std::deque<Record> records;
+    Clock::time_point lastRecord = Clock::now();
+    bool done = false;
+
+    Input(std::string name, Open open)
+        : name(std::move(name)), open(std::move(open)) {}
+  };
+
+  std::chrono::milliseconds lag_;
+  std::vector<std::unique_ptr<Input>> inputs_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+
+public:
+  explicit FollowingMerge(std::chrono::milliseconds lag) : lag_(lag) {}
+
+  FollowingMerge(const FollowingMerge &) = delete;
+  FollowingMerge &operator=(const FollowingMerge &) = delete;
+
+  ~FollowingMerge() {
+    for (auto &thread : threads_) thread.join();
+  }
+
+  /// Adds an input, which open opens on the input's thread (so it may wait
+  /// for the file to have something in it), given the handler the input
+  /// should write its records to.
+  void add(std::string name, Open open) {
+    inputs_.push_back(std::make_unique<Input>(std::move(name), std::move(open)));
+  }
+
+  /// Writes the merged records to out. Returns only if every input has come
+  /// to an end, which (since they're followed) means they all failed.
+  void run(std::ostream &out) {
+    for (auto &input : inputs_)
+      threads_.emplace_back([this, &input = *input]() { read(input); });
+
+    std::unique_lock lock(mutex_);
+    while (true) {
+      Input *first = nullptr;
+      bool waiting = false;
+      // when every input with nothing new has had nothing new for lag
+      auto quiet = Clock::time_point::min();
+      for (auto &input : inputs_) {
+        if (input->records.empty()) {
+          if (input->done) continue;
+          waiting = true;
+          quiet = std::max(quiet, input->lastRecord + lag_);
+          continue;
+        }
+        auto &record = input->records.front();
+        if (!first || keyLess(record.key, first->records.front().key))
+          first = input.get();
+      }
+      if (!first) {
+        if (!waiting) return;
+        cond_.wait(lock);
+        continue;
+      }
+      if (waiting && Clock::now() < quiet) {
+        // the next record of an input with nothing new yet might go first
+        cond_.wait_until(lock, quiet);
+        continue;
+      }
+      auto record = std::move(first->records.front());
+      first->records.pop_front();
+      cond_.notify_all();
+      lock.unlock();
+      out << record.json << std::flush;
+      lock.lock();
+    }
+  }
+
+private:
+  void read(Input &input) {
+    try {
+      input.input = input.open(input.handler);
+      while (input.input->next()) {
+        input.input->output();
+        Record record{input.input->key(), input.out.str()};
+        input.out.str("");
+        std::unique_lock lock(mutex_);
+        cond_.wait(lock, [&]() { return input.records.size() < MaxQueued; });
+        input.records.push_back(std::move(record));
+        input.lastRecord = Clock::now();
+        cond_.notify_all();
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << " while merging " << input.name << "\n";
+    }
+    std::unique_lock lock(mutex_);
+    input.done = true;
+    cond_.notify_all();
+  }
+};
+
+}
@@ -0,0 +1,158 @@
+#include "main.h"
+#include "AuOutputHandler.h"
+#include "JsonOutputHandler.h"
+#include "Merge.h"
+#include "StreamDetection.h"
+#include "TclapHelper.h"
+#include "au/FileByteSource.h"
+#include "au/FileWatcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <sys/stat.h>
+
+namespace au {
+
+namespace {
+
+void usage() {
+  std::cout
+      << "usage: au merge [options] -k <key> [--] <path>...\n"
+      << "\n"
+      << " Merges au and/or json files, each of which is in order by the value\n"
+      << " of <key> (say a timestamp), into one stream in order by <key>. Records\n"
+      << " with the same value keep the order of the files, and records without\n"
+      << " <key> stay after the record before them. Writes to stdout. Any <path>\n"
+      << " may be \"-\" for stdin.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -k --key <key>      merge by the values of <key>, at any depth\n"
+      << "  -e --encode         output au-encoded records rather than json. not\n"
+      << "                      compatible with json files or -f\n"
+      << "  -f --follow         at the end of the files, wait for more records to be\n"
+      << "                      appended, and merge those in as they arrive\n"
+      << "  --lag <ms>          with -f, hold records back for up to <ms> (default\n"
+      << "                      1000) for a file with nothing new, in case its next\n"
+      << "                      record goes first\n"
+      << "  -j --threads <n>    decompress gzipped files ahead of the merge with <n>\n"
+      << "                      threads between them (default: number of cores)\n";
+}
+
+/// Waits for something to be written to fileName, if it's empty, so there's
+/// something to tell what it holds.
+void waitForData(const std::string &fileName) {
+  if (fileName == "-") return;
+  FileWatcher watcher(fileName);
+  struct stat fileStat;
+  while (::stat(fileName.c_str(), &fileStat) == 0 && fileStat.st_size == 0)
+    watcher.wait();
+}
+
+/// An input for the file in source, of au records if it has an au header and
+/// of json records otherwise.
+template <typename OutputHandler>
+std::unique_ptr<MergeInput> openInput(FileByteSource &source,
+                                      const std::string &key,
+                                      OutputHandler &handler) {
+  auto auFile = isAuFile(source);
+  return visitSource(source, [&](auto &concrete)
+                                 -> std::unique_ptr<MergeInput> {
+    using Source = std::decay_t<decltype(concrete)>;
+    if (auFile) {
+      return std::make_unique<AuMergeInput<Source, OutputHandler>>(
+          concrete, key, handler);
+    }
+    if constexpr (std::is_same_v<OutputHandler, JsonOutputHandler>)
+      return std::make_unique<JsonMergeInput<Source>>(concrete, key, handler);
+    THROW_RT(source.name() << " appears to be json. au-encoded output is not"
+             " yet supported when merging json");
+  });
+}
+
+template <typename OutputHandler>
+int doMerge(std::vector<std::unique_ptr<FileByteSource>> &sources,
+            const std::string &key, OutputHandler &handler) {
+  std::vector<std::unique_ptr<MergeInput>> inputs;
+  try {
+    for (auto &source : sources)
+      inputs.push_back(openInput(*source, key, handler));
+    mergeInputs(inputs);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << " while merging\n";
+    return 1;
+  }
+  return 0;
+}
+
+}
+
+int merge(int argc, const char * const *argv) {
+  TclapHelper tclap(usage);
+
+  TCLAP::ValueArg<std::string> key(
+      "k", "key", "key", true, "", "string", tclap.cmd());
+  TCLAP::SwitchArg encode("e", "encode", "encode", tclap.cmd());
+  TCLAP::SwitchArg follow("f", "follow", "follow", tclap.cmd());
+  TCLAP::ValueArg<size_t> lag(
+      "", "lag", "lag", false, 1000, "ms", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
+  TCLAP::UnlabeledMultiArg<std::string> fileNames(
+      "path", "", true, "path", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  auto &files = fileNames.getValue();
+  if (std::count(files.begin(), files.end(), "-") > 1) {
+    std::cerr << "stdin can only be merged once." << std::endl;
+    return 1;
+  }
+  if (follow.isSet() && encode.isSet()) {
+    std::cerr << "-e is not compatible with -f." << std::endl;
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<FileByteSource>> sources(files.size());
+  if (follow.isSet()) {
+    FollowingMerge merge(std::chrono::milliseconds(lag.getValue()));
+    for (size_t i = 0; i < files.size(); i++) {
+      merge.add(files[i], [&, i](JsonOutputHandler &handler) {
+        waitForData(files[i]);
+        auto &source = sources[i];
+        source = detectSource(files[i], std::nullopt, false, true);
+        auto input = openInput(*source, key.getValue(), handler);
+        source->setFollow(true);
+        return input;
+      });
+    }
+    merge.run(std::cout);
+    return 1;
+  }
+
+  for (size_t i = 0; i < files.size(); i++) {
+    sources[i] = detectSource(files[i], std::nullopt, false);
+    if (encode.isSet() && !checkAuFile(*sources[i])) return 1;
+  }
+
+  // merging reads the files in step, so they're all decompressed at once
+  auto inflateThreads = std::max<size_t>(1, threads.getValue() / files.size());
+  for (auto &source : sources) {
+    if (auto *zipped = dynamic_cast<ZipByteSource *>(source.get()))
+      zipped->inflateAhead(inflateThreads);
+  }
+
+  if (encode.isSet()) {
+    AuOutputHandler handler(
+        AU_STR("Encoded by au: merge by " << key.getValue()
+               << " of au files"));
+    return doMerge(sources, key.getValue(), handler);
+  }
+  JsonOutputHandler handler;
+  return doMerge(sources, key.getValue(), handler);
+}
+
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include "au/ParseError.h"
+
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace au {
+
+/// Reads a file in pieces on a background thread, a few pieces ahead of
+/// whoever is consuming them.
+class ReadAhead {
+  static constexpr size_t MaxQueued = 4;
+
+  FILE *file_;
+  const size_t pieceSize_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::vector<uint8_t>> queued_;
+  bool eof_ = false;
+  int error_ = 0; // the errno of a failed read
+  bool stop_ = false;
+  std::thread thread_;
+
+  void work() {
+    while (true) {
+      std::vector<uint8_t> piece(pieceSize_);
+      piece.resize(fread(piece.data(), 1, pieceSize_, file_));
+      int error = ferror(file_) ? errno : 0;
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [&]() { return stop_ || queued_.size() < MaxQueued; });
+      if (stop_) return;
+      if (!piece.empty()) queued_.emplace_back(std::move(piece));
+      eof_ = feof(file_) != 0;
+      error_ = error;
+      cv_.notify_all();
+      if (eof_ || error_) return;
+    }
+  }
+
+public:
+  ReadAhead(FILE *file, size_t pieceSize)
+      : file_(file), pieceSize_(pieceSize), thread_([this]() { work(); }) {}
+
+  ~ReadAhead() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  ReadAhead(const ReadAhead &) = delete;
+  ReadAhead &operator=(const ReadAhead &) = delete;
+
+  /// The next piece of the file, or an empty one at eof.
+  std::vector<uint8_t> next() {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&]() { return !queued_.empty() || eof_ || error_; });
+    if (queued_.empty()) {
+      if (error_) THROW_RT("Error reading input: " << strerror(error_));
+      return {};
+    }
+    auto result = std::move(queued_.front());
+    queued_.pop_front();
+    cv_.notify_all();
+    return result;
+  }
+};
+
+/// Compresses buffers with compress_ on a pool of threads: checkpoint windows
+/// for zindex, gzip members for au gzip, or zstd frames for au zstd. Results
+/// are collected in the order the buffers were submitted.
+class ParallelCompressor {
+  struct Job {
+    std::vector<uint8_t> input;
+    std::string compressed;
+    std::exception_ptr error;
+    bool done = false;
+  };
+
+  using Compress = std::function<std::string(const std::vector<uint8_t> &)>;
+
+  const Compress compress_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_; // submitted but not yet collected
+  size_t claimed_ = 0; // jobs_[0, claimed_) have been picked up by a worker
+  size_t unfinished_ = 0; // jobs_ which haven't been compressed yet
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+
+  void work() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [&]() { return stop_ || claimed_ < jobs_.size(); });
+      if (stop_) return;
+      // jobs_ only shrinks from the front, and never past unfinished jobs, so
+      // this reference stays good while we're unlocked
+      auto &job = jobs_[claimed_++];
+      lock.unlock();
+      try {
+        job.compressed = compress_(job.input);
+      } catch (...) {
+        job.error = std::current_exception();
+      }
+      job.input = {};
+      lock.lock();
+      job.done = true;
+      unfinished_--;
+      cv_.notify_all();
+    }
+  }
+
+public:
+  ParallelCompressor(size_t threads, Compress compress)
+      : compress_(std::move(compress)) {
+    for (size_t i = 0; i < threads; i++)
+      workers_.emplace_back([this]() { work(); });
+  }
+
+  ~ParallelCompressor() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : workers_) t.join();
+  }
+
+  ParallelCompressor(const ParallelCompressor &) = delete;
+  ParallelCompressor &operator=(const ParallelCompressor &) = delete;
+
+  /// Queues input for compression. Doesn't wait for it, unless there's
+  /// already plenty waiting to be compressed. Only jobs which haven't been
+  /// compressed count: the caller is usually the only one collecting, so
+  /// waiting for it to collect would never end.
+  void submit(std::vector<uint8_t> input) {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&]() { return unfinished_ < 4 * workers_.size(); });
+    jobs_.push_back(Job{std::move(input), {}, nullptr, false});
+    unfinished_++;
+    cv_.notify_all();
+  }
+
+  /// If the oldest uncollected input has been compressed (waiting for it, if
+  /// wait is set), passes the result to f.
+  /// @return whether there was a result to pass on
+  template <typename F>
+  bool collect(bool wait, F &&f) {
+    std::unique_lock lock(mutex_);
+    if (wait)
+      cv_.wait(lock, [&]() { return jobs_.empty() || jobs_.front().done; });
+    if (jobs_.empty() || !jobs_.front().done) return false;
+    auto job = std::move(jobs_.front());
+    jobs_.pop_front();
+    claimed_--;
+    cv_.notify_all();
+    lock.unlock();
+    if (job.error) std::rethrow_exception(job.error);
+    f(job.compressed);
+    return true;
+  }
+};
+
+}
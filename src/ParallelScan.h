@@ -0,0 +1,227 @@
+#pragma once
+
+#include "Dictionary.h"
+#include "Tail.h"
+#include "au/AuDecoder.h"
+#include "au/FileByteSource.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <limits>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace au {
+
+/// The default amount of the file handed to a worker at a time. Big enough
+/// that the cost of syncing (which may rebuild a dictionary) is lost in the
+/// noise, small enough to keep the reorder buffer modest.
+constexpr size_t PARALLEL_CHUNK_SIZE = 4 * 1024 * 1024;
+
+/// Parses any header or dictionary records ahead of the next value record.
+/// @return true if there is a next value record, in which case the source is
+///   left positioned at the start of it.
+template <typename RecordHandler, typename Source>
+bool skipToValue(Source &source, RecordHandler &handler) {
+  RecordParser<RecordHandler, Source> parser(source, handler);
+  for (auto c = source.peek(); c != 'V'; c = source.peek()) {
+    if (c.isEof()) return false;
+    parser.record();
+  }
+  return true;
+}
+
+/// One chunk of a parallel scan. A chunk owns the value records which start
+/// in [begin, end). Dictionary records belong to whichever chunk needs them.
+struct ChunkRange {
+  size_t begin;
+  size_t end;
+  /// If set, begin is known to be the start of a value record (or eof), so
+  /// there's no need to search for one.
+  bool exact = false;
+  /// Where the first value record of the chunk actually starts.
+  size_t start = 0;
+  /// Where the first value record after the chunk starts, i.e., where the
+  /// next chunk ought to have started.
+  size_t next = 0;
+
+  /// Positions source at the first value record of the chunk, building the
+  /// dictionary it needs (from checkpoints, if there are any). The first chunk
+  /// starts with the file header, which will be handled by nextValue().
+  /// @return false if there are no value records in the chunk.
+  template <typename Source>
+  bool sync(Source &source,
+            Dictionary &dictionary,
+            const DictCheckpoints *checkpoints = nullptr) {
+    start = next = source.endPos();
+    if (begin == 0 && !exact) {
+      source.seek(0);
+      start = 0;
+      return true;
+    }
+    if (exact) {
+      if (begin >= source.endPos()) return false;
+      TailHandler(dictionary, source, checkpoints).syncAt(begin);
+    } else {
+      // a record starting exactly at begin is preceded by the end of the
+      // previous record, which is what sync() looks for.
+      source.seek(begin - 2);
+      if (!TailHandler(dictionary, source, checkpoints).sync(true))
+        return false;
+    }
+    start = source.pos();
+    return true;
+  }
+
+  /// Parses any dictionary records up to the next value record.
+  /// @return true if that record belongs to this chunk. Otherwise, notes
+  ///   where it is in next.
+  template <typename RecordHandler, typename Source>
+  bool nextValue(Source &source, RecordHandler &handler) {
+    if (skipToValue(source, handler) && source.pos() < end) return true;
+    next = source.pos();
+    return false;
+  }
+};
+
+/// Whether it's worth scanning source in parallel: it has to be a regular file
+/// we can map (so each worker can have its own view of it) and big enough to
+/// split.
+inline bool canScanInParallel(FileByteSource &source,
+                              size_t threads,
+                              size_t chunkSize = PARALLEL_CHUNK_SIZE) {
+  return threads > 1 && dynamic_cast<MmapByteSource *>(&source)
+         && source.endPos() >= 2 * chunkSize;
+}
+
+/// Scans the value records of an au file on several threads. The file is cut
+/// into chunks of chunkSize bytes. Each worker has its own mapping of the file
+/// and calls
+///
+///     scan(MmapByteSource &, ChunkRange &, Result &)
+///
+/// for one chunk at a time. scan should start with ChunkRange::sync() (with a
+/// fresh dictionary), then handle value records while ChunkRange::nextValue()
+/// says they're part of the chunk. It may read on past the end of the chunk
+/// if it needs to.
+///
+/// The results are passed to emit(Result &) on the calling thread in file
+/// order. A limited number of chunks may be in flight at once, so the memory
+/// used doesn't depend on the size of the file.
+///
+/// sync() finds the start of a chunk heuristically. The chunk before knows
+/// exactly where it should have been though, so if they disagree (sync() can
+/// in principle be fooled by bytes in a string that look like a value record),
+/// the chunk is scanned again on this thread, starting from the right place.
+///
+/// If scan throws, emit is called with whatever it had produced, and then the
+/// exception is rethrown from here.
+template <typename Result, typename Scan, typename Emit>
+void parallelScan(MmapByteSource &source, size_t threads, Scan &&scan,
+                  Emit &&emit, size_t chunkSize = PARALLEL_CHUNK_SIZE) {
+  struct Chunk {
+    ChunkRange range;
+    Result result;
+    std::exception_ptr error;
+  };
+
+  auto endPos = source.endPos();
+  auto numChunks = (endPos + chunkSize - 1) / chunkSize;
+  auto maxInFlight = 2 * threads;
+  auto rangeOf = [&](size_t idx) {
+    // the last chunk takes anything appended since we started
+    return ChunkRange{idx * chunkSize,
+                      idx + 1 == numChunks
+                          ? std::numeric_limits<size_t>::max()
+                          : (idx + 1) * chunkSize};
+  };
+  auto run = [&](MmapByteSource &src, Chunk &chunk) {
+    try {
+      scan(src, chunk.range, chunk.result);
+    } catch (...) {
+      chunk.error = std::current_exception();
+    }
+  };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::map<size_t, Chunk> done; // the reorder buffer
+  size_t claimed = 0;
+  size_t emitted = 0;
+  bool stop = false;
+
+  auto worker = [&](MmapByteSource &src) {
+    while (true) {
+      size_t idx;
+      {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&]() {
+          return stop || claimed == numChunks
+                 || claimed < emitted + maxInFlight;
+        });
+        if (stop || claimed == numChunks) return;
+        idx = claimed++;
+      }
+      Chunk chunk{rangeOf(idx), Result(), nullptr};
+      run(src, chunk);
+      {
+        std::lock_guard lock(mutex);
+        done.emplace(idx, std::move(chunk));
+      }
+      cv.notify_all();
+    }
+  };
+
+  // opened up front, so any failure to do so is reported from here
+  std::vector<std::unique_ptr<MmapByteSource>> sources;
+  for (size_t i = 0; i < std::min(threads, numChunks); i++)
+    sources.emplace_back(std::make_unique<MmapByteSource>(source.name()));
+
+  std::vector<std::thread> workers;
+  auto finish = [&]() {
+    {
+      std::lock_guard lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    for (auto &t : workers) t.join();
+    workers.clear();
+  };
+
+  try {
+    for (auto &src : sources)
+      workers.emplace_back(worker, std::ref(*src));
+
+    size_t expected = 0;
+    for (size_t idx = 0; idx < numChunks; idx++) {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [&]() { return done.count(idx) != 0; });
+      auto chunk = std::move(done.at(idx));
+      done.erase(idx);
+      emitted = idx + 1;
+      lock.unlock();
+      cv.notify_all();
+
+      if (idx && chunk.range.start != expected) {
+        chunk = Chunk{rangeOf(idx), Result(), nullptr};
+        chunk.range.begin = expected;
+        chunk.range.exact = true;
+        run(source, chunk);
+      }
+      emit(chunk.result);
+      if (chunk.error) std::rethrow_exception(chunk.error);
+      expected = chunk.range.next;
+    }
+  } catch (...) {
+    finish();
+    throw;
+  }
+  finish();
+}
+
+}
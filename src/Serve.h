@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+namespace au {
+
+class GrepCache;
+
+/// Where au serve listens unless told otherwise: $AU_SOCKET if it's set, or
+/// else au.sock in $XDG_RUNTIME_DIR, or failing that a socket in /tmp named
+/// for the current user.
+std::string defaultServeSocket();
+
+/// How long au serve waits on a client. Requests are served one at a time, so
+/// one which stalls mustn't hold up the rest for good.
+struct ServeTimeouts {
+  /// To send its request.
+  std::chrono::milliseconds request{std::chrono::seconds(5)};
+  /// To take each part of the reply. It's longer, as the reply might be
+  /// piped to something that's slow to take it.
+  std::chrono::milliseconds reply{std::chrono::seconds(60)};
+};
+
+/// Listens on a unix socket at path which only the current user can connect
+/// to, replacing whatever is left there by a server which has gone. Returns
+/// the listening socket.
+/// @throws std::runtime_error if another server is listening there, or if it
+/// can't listen.
+int listenForGreps(const std::string &path);
+
+/// Reads a request from a client connected on fd, runs it and sends back its
+/// output and exit code, keeping what it can in cache for the next one.
+/// Clients running as anyone but the current user are hung up on.
+void serveConnection(int fd, GrepCache &cache,
+                     const ServeTimeouts &timeouts = {});
+
+/// Runs grep (or zgrep, if compressed) on behalf of an au serve client,
+/// keeping what it can in cache for the next one. See Grep.cpp.
+int grepServed(int argc,
+               const char * const *argv,
+               bool compressed,
+               GrepCache &cache);
+
+/// Has au serve run a grep with the given arguments (the same as for grep
+/// itself, --server and all), and relays its output and exit code. A server
+/// running as anyone but the current user is refused.
+int grepViaServer(int argc, const char * const *argv,
+                  std::ostream &out = std::cout,
+                  std::ostream &err = std::cerr);
+
+}
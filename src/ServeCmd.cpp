@@ -0,0 +1,402 @@
+#include "main.h"
+#include "GrepCache.h"
+#include "Serve.h"
+#include "TclapHelper.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace au {
+
+namespace {
+
+// A request is a 4-byte length, then the client's working directory and its
+// arguments (from the command on), each terminated by a NUL. The reply is a
+// series of frames, each a channel byte, a 4-byte length and that many bytes.
+// The last frame is on the Exit channel, and holds the 4-byte exit code.
+constexpr char Stdout = 'o';
+constexpr char Stderr = 'e';
+constexpr char Exit = 'x';
+constexpr uint32_t MAX_REQUEST = 1u << 20;
+
+void usage() {
+  std::cout
+      << "usage: au serve [options]\n"
+      << "\n"
+      << " Listens on a unix socket for greps sent by grep --server, and runs them\n"
+      << " one at a time. Whatever can be kept from one search of a file to the\n"
+      << " next is kept: the open file, its gzip index, inflate state and\n"
+      << " dictionaries, its au index samples, and the key values seen while\n"
+      << " binary searching, so that each grep -o starts closer than the last.\n"
+      << " The socket defaults to $AU_SOCKET, or $XDG_RUNTIME_DIR/au.sock if that's\n"
+      << " unset, or /tmp/au-<uid>.sock if both are.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -s --socket <path>  listen on <path>\n";
+}
+
+class Socket {
+  int fd_;
+
+public:
+  explicit Socket(int fd) : fd_(fd) {}
+  ~Socket() { if (fd_ >= 0) ::close(fd_); }
+  Socket(const Socket &) = delete;
+  Socket &operator=(const Socket &) = delete;
+
+  int get() const { return fd_; }
+};
+
+bool setAddress(const std::string &path, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) return false;
+  memcpy(addr.sun_path, path.data(), path.size());
+  return true;
+}
+
+/// Returns -1 (with errno set) on failure.
+int connectTo(const std::string &path) {
+  sockaddr_un addr;
+  if (!setAddress(path, addr)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    auto err = errno;
+    ::close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+/// The user at the other end of the unix socket fd, or -1 if that can't be
+/// found.
+uid_t peerUid(int fd) {
+#ifdef SO_PEERCRED
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return static_cast<uid_t>(-1);
+  return cred.uid;
+#else
+  uid_t uid;
+  gid_t gid;
+  if (::getpeereid(fd, &uid, &gid) != 0) return static_cast<uid_t>(-1);
+  return uid;
+#endif
+}
+
+bool setTimeout(int fd, int option, std::chrono::milliseconds timeout) {
+  timeval tv{};
+  tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+  tv.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+  return ::setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)) == 0;
+}
+
+bool writeAll(int fd, const char *data, size_t len) {
+  while (len) {
+    // MSG_NOSIGNAL, so that a client going away isn't the end of the server
+    auto n = ::send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool readAll(int fd, char *data, size_t len) {
+  while (len) {
+    auto n = ::read(fd, data, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool writeFrame(int fd, char channel, const char *data, uint32_t len) {
+  char header[1 + sizeof(len)];
+  header[0] = channel;
+  memcpy(header + 1, &len, sizeof(len));
+  return writeAll(fd, header, sizeof(header)) && writeAll(fd, data, len);
+}
+
+/// Sends what's written to it to the client, as frames on one channel. Once
+/// the client has gone away, the rest is dropped.
+class FrameBuf : public std::streambuf {
+  int fd_;
+  char channel_;
+  bool connected_ = true;
+  char buf_[64 * 1024];
+
+public:
+  FrameBuf(int fd, char channel) : fd_(fd), channel_(channel) {
+    setp(buf_, buf_ + sizeof(buf_));
+  }
+
+protected:
+  int overflow(int c) override {
+    flush();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  int sync() override {
+    flush();
+    return 0;
+  }
+
+private:
+  void flush() {
+    auto len = static_cast<uint32_t>(pptr() - pbase());
+    if (len && connected_)
+      connected_ = writeFrame(fd_, channel_, pbase(), len);
+    setp(buf_, buf_ + sizeof(buf_));
+  }
+};
+
+/// Points a standard stream at another buffer for as long as it's in scope.
+class Redirect {
+  std::ostream &stream_;
+  std::streambuf *orig_;
+
+public:
+  Redirect(std::ostream &stream, std::streambuf *buf)
+      : stream_(stream), orig_(stream.rdbuf(buf)) {}
+  ~Redirect() {
+    stream_.flush();
+    stream_.rdbuf(orig_);
+    stream_.clear();
+  }
+  Redirect(const Redirect &) = delete;
+  Redirect &operator=(const Redirect &) = delete;
+};
+
+int runRequest(const std::vector<std::string> &request, GrepCache &cache) {
+  if (request.size() < 2) {
+    std::cerr << "Malformed request" << std::endl;
+    return 1;
+  }
+  // relative paths are relative to the client
+  if (::chdir(request[0].c_str()) != 0) {
+    std::cerr << "Could not change to directory " << request[0] << ": "
+              << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::vector<const char *> argv{"au"};
+  for (auto it = request.begin() + 1; it != request.end(); ++it)
+    argv.push_back(it->c_str());
+  auto argc = static_cast<int>(argv.size());
+  auto &cmd = request[1];
+  if (cmd == "grep") return grepServed(argc, argv.data(), false, cache);
+  if (cmd == "zgrep") return grepServed(argc, argv.data(), true, cache);
+  std::cerr << "au serve only runs grep and zgrep, not " << cmd << std::endl;
+  return 1;
+}
+
+}
+
+void serveConnection(int fd, GrepCache &cache, const ServeTimeouts &timeouts) {
+  // the socket's permissions should see to this, but it might have been
+  // opened up, or be somewhere that doesn't honour them
+  if (peerUid(fd) != ::getuid()) return;
+  // a client which stops taking its reply would otherwise block the server
+  // in send() for good
+  if (!setTimeout(fd, SO_RCVTIMEO, timeouts.request)
+      || !setTimeout(fd, SO_SNDTIMEO, timeouts.reply))
+    return;
+  uint32_t len;
+  if (!readAll(fd, reinterpret_cast<char *>(&len), sizeof(len))
+      || len > MAX_REQUEST)
+    return;
+  std::string buf(len, '\0');
+  if (!readAll(fd, buf.data(), len)) return;
+  std::vector<std::string> request;
+  for (size_t pos = 0; pos < buf.size();) {
+    auto end = buf.find('\0', pos);
+    if (end == std::string::npos) return;
+    request.emplace_back(buf, pos, end - pos);
+    pos = end + 1;
+  }
+
+  int32_t result = 1;
+  {
+    FrameBuf out(fd, Stdout);
+    FrameBuf err(fd, Stderr);
+    Redirect redirectOut(std::cout, &out);
+    Redirect redirectErr(std::cerr, &err);
+    try {
+      result = runRequest(request, cache);
+    } catch (const std::exception &e) {
+      std::cerr << "Runtime error: " << e.what() << std::endl;
+      result = 1;
+    }
+  }
+  writeFrame(fd, Exit, reinterpret_cast<const char *>(&result),
+             sizeof(result));
+}
+
+std::string defaultServeSocket() {
+  if (auto *env = ::getenv("AU_SOCKET")) return env;
+  auto *runtimeDir = ::getenv("XDG_RUNTIME_DIR");
+  if (runtimeDir && *runtimeDir) return std::string(runtimeDir) + "/au.sock";
+  return "/tmp/au-" + std::to_string(::getuid()) + ".sock";
+}
+
+int listenForGreps(const std::string &path) {
+  sockaddr_un addr;
+  if (!setAddress(path, addr)) THROW_RT("Socket path " << path
+                                        << " is too long");
+  if (Socket(connectTo(path)).get() >= 0)
+    THROW_RT("au serve is already listening on " << path);
+  // whatever is there is left over from a server which has gone
+  ::unlink(path.c_str());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  // only we get to have files read as us
+  auto mask = ::umask(0077);
+  auto bound = fd >= 0
+      && ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+  ::umask(mask);
+  if (!bound || ::listen(fd, SOMAXCONN) != 0) {
+    auto err = errno;
+    if (fd >= 0) ::close(fd);
+    THROW_RT("Could not listen on " << path << ": " << strerror(err));
+  }
+  return fd;
+}
+
+int grepViaServer(int argc, const char * const *argv, std::ostream &out,
+                  std::ostream &err) {
+  auto path = defaultServeSocket();
+  Socket conn(connectTo(path));
+  if (conn.get() < 0) {
+    err << "Could not connect to au serve at " << path << ": "
+        << strerror(errno) << std::endl;
+    return 1;
+  }
+  // anyone can listen on a socket in /tmp, and a server that isn't ours has
+  // no business seeing what we're searching for, or answering for it
+  auto serverUid = peerUid(conn.get());
+  if (serverUid != ::getuid()) {
+    err << "Refusing to use au serve at " << path << ", which is run by "
+        << (serverUid == static_cast<uid_t>(-1)
+                ? std::string("an unknown user")
+                : "uid " + std::to_string(serverUid))
+        << std::endl;
+    return 1;
+  }
+
+  char cwd[PATH_MAX];
+  if (!::getcwd(cwd, sizeof(cwd))) {
+    err << "Could not get working directory: " << strerror(errno)
+        << std::endl;
+    return 1;
+  }
+  std::string request(sizeof(uint32_t), '\0');
+  request.append(cwd);
+  request.push_back('\0');
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--server") == 0) continue;
+    request.append(argv[i]);
+    request.push_back('\0');
+  }
+  auto len = static_cast<uint32_t>(request.size() - sizeof(uint32_t));
+  if (len > MAX_REQUEST) {
+    err << "Arguments too long for au serve" << std::endl;
+    return 1;
+  }
+  memcpy(request.data(), &len, sizeof(len));
+  if (!writeAll(conn.get(), request.data(), request.size())) {
+    err << "Error sending request to au serve: " << strerror(errno)
+        << std::endl;
+    return 1;
+  }
+
+  std::string payload;
+  while (true) {
+    char header[1 + sizeof(uint32_t)];
+    uint32_t frameLen;
+    if (!readAll(conn.get(), header, sizeof(header))) break;
+    memcpy(&frameLen, header + 1, sizeof(frameLen));
+    payload.resize(frameLen);
+    if (!readAll(conn.get(), payload.data(), frameLen)) break;
+    auto size = static_cast<std::streamsize>(payload.size());
+    switch (header[0]) {
+      case Stdout:
+        out.write(payload.data(), size);
+        break;
+      case Stderr:
+        err.write(payload.data(), size);
+        break;
+      case Exit: {
+        int32_t result;
+        if (payload.size() != sizeof(result)) break;
+        memcpy(&result, payload.data(), sizeof(result));
+        out.flush();
+        return result;
+      }
+      default:
+        break;
+    }
+  }
+  out.flush();
+  err << "au serve went away before finishing" << std::endl;
+  return 1;
+}
+
+int serve(int argc, const char * const *argv) {
+  TclapHelper tclap(usage);
+
+  TCLAP::ValueArg<std::string> socketPath(
+      "s", "socket", "socket", false, defaultServeSocket(), "path",
+      tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  auto &path = socketPath.getValue();
+  std::unique_ptr<Socket> listener;
+  try {
+    listener = std::make_unique<Socket>(listenForGreps(path));
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "Listening on " << path << std::endl;
+
+  GrepCache cache;
+  while (true) {
+    Socket conn(::accept(listener->get(), nullptr, nullptr));
+    if (conn.get() < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      std::cerr << "Error accepting connection: " << strerror(errno)
+                << std::endl;
+      return 1;
+    }
+    serveConnection(conn.get(), cache);
+  }
+}
+
+}
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace au {
@@ -127,7 +128,8 @@ void dictStats(const Dictionary::Dict &dictionary,
       << "Dictionary stats " << event << ":\n"
       << "  Total entries: " << commafy(dictionary.size()) << '\n';
   SizeHistogram hist {"Dictionary entries"};
-  for (auto &&entry : dictionary.entries()) hist.add(entry.size());
+  for (auto i = 0u; i < dictionary.size(); i++)
+    hist.add(dictionary.at(i).size());
   hist.dumpStats({});
 
   auto numEntries = dictionary.size();
@@ -309,14 +311,17 @@ struct StatsRecordHandler {
 
 class StatsDecoder {
   std::string filename_;
+  size_t threads_;
 
 public:
-  StatsDecoder(const std::string &filename)
-      : filename_(filename) {}
+  StatsDecoder(const std::string &filename, size_t threads)
+      : filename_(filename), threads_(threads) {}
 
   int decode(StatsRecordHandler &handler) const {
     auto source = detectSource(filename_, std::nullopt, false);
     if (!checkAuFile(*source)) return 1;
+    if (auto *zipped = dynamic_cast<ZipByteSource *>(source.get()))
+      zipped->inflateAhead(threads_);
     try {
       RecordParser(*source, handler).parseStream();
     } catch (parse_error &e) {
@@ -361,7 +366,9 @@ void usage() {
       << "usage: au stats [options] [--] <path>...\n"
       << "\n"
       << "  -h --help        show usage and exit\n"
-      << "  -d --dict        dump full dictionary\n";
+      << "  -d --dict        dump full dictionary\n"
+      << "  -j --threads <n> decompress indexed gzipped files with <n> threads\n"
+      << "                   (default: number of cores)\n";
 }
 
 }
@@ -370,6 +377,9 @@ int stats(int argc, const char * const *argv) {
   TclapHelper tclap(usage);
 
   TCLAP::SwitchArg dictDump("d", "dict", "dict", tclap.cmd(), false);
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
   TCLAP::UnlabeledMultiArg<std::string> fileNames(
       "path", "", false, "path", tclap.cmd());
 
@@ -380,7 +390,7 @@ int stats(int argc, const char * const *argv) {
 
   for (auto &f : fileNames.getValue()) {
     StatsRecordHandler handler(dictDump.isSet());
-    auto result = StatsDecoder(f).decode(handler);
+    auto result = StatsDecoder(f, threads.getValue()).decode(handler);
     if (result) return result;
   }
 
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Zindex.h"
+#ifdef AU_ZSTD
+#include "Zstd.h"
+#endif
 #include "au/FileByteSource.h"
 
 namespace au {
@@ -35,21 +38,67 @@ static inline bool isGzipFile(AuByteSource &source) {
   return magicMatched;
 }
 
+static inline bool isZstdFile(AuByteSource &source) {
+  auto magicMatched = false;
+  auto pos = source.pos();
+  try {
+    source.readFunc(4, [&](auto fragment) {
+      if (fragment == "\x28\xb5\x2f\xfd") {
+        magicMatched = true;
+      }
+    });
+  } catch (parse_error &) {}
+  source.seek(pos);
+  return magicMatched;
+}
+
+/// Opens fileName as whichever source suits it. A file which is to be followed
+/// isn't mapped: if it's truncated under the mapping (as copytruncate log
+/// rotation does), the read fails (see MappedFile), where a plain read just
+/// sees eof and waits for the file to grow again.
 static inline std::unique_ptr<FileByteSource> detectSource(
     const std::string &fileName,
     const std::optional<std::string> &indexFile,
-    bool compressed) {
+    bool compressed,
+    bool follow = false) {
   std::unique_ptr<FileByteSource> source;
   auto fbs = std::make_unique<FileByteSourceImpl>(fileName);
   if (compressed || isGzipFile(*fbs)) {
     auto *ptr = fbs.get();
     source.reset(new ZipByteSource(*ptr, indexFile));
+  } else if (isZstdFile(*fbs)) {
+#ifdef AU_ZSTD
+    source = std::make_unique<ZstdByteSource>(*fbs);
+#else
+    THROW_RT(fileName << " is zstd compressed, but au was built without zstd "
+                         "support");
+#endif
+  } else if (fileName != "-" && !follow && fbs->isMappable()) {
+    source = std::make_unique<MmapByteSource>(fileName);
   } else {
     source = std::move(fbs);
   }
   return source;
 }
 
+/// Call visitor with source downcast to its concrete type. This lets the
+/// visitor instantiate the decode path for that type (see BaseParser) so
+/// none of the per-byte calls go through the vtable.
+template <typename Visitor>
+decltype(auto) visitSource(FileByteSource &source, Visitor &&visitor) {
+  if (auto *mmapped = dynamic_cast<MmapByteSource *>(&source))
+    return visitor(*mmapped);
+  if (auto *zipped = dynamic_cast<ZipByteSource *>(&source))
+    return visitor(*zipped);
+#ifdef AU_ZSTD
+  if (auto *zstd = dynamic_cast<ZstdByteSource *>(&source))
+    return visitor(*zstd);
+#endif
+  if (auto *file = dynamic_cast<FileByteSourceImpl *>(&source))
+    return visitor(*file);
+  THROW_RT("Unsupported byte source for " << source.name());
+}
+
 static inline bool checkAuFile(AuByteSource &source) {
   if (isAuFile(source)) return true;
   std::cerr << source.name() << " does not appear to be an au-encoded file"
@@ -5,6 +5,9 @@
 #include "au/FileByteSource.h"
 #include "StreamDetection.h"
 
+#include <memory>
+#include <sys/stat.h>
+
 namespace au {
 
 namespace {
@@ -15,10 +18,45 @@ void usage(const char *cmd) {
       << "\n"
       << "  -h --help           show usage and exit\n"
       << "  -f --follow         output appended data as the file grows\n"
+      << "  -n --records <n>    start with the last <n> value records\n"
       << "  -b --bytes <n>      start <n> bytes from end of file (default 5k)\n"
       << "  -x --index <path>   use gzip index in <path>\n";
 }
 
+void tacUsage() {
+  std::cout
+      << "usage: au tac [options] [--] <path>\n"
+      << "\n"
+      << "Decodes the records of an au file, last first.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -x --index <path>   use gzip index in <path>\n";
+}
+
+/// Opens fileName for tail or tac, along with its dictionary checkpoints.
+/// Returns null (having said why it can't be done) if it can't be read
+/// backwards.
+std::unique_ptr<FileByteSource> openSeekable(
+    const char *verb,
+    const std::string &fileName,
+    const std::optional<std::string> &indexFile,
+    bool compressed,
+    bool follow,
+    std::unique_ptr<const DictCheckpoints> &checkpoints) {
+  auto source = detectSource(fileName, indexFile, compressed, follow);
+  if (!source->isSeekable()) {
+    std::cerr << "Cannot " << verb << " non-seekable file '" << source->name()
+        << "'" << std::endl;
+    return nullptr;
+  }
+  struct stat fileStat;
+  if (::stat(fileName.c_str(), &fileStat) == 0) {
+    checkpoints = DictCheckpoints::load(
+        DictCheckpoints::filenameFor(fileName), fileStat);
+  }
+  return source;
+}
+
 int tailCmd(int argc, const char *const *argv, bool compressed) {
   TclapHelper tclap([compressed]() { usage(compressed ? "ztail" : "tail"); });
 
@@ -26,6 +64,8 @@ int tailCmd(int argc, const char *const *argv, bool compressed) {
   // Offset in bytes so we can fine-tune the starting point for test purposes.
   TCLAP::ValueArg<size_t> startOffset(
       "b", "bytes", "bytes", false, 5 * 1024, "integer", tclap.cmd());
+  TCLAP::ValueArg<size_t> records(
+      "n", "records", "records", false, 0, "integer", tclap.cmd());
   TCLAP::UnlabeledValueArg<std::string> fileName(
       "path", "", true, "path", "", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
@@ -33,25 +73,48 @@ int tailCmd(int argc, const char *const *argv, bool compressed) {
 
   if (!tclap.parse(argc, argv)) return 1;
 
+  if (records.isSet() && startOffset.isSet()) {
+    std::cerr << "only one of -n or -b may be specified." << std::endl;
+    return 1;
+  }
+
   Dictionary dictionary;
   JsonOutputHandler jsonHandler;
 
   if (fileName.getValue().empty() || fileName.getValue() == "-") {
     std::cerr << "Tailing stdin not supported\n";
   } else {
+    std::unique_ptr<const DictCheckpoints> checkpoints;
     std::optional<std::string> indexFile =
         index.isSet() ? std::optional{index.getValue()}
                       : std::nullopt;
-    auto source = detectSource(fileName, indexFile, compressed);
-    if (!source->isSeekable()) {
-      std::cerr << "Cannot tail non-seekable file '" << source->name() << "'"
-          << std::endl;
-      return 1;
+    auto source = openSeekable("tail", fileName, indexFile, compressed,
+                               follow, checkpoints);
+    if (!source) return 1;
+    if (records.isSet()) {
+      return visitSource(*source, [&](auto &concrete) {
+        TailHandler handler(dictionary, concrete, checkpoints.get());
+        // not before, or finding the records would wait at the end of the
+        // file for more of them
+        if (!handler.seekLast(records)) {
+          if (!follow) return 0;
+          // no records yet, so the first ones to arrive are the ones we want
+          concrete.seek(0);
+          concrete.setFollow(true);
+          handler.parseStream(jsonHandler);
+          return 0;
+        }
+        concrete.setFollow(follow);
+        handler.parseRecords(jsonHandler);
+        return 0;
+      });
     }
     source->setFollow(follow);
     source->tail(startOffset);
-    TailHandler tailHandler(dictionary, *source);
-    tailHandler.parseStream(jsonHandler);
+    visitSource(*source, [&](auto &concrete) {
+      TailHandler(dictionary, concrete, checkpoints.get())
+          .parseStream(jsonHandler);
+    });
   }
 
   return 0;
@@ -67,4 +130,38 @@ int ztail(int argc, const char * const *argv) {
   return tailCmd(argc, argv, true);
 }
 
+int tac(int argc, const char * const *argv) {
+  TclapHelper tclap(tacUsage);
+
+  TCLAP::UnlabeledValueArg<std::string> fileName(
+      "path", "", true, "path", "", tclap.cmd());
+  TCLAP::ValueArg<std::string> index(
+      "x", "index", "index", false, "", "string", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  if (fileName.getValue().empty() || fileName.getValue() == "-") {
+    std::cerr << "Reversing stdin not supported\n";
+    return 1;
+  }
+  std::unique_ptr<const DictCheckpoints> checkpoints;
+  std::optional<std::string> indexFile =
+      index.isSet() ? std::optional{index.getValue()}
+                    : std::nullopt;
+  auto source = openSeekable("reverse", fileName, indexFile, false, false,
+                             checkpoints);
+  if (!source) return 1;
+  if (!checkAuFile(*source)) return 1;
+
+  // a window of records can span a few dictionaries, and going backwards
+  // they're all needed again as its records are output
+  Dictionary dictionary(4);
+  JsonOutputHandler jsonHandler;
+  visitSource(*source, [&](auto &concrete) {
+    TailHandler(dictionary, concrete, checkpoints.get())
+        .parseReversed(jsonHandler);
+  });
+  return 0;
+}
+
 }
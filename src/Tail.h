@@ -2,13 +2,16 @@
 
 #include "au/AuDecoder.h"
 #include "AuRecordHandler.h"
+#include "DictCheckpoints.h"
 #include "Dictionary.h"
 
+#include <algorithm>
 #include <list>
+#include <vector>
 
 namespace au {
 
-class DictionaryBuilder : public BaseParser {
+class DictionaryBuilder : public BaseParser<> {
   std::list<std::string> newEntries_;
   Dictionary &dictionary_;
   /// A valid dictionary must end before this point
@@ -19,7 +22,7 @@ public:
   DictionaryBuilder(AuByteSource &source,
                     Dictionary &dictionary,
                     size_t endOfDictAbsPos)
-      : BaseParser(source),
+      : BaseParser<>(source),
         dictionary_(dictionary),
         endOfDictAbsPos_(endOfDictAbsPos),
         lastDictPos_(source.pos())
@@ -145,12 +148,28 @@ private:
   }
 };
 
-class TailHandler : public BaseParser {
+template <typename Source = AuByteSource>
+class TailHandler : public BaseParser<Source> {
+  using Base = BaseParser<Source>;
+  using Base::source_;
+  using Base::expect;
+  using Base::readBackref;
+  using Base::readVarint;
+  using Base::term;
+
   Dictionary &dictionary_;
+  const DictCheckpoints *checkpoints_;
+  /// How far before the end valueRecordsBefore() starts looking. Grows to fit
+  /// what it's asked for, and stays grown for the next call.
+  size_t window_ = 64 * 1024;
 
 public:
-  TailHandler(Dictionary &dictionary, AuByteSource &source)
-      : BaseParser(source), dictionary_(dictionary) {}
+  /// If the file has dictionary checkpoints, dictionaries are restored from
+  /// them rather than rebuilt from the dictionary records alone.
+  TailHandler(Dictionary &dictionary,
+              Source &source,
+              const DictCheckpoints *checkpoints = nullptr)
+      : Base(source), dictionary_(dictionary), checkpoints_(checkpoints) {}
 
   template <typename OutputHandler>
   void parseStream(OutputHandler &handler) {
@@ -160,15 +179,111 @@ public:
              "Consider starting earlier in the file. See the -b option.\n";
       return;
     }
+    parseRecords(handler);
+  }
 
-    // At this point we should have a full/valid dictionary and be positioned
-    // at the start of a value record.
+  /// Outputs the records from the current position, which must be the start
+  /// of a value record with its dictionary in place (see sync()).
+  template <typename OutputHandler>
+  void parseRecords(OutputHandler &handler) {
     AuRecordHandler<OutputHandler> recordHandler(dictionary_, handler);
-    RecordParser<decltype(recordHandler)>(source_, recordHandler)
+    RecordParser<decltype(recordHandler), Source>(source_, recordHandler)
       .parseStream(false);
   }
 
-  bool sync() {
+  /// Positions the source at the start of the last n value records before
+  /// the end of the file, with their dictionary in place, ready for
+  /// parseRecords(). If there are fewer, that's the first value record. With n
+  /// of 0, it's the end of the last one. Returns false if there are no value
+  /// records at all.
+  bool seekLast(size_t n) {
+    auto records = valueRecordsBefore(source_.endPos(), n);
+    if (records.empty()) return false;
+    if (n == 0) {
+      syncAt(records.back());
+      DictTracker tracker;
+      AuRecordHandler<DictTracker> handler(dictionary_, tracker);
+      RecordParser(source_, handler).record();
+      return true;
+    }
+    syncAt(records[records.size() - std::min(n, records.size())]);
+    return true;
+  }
+
+  /// Outputs the value records before the current end of the file, last one
+  /// first. It works back through the file a window at a time, so only the
+  /// positions of the records in one window are held at once, and each
+  /// dictionary is only built once, however far it is from the end.
+  template <typename OutputHandler>
+  void parseReversed(OutputHandler &handler) {
+    window_ = std::max<size_t>(window_, 1024 * 1024);
+    AuRecordHandler<OutputHandler> recordHandler(dictionary_, handler);
+    RecordParser<decltype(recordHandler), Source> parser(source_, recordHandler);
+    auto end = source_.endPos();
+    while (true) {
+      auto records = valueRecordsBefore(end, 1);
+      if (records.empty()) return;
+      // have a buffered source hold on to the whole window, so that going
+      // back through it doesn't mean reading it again for every record
+      source_.seek(records.front());
+      source_.setPin(records.front());
+      source_.skip(end - records.front());
+      source_.clearPin();
+      for (auto it = records.rbegin(); it != records.rend(); ++it) {
+        // these are known to be good, so they needn't be validated again
+        findDictionary(*it);
+        source_.seek(*it);
+        parser.record();
+      }
+      end = records.front();
+    }
+  }
+
+  /// The starts of the value records in a window which finishes at end, in
+  /// order. The window starts at the first value record found (by sync())
+  /// some way before end, so its records are found by reading them in order
+  /// rather than guessed at, and it grows until it has at least n records or
+  /// reaches the start of the file. It may have more than n. Throws if a
+  /// record in the window is bad, unless it's the last one, which may be only
+  /// partly written so far.
+  std::vector<size_t> valueRecordsBefore(size_t end, size_t n) {
+    std::vector<size_t> result;
+    while (true) {
+      auto start = end > window_ ? end - window_ : 0;
+      result.clear();
+      source_.seek(start);
+      if (sync(true)) {
+        DictTracker tracker;
+        AuRecordHandler<DictTracker> handler(dictionary_, tracker);
+        auto parser = RecordParser(source_, handler);
+        auto sor = source_.pos();
+        try {
+          while (source_.pos() < end) {
+            auto c = source_.peek();
+            if (c.isEof()) break;
+            sor = source_.pos();
+            parser.record();
+            if (c == 'V' && source_.pos() <= end) result.push_back(sor);
+          }
+        } catch (std::exception &) {
+          // it was the last record if there's no good one after it
+          source_.seek(sor + 1);
+          if (sync(true) && source_.pos() < end) throw;
+        }
+      }
+      if (result.size() >= n || start == 0) return result;
+      // aim for enough room at the size of records so far, and a bit more
+      auto wanted = result.empty()
+          ? 0 : (end - result.front()) / result.size() * n / 4 * 5;
+      window_ = std::max(window_ * 2, wanted);
+    }
+  }
+
+  /// Scans forward from the current position to the first valid value
+  /// record, building the dictionary it needs, and leaves the source
+  /// positioned at the start of it. Returns false if there's no such record.
+  /// Failed candidates are reported on stderr unless quiet is set.
+  bool sync(bool quiet = false) {
     while (true) {
       size_t sor = source_.pos();
       try {
@@ -178,52 +293,76 @@ public:
         }
         term();
         sor = source_.pos();
-        expect('V');
-        auto backDictRef = readBackref();
-        if (backDictRef > sor) {
-          THROW_RT("Back dictionary reference is before the start of the file. "
-                   "Current absolute position: " << sor << " backDictRef: "
-                                                 << backDictRef);
-        }
-
-        if (!dictionary_.search(sor - backDictRef)) {
-          source_.seek(sor - backDictRef);
-          DictionaryBuilder builder(source_, dictionary_, sor);
-          builder.build();
-          // We seem to have a complete dictionary. Let's try validating this val.
-          source_.seek(sor);
-          expect('V');
-          if (backDictRef != readBackref()) {
-            THROW_RT("Read different value 2nd time!");
-          }
-        }
-
-        auto valueLen = readVarint();
-        auto startOfValue = source_.pos();
-
-        auto &dict = dictionary_.findDictionary(sor, backDictRef);
-        ValidatingHandler validatingHandler(
-            dict, source_, startOfValue + valueLen);
-        ValueParser<ValidatingHandler> valueValidator(
-            source_, validatingHandler);
-        valueValidator.value();
-        term();
-        if (valueLen != source_.pos() - startOfValue) {
-          THROW_RT("Length doesn't match. Expected: " << valueLen << " actual "
-                                                      << source_.pos() - startOfValue);
-        }
-
-        // We seem to have a good value record. Reset stream to start of record.
-        source_.seek(sor);
+        syncAt(sor);
         return true; // Sync was successful
       } catch (std::exception &e) {
-        std::cerr << "Ignoring exception while synchronizing start of tailing "
-                     "(attempted start-of-record: " << sor << "): "
-                  << e.what() << "\n";
+        if (!quiet)
+          std::cerr << "Ignoring exception while synchronizing start of "
+                       "tailing (attempted start-of-record: " << sor << "): "
+                    << e.what() << "\n";
         source_.seek(sor + 1);
       }
     }
   }
+
+  /// Like sync(), but for a value record already known to start at sor.
+  /// Throws if there isn't a valid one there.
+  void syncAt(size_t sor) {
+    auto backDictRef = findDictionary(sor);
+    source_.seek(sor);
+    expect('V');
+    if (backDictRef != readBackref()) {
+      THROW_RT("Read different value 2nd time!");
+    }
+
+    auto valueLen = readVarint();
+    auto startOfValue = source_.pos();
+
+    auto &dict = dictionary_.findDictionary(sor, backDictRef);
+    ValidatingHandler validatingHandler(
+        dict, source_, startOfValue + valueLen);
+    ValueParser<ValidatingHandler, Source> valueValidator(
+        source_, validatingHandler);
+    valueValidator.value();
+    term();
+    if (valueLen != source_.pos() - startOfValue) {
+      THROW_RT("Length doesn't match. Expected: " << valueLen << " actual "
+                                                  << source_.pos() - startOfValue);
+    }
+
+    // We seem to have a good value record. Reset stream to start of record.
+    source_.seek(sor);
+  }
+
+private:
+  /// Makes sure the dictionary for the value record at sor is in place,
+  /// building it if need be, and returns the record's backref to it. Leaves
+  /// the source just about anywhere.
+  size_t findDictionary(size_t sor) {
+    source_.seek(sor);
+    expect('V');
+    auto backDictRef = readBackref();
+    if (backDictRef > sor) {
+      THROW_RT("Back dictionary reference is before the start of the file. "
+               "Current absolute position: " << sor << " backDictRef: "
+                                             << backDictRef);
+    }
+
+    if (checkpoints_ && !dictionary_.search(sor - backDictRef))
+      checkpoints_->restore(dictionary_, sor - backDictRef);
+    if (!dictionary_.search(sor - backDictRef)) {
+      source_.seek(sor - backDictRef);
+      DictionaryBuilder builder(source_, dictionary_, sor);
+      builder.build();
+    }
+    return backDictRef;
+  }
 };
 
+template <typename Source>
+TailHandler(Dictionary &, Source &) -> TailHandler<Source>;
+template <typename Source>
+TailHandler(Dictionary &, Source &, const DictCheckpoints *)
+    -> TailHandler<Source>;
+
 }
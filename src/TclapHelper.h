@@ -2,27 +2,39 @@
 
 #include <tclap/CmdLine.h>
 
+#include <cstdlib>
 #include <functional>
 
 namespace au {
 
 class TclapHelper {
+  /// Thrown in place of exiting, when the process has to outlive the parse.
+  struct Exit {
+    int status;
+  };
+
   struct UsageVisitor : public TCLAP::Visitor {
     std::function<void()> usage;
-    UsageVisitor(const std::function<void()> &usage) : usage(usage) {}
+    bool exits;
+    UsageVisitor(const std::function<void()> &usage, bool exits)
+        : usage(usage), exits(exits) {}
     void visit() override {
       usage();
-      exit(0);
+      if (!exits) throw Exit{0};
+      ::exit(0);
     }
   };
 
   struct UsageOutput : public TCLAP::StdOutput {
     std::function<void()> usage_;
-    UsageOutput(const std::function<void()> &usage) : usage_(usage) {}
+    bool exits_;
+    UsageOutput(const std::function<void()> &usage, bool exits)
+        : usage_(usage), exits_(exits) {}
     void failure(TCLAP::CmdLineInterface &, TCLAP::ArgException &e) override {
       std::cerr << e.error() << std::endl;
       usage_();
-      exit(1);
+      if (!exits_) throw Exit{1};
+      ::exit(1);
     }
     void usage(TCLAP::CmdLineInterface &) override {
       usage_();
@@ -32,10 +44,14 @@ class TclapHelper {
   UsageVisitor usageVisitor_;
   TCLAP::CmdLine cmd_;
   TCLAP::SwitchArg help_;
+  int status_ = 0;
 
 public:
-  explicit TclapHelper(std::function<void()> usage)
-      : usageVisitor_(usage),
+  /// Unless exits is false, --help and bad arguments end the process, once
+  /// the usage has been written out. If it's false, parse() returns false
+  /// instead, as au serve needs.
+  explicit TclapHelper(std::function<void()> usage, bool exits = true)
+      : usageVisitor_(usage, exits),
         cmd_("", ' ', "", false),
         help_("h", "help", "help", cmd_, false, &usageVisitor_) {
   }
@@ -44,16 +60,23 @@ public:
 
   bool parse(int argc, const char * const *argv) {
     try {
-      UsageOutput output(usageVisitor_.usage);
+      UsageOutput output(usageVisitor_.usage, usageVisitor_.exits);
       cmd_.setOutput(&output);
       cmd_.parse(argc-1, argv+1);
       return true;
     } catch (TCLAP::ArgException &e) {
       std::cerr << "error: " << e.error() << " for arg " << e.argId()
                 << std::endl;
+      status_ = 1;
+      return false;
+    } catch (Exit &e) {
+      status_ = e.status;
       return false;
     }
   }
+
+  /// What to exit with once parse() has returned false: 0 after --help.
+  int status() const { return status_; }
 };
 
 }
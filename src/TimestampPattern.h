@@ -6,6 +6,7 @@
 #include <chrono>
 #include <cctype>
 #include <cstring>
+#include <optional>
 #include <utility>
 
 namespace au {
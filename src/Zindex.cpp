@@ -1,16 +1,29 @@
-#include "au/AuEncoder.h"
 #include "au/ParseError.h"
 #include "DocumentParser.h"
+#include "LruList.h"
+#include "ParallelCompressor.h"
 #include "Zindex.h"
 
 #include <zlib.h>
 
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 // this file contains code adapted from https://github.com/mattgodbolt/zindex
 
@@ -18,13 +31,40 @@ namespace au {
 
 namespace {
 
-constexpr size_t DefaultIndexEvery = 8 * 1024 * 1024u;
+// how much au gzip puts in each member. each one is a checkpoint, so this is
+// also how far a seek might have to inflate to get where it's going
+constexpr size_t DefaultMemberSize = 1024 * 1024u;
 constexpr size_t WindowSize = 32768u;
 // TODO to ensure upgrading from an uncompressed stream works, this must
 // currently be at least as big as the buf_ in the FileByteStream. this is NOT
 // the best way to do this.
 constexpr size_t ChunkSize = 256 * 1024u; //16384u;
-constexpr auto Version = 1u;
+constexpr auto Version = 2u;
+constexpr char IndexMagic[4] = {'A', 'U', 'Z', 'X'};
+
+/// The fixed-size header at the start of a v2 index. Here and in the table,
+/// integers are in native (i.e., little-endian) byte order.
+struct IndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t compressedSize;
+  uint64_t compressedModTime;
+  uint64_t nameLength;  // the compressed file's base name follows the header
+  uint64_t tableOffset; // 0 until the index is complete
+  uint64_t numEntries;  // including the final one
+};
+
+/// One checkpoint in the table at the end of a v2 index.
+struct IndexTableEntry {
+  uint64_t uncompressedOffset;
+  uint64_t compressedOffset;
+  uint64_t windowOffset; // where its compressed window is in the index
+  uint32_t windowSize;   // 0 at the start of a gzip member, and at the end
+  uint32_t bitOffset;
+};
+
+static_assert(sizeof(IndexHeader) == 48);
+static_assert(sizeof(IndexTableEntry) == 32);
 
 std::string getRealPath(const std::string &relPath) {
   char realPathBuf[PATH_MAX];
@@ -48,23 +88,52 @@ void X(int zlibErr) {
   if (zlibErr != Z_OK) throw ZlibError(zlibErr);
 }
 
-size_t makeWindow(uint8_t *out, size_t outSize, const uint8_t *in,
-                  uint64_t left) {
-  uint8_t temp[WindowSize];
-  // Could compress directly into out if I (mgodbolt, that is) wasn't so lazy.
+/// The window as it stands after inflating up to a checkpoint, oldest byte
+/// first. in is the circular inflate buffer, with left bytes still unused.
+std::vector<uint8_t> unrollWindow(const uint8_t *in, uint64_t left) {
+  std::vector<uint8_t> result(WindowSize);
   if (left)
-    memcpy(temp, in + WindowSize - left, left);
+    memcpy(result.data(), in + WindowSize - left, left);
   if (left < WindowSize)
-    memcpy(temp + left, in, WindowSize - left);
-  uLongf destLen = outSize;
-  X(compress2(out, &destLen, temp, WindowSize, 9));
-  return destLen;
+    memcpy(result.data() + left, in, WindowSize - left);
+  return result;
+}
+
+/// A checkpoint at the start of a gzip member needs no window, and is stored
+/// with an empty one.
+std::string compressWindow(const std::vector<uint8_t> &window) {
+  if (window.empty()) return {};
+  std::string result(compressBound(WindowSize), '\0');
+  uLongf destLen = result.size();
+  X(compress2(reinterpret_cast<uint8_t *>(result.data()), &destLen,
+              window.data(), window.size(), 9));
+  result.resize(destLen);
+  return result;
+}
+
+/// Compresses data into a complete gzip member, which can be inflated without
+/// any of the data before it.
+std::string gzipMember(const std::vector<uint8_t> &data, int level) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  X(deflateInit2(&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY));
+  std::string result(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = const_cast<uint8_t *>(data.data());
+  stream.avail_in = static_cast<uInt>(data.size());
+  stream.next_out = reinterpret_cast<uint8_t *>(result.data());
+  stream.avail_out = static_cast<uInt>(result.size());
+  auto ret = deflate(&stream, Z_FINISH);
+  (void)deflateEnd(&stream);
+  if (ret != Z_STREAM_END) throw ZlibError(ret == Z_OK ? Z_BUF_ERROR : ret);
+  result.resize(stream.total_out);
+  return result;
 }
 
-void uncompressWindow(const std::vector<uint8_t> &compressed, uint8_t *to,
-                      size_t len) {
+void uncompressWindow(std::string_view compressed, uint8_t *to, size_t len) {
     uLongf destLen = len;
-    X(::uncompress(to, &len, &compressed[0], compressed.size()));
+    X(::uncompress(to, &destLen,
+                   reinterpret_cast<const uint8_t *>(compressed.data()),
+                   compressed.size()));
     if (destLen != len)
         THROW_RT("Unable to decompress a full window");
 }
@@ -85,6 +154,42 @@ struct ZStream {
     X(inflateReset(&stream));
   }
 
+  void reset(Type newType) {
+    type = newType;
+    X(inflateReset2(&stream, static_cast<int>(type)));
+  }
+
+  /// Makes sure there's input to inflate, reading more from file into buf if
+  /// need be.
+  /// @return false at the end of file
+  bool fill(FILE *file, uint8_t *buf, size_t size) {
+    if (stream.avail_in) return true;
+    stream.avail_in = static_cast<uInt>(::fread(buf, 1, size, file));
+    if (ferror(file)) throw ZlibError(Z_ERRNO);
+    stream.next_in = buf;
+    return stream.avail_in != 0;
+  }
+
+  /// Gets ready to inflate the next member of a multi-member gzip file (as
+  /// written by au gzip, bgzip or pigz), once inflate() has returned
+  /// Z_STREAM_END.
+  /// @return false if there's no next member, i.e. we're at the end of file
+  bool nextMember(FILE *file, uint8_t *buf, size_t size) {
+    if (type == Type::Raw) {
+      // a raw stream stops short of the gzip trailer
+      for (size_t skip = 8; skip;) {
+        if (!fill(file, buf, size)) return false;
+        auto n = std::min<size_t>(skip, stream.avail_in);
+        stream.next_in += n;
+        stream.avail_in -= static_cast<uInt>(n);
+        skip -= n;
+      }
+    }
+    if (!fill(file, buf, size)) return false;
+    reset(Type::ZlibOrGzip);
+    return true;
+  }
+
   ~ZStream() {
     (void)inflateEnd(&stream);
   }
@@ -93,19 +198,20 @@ struct ZStream {
   ZStream &operator=(ZStream &) = delete;
 };
 
+/// Everything needed to carry on inflating from some point in the stream. A
+/// context has its own input buffer, so ZipByteSource can keep a few of them
+/// around and switch between them. Output goes straight to the caller.
 struct CachedContext {
   ZStream zs_;
   size_t pos_ = 0; // current absolute position in stream
-  size_t cur_ = 0; // current offset into ZipByteSource::output_
-  size_t limit_ = 0; // number of valid bytes in ZipByteSource::output_
   bool eof_ = false;
+  off_t filePos_ = 0; // where the file was left when this context was set aside
+  uint8_t input_[ChunkSize];
 
-  explicit CachedContext()
-      : zs_(ZStream::Type::ZlibOrGzip) {}
+  CachedContext() : zs_(ZStream::Type::ZlibOrGzip) {}
 
   explicit CachedContext(size_t uncompressedOffset)
-      : zs_(ZStream::Type::Raw),
-        pos_(uncompressedOffset) {}
+      : zs_(ZStream::Type::Raw), pos_(uncompressedOffset) {}
 };
 
 std::string getIndexFilename(const std::string &filename,
@@ -114,58 +220,127 @@ std::string getIndexFilename(const std::string &filename,
   return getRealPath(filename) + ".auzx";
 }
 
-}
+/// Writes a v2 .auzx index: the header and the compressed file's name, then
+/// each checkpoint's window as it comes, then a table of the checkpoints. The
+/// header only gets the table's offset once that's written, so an index which
+/// was never finished can't be mistaken for a complete one. The index is
+/// written to a file, or else built up in memory.
+class IndexWriter {
+  std::filebuf file_;
+  std::stringbuf memory_;
+  std::ostream out_{&memory_};
+  IndexHeader header_{};
+  std::vector<IndexTableEntry> table_;
+  uint64_t written_ = 0;
+
+  void write(const void *data, size_t len) {
+    out_.write(static_cast<const char *>(data),
+               static_cast<std::streamsize>(len));
+    if (!out_) THROW_RT("Error writing index"); // TODO strerror, etc
+    written_ += len;
+  }
 
-int zindexFile(const std::string &fileName,
-               const std::optional<std::string> &indexFilename) {
-  size_t indexEvery = DefaultIndexEvery; // TODO extract
+public:
+  /// @return false if the index file couldn't be opened
+  bool open(const std::string &ifn) {
+    // TODO fail if file exists...
+    if (unlink(ifn.c_str()) == 0)
+      std::cout << "Rebuilding existing index " << ifn << std::endl;
+    if (!file_.open(ifn, std::ios_base::out | std::ios_base::binary)) {
+      std::cerr << "Unable to open output " << ifn << std::endl; // TODO strerror, etc
+      return false;
+    }
+    out_.rdbuf(&file_);
+    return true;
+  }
 
-  auto ifn = getIndexFilename(fileName, indexFilename);
-  std::cout << "Indexing " << fileName << " to " << ifn << "...\n";
+  /// The finished index, if it wasn't written to a file.
+  std::string contents() const {
+    return memory_.str();
+  }
 
-  // open gzipped file, or fail...
-  File from(fopen(fileName.c_str(), "rb"));
-  if (from.get() == nullptr) {
-      std::cerr << "Could not open " << fileName << " for reading\n";
-      return 1;
+  void metadata(const std::string &fileName,
+                const struct stat &compressedStat) {
+    auto name = getBaseName(fileName);
+    memcpy(header_.magic, IndexMagic, sizeof(IndexMagic));
+    header_.version = Version;
+    header_.compressedSize = static_cast<uint64_t>(compressedStat.st_size);
+    header_.compressedModTime = static_cast<uint64_t>(compressedStat.st_mtime);
+    header_.nameLength = name.size();
+    write(&header_, sizeof(header_));
+    write(name.data(), name.size());
   }
-  struct stat compressedStat;
-  if (fstat(fileno(from.get()), &compressedStat) != 0)
-    throw ZlibError(Z_DATA_ERROR);
 
-  // open index file, or fail...
-  // TODO fail if file exists...
-  if (unlink(ifn.c_str()) == 0)
-    std::cout << "Rebuilding existing index " << ifn << std::endl;
-  std::ofstream out;
-  out.open(ifn, std::ios_base::binary);
-  if (!out) {
-    std::cerr << "Unable to open output " << ifn << std::endl; // TODO strerror, etc
-    return 1;
+  /// An empty window marks a checkpoint at the start of a gzip member (and
+  /// the final entry).
+  void checkpoint(uint64_t uncompressedOffset, uint64_t compressedOffset,
+                  int bitOffset, std::string_view window) {
+    table_.push_back(IndexTableEntry{
+        uncompressedOffset, compressedOffset, written_,
+        static_cast<uint32_t>(window.size()),
+        static_cast<uint32_t>(bitOffset)});
+    write(window.data(), window.size());
   }
 
-  AuEncoder idx(AU_STR("Index of " << fileName << ", written by au"));
-  auto emit = [&](auto &&f) {
-    idx.encode(f, [&](std::string_view dict, std::string_view val) {
-      out << dict << val; // TODO error if write fails
-      return dict.size() + val.size();
-    });
+  /// Writes the table, after the last checkpoint.
+  void finish() {
+    static const char padding[alignof(IndexTableEntry)] = {};
+    write(padding, (sizeof(padding) - written_ % sizeof(padding))
+                   % sizeof(padding));
+    header_.tableOffset = written_;
+    header_.numEntries = table_.size();
+    write(table_.data(), table_.size() * sizeof(IndexTableEntry));
+    out_.seekp(0);
+    write(&header_, sizeof(header_));
+    if (file_.is_open() && !file_.close())
+      THROW_RT("Error writing index"); // TODO strerror, etc
+  }
+};
+
+}
+
+namespace {
+
+/// Inflates all of the gzipped file from, adding a checkpoint to idx roughly
+/// every indexEvery bytes of uncompressed data, and finishes idx. Progress is
+/// reported to log, if given.
+void buildIndex(FILE *from, const std::string &fileName, IndexWriter &idx,
+                size_t threads, size_t indexEvery, std::ostream *log) {
+  struct stat compressedStat;
+  if (fstat(fileno(from), &compressedStat) != 0)
+    throw ZlibError(Z_DATA_ERROR);
+  idx.metadata(fileName, compressedStat);
+
+  // actually build the index. input is read ahead on one thread and inflated
+  // on this one, while windows are compressed on the rest. the entries are
+  // written out in order as their windows become available.
+  struct Checkpoint {
+    uint64_t uncompressedOffset;
+    uint64_t compressedOffset;
+    int bitOffset;
+  };
+  std::deque<Checkpoint> checkpoints;
+  ParallelCompressor compressor(std::max<size_t>(threads, 1), compressWindow);
+  auto writeCheckpoints = [&](bool wait) {
+    while (compressor.collect(wait, [&](std::string_view window) {
+      auto &cp = checkpoints.front();
+      idx.checkpoint(cp.uncompressedOffset, cp.compressedOffset, cp.bitOffset,
+                     window);
+      checkpoints.pop_front();
+    }));
   };
 
-  emit([&](AuWriter &au) {
-    au.map(
-      "fileType", "zindex",
-      "version", Version,
-      "compressedFile", getBaseName(fileName),
-      "compressedSize", static_cast<uint64_t>(compressedStat.st_size),
-      "compressedModTime", static_cast<uint64_t>(compressedStat.st_mtime)
-    );
-  });
-
-  // actually build the index...
+  ReadAhead reader(from, ChunkSize);
   ZStream zs(ZStream::Type::ZlibOrGzip);
-  uint8_t input[ChunkSize];
-  uint8_t window[WindowSize];
+  std::vector<uint8_t> input;
+  uint8_t window[WindowSize] = {};
+  auto refill = [&]() {
+    writeCheckpoints(false);
+    input = reader.next();
+    zs.stream.avail_in = static_cast<uInt>(input.size());
+    zs.stream.next_in = input.data();
+    return !input.empty();
+  };
 
   int ret = 0;
   uint64_t totalIn = 0;
@@ -173,16 +348,9 @@ int zindexFile(const std::string &fileName,
   uint64_t last = 0;
   bool emitInitialAccessPoint = true;
 
-  do {
-    if (zs.stream.avail_in == 0) {
-      zs.stream.avail_in =
-        static_cast<uInt>(fread(input, 1, ChunkSize, from.get()));
-      if (ferror(from.get()))
-        throw ZlibError(Z_ERRNO);
-      if (zs.stream.avail_in == 0)
-        throw ZlibError(Z_DATA_ERROR);
-      zs.stream.next_in = input;
-    }
+  while (true) {
+    if (zs.stream.avail_in == 0)
+      refill();
     do {
       if (zs.stream.avail_out == 0) {
         zs.stream.avail_out = WindowSize;
@@ -193,7 +361,8 @@ int zindexFile(const std::string &fileName,
       ret = inflate(&zs.stream, Z_BLOCK);
       totalIn -= zs.stream.avail_in;
       totalOut -= zs.stream.avail_out;
-      if (ret == Z_NEED_DICT)
+      // no progress, with no more input: the file must be truncated
+      if (ret == Z_NEED_DICT || ret == Z_BUF_ERROR)
         throw ZlibError(Z_DATA_ERROR);
       if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
         throw ZlibError(ret);
@@ -205,65 +374,336 @@ int zindexFile(const std::string &fileName,
       bool endOfBlock = zs.stream.data_type & 0x80;
       bool lastBlockInStream = zs.stream.data_type & 0x40;
       if (endOfBlock && !lastBlockInStream && needsIndex) {
-        std::cout << "Creating checkpoint at " << totalOut <<
-          " (compressed offset " << totalIn << ")\n";
-        uint8_t apWindow[compressBound(WindowSize)];
-        auto size = makeWindow(apWindow, sizeof(apWindow), window,
-            zs.stream.avail_out);
-        auto windowStr =
-            std::string_view(reinterpret_cast<char *>(apWindow), size);
-        emit([&](AuWriter &au) {
-          au.map(
-            "uncompressedOffset", totalOut,
-            "compressedOffset", totalIn,
-            "bitOffset", zs.stream.data_type & 0x7,
-            "window", windowStr
-          );
-        });
+        if (log)
+          *log << "Creating checkpoint at " << totalOut <<
+            " (compressed offset " << totalIn << ")\n";
+        checkpoints.push_back(
+            Checkpoint{totalOut, totalIn, zs.stream.data_type & 0x7});
+        compressor.submit(unrollWindow(window, zs.stream.avail_out));
+        writeCheckpoints(false);
 
         last = totalOut;
         emitInitialAccessPoint = false;
       }
       //progress.update<PrettyBytes>(totalIn, compressedStat.st_size); TODO?
     } while (zs.stream.avail_in);
-  } while (ret != Z_STREAM_END);
-
-  if (zs.stream.avail_in || !feof(from.get())) {
-    std::cout << "\n"
-              << "WARNING: this file appears to contain multiple gzip blocks.\n"
-              << "This tool does not currently support such files!\n"
-              << "Data beyond the first block will not be indexed.\n\n";
+    if (ret != Z_STREAM_END) continue;
+
+    // that's the end of a gzip member. files written by au gzip, bgzip or
+    // pigz have more of them after it
+    if (zs.stream.avail_in == 0 && !refill()) break;
+    zs.reset();
+    if (totalOut - last > indexEvery) {
+      if (log)
+        *log << "Creating checkpoint at " << totalOut <<
+          " (start of gzip member at compressed offset " << totalIn << ")\n";
+      checkpoints.push_back(Checkpoint{totalOut, totalIn, 0});
+      compressor.submit({});
+      last = totalOut;
+    }
   }
+  writeCheckpoints(true);
 
   // TODO find a better way to record the total uncompressed size...
-  std::cout << "Writing final entry...\n";
-  emit([&](AuWriter &au) {
-    au.map(
-        "uncompressedOffset", totalOut,
-        "compressedOffset", totalIn,
-        "bitOffset", zs.stream.data_type & 0x7,
-        "window", ""
-    );
-  });
+  if (log) *log << "Writing final entry...\n";
+  idx.checkpoint(totalOut, totalIn, zs.stream.data_type & 0x7, "");
+  idx.finish();
+}
+
+}
+
+int zindexFile(const std::string &fileName,
+               const std::optional<std::string> &indexFilename,
+               size_t threads, size_t indexEvery) {
+
+  auto ifn = getIndexFilename(fileName, indexFilename);
+  std::cout << "Indexing " << fileName << " to " << ifn << "...\n";
+
+  // open gzipped file, or fail...
+  File from(fopen(fileName.c_str(), "rb"));
+  if (from.get() == nullptr) {
+      std::cerr << "Could not open " << fileName << " for reading\n";
+      return 1;
+  }
+
+  // open index file, or fail...
+  IndexWriter idx;
+  if (!idx.open(ifn)) return 1;
+  buildIndex(from.get(), fileName, idx, threads, indexEvery, &std::cout);
 
   std::cout << "Index complete.\n";
   return 0;
 }
 
-struct Zindex {
+int gzipFile(const std::string &fileName, const std::string &outputName,
+             const std::optional<std::string> &indexFilename,
+             size_t threads, int level) {
+  auto ifn = getIndexFilename(outputName, indexFilename);
+  std::cout << "Compressing " << fileName << " to " << outputName
+            << ", indexed in " << ifn << "...\n";
+
+  File from(fileName == "-" ? stdin : fopen(fileName.c_str(), "rb"));
+  if (from.get() == nullptr) {
+    std::cerr << "Could not open " << fileName << " for reading\n";
+    return 1;
+  }
+  // never overwrite an existing file, in case it's the only copy of something
+  File to(fopen(outputName.c_str(), "wbx"));
+  if (to.get() == nullptr) {
+    std::cerr << "Unable to open output " << outputName
+              << " (does it already exist?)\n";
+    return 1;
+  }
+
+  // each member starts a checkpoint. as its offset in the compressed file
+  // isn't known until the members before it are written, they're kept here
+  // until the index can be written after the file is complete.
+  struct Checkpoint {
+    uint64_t uncompressedOffset;
+    uint64_t compressedOffset;
+  };
+  std::vector<Checkpoint> checkpoints;
+  std::deque<uint64_t> memberStarts;
+  uint64_t totalIn = 0;
+  uint64_t totalOut = 0;
+  struct stat compressedStat;
+
+  // a partly written file would pass for the real thing until it was read
+  // to the end, so it's removed
+  try {
+    ParallelCompressor compressor(
+        std::max<size_t>(threads, 1),
+        [level](const std::vector<uint8_t> &data) {
+          return gzipMember(data, level);
+        });
+    auto writeMembers = [&](bool wait) {
+      while (compressor.collect(wait, [&](std::string_view member) {
+        checkpoints.push_back(Checkpoint{memberStarts.front(), totalOut});
+        memberStarts.pop_front();
+        if (::fwrite(member.data(), 1, member.size(), to.get())
+            != member.size())
+          THROW_RT("Error writing to " << outputName << ": "
+                   << strerror(errno));
+        totalOut += member.size();
+      }));
+    };
+
+    ReadAhead reader(from.get(), DefaultMemberSize);
+    while (true) {
+      auto data = reader.next();
+      // an empty file still gets one (empty) member, to be a valid gzip file
+      if (data.empty() && totalIn) break;
+      writeMembers(false);
+      memberStarts.push_back(totalIn);
+      totalIn += data.size();
+      auto isEmpty = data.empty();
+      compressor.submit(std::move(data));
+      if (isEmpty) break;
+    }
+    writeMembers(true);
+
+    if (fflush(to.get()) != 0)
+      THROW_RT("Error writing to " << outputName << ": " << strerror(errno));
+    if (fstat(fileno(to.get()), &compressedStat) != 0)
+      THROW_RT("Unable to get file stats for " << outputName << ": "
+               << strerror(errno));
+  } catch (...) {
+    to.reset();
+    ::unlink(outputName.c_str());
+    throw;
+  }
+
+  IndexWriter idx;
+  if (!idx.open(ifn)) return 1;
+  idx.metadata(outputName, compressedStat);
+  for (auto &cp : checkpoints)
+    idx.checkpoint(cp.uncompressedOffset, cp.compressedOffset, 0, "");
+  idx.checkpoint(totalIn, totalOut, 0, "");
+  idx.finish();
+
+  std::cout << "Wrote " << checkpoints.size() << " gzip members ("
+            << totalIn << " bytes compressed to " << totalOut << ").\n";
+  return 0;
+}
+
+/// The index of a gzipped file. A v2 index is mapped, and used in place: a
+/// checkpoint's window isn't touched until a seek needs it. One which was just
+/// built in memory is used in place too. A v1 (au encoded) index has to be
+/// read in full.
+class Zindex {
+public:
   struct IndexEntry {
     size_t compressedOffset = 0;
     size_t uncompressedOffset = 0;
     int bitOffset = 0;
-    std::vector<uint8_t> window;
+    std::string_view window; // compressed. empty at the start of a gzip member
   };
 
-  std::vector<IndexEntry> index_;
   std::string compressedFilename;
   size_t compressedSize = 0;
   size_t compressedModTime = 0;
 
-  Zindex(const std::string &filename) {
+private:
+  struct Unmapper {
+    size_t len;
+    void operator()(const char *data) const {
+      ::munmap(const_cast<char *>(data), len);
+    }
+  };
+
+  // v2
+  std::unique_ptr<const char, Unmapper> map_{nullptr, Unmapper{0}};
+  // instead of map_, for an index built in memory
+  std::unique_ptr<const std::string> memory_;
+  const char *data_ = nullptr; // the start of map_ or memory_
+  const char *table_ = nullptr;
+  size_t numEntries_ = 0;
+
+  // v1
+  struct V1Entry {
+    size_t compressedOffset;
+    size_t uncompressedOffset;
+    int bitOffset;
+    std::string window;
+  };
+  std::vector<V1Entry> v1Entries_;
+
+public:
+  explicit Zindex(const std::string &filename) {
+    if (!loadV2(filename)) loadV1(filename);
+    check(filename);
+  }
+
+  /// An index of the file described by name, built in memory by buildIndex().
+  Zindex(std::string contents, const std::string &name)
+      : memory_(std::make_unique<const std::string>(std::move(contents))) {
+    loadV2(memory_->data(), memory_->size(), name);
+    check(name);
+  }
+
+  size_t numEntries() const {
+    return data_ ? numEntries_ : v1Entries_.size();
+  }
+
+  IndexEntry entry(size_t idx) const {
+    if (!data_) {
+      auto &e = v1Entries_[idx];
+      return IndexEntry{e.compressedOffset, e.uncompressedOffset, e.bitOffset,
+                        e.window};
+    }
+    IndexTableEntry e;
+    memcpy(&e, table_ + idx * sizeof(e), sizeof(e));
+    return IndexEntry{e.compressedOffset, e.uncompressedOffset,
+                      static_cast<int>(e.bitOffset),
+                      std::string_view(data_ + e.windowOffset, e.windowSize)};
+  }
+
+  size_t uncompressedSize() const {
+    // total stream size is "start" of dummy final entry
+    return entry(numEntries() - 1).uncompressedOffset;
+  }
+
+  /// The number of entries which start at or before abspos.
+  size_t upperBound(size_t abspos) const {
+    size_t lo = 0;
+    size_t hi = numEntries();
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      if (abspos < entry(mid).uncompressedOffset)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return lo;
+  }
+
+  IndexEntry find(size_t abspos) const {
+    auto idx = upperBound(abspos);
+    if (idx == 0)
+      THROW_RT("Couldn't find index entry containing " << abspos);
+    return entry(idx - 1);
+  }
+
+private:
+  void check(const std::string &filename) const {
+    if (numEntries() == 0)
+      THROW_RT("Index " << filename <<  " should contain at least one entry!");
+
+    auto last = entry(numEntries() - 1);
+    if (!last.window.empty()) {
+      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
+               " has non-empty compression window data.");
+    }
+
+    if (last.compressedOffset != compressedSize) {
+      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
+               " has compressed offset " << last.compressedOffset
+               << " but metadata shows compressed size " << compressedSize);
+    }
+  }
+
+  /// @return false if filename isn't a v2 index
+  bool loadV2(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      THROW_RT("open: " << strerror(errno) << " (" << filename << ")");
+    struct stat stats;
+    char magic[sizeof(IndexMagic)];
+    if (::fstat(fd, &stats) != 0
+        || static_cast<size_t>(stats.st_size) < sizeof(IndexHeader)
+        || ::pread(fd, magic, sizeof(magic), 0)
+           != static_cast<ssize_t>(sizeof(magic))
+        || memcmp(magic, IndexMagic, sizeof(magic)) != 0) {
+      ::close(fd);
+      return false;
+    }
+    auto len = static_cast<size_t>(stats.st_size);
+    auto *data = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      THROW_RT("mmap: " << strerror(errno) << " (" << filename << ")");
+    map_ = std::unique_ptr<const char, Unmapper>(
+        static_cast<const char *>(data), Unmapper{len});
+    loadV2(map_.get(), len, filename);
+    return true;
+  }
+
+  void loadV2(const char *data, size_t len, const std::string &filename) {
+    if (len < sizeof(IndexHeader))
+      THROW_RT("Index " << filename << " is corrupt: it's too short for its"
+               " header.");
+    IndexHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != Version)
+      THROW_RT("Wrong version in index " << filename << ", expected version "
+               << Version);
+    if (header.tableOffset == 0)
+      THROW_RT("Index " << filename << " appears to be incomplete: it has no"
+               " table of entries.");
+    if (header.nameLength > len - sizeof(header)
+        || header.tableOffset > len
+        || header.numEntries > (len - header.tableOffset)
+                               / sizeof(IndexTableEntry))
+      THROW_RT("Index " << filename << " is corrupt: it's too short for its"
+               " header.");
+    compressedFilename = std::string(data + sizeof(header), header.nameLength);
+    compressedSize = header.compressedSize;
+    compressedModTime = header.compressedModTime;
+    data_ = data;
+    table_ = data + header.tableOffset;
+    numEntries_ = header.numEntries;
+
+    for (size_t i = 0; i < numEntries_; i++) {
+      IndexTableEntry e;
+      memcpy(&e, table_ + i * sizeof(e), sizeof(e));
+      if (e.windowOffset > header.tableOffset
+          || e.windowSize > header.tableOffset - e.windowOffset)
+        THROW_RT("Index " << filename << " is corrupt: entry " << i
+                 << " has a window outside the index.");
+    }
+  }
+
+  void loadV1(const std::string &filename) {
     FileByteSourceImpl source(filename);
     Dictionary dictionary;
 
@@ -294,61 +734,225 @@ struct Zindex {
       auto bitOffset = entry["bitOffset"].GetInt();
       auto window = std::string_view(entry["window"].GetString(),
           entry["window"].GetStringLength());
-      index_.emplace_back(IndexEntry {
+      v1Entries_.emplace_back(V1Entry {
         compressedOffset,
         uncompressedStartOffset,
         bitOffset,
-        std::vector<uint8_t>(window.begin(), window.end())
+        std::string(window)
       });
     }
+  }
+};
 
-    if (index_.empty())
-      THROW_RT("Index " << filename <<  " should contain at least one entry!");
+/// Sets zs up to inflate from the checkpoint at entry, i.e., positions file at
+/// the entry's compressed offset and primes zs with the leftover bits and the
+/// window of data before it. zs must be a raw stream.
+void startAt(ZStream &zs, FILE *file, const Zindex::IndexEntry &entry,
+             const uint8_t *window) {
+  auto compressedOffset = entry.compressedOffset;
+  auto bitOffset = entry.bitOffset;
+  size_t seekPos = bitOffset ? compressedOffset - 1 : compressedOffset;
+  auto err = ::fseek(file, static_cast<long>(seekPos), SEEK_SET);
+  if (err != 0)
+    THROW_RT("Error seeking in file"); // todo errno
+  zs.stream.avail_in = 0;
+  if (entry.window.empty()) {
+    // the checkpoint is at the start of a gzip member, which needs no window
+    zs.reset(ZStream::Type::ZlibOrGzip);
+    return;
+  }
 
-    const auto &last = index_.back();
-    if (!last.window.empty()) {
-      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
-               " has non-empty compression window data.");
-    }
+  if (bitOffset) {
+    auto ch = fgetc(file);
+    if (ch == -1)
+      throw ZlibError(ferror(file) ? Z_ERRNO : Z_DATA_ERROR);
+    X(inflatePrime(&zs.stream, bitOffset, ch >> (8 - bitOffset)));
+  }
+  X(inflateSetDictionary(&zs.stream, window, WindowSize));
+}
 
-    if (last.compressedOffset != compressedSize) {
-      THROW_RT("Index " << filename << " appears to be incomplete: Final entry"
-               " has compressed offset " << last.compressedOffset
-               << " but metadata shows compressed size " << compressedSize);
+void startAt(ZStream &zs, FILE *file, const Zindex::IndexEntry &entry) {
+  uint8_t window[WindowSize] = {};
+  if (!entry.window.empty())
+    uncompressWindow(entry.window, window, WindowSize);
+  startAt(zs, file, entry, window);
+}
+
+/// Inflates the stretches of an indexed file between checkpoints on worker
+/// threads, ahead of a reader working through them in order. Segment 0 runs
+/// from the start of the file to the first checkpoint, and segment k from
+/// checkpoint k-1 to checkpoint k. Each one can be inflated independently of
+/// the others: the first as an ordinary gzip stream, and the rest from the
+/// bit offset and window stored in the index. Segments are only as far apart
+/// as the index's checkpoints, which may be a long way, so what's inflated
+/// ahead is bounded by its size rather than by a number of segments.
+class SegmentInflater {
+public:
+  struct Segment {
+    size_t idx = 0;
+    size_t start = 0;
+    std::vector<uint8_t> data;
+    std::exception_ptr error;
+  };
+
+private:
+  const std::string fname_;
+  const Zindex &index_;
+  const size_t maxBytesAhead_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<size_t, Segment> ready_; // the reorder buffer
+  size_t claimed_;
+  size_t taken_;
+  size_t bytesAhead_ = 0; // the size of segments [taken_, claimed_)
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+
+public:
+  SegmentInflater(std::string fname, const Zindex &index, size_t first,
+                  size_t threads, size_t maxBytesAhead)
+      : fname_(std::move(fname)),
+        index_(index),
+        maxBytesAhead_(maxBytesAhead),
+        claimed_(first),
+        taken_(first) {
+    for (size_t i = 0; i < threads; i++)
+      workers_.emplace_back([this]() { work(); });
+  }
+
+  ~SegmentInflater() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
     }
+    cv_.notify_all();
+    for (auto &t : workers_) t.join();
   }
 
-  size_t numEntries() const { return index_.size(); }
+  SegmentInflater(const SegmentInflater &) = delete;
+  SegmentInflater &operator=(const SegmentInflater &) = delete;
 
-  size_t uncompressedSize() const {
-    // total stream size is "start" of dummy final entry
-    return index_.back().uncompressedOffset;
+  size_t numSegments() const { return index_.numEntries(); }
+
+  /// Where segment idx starts in the uncompressed stream.
+  size_t boundary(size_t idx) const {
+    return idx ? index_.entry(idx - 1).uncompressedOffset : 0;
+  }
+
+  size_t segmentSize(size_t idx) const {
+    return boundary(idx + 1) - boundary(idx);
   }
 
-  IndexEntry &find(size_t abspos) {
-    auto it = std::upper_bound(
-        index_.begin(), index_.end(), abspos,
-        [](size_t pos, const IndexEntry &entry) {
-          return pos < entry.uncompressedOffset;
+  /// The segment of index containing abspos (or the last one, if abspos is
+  /// the end of the stream).
+  static size_t segmentFor(const Zindex &index, size_t abspos) {
+    return std::min(index.upperBound(abspos), index.numEntries() - 1);
+  }
+
+  /// Whether segment idx has been (or is being) inflated, and hasn't been
+  /// taken yet.
+  bool isAhead(size_t idx) {
+    std::lock_guard lock(mutex_);
+    return idx >= taken_ && idx < claimed_;
+  }
+
+  /// Blocks until segment idx is inflated, and returns it. Segments must be
+  /// taken in order.
+  Segment take(size_t idx) {
+    std::unique_lock lock(mutex_);
+    assert(idx == taken_);
+    cv_.wait(lock, [&]() { return ready_.count(idx) != 0; });
+    auto segment = std::move(ready_.at(idx));
+    ready_.erase(idx);
+    taken_ = idx + 1;
+    bytesAhead_ -= segmentSize(idx);
+    lock.unlock();
+    cv_.notify_all();
+    if (segment.error) std::rethrow_exception(segment.error);
+    return segment;
+  }
+
+private:
+  void work() {
+    File file(fopen(fname_.c_str(), "rb"));
+    while (true) {
+      Segment segment;
+      {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [&]() {
+          return stop_ || claimed_ == numSegments() || claimed_ == taken_
+                 || bytesAhead_ + segmentSize(claimed_) <= maxBytesAhead_;
         });
-    if (it == index_.begin())
-      THROW_RT("Couldn't find index entry containing " << abspos);
-    --it;
-    return *it;
+        if (stop_ || claimed_ == numSegments()) return;
+        segment.idx = claimed_++;
+        bytesAhead_ += segmentSize(segment.idx);
+      }
+      try {
+        if (file.get() == nullptr)
+          THROW_RT("Could not open " << fname_ << " for reading");
+        inflate(file.get(), segment);
+      } catch (...) {
+        segment.error = std::current_exception();
+      }
+      {
+        std::lock_guard lock(mutex_);
+        ready_.emplace(segment.idx, std::move(segment));
+      }
+      cv_.notify_all();
+    }
+  }
+
+  void inflate(FILE *file, Segment &segment) const {
+    segment.start = boundary(segment.idx);
+    segment.data.resize(boundary(segment.idx + 1) - segment.start);
+
+    std::optional<ZStream> zs;
+    if (segment.idx == 0) {
+      zs.emplace(ZStream::Type::ZlibOrGzip);
+      if (::fseek(file, 0, SEEK_SET) != 0)
+        THROW_RT("Error seeking in file"); // todo errno
+    } else {
+      zs.emplace(ZStream::Type::Raw);
+      startAt(*zs, file, index_.entry(segment.idx - 1));
+    }
+
+    std::vector<uint8_t> input(ChunkSize);
+    auto &stream = zs->stream;
+    size_t done = 0;
+    while (done < segment.data.size()) {
+      zs->fill(file, input.data(), input.size());
+      stream.next_out = segment.data.data() + done;
+      stream.avail_out = static_cast<uInt>(
+          std::min<size_t>(segment.data.size() - done, ChunkSize));
+      auto availBefore = stream.avail_out;
+      auto ret = ::inflate(&stream, Z_NO_FLUSH);
+      if (ret == Z_NEED_DICT || ret == Z_BUF_ERROR)
+        throw ZlibError(Z_DATA_ERROR);
+      if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+        throw ZlibError(ret);
+      done += availBefore - stream.avail_out;
+      if (ret == Z_STREAM_END && done < segment.data.size()
+          && !zs->nextMember(file, input.data(), input.size()))
+        THROW_RT("Compressed data ended before the next index checkpoint");
+    }
   }
 };
 
 struct ZipByteSource::Impl {
   File compressed_;
   std::optional<Zindex> index_;
-  // based on the average block size, used to determine whether to seek forward
-  // by decompressing or seeking to a new block. also used to determine the size
-  // of the decompression lookback buffer to use after each seek
-  std::optional<size_t> blockSize_;
   std::unique_ptr<CachedContext> context_;
-  uint8_t input_[ChunkSize];
-  size_t outputSize_;
-  uint8_t *output_;
+  // contexts we've jumped away from, which a bisect often comes back to
+  LruList<std::unique_ptr<CachedContext>> contexts_{3};
+  // uncompressed windows of recently visited checkpoints, by compressedOffset
+  LruList<std::pair<size_t, std::unique_ptr<uint8_t[]>>> windows_{16};
+  std::string fname_;
+  std::optional<std::string> indexFname_;
+  // set by inflateAhead(). while it's set, reads come from segment_ rather
+  // than context_
+  std::unique_ptr<SegmentInflater> inflater_;
+  SegmentInflater::Segment segment_;
+  size_t segmentCur_ = 0;
 
   Impl(File &&file,
        const std::string &fname,
@@ -361,15 +965,9 @@ struct ZipByteSource::Impl {
           }
           return std::nullopt;
         }()),
-        blockSize_([&]() -> std::optional<size_t> {
-          if (index_.has_value()) {
-            return 2 * index_->uncompressedSize() / index_->numEntries();
-          }
-          return std::nullopt;
-        }()),
         context_(new CachedContext()),
-        outputSize_(blockSize_ ? *blockSize_ : ChunkSize * 4), // Chosen at random
-        output_(new uint8_t[outputSize_]) {
+        fname_(fname),
+        indexFname_(indexFname) {
     if (compressed_.get() == nullptr)
       THROW_RT("Could not open " << fname << " for reading");
 
@@ -403,25 +1001,87 @@ struct ZipByteSource::Impl {
     // quite ugly. find a cleaner way to upgrade a file byte source to a
     // ZipByteSource...
     auto len = static_cast<size_t>(source.limit_ - source.cur_);
-    if (len > sizeof(input_))
+    auto &input = context_->input_;
+    if (len > sizeof(input))
       THROW_RT("Initializing ZipByteStream from FileInputSream with too much"
-        " buffered data (" << len << " > " << sizeof(input_) << ")");
-    ::memcpy(input_, source.cur_, len);
+        " buffered data (" << len << " > " << sizeof(input) << ")");
+    ::memcpy(input, source.cur_, len);
     context_->zs_.stream.avail_in = static_cast<uint32_t>(len);
-    context_->zs_.stream.next_in = input_;
+    context_->zs_.stream.next_in = input;
+  }
+
+  void autoIndex(size_t threads, bool save) {
+    if (index_) return;
+    // a pass of our own, which leaves the stream we're reading alone
+    File file(fopen(fname_.c_str(), "rb"));
+    if (file.get() == nullptr)
+      THROW_RT("Could not open " << fname_ << " for reading");
+    IndexWriter idx;
+    buildIndex(file.get(), fname_, idx, threads, DefaultIndexEvery, nullptr);
+    auto contents = idx.contents();
+
+    if (save) {
+      // not being able to save the index is no reason not to use it
+      auto ifn = getIndexFilename(fname_, indexFname_);
+      File out(fopen(ifn.c_str(), "wbx"));
+      if (out.get() == nullptr
+          || ::fwrite(contents.data(), 1, contents.size(), out.get())
+             != contents.size()
+          || ::fflush(out.get()) != 0) {
+        std::cerr << "Unable to save index " << ifn << ": " << strerror(errno)
+                  << std::endl;
+        if (out.get()) ::unlink(ifn.c_str());
+      }
+    }
+
+    index_.emplace(std::move(contents), fname_);
   }
 
-  ~Impl() {
-    delete[] output_;
+  void inflateAhead(size_t threads, size_t maxBytesAhead) {
+    if (!index_ || threads < 2 || inflater_) return;
+    auto pos = context_->pos_;
+    auto idx = SegmentInflater::segmentFor(*index_, pos);
+    inflater_ = std::make_unique<SegmentInflater>(
+        fname_, *index_, idx, threads, maxBytesAhead);
+    segment_ = inflater_->take(idx);
+    segmentCur_ = pos - segment_.start;
+  }
+
+  size_t readAhead(char *buf, size_t len) {
+    while (segmentCur_ == segment_.data.size()) {
+      if (segment_.idx + 1 == inflater_->numSegments()) return 0;
+      segment_ = inflater_->take(segment_.idx + 1);
+      segmentCur_ = 0;
+    }
+    auto n = std::min(segment_.data.size() - segmentCur_, len);
+    ::memcpy(buf, segment_.data.data() + segmentCur_, n);
+    segmentCur_ += n;
+    return n;
+  }
+
+  /// Seeks among the inflated segments if abspos is in the current one or one
+  /// that's on its way. Otherwise, stops inflating ahead, and leaves a fresh
+  /// context at the start of the file for doSeek() to take it from there.
+  bool seekAhead(size_t abspos) {
+    auto idx = SegmentInflater::segmentFor(*index_, abspos);
+    if (idx == segment_.idx || inflater_->isAhead(idx)) {
+      while (segment_.idx < idx)
+        segment_ = inflater_->take(segment_.idx + 1);
+      segmentCur_ = abspos - segment_.start;
+      return true;
+    }
+    inflater_.reset();
+    segment_ = SegmentInflater::Segment();
+    context_.reset(new CachedContext());
+    if (::fseek(compressed_.get(), 0, SEEK_SET) != 0)
+      THROW_RT("Error seeking in file"); // todo errno
+    return false;
   }
 
   size_t doRead(char *buf, size_t len) {
-    auto &c = *context_;
-    if (c.cur_ == c.limit_) gzread();
-    auto n = std::min(c.limit_ - c.cur_, len);
-    ::memcpy(buf, output_+c.cur_, n);
-    c.cur_ += n;
-    c.pos_ += n;
+    if (inflater_) return readAhead(buf, len);
+    auto n = inflateTo(reinterpret_cast<uint8_t *>(buf), len);
+    context_->pos_ += n;
     return n;
   }
 
@@ -434,115 +1094,96 @@ struct ZipByteSource::Impl {
   }
 
   void doSeek(size_t abspos) {
-    auto &c = *context_;
-    if (!blockSize_) {
-      THROW_RT("blockSize_ is not set but trying to perform a seek");
-    }
     if (!index_) {
       THROW_RT("index_ is not set but trying to perform a seek");
     }
+    if (inflater_ && seekAhead(abspos)) return;
 
-    if (abspos < c.pos_ && c.pos_ - abspos <= c.cur_) {
-      // we're seeking backward within current buffer
-      auto relseek = c.pos_ - abspos;
-      c.cur_ -= relseek;
-      c.pos_ -= relseek;
-      return;
-    }
-
-    size_t bufRemaining = c.limit_ - c.cur_;
-    if (abspos > c.pos_ && abspos - c.pos_ <= bufRemaining) {
-      // we're seeking forward within current buffer
-      auto relseek = abspos - c.pos_;
-      c.cur_ += relseek;
-      c.pos_ += relseek;
-      return;
-    }
-
-    // now we're either seeking backward, or else forward beyond end of
-    // buffer. do we really need to seek? or can we just skip ahead some?
-    if (abspos < c.pos_ || abspos > *blockSize_ + bufRemaining) {
-      // we're either seeking backward beyond the start of output_,
-      // or far enough forward that it's better to jump instead of scan.
-      Zindex::IndexEntry &indexEntry = index_->find(abspos);
-      auto compressedOffset = indexEntry.compressedOffset;
-      auto uncompressedOffset = indexEntry.uncompressedOffset;
-      auto bitOffset = indexEntry.bitOffset;
-      context_.reset(new CachedContext(uncompressedOffset));
-      uint8_t window[WindowSize];
-      uncompressWindow(indexEntry.window, window, WindowSize);
-
-      size_t seekPos = bitOffset ? compressedOffset - 1 : compressedOffset;
-      auto err = ::fseek(compressed_.get(), static_cast<long>(seekPos),
-        SEEK_SET);
-      if (err != 0)
-        THROW_RT("Error seeking in file"); // todo errno
-      context_->zs_.stream.avail_in = 0;
-      if (bitOffset) {
-        auto ch = fgetc(compressed_.get());
-        if (ch == -1)
-          throw ZlibError(ferror(compressed_.get()) ?
-              Z_ERRNO : Z_DATA_ERROR);
-        X(inflatePrime(&context_->zs_.stream, bitOffset,
-          ch >> (8 - bitOffset)));
-      }
-      X(inflateSetDictionary(&context_->zs_.stream, &window[0], WindowSize));
-    }
+    // FileByteSource has already looked in its own buffer, so we have to go
+    // back to a checkpoint unless we're somewhere between the checkpoint and
+    // abspos, in which case we can just skip ahead.
+    auto indexEntry = index_->find(abspos);
+    if (abspos < context_->pos_
+        || context_->pos_ < indexEntry.uncompressedOffset)
+      jumpTo(abspos, indexEntry);
 
     if (abspos < context_->pos_)
       THROW_RT("Invariant abspos >= context_->pos_ doesn't hold: abspos = "
                    << abspos << ", context_->pos_ = " << context_->pos_);
-    char discardBuffer[WindowSize];
+    // the inflated bytes are thrown away, but zlib keeps the window it needs
+    // internally, so there's no need to copy them anywhere.
+    uint8_t scratch[WindowSize];
     auto numToSkip = abspos - context_->pos_;
     while (numToSkip) {
-      auto skipNow = std::min(WindowSize, numToSkip);
-      auto numRead = doRead(discardBuffer, skipNow);
-      if (numRead <= 0) THROW_RT("Unable to skip any bytes!");
-      numToSkip -= static_cast<size_t>(numRead);
+      auto numRead = inflateTo(scratch, std::min(WindowSize, numToSkip));
+      if (numRead == 0) THROW_RT("Unable to skip any bytes!");
+      context_->pos_ += numRead;
+      numToSkip -= numRead;
     }
   }
 
-  size_t gzread() {
-    if (context_->eof_) return 0;
+  /// Sets the current context aside and switches to one that can reach abspos
+  /// without going back further than the checkpoint at or before it: a cached
+  /// context if there's a suitable one, otherwise a new one started from that
+  /// checkpoint.
+  void jumpTo(size_t abspos, const Zindex::IndexEntry &indexEntry) {
+    auto usable = [&](const std::unique_ptr<CachedContext> &ctx) {
+      return ctx->pos_ <= abspos && ctx->pos_ >= indexEntry.uncompressedOffset;
+    };
+    auto file = compressed_.get();
+    context_->filePos_ = ::ftello(file);
+    auto cached = contexts_.take(usable);
+    if (cached) {
+      contexts_.add(std::move(context_));
+      context_ = std::move(*cached);
+      if (::fseeko(file, context_->filePos_, SEEK_SET) != 0)
+        THROW_RT("Error seeking in file"); // todo errno
+      return;
+    }
 
-    if (context_->cur_ != context_->limit_)
-      THROW_RT("Shouldn't call gzread() unless cur_ == limit_!");
+    contexts_.add(std::move(context_));
+    context_.reset(new CachedContext(indexEntry.uncompressedOffset));
+    startAt(context_->zs_, file, indexEntry, windowFor(indexEntry));
+  }
 
-    if (context_->cur_ == outputSize_) {
-      // buffer is full. we're only called when we're supposed to read
-      // something, so just clear it and continue...
-      context_->cur_ = context_->limit_ = 0;
-    }
+  const uint8_t *windowFor(const Zindex::IndexEntry &entry) {
+    if (entry.window.empty()) return nullptr;
+    auto key = entry.compressedOffset;
+    auto cached = windows_.find([key](const auto &w) { return w.first == key; });
+    if (cached) return cached->second.get();
+    std::unique_ptr<uint8_t[]> window(new uint8_t[WindowSize]);
+    uncompressWindow(entry.window, window.get(), WindowSize);
+    return windows_.add({key, std::move(window)}).second.get();
+  }
 
-    auto &zs = context_->zs_;
-    zs.stream.next_out = output_+context_->limit_;
-    zs.stream.avail_out = static_cast<uInt>(
-        std::min(outputSize_ - context_->limit_, ChunkSize)); // TODO ChunkSize or whatever...
+  /// Inflates up to len bytes into out, stopping early only at the end of the
+  /// stream. Doesn't update the context's position.
+  size_t inflateTo(uint8_t *out, size_t len) {
+    auto &c = *context_;
+    if (c.eof_) return 0;
+
+    auto &zs = c.zs_;
+    zs.stream.next_out = out;
+    zs.stream.avail_out = static_cast<uInt>(std::min<size_t>(len, UINT_MAX));
     size_t total = 0;
     do {
-      if (zs.stream.avail_in == 0) {
-        zs.stream.avail_in = static_cast<uInt>(
-          ::fread(input_, 1, sizeof(input_), compressed_.get()));
-        if (ferror(compressed_.get())) throw ZlibError(Z_ERRNO);
-        zs.stream.next_in = input_;
-      }
+      zs.fill(compressed_.get(), c.input_, sizeof(c.input_));
       auto availBefore = zs.stream.avail_out;
       auto ret = inflate(&zs.stream, Z_NO_FLUSH);
-      if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+      // no progress, with no more input: the file must be truncated
+      if (ret == Z_NEED_DICT || ret == Z_BUF_ERROR)
+        throw ZlibError(Z_DATA_ERROR);
       if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
         throw ZlibError(ret);
-      auto numUncompressed = availBefore - zs.stream.avail_out;
-      context_->limit_ += numUncompressed;
-      total += numUncompressed;
+      total += availBefore - zs.stream.avail_out;
       if (ret == Z_STREAM_END) {
-        // this is the end of the first gzip block. we don't currently
-        // support multiple blocks... it's hard for us to detect here whether
-        // there are multiple blocks or not, because in the presence of the
-        // gzip framing data, the underlying file might not actually be at
-        // eof. so we don't bother to detect or warn. they will have gotten
-        // the warning when the built the index, at least.
-        context_->eof_ = true;
-        break;
+        // this is the end of a gzip member. there may be more after it (au
+        // gzip, bgzip and pigz all write several), in which case we carry on
+        // with the next one.
+        if (!zs.nextMember(compressed_.get(), c.input_, sizeof(c.input_))) {
+          c.eof_ = true;
+          break;
+        }
       }
     } while (zs.stream.avail_out);
     return total;
@@ -577,4 +1218,12 @@ void ZipByteSource::doSeek(size_t abspos) {
   return impl_->doSeek(abspos);
 }
 
+void ZipByteSource::autoIndex(size_t threads, bool save) {
+  impl_->autoIndex(threads, save);
+}
+
+void ZipByteSource::inflateAhead(size_t threads, size_t maxBytesAhead) {
+  impl_->inflateAhead(threads, maxBytesAhead);
+}
+
 }
@@ -10,10 +10,31 @@ namespace au {
 
 class FileByteSourceImpl;
 
+/// The default distance between checkpoints in the uncompressed data.
+constexpr size_t DefaultIndexEvery = 8 * 1024 * 1024u;
+
+/// Builds an index for the gzipped fileName, with a checkpoint roughly every
+/// indexEvery bytes of uncompressed data. Input is read ahead on a thread of
+/// its own, and the windows stored at checkpoints are compressed on threads
+/// worker threads.
 int zindexFile(const std::string &fileName,
-               const std::optional<std::string> &indexFilename);
+               const std::optional<std::string> &indexFilename,
+               size_t threads = 1,
+               size_t indexEvery = DefaultIndexEvery);
+
+/// The default bound on how much ZipByteSource::inflateAhead() inflates
+/// before it's read.
+constexpr size_t DefaultInflateAheadBytes = 64 * 1024 * 1024u;
 
-class ZipByteSource : public FileByteSource {
+/// Compresses fileName into outputName as a series of independent gzip
+/// members, compressed in parallel on threads worker threads, and writes an
+/// index with a checkpoint at the start of each member. No second pass over
+/// the compressed file is needed to index it.
+int gzipFile(const std::string &fileName, const std::string &outputName,
+             const std::optional<std::string> &indexFilename,
+             size_t threads = 1, int level = 6);
+
+class ZipByteSource final : public FileByteSource {
   struct Impl;
   std::unique_ptr<Impl> impl_;
 public:
@@ -24,6 +45,28 @@ public:
   ~ZipByteSource() override;
 
   bool isSeekable() const override;
+
+  /// If the file isn't indexed, inflates all of it once (on threads worker
+  /// threads, as zindexFile() does) to build an index in memory, after which
+  /// it's seekable. If save is set, the index is also written wherever the
+  /// constructor would have looked for it, ready for next time.
+  void autoIndex(size_t threads, bool save);
+
+  /// If the file is indexed, inflates the stretches between index checkpoints
+  /// on threads worker threads from here on, ahead of sequential reads, with
+  /// no more than maxBytesAhead of them waiting to be read (besides the one
+  /// being read, and at least one more, however big). Seeking to anywhere
+  /// that isn't already inflated (or on its way) goes back to inflating
+  /// serially.
+  void inflateAhead(size_t threads,
+                    size_t maxBytesAhead = DefaultInflateAheadBytes);
+
+  using FileByteSource::readFunc;
+  template <typename F>
+  void readFunc(size_t len, F &&func) {
+    readBuffered(len, std::forward<F>(func));
+  }
+
   size_t doRead(char *buf, size_t len) override;
   size_t endPos() const override;
   void doSeek(size_t abspos) override;
@@ -1,6 +1,8 @@
 #include "TclapHelper.h"
 #include "Zindex.h"
 
+#include <thread>
+
 namespace au {
 
 namespace {
@@ -13,7 +15,12 @@ void usage() {
       << " <path> may be \"-\" for stdin, in which case index is written to stdin.auzx.\n"
       << "\n"
       << "  -h --help          show usage and exit\n"
-      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.auzx)\n";
+      << "  -x --index <path>  write index to <path> (defaults to inputpath.au.auzx)\n"
+      << "  -j --threads <num> compress index windows on <num> threads (defaults to\n"
+      << "                     the number of cores)\n"
+      << "  -e --every <bytes> checkpoint every <bytes> of uncompressed data\n"
+      << "                     (default " << DefaultIndexEvery << "). more\n"
+      << "                     checkpoints make seeks cheaper, and the index bigger\n";
 
 }
 
@@ -26,14 +33,25 @@ int zindex(int argc, const char * const *argv) {
       "path", "", true, "", "path", tclap.cmd());
   TCLAP::ValueArg<std::string> index(
       "x", "index", "index", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
+  TCLAP::ValueArg<size_t> every(
+      "e", "every", "every", false, DefaultIndexEvery, "size_t", tclap.cmd());
 
   if (!tclap.parse(argc, argv)) return 1;
 
+  if (every.getValue() == 0) {
+    std::cerr << "Checkpoint interval (-e) must be positive\n";
+    return 1;
+  }
+
   std::optional<std::string> indexFile;
   if (index.isSet()) indexFile = index.getValue();
 
   // TODO support stdin
-  return zindexFile(path.getValue(), indexFile);
+  return zindexFile(path.getValue(), indexFile, threads.getValue(),
+                    every.getValue());
 }
 
 }
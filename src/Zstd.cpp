@@ -0,0 +1,378 @@
+#include "au/ParseError.h"
+#include "ParallelCompressor.h"
+#include "Zstd.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <vector>
+#include <unistd.h>
+
+// the seekable format is described in the zstd sources, in
+// contrib/seekable_format/zstd_seekable_compression_format.md
+
+namespace au {
+
+namespace {
+
+constexpr uint32_t SkippableMagic = 0x184D2A5Eu;
+constexpr uint32_t SeekableMagic = 0x8F92EAB1u;
+constexpr size_t SkippableHeaderSize = 8;
+constexpr size_t FooterSize = 9;
+constexpr uint8_t ChecksumFlag = 0x80;
+constexpr uint32_t MaxFrames = 0x8000000u;
+// how much au zstd puts in each frame. a seek has to decompress (up to) a
+// whole frame to get where it's going
+constexpr size_t DefaultFrameSize = 1024 * 1024u;
+
+struct ZstdError : std::runtime_error {
+  explicit ZstdError(size_t code)
+  : std::runtime_error(std::string("Error from zstd: ")
+                       + ZSTD_getErrorName(code)) {}
+};
+
+size_t Z(size_t code) {
+  if (ZSTD_isError(code)) throw ZstdError(code);
+  return code;
+}
+
+uint32_t readLE32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0])
+         | static_cast<uint32_t>(p[1]) << 8
+         | static_cast<uint32_t>(p[2]) << 16
+         | static_cast<uint32_t>(p[3]) << 24;
+}
+
+void writeLE32(std::string &out, uint32_t val) {
+  for (int i = 0; i < 4; i++) {
+    out.push_back(static_cast<char>(val & 0xff));
+    val >>= 8;
+  }
+}
+
+struct DCtxFreer {
+  void operator()(ZSTD_DCtx *dctx) { ZSTD_freeDCtx(dctx); }
+};
+
+using DCtx = std::unique_ptr<ZSTD_DCtx, DCtxFreer>;
+
+std::string compressFrame(const std::vector<uint8_t> &data, int level) {
+  std::string result(ZSTD_compressBound(data.size()), '\0');
+  result.resize(Z(ZSTD_compress(result.data(), result.size(),
+                                data.data(), data.size(), level)));
+  return result;
+}
+
+/// Where each frame of a file in the seekable format starts, from the seek
+/// table at the end of the file.
+struct SeekTable {
+  struct Frame {
+    size_t compressedOffset;
+    size_t uncompressedOffset;
+  };
+  // one per frame, plus a final one marking the end of the data
+  std::vector<Frame> frames;
+
+  size_t numFrames() const { return frames.size() - 1; }
+  size_t uncompressedSize() const { return frames.back().uncompressedOffset; }
+
+  /// The frame containing abspos, or numFrames() if abspos is at the end.
+  size_t frameFor(size_t abspos) const {
+    auto it = std::upper_bound(
+        frames.begin(), frames.end(), abspos,
+        [](size_t pos, const Frame &frame) {
+          return pos < frame.uncompressedOffset;
+        });
+    if (it == frames.end()) return numFrames();
+    return static_cast<size_t>(it - frames.begin()) - 1;
+  }
+
+  /// Reads the seek table from the end of file, if it has one. Leaves file
+  /// positioned anywhere.
+  static std::optional<SeekTable> read(FILE *file) {
+    uint8_t footer[FooterSize];
+    if (::fseeko(file, -static_cast<off_t>(FooterSize), SEEK_END) != 0
+        || ::fread(footer, 1, FooterSize, file) != FooterSize
+        || readLE32(footer + 5) != SeekableMagic)
+      return std::nullopt;
+    auto fileSize = static_cast<size_t>(::ftello(file));
+
+    auto numFrames = readLE32(footer);
+    size_t entrySize = footer[4] & ChecksumFlag ? 12 : 8;
+    if (numFrames > MaxFrames)
+      THROW_RT("Corrupt zstd seek table: too many frames");
+    size_t tableSize = numFrames * entrySize + FooterSize;
+    if (tableSize + SkippableHeaderSize > fileSize)
+      THROW_RT("Corrupt zstd seek table: bigger than the file");
+
+    std::vector<uint8_t> table(SkippableHeaderSize + tableSize);
+    if (::fseeko(file, -static_cast<off_t>(table.size()), SEEK_END) != 0)
+      THROW_RT("Unable to seek to zstd seek table: " << strerror(errno));
+    if (::fread(table.data(), 1, table.size(), file) != table.size())
+      THROW_RT("Unable to read zstd seek table: "
+               << (ferror(file) ? strerror(errno) : "unexpected eof"));
+    if (readLE32(&table[0]) != SkippableMagic
+        || readLE32(&table[4]) != tableSize)
+      THROW_RT("Corrupt zstd seek table: bad skippable frame header");
+
+    SeekTable result;
+    result.frames.reserve(numFrames + 1);
+    Frame frame{0, 0};
+    for (size_t i = 0; i < numFrames; i++) {
+      auto *entry = &table[SkippableHeaderSize + i * entrySize];
+      result.frames.push_back(frame);
+      frame.compressedOffset += readLE32(entry);
+      frame.uncompressedOffset += readLE32(entry + 4);
+    }
+    result.frames.push_back(frame);
+    if (frame.compressedOffset + table.size() != fileSize)
+      THROW_RT("Corrupt zstd seek table: frame sizes don't add up to the "
+               "file size");
+    return result;
+  }
+};
+
+}
+
+struct ZstdByteSource::Impl {
+  File file_;
+  std::string fname_;
+  std::optional<SeekTable> table_;
+  DCtx dctx_;
+
+  // with a seek table, whole frames are decompressed into frameData_
+  std::vector<char> frameData_;
+  std::optional<size_t> loaded_; // the frame in frameData_
+  size_t frameCur_ = 0;
+  size_t next_ = 0; // the frame to read once frameData_ is used up
+  std::vector<char> compressed_;
+
+  // otherwise, it's streamed through input_
+  std::vector<uint8_t> input_;
+  ZSTD_inBuffer in_{nullptr, 0, 0};
+  bool frameDone_ = true;
+
+  Impl(File &&file, const std::string &fname, std::string_view buffered)
+      : file_(std::move(file)),
+        fname_(fname),
+        dctx_(ZSTD_createDCtx()) {
+    if (file_.get() == nullptr)
+      THROW_RT("Could not open " << fname << " for reading");
+    if (!dctx_)
+      THROW_RT("Unable to create zstd decompression context");
+
+    auto here = ::ftello(file_.get());
+    if (here >= 0) {
+      table_ = SeekTable::read(file_.get());
+      if (::fseeko(file_.get(), here, SEEK_SET) != 0)
+        THROW_RT("Error seeking in file"); // todo errno
+    }
+    if (table_) return;
+
+    // we may have been handed a stream that's already been read from, in
+    // which case what was read is where we start
+    input_.resize(std::max(buffered.size(), ZSTD_DStreamInSize()));
+    ::memcpy(input_.data(), buffered.data(), buffered.size());
+    in_ = ZSTD_inBuffer{input_.data(), buffered.size(), 0};
+  }
+
+  bool isSeekable() const {
+    return table_.has_value();
+  }
+
+  size_t endPos() const {
+    if (!table_)
+      THROW_RT("Size of " << fname_ << " is unknown without a zstd seek table");
+    return table_->uncompressedSize();
+  }
+
+  size_t doRead(char *buf, size_t len) {
+    if (!table_) return readStream(buf, len);
+    while (frameCur_ == frameData_.size()) {
+      if (next_ == table_->numFrames()) return 0;
+      load(next_++);
+      frameCur_ = 0;
+    }
+    auto n = std::min(frameData_.size() - frameCur_, len);
+    ::memcpy(buf, frameData_.data() + frameCur_, n);
+    frameCur_ += n;
+    return n;
+  }
+
+  void doSeek(size_t abspos) {
+    if (!table_)
+      THROW_RT("Trying to seek in " << fname_ << ", which has no zstd seek "
+               "table");
+    if (abspos > table_->uncompressedSize())
+      THROW_RT("Seek to " << abspos << " beyond the end of " << fname_);
+    auto idx = table_->frameFor(abspos);
+    if (idx == table_->numFrames()) {
+      frameCur_ = frameData_.size();
+      next_ = idx;
+      return;
+    }
+    if (loaded_ != idx) load(idx);
+    frameCur_ = abspos - table_->frames[idx].uncompressedOffset;
+    next_ = idx + 1;
+  }
+
+private:
+  void load(size_t idx) {
+    auto &frame = table_->frames[idx];
+    auto &end = table_->frames[idx + 1];
+    compressed_.resize(end.compressedOffset - frame.compressedOffset);
+    if (::fseeko(file_.get(), static_cast<off_t>(frame.compressedOffset),
+                 SEEK_SET) != 0)
+      THROW_RT("Error seeking in file"); // todo errno
+    if (::fread(compressed_.data(), 1, compressed_.size(), file_.get())
+        != compressed_.size())
+      THROW_RT("Unable to read zstd frame " << idx << " of " << fname_);
+    frameData_.resize(end.uncompressedOffset - frame.uncompressedOffset);
+    auto size = Z(ZSTD_decompressDCtx(dctx_.get(),
+                                      frameData_.data(), frameData_.size(),
+                                      compressed_.data(), compressed_.size()));
+    if (size != frameData_.size())
+      THROW_RT("zstd frame " << idx << " of " << fname_ << " doesn't match "
+               "its size in the seek table");
+    loaded_ = idx;
+  }
+
+  size_t readStream(char *buf, size_t len) {
+    ZSTD_outBuffer out{buf, len, 0};
+    // skippable frames, like a seek table, produce no output at all
+    while (out.pos == 0) {
+      if (in_.pos == in_.size) {
+        in_.size = ::fread(input_.data(), 1, input_.size(), file_.get());
+        in_.pos = 0;
+        if (ferror(file_.get()))
+          THROW_RT("Error reading " << fname_ << ": " << strerror(errno));
+        if (in_.size == 0) {
+          if (!frameDone_)
+            THROW_RT("zstd data in " << fname_ << " is truncated");
+          return 0;
+        }
+      }
+      frameDone_ = Z(ZSTD_decompressStream(dctx_.get(), &out, &in_)) == 0;
+    }
+    return out.pos;
+  }
+};
+
+ZstdByteSource::ZstdByteSource(const std::string &fname)
+: FileByteSource(fname),
+  impl_(std::make_unique<Impl>(File(fopen(fname.c_str(), "rb")), fname,
+                               std::string_view())) {}
+
+ZstdByteSource::ZstdByteSource(FileByteSourceImpl &source)
+: FileByteSource(source.name()),
+  impl_(std::make_unique<Impl>(
+      std::move(source.file_), source.name(),
+      std::string_view(source.cur_,
+                       static_cast<size_t>(source.limit_ - source.cur_)))) {}
+
+ZstdByteSource::~ZstdByteSource() {}
+
+bool ZstdByteSource::isSeekable() const {
+  return impl_->isSeekable();
+}
+
+size_t ZstdByteSource::doRead(char *buf, size_t len) {
+  return impl_->doRead(buf, len);
+}
+
+size_t ZstdByteSource::endPos() const {
+  return impl_->endPos();
+}
+
+void ZstdByteSource::doSeek(size_t abspos) {
+  return impl_->doSeek(abspos);
+}
+
+int zstdFile(const std::string &fileName, const std::string &outputName,
+             size_t threads, int level) {
+  std::cout << "Compressing " << fileName << " to " << outputName << "...\n";
+
+  File from(fileName == "-" ? stdin : fopen(fileName.c_str(), "rb"));
+  if (from.get() == nullptr) {
+    std::cerr << "Could not open " << fileName << " for reading\n";
+    return 1;
+  }
+  // never overwrite an existing file, in case it's the only copy of something
+  File to(fopen(outputName.c_str(), "wbx"));
+  if (to.get() == nullptr) {
+    std::cerr << "Unable to open output " << outputName
+              << " (does it already exist?)\n";
+    return 1;
+  }
+  auto write = [&](std::string_view data) {
+    if (::fwrite(data.data(), 1, data.size(), to.get()) != data.size())
+      THROW_RT("Error writing to " << outputName << ": " << strerror(errno));
+  };
+
+  // the seek table entries, in the order the frames are written
+  std::string entries;
+  std::deque<uint32_t> frameSizes;
+  uint32_t numFrames = 0;
+  uint64_t totalIn = 0;
+  uint64_t totalOut = 0;
+
+  // a partly written file would pass for the real thing until it was read
+  // to the end, so it's removed
+  try {
+    ParallelCompressor compressor(
+        std::max<size_t>(threads, 1),
+        [level](const std::vector<uint8_t> &data) {
+          return compressFrame(data, level);
+        });
+    auto writeFrames = [&](bool wait) {
+      while (compressor.collect(wait, [&](std::string_view frame) {
+        write(frame);
+        writeLE32(entries, static_cast<uint32_t>(frame.size()));
+        writeLE32(entries, frameSizes.front());
+        frameSizes.pop_front();
+        numFrames++;
+        totalOut += frame.size();
+      }));
+    };
+
+    ReadAhead reader(from.get(), DefaultFrameSize);
+    while (true) {
+      auto data = reader.next();
+      // an empty file still gets one (empty) frame, to start with zstd's magic
+      if (data.empty() && totalIn) break;
+      writeFrames(false);
+      frameSizes.push_back(static_cast<uint32_t>(data.size()));
+      totalIn += data.size();
+      auto isEmpty = data.empty();
+      compressor.submit(std::move(data));
+      if (isEmpty) break;
+    }
+    writeFrames(true);
+
+    std::string table;
+    writeLE32(table, SkippableMagic);
+    writeLE32(table, static_cast<uint32_t>(entries.size() + FooterSize));
+    table += entries;
+    writeLE32(table, numFrames);
+    table.push_back(0); // no checksums
+    writeLE32(table, SeekableMagic);
+    write(table);
+    if (fflush(to.get()) != 0)
+      THROW_RT("Error writing to " << outputName << ": " << strerror(errno));
+  } catch (...) {
+    to.reset();
+    ::unlink(outputName.c_str());
+    throw;
+  }
+
+  std::cout << "Wrote " << numFrames << " zstd frames (" << totalIn
+            << " bytes compressed to " << totalOut << ").\n";
+  return 0;
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "au/FileByteSource.h"
+
+#include <memory>
+#include <string>
+
+namespace au {
+
+class FileByteSourceImpl;
+
+/// Compresses fileName into outputName in the zstd seekable format: a series
+/// of independent frames, compressed on threads worker threads, followed by a
+/// seek table of their sizes in a skippable frame. The zstd tool decompresses
+/// the result as usual, and ZstdByteSource can seek in it without an index.
+int zstdFile(const std::string &fileName, const std::string &outputName,
+             size_t threads = 1, int level = 3);
+
+/// Reads a zstd compressed file. A file in the seekable format (see zstdFile)
+/// is seekable, by decompressing just the frame containing the new position.
+/// Anything else is decompressed as a stream.
+class ZstdByteSource final : public FileByteSource {
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+public:
+  explicit ZstdByteSource(const std::string &fname);
+  explicit ZstdByteSource(FileByteSourceImpl &source);
+  ~ZstdByteSource() override;
+
+  bool isSeekable() const override;
+
+  using FileByteSource::readFunc;
+  template <typename F>
+  void readFunc(size_t len, F &&func) {
+    readBuffered(len, std::forward<F>(func));
+  }
+
+  size_t doRead(char *buf, size_t len) override;
+  size_t endPos() const override;
+  void doSeek(size_t abspos) override;
+};
+
+}
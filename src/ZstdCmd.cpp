@@ -0,0 +1,62 @@
+#include "TclapHelper.h"
+#include "Zstd.h"
+
+#include <thread>
+
+namespace au {
+
+namespace {
+
+void usage() {
+  std::cout
+      << "usage: au zstd [options] [--] <path>\n"
+      << "\n"
+      << " Compresses an au or json file on several threads into independent zstd\n"
+      << " frames, followed by a table of where they are. The result can be read\n"
+      << " by zstd, and searched with grep -o without any separate index. <path>\n"
+      << " is left in place.\n"
+      << " <path> may be \"-\" for stdin, in which case -o must be given.\n"
+      << "\n"
+      << "  -h --help           show usage and exit\n"
+      << "  -o --output <path>  write to <path> (defaults to inputpath.zst). Existing\n"
+      << "                      files are never overwritten\n"
+      << "  -j --threads <num>  compress on <num> threads (defaults to the number of\n"
+      << "                      cores)\n"
+      << "  -l --level <num>    compression level, 1-19 (default 3)\n";
+}
+
+}
+
+int zstd(int argc, const char * const *argv) {
+  TclapHelper tclap(usage);
+
+  TCLAP::UnlabeledValueArg<std::string> path(
+      "path", "", true, "", "path", tclap.cmd());
+  TCLAP::ValueArg<std::string> output(
+      "o", "output", "output", false, "", "string", tclap.cmd());
+  TCLAP::ValueArg<size_t> threads(
+      "j", "threads", "threads", false, std::thread::hardware_concurrency(),
+      "size_t", tclap.cmd());
+  TCLAP::ValueArg<int> level(
+      "l", "level", "level", false, 3, "int", tclap.cmd());
+
+  if (!tclap.parse(argc, argv)) return 1;
+
+  if (level.getValue() < 1 || level.getValue() > 19) {
+    std::cerr << "Compression level must be between 1 and 19\n";
+    return 1;
+  }
+
+  std::string outputFile = path.getValue() + ".zst";
+  if (output.isSet()) {
+    outputFile = output.getValue();
+  } else if (path.getValue() == "-") {
+    std::cerr << "Output path (-o) is required when compressing stdin\n";
+    return 1;
+  }
+
+  return zstdFile(path.getValue(), outputFile, threads.getValue(),
+                  level.getValue());
+}
+
+}
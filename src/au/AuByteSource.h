@@ -80,6 +80,8 @@ public:
 
   using Fn = std::function<void(std::string_view)>;
   /// Call func with the next len bytes from the underlying byte source.
+  /// Concrete sources also provide a template overload taking any callable,
+  /// which the parsers use when they know the concrete type of the source.
   virtual void readFunc(size_t len, Fn &&func) = 0;
 
   virtual void setPin(size_t abspos) = 0;
@@ -91,6 +93,11 @@ public:
 
   virtual void skip(size_t len) = 0;
 
+  /// The bytes starting at pos() which are already in memory, and so can be
+  /// examined without reading from the underlying stream. This may be empty
+  /// (or short) at any time, so callers must be able to fall back to next().
+  virtual std::string_view buffered() const { return {}; }
+
   /// Seek to length bytes from the end of the stream
   void tail(size_t length) {
     auto end = endPos();
@@ -2,8 +2,10 @@
 
 #include "au/AuCommon.h"
 #include "au/AuByteSource.h"
+#include "au/BlockSummary.h"
 #include "au/Handlers.h"
 #include "au/ParseError.h"
+#include "au/Varint.h"
 
 #include <cassert>
 #include <cstdint>
@@ -13,6 +15,7 @@
 #include <iomanip>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <cstddef>
 #include <chrono>
@@ -42,15 +45,30 @@ public:
   const std::string &str() const { return str_; }
 };
 
+/// The parsers are templated on the type of the byte source. Instantiating
+/// them with a concrete (final) source type lets the compiler devirtualize and
+/// inline the per-byte calls to next() and peek(), and pass string fragments
+/// to a lambda rather than through a std::function. The default of
+/// AuByteSource gives the original, virtual interface for embedders.
+template <typename Source = AuByteSource>
 class BaseParser {
 protected:
   static constexpr int AU_FORMAT_VERSION = FormatVersion1::AU_FORMAT_VERSION;
 
-  AuByteSource &source_;
+  Source &source_;
 
-  explicit BaseParser(AuByteSource &source)
+  explicit BaseParser(Source &source)
       : source_(source) {}
 
+  template<typename T>
+  void read(T *t, size_t len) const {
+    char *buf = static_cast<char *>(static_cast<void *>(t));
+    source_.readFunc(len, [&](std::string_view fragment) {
+      ::memcpy(buf, fragment.data(), fragment.size());
+      buf += fragment.size();
+    });
+  }
+
   void expect(char e) const {
     auto c = source_.next();
     if (c == e) return;
@@ -59,25 +77,35 @@ protected:
 
   uint32_t readBackref() const {
     uint32_t val;
-    source_.read<uint32_t>(&val, sizeof(val));
+    read(&val, sizeof(val));
     return val;
   }
 
   double readDouble() const {
     double val;
     static_assert(sizeof(val) == 8, "sizeof(double) must be 8");
-    source_.read(&val, sizeof(val));
+    read(&val, sizeof(val));
     return val;
   }
 
   time_point readTime() const {
     uint64_t nanos;
-    source_.read(&nanos, sizeof(nanos));
+    read(&nanos, sizeof(nanos));
     std::chrono::nanoseconds n(nanos);
     return time_point() + n;
   }
 
   uint64_t readVarint() const {
+    // nearly every varint is read from the middle of a buffer, where we can
+    // decode it in place. fall back to a byte at a time near the end.
+    if (auto buf = source_.buffered(); buf.size() >= varint::MAX_LEN) {
+      uint64_t result;
+      auto len = varint::decode(buf.data(), result);
+      if (!len) AU_THROW("Bad varint encoding");
+      source_.skip(len);
+      return result;
+    }
+
     auto shift = 0u;
     uint64_t result = 0;
     while (true) {
@@ -157,8 +185,17 @@ struct TooDeeplyNested : std::runtime_error {
   TooDeeplyNested() : runtime_error("File too deeply nested") {}
 };
 
-template<typename Handler>
-class ValueParser : BaseParser {
+template<typename Handler, typename Source = AuByteSource>
+class ValueParser : BaseParser<Source> {
+  using Base = BaseParser<Source>;
+  using Base::source_;
+  using Base::expect;
+  using Base::parseString;
+  using Base::readDouble;
+  using Base::readTime;
+  using Base::readVarint;
+  using Base::read;
+
   Handler &handler_;
   /** A positive value that when multiplied by -1 represents the most negative
   number we support (std::numeric_limits<int64_t>::min() * -1). */
@@ -181,8 +218,8 @@ class ValueParser : BaseParser {
   };
 
 public:
-  ValueParser(AuByteSource &source, Handler &handler)
-      : BaseParser(source), handler_(handler) {}
+  ValueParser(Source &source, Handler &handler)
+      : Base(source), handler_(handler) {}
 
   void value() const {
     size_t sov = source_.pos();
@@ -231,13 +268,13 @@ public:
       }
       case marker::PosInt64: {
         uint64_t val;
-        source_.read(&val, sizeof(val));
+        read(&val, sizeof(val));
         handler_.onUint(sov, val);
         break;
       }
       case marker::NegInt64: {
         uint64_t val;
-        source_.read(&val, sizeof(val));
+        read(&val, sizeof(val));
         if (val > NEG_INT_LIMIT) {
           AU_THROW("Signed int overflows int64_t: (-)" << val << " 0x"
                 << std::setfill('0') << std::setw(16) << std::hex << val);
@@ -315,13 +352,35 @@ private:
   }
 };
 
-template<typename Handler>
-class RecordParser : BaseParser {
+/// Record handlers may provide
+///   bool skipBlock(const BlockSummary &)
+/// which is offered each summary record. If it returns true, the records of
+/// the block are skipped (all but dictionary records, which are still handed
+/// to the handler) and the block counts as a single value record.
+template <typename H, typename = void>
+struct CanSkipBlocks : std::false_type {};
+template <typename H>
+struct CanSkipBlocks<H, std::void_t<decltype(std::declval<H &>().skipBlock(
+    std::declval<const BlockSummary &>()))>>
+    : std::true_type {};
+
+template<typename Handler, typename Source = AuByteSource>
+class RecordParser : BaseParser<Source> {
+  using Base = BaseParser<Source>;
+  using Base::source_;
+  using Base::expect;
+  using Base::parseFormatVersion;
+  using Base::parseFullString;
+  using Base::read;
+  using Base::readBackref;
+  using Base::readVarint;
+  using Base::term;
+
   Handler &handler_;
 
 public:
-  RecordParser(AuByteSource &source, Handler &handler)
-      : BaseParser(source), handler_(handler) {}
+  RecordParser(Source &source, Handler &handler)
+      : Base(source), handler_(handler) {}
 
   void parseStream(bool expectHeader = true) const {
     if (expectHeader) checkHeader();
@@ -373,6 +432,8 @@ public:
                 "didn't skip value!");
         return true;
       }
+      case 'S':     // Summary of the block which follows
+        return summary();
       default:
         AU_THROW("Unexpected character at start of record: " << c);
     }
@@ -380,6 +441,57 @@ public:
   }
 
 private:
+  bool summary() const {
+    BlockSummary summary;
+    uint32_t blockLen;
+    read(&blockLen, sizeof(blockLen));
+    summary.blockLen = blockLen;
+    summary.flags = source_.next().uint8Value();
+    summary.numHashes = source_.next().uint8Value();
+    uint32_t filterLen;
+    read(&filterLen, sizeof(filterLen));
+    if constexpr (CanSkipBlocks<Handler>::value) {
+      std::string copy;
+      auto filter = source_.buffered();
+      if (filter.size() >= filterLen) {
+        summary.filter = filter.substr(0, filterLen);
+      } else {
+        copy.resize(filterLen);
+        read(copy.data(), filterLen);
+        summary.filter = copy;
+        filterLen = 0;
+      }
+      auto skip = handler_.skipBlock(summary);
+      source_.skip(filterLen);
+      term();
+      if (skip) {
+        skipBlock(summary);
+        return true;
+      }
+    } else {
+      source_.skip(filterLen);
+      term();
+    }
+    return false;
+  }
+
+  void skipBlock(const BlockSummary &summary) const {
+    if (!summary.hasDictRecords()) {
+      source_.skip(summary.blockLen);
+      return;
+    }
+    auto end = source_.pos() + summary.blockLen;
+    while (source_.pos() < end) {
+      if (source_.peek() != 'V') {
+        record();
+        continue;
+      }
+      source_.next();
+      readBackref();
+      source_.skip(readVarint());
+    }
+  }
+
   struct HeaderHandler : NoopRecordHandler {
     bool headerSeen = false;
     void onHeader(uint64_t, const std::string &) override {
@@ -393,7 +505,7 @@ private:
     if (source_.peek().isEof()) return;
     HeaderHandler hh;
     try {
-      RecordParser<HeaderHandler>(source_, hh).record();
+      RecordParser<HeaderHandler, Source>(source_, hh).record();
     } catch (const au::parse_error &) {
       // don't care what it was...
     }
@@ -402,9 +514,9 @@ private:
   }
 };
 
-template<typename Handler>
-ValueParser(AuByteSource &source, Handler &handler) -> ValueParser<Handler>;
-template<typename Handler>
-RecordParser(AuByteSource &source, Handler &handler) -> RecordParser<Handler>;
+template<typename Handler, typename Source>
+ValueParser(Source &source, Handler &handler) -> ValueParser<Handler, Source>;
+template<typename Handler, typename Source>
+RecordParser(Source &source, Handler &handler) -> RecordParser<Handler, Source>;
 
 }
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "au/AuCommon.h"
+#include "au/AuDecoder.h"
+#include "au/BlockSummary.h"
+#include "au/BufferByteSource.h"
+#include "au/Varint.h"
 
 #include <algorithm>
 #include <chrono>
@@ -192,6 +196,14 @@ public:
     return purged;
   }
 
+  /// Starts counting the uses of every entry afresh.
+  void resetCounts() {
+    for (auto &[_, entry] : dictionary_) {
+      (void) _;
+      entry.occurences = 0;
+    }
+  }
+
   void doReIndex() {
     std::vector<std::pair<std::size_t,std::string>> tmpDict;
     tmpDict.reserve(dictionary_.size());
@@ -240,11 +252,19 @@ public:
     v[idx++] = c;
   }
   char *raw(size_t size) {
+    auto front = reserve(size);
+    idx += size;
+    return front;
+  }
+  /// Like raw(), but doesn't advance past the space. Use advance() to keep
+  /// however much of it was actually written.
+  char *reserve(size_t size) {
     if (__builtin_expect(idx + size > v.capacity(), 0))
       v.resize(std::max(v.size() * 2, idx + size));
-    auto front = idx;
+    return v.data() + idx;
+  }
+  void advance(size_t size) {
     idx += size;
-    return v.data() + front;
   }
   void write(const char *data, size_t size) {
     if (data && size) memcpy(raw(size), data, size);
@@ -512,60 +532,10 @@ protected:
   }
 
   void valueInt(uint64_t i) {
-    if (i < (1ul << 7)) {
+    if (i < 0x80u) {
       msgBuf_.put(static_cast<char>(i));
-    } else if (i < (1ul << 14)) {
-      auto ptr = msgBuf_.raw(2);
-      ptr[0] = static_cast<char>((i & 0x7fu) | 0x80u);
-      ptr[1] = static_cast<char>(i >> 7);
-    } else if (i < (1ul << 21)) {
-      auto ptr = msgBuf_.raw(3);
-      ptr[0] = static_cast<char>((i & 0x7fu) | 0x80u);
-      ptr[1] = static_cast<char>(((i >> 7) & 0x7fu) | 0x80u);
-      ptr[2] = static_cast<char>(i >> 14);
-    } else if (i < (1ul << 28)) {
-      auto ptr = msgBuf_.raw(4);
-      ptr[0] = static_cast<char>((i & 0x7fu) | 0x80u);
-      ptr[1] = static_cast<char>(((i >> 7) & 0x7fu) | 0x80u);
-      ptr[2] = static_cast<char>(((i >> 14) & 0x7fu) | 0x80u);
-      ptr[3] = static_cast<char>(i >> 21);
-    } else if (i < (1ul << 35)) {
-      auto ptr = msgBuf_.raw(5);
-      ptr[0] = static_cast<char>((i & 0x7fu) | 0x80u);
-      ptr[1] = static_cast<char>(((i >> 7) & 0x7fu) | 0x80u);
-      ptr[2] = static_cast<char>(((i >> 14) & 0x7fu) | 0x80u);
-      ptr[3] = static_cast<char>(((i >> 21) & 0x7fu) | 0x80u);
-      ptr[4] = static_cast<char>(i >> 28);
-    } else if (i < (1ul << 42)) {
-      auto ptr = msgBuf_.raw(6);
-      ptr[0] = static_cast<char>((i & 0x7fu) | 0x80u);
-      ptr[1] = static_cast<char>(((i >> 7) & 0x7fu) | 0x80u);
-      ptr[2] = static_cast<char>(((i >> 14) & 0x7fu) | 0x80u);
-      ptr[3] = static_cast<char>(((i >> 21) & 0x7fu) | 0x80u);
-      ptr[4] = static_cast<char>(((i >> 28) & 0x7fu) | 0x80u);
-      ptr[5] = static_cast<char>(i >> 35);
-    } else if (i < (1ul << 49)) {
-      auto ptr = msgBuf_.raw(7);
-      ptr[0] = static_cast<char>((i & 0x7fu) | 0x80u);
-      ptr[1] = static_cast<char>(((i >> 7) & 0x7fu) | 0x80u);
-      ptr[2] = static_cast<char>(((i >> 14) & 0x7fu) | 0x80u);
-      ptr[3] = static_cast<char>(((i >> 21) & 0x7fu) | 0x80u);
-      ptr[4] = static_cast<char>(((i >> 28) & 0x7fu) | 0x80u);
-      ptr[5] = static_cast<char>(((i >> 35) & 0x7fu) | 0x80u);
-      ptr[6] = static_cast<char>(i >> 42);
     } else {
-      // above this we need at least 8 bytes. should not have called this
-      // function but we use the general formula...
-      while (true) {
-        char toWrite = static_cast<char>(i & 0x7fu);
-        i >>= 7;
-        if (i) {
-          msgBuf_.put((toWrite | static_cast<char>(0x80u)));
-        } else {
-          msgBuf_.put(toWrite);
-          break;
-        }
-      }
+      msgBuf_.advance(varint::encode(i, msgBuf_.reserve(varint::MAX_LEN)));
     }
   }
 
@@ -635,7 +605,127 @@ private:
   AuWriter &IntUnsigned(uint64_t i) { return auInt(i); }
 };
 
+/// Adds the scalar values of an encoded value to a summary's bloom filter, as
+/// described in BlockSummary. This is a ValueHandler.
+class AuSummaryCollector {
+  const std::vector<std::string> &dict_;
+  char *filter_;
+  size_t filterLen_;
+  uint8_t numHashes_;
+  struct Context {
+    bool object;
+    size_t counter;
+    /// For objects, the last key seen; for arrays, the key they're under.
+    std::optional<std::string> key;
+  };
+  std::vector<Context> context_;
+  std::string str_;
+
+public:
+  AuSummaryCollector(const std::vector<std::string> &dict,
+                     std::string &filter,
+                     uint8_t numHashes)
+      : dict_(dict), filter_(filter.data()), filterLen_(filter.size()),
+        numHashes_(numHashes) {}
+
+  void collect(std::string_view value) {
+    context_.clear();
+    context_.push_back(Context{false, 0, std::nullopt});
+    BufferByteSource source(value);
+    ValueParser parser(source, *this);
+    parser.value();
+  }
+
+  void onNull(size_t) { next(); }
+  void onBool(size_t, bool) { next(); }
+  void onTime(size_t, time_point) { next(); }
+  void onUint(size_t, uint64_t value) {
+    add(BlockSummary::Uint, BlockSummary::bytesOf(value));
+  }
+  void onInt(size_t, int64_t value) {
+    add(BlockSummary::Int, BlockSummary::bytesOf(value));
+  }
+  void onDouble(size_t, double value) {
+    if (value == 0.0) value = 0.0;
+    add(BlockSummary::Double, BlockSummary::bytesOf(value));
+  }
+
+  void onDictRef(size_t, size_t dictIdx) { string(dict_.at(dictIdx)); }
+
+  void onObjectStart() { context_.push_back(Context{true, 0, std::nullopt}); }
+  void onObjectEnd() { unnest(); }
+  void onArrayStart() { context_.push_back(Context{false, 0, key()}); }
+  void onArrayEnd() { unnest(); }
+
+  void onStringStart(size_t, size_t len) {
+    str_.clear();
+    str_.reserve(len);
+  }
+
+  void onStringFragment(std::string_view frag) {
+    str_.append(frag.data(), frag.size());
+  }
+
+  void onStringEnd() { string(str_); }
+
+private:
+  bool isKey() const {
+    return context_.back().object && context_.back().counter % 2 == 0;
+  }
+
+  std::optional<std::string> key() const { return context_.back().key; }
+
+  void next() { context_.back().counter++; }
+
+  void unnest() {
+    context_.pop_back();
+    next();
+  }
+
+  void string(std::string_view sv) {
+    if (isKey()) {
+      context_.back().key = std::string(sv);
+      next();
+    } else {
+      add(BlockSummary::String, sv);
+    }
+  }
+
+  void add(BlockSummary::Type type, std::string_view bytes) {
+    BlockSummary::add(filter_, filterLen_, numHashes_,
+                      BlockSummary::hash(nullptr, type, bytes));
+    if (auto &key = context_.back().key) {
+      std::string_view keyView = *key;
+      BlockSummary::add(filter_, filterLen_, numHashes_,
+                        BlockSummary::hash(&keyView, type, bytes));
+    }
+    next();
+  }
+};
+
 class AuEncoder {
+public:
+  /// A sync point is a dictionary clear, followed by the entries of the old
+  /// dictionary which were used often enough to be worth carrying over. A
+  /// reader which seeks into the file only has to read back as far as the
+  /// last clear to build the dictionary it needs (see DictionaryBuilder), so
+  /// sync points bound the cost of a seek, for a few more bytes of output.
+  struct SyncConfig {
+    /// Write a sync point once the dictionary has gone this many bytes of
+    /// output without being cleared. 0 means never.
+    size_t everyBytes;
+    /// Carry over the entries which have been used at least this many times
+    /// since the last sync point. A higher threshold makes sync points
+    /// cheaper, but the entries left behind have to be added to the
+    /// dictionary again if they turn up later.
+    size_t keepThreshold;
+
+    // not default member initializers, which can't be used in the default
+    // argument to AuEncoder's constructor below.
+    SyncConfig() : everyBytes(0), keepThreshold(50) {}
+  };
+
+private:
   static constexpr uint32_t AU_FORMAT_VERSION
       = FormatVersion1::AU_FORMAT_VERSION;
   AuStringIntern stringIntern_;
@@ -648,8 +738,27 @@ class AuEncoder {
   size_t purgeThreshold_;
   size_t reindexInterval_;
   size_t clearThreshold_;
-
-  void exportDict() {
+  BlockSummary::Config summaryConfig_;
+  /// When writing summaries, the records held back until the current block
+  /// is finished: those before its summary, room for the summary, then the
+  /// block itself.
+  std::string pending_;
+  size_t summaryPos_ = 0;
+  size_t blockRecords_ = 0;
+  uint8_t blockFlags_ = 0;
+  std::string filter_;
+  SyncConfig syncConfig_;
+  size_t bytesSinceClear_ = 0;
+  /// The number of entries carried over by the last sync point which are yet
+  /// to be written.
+  size_t carriedOver_ = 0;
+  size_t syncPoints_ = 0;
+  /// The bytes written for sync points: their clears and carried-over entries.
+  size_t syncBytes_ = 0;
+
+  /// Returns the bytes written for entries carried over by a sync point.
+  size_t exportDict() {
+    size_t carried = 0;
     auto &dict = stringIntern_.dict();
     if (dict.size() > lastDictSize_) {
       auto sor = dictBuf_.tellp();
@@ -657,18 +766,26 @@ class AuEncoder {
       af.raw('A');
       af.backref(static_cast<uint32_t>(backref_)); // TODO do we guarantee elsewhere that this is never allowed to exceed 32 bits?
       for (size_t i = lastDictSize_; i < dict.size(); ++i) {
+        if (carriedOver_ && i == carriedOver_)
+          carried = dictBuf_.tellp() - sor;
         auto &s = dict[i];
         af.value(std::string_view(s.c_str(), s.length()), false);
       }
       af.term();
+      if (carriedOver_ && carriedOver_ >= dict.size())
+        carried = dictBuf_.tellp() - sor;
+      carriedOver_ = 0;
+      syncBytes_ += carried;
       backref_ = dictBuf_.tellp() - sor;
       lastDictSize_ = dict.size();
     }
+    return carried;
   }
 
   template <typename F>
   ssize_t finalizeAndWrite(F &&write) {
-    exportDict();
+    auto carried = exportDict();
+    if (summaryConfig_.blockRecords && !blockRecords_) startBlock();
     auto sor = dictBuf_.tellp();
     AuWriter af(dictBuf_, stringIntern_);
     af.raw('V');
@@ -676,10 +793,25 @@ class AuEncoder {
     af.valueInt(buf_.tellp());
     backref_ += dictBuf_.tellp() - sor;
 
-    auto result = write(dictBuf_.str(), buf_.str());
+    ssize_t result = 0;
+    if (summaryConfig_.blockRecords) {
+      if (sor) blockFlags_ |= BlockSummary::HasDictRecords;
+      pending_.append(dictBuf_.str());
+      pending_.append(buf_.str());
+      AuSummaryCollector(stringIntern_.dict(), filter_,
+                         summaryConfig_.numHashes).collect(buf_.str());
+      if (++blockRecords_ >= summaryConfig_.blockRecords
+          || pending_.size() - summaryPos_ >= summaryConfig_.blockBytes)
+        result = finishBlock(write);
+    } else {
+      result = static_cast<ssize_t>(write(dictBuf_.str(), buf_.str()));
+    }
 
     records_++;
     backref_ += buf_.tellp();
+    // the entries carried over by a sync point don't count towards the next
+    // one, or a dictionary of more than everyBytes would sync every record
+    bytesSinceClear_ += dictBuf_.tellp() + buf_.tellp() - carried;
 
     buf_.clear();
     dictBuf_.clear();
@@ -696,6 +828,47 @@ class AuEncoder {
       clearDictionary(true);
     }
 
+    if (syncConfig_.everyBytes && bytesSinceClear_ >= syncConfig_.everyBytes)
+      sync();
+
+    return result;
+  }
+
+  /// Leaves room for the summary of a block which starts with the next value
+  /// record. Whatever was to be written before that record goes first.
+  void startBlock() {
+    pending_.append(dictBuf_.str());
+    dictBuf_.clear();
+    summaryPos_ = pending_.size();
+    auto size = BlockSummary::recordSize(summaryConfig_.filterBytes);
+    pending_.append(size, '\0');
+    backref_ += size;
+    filter_.assign(summaryConfig_.filterBytes, '\0');
+    blockFlags_ = 0;
+  }
+
+  template <typename W>
+  ssize_t finishBlock(W &&write) {
+    auto size = BlockSummary::recordSize(summaryConfig_.filterBytes);
+    auto blockLen = static_cast<uint32_t>(pending_.size() - summaryPos_ - size);
+    auto filterLen = static_cast<uint32_t>(filter_.size());
+    auto *out = pending_.data() + summaryPos_;
+    auto put = [&](const void *data, size_t len) {
+      memcpy(out, data, len);
+      out += len;
+    };
+    put("S", 1);
+    put(&blockLen, sizeof(blockLen));
+    put(&blockFlags_, sizeof(blockFlags_));
+    put(&summaryConfig_.numHashes, sizeof(summaryConfig_.numHashes));
+    put(&filterLen, sizeof(filterLen));
+    put(filter_.data(), filter_.size());
+    const char term[] = {marker::RecordEnd, '\n'};
+    put(term, sizeof(term));
+
+    auto result = write(std::string_view(pending_), std::string_view());
+    pending_.clear();
+    blockRecords_ = 0;
     return static_cast<ssize_t>(result);
   }
 
@@ -724,17 +897,29 @@ public:
           reindexInterval,
           AuStringIntern::Config{})
   {}
+  /**
+   * @param summaryConfig If summaryConfig.blockRecords isn't 0, a summary
+   * record is written ahead of each block of that many records (see
+   * BlockSummary). Records are then held back until their block is finished,
+   * so call flush() after the last one.
+   * @param syncConfig If syncConfig.everyBytes isn't 0, a sync point is
+   * written at least that often (see SyncConfig).
+   */
   AuEncoder(std::string metadata,
             size_t purgeInterval,
             size_t purgeThreshold,
             size_t reindexInterval,
-            AuStringIntern::Config stringInternConfig)
+            AuStringIntern::Config stringInternConfig,
+            BlockSummary::Config summaryConfig = BlockSummary::Config{},
+            SyncConfig syncConfig = SyncConfig{})
       : stringIntern_(stringInternConfig),
         backref_(0), lastDictSize_(0), records_(0),
         purgeInterval_(purgeInterval),
         purgeThreshold_(purgeThreshold),
         reindexInterval_(reindexInterval),
-        clearThreshold_(stringInternConfig.clearThreshold)
+        clearThreshold_(stringInternConfig.clearThreshold),
+        summaryConfig_(summaryConfig),
+        syncConfig_(syncConfig)
   {
     if (metadata.size() > FormatVersion1::MAX_METADATA_SIZE)
       metadata.resize(FormatVersion1::MAX_METADATA_SIZE);
@@ -777,6 +962,14 @@ public:
     return result;
   }
 
+  /// Writes out the records held back for the current block, if any, with
+  /// its summary.
+  template<typename W>
+  ssize_t flush(W &&write) {
+    if (!blockRecords_) return 0;
+    return finishBlock(write);
+  }
+
   void clearDictionary(bool clearUsageTracker = false) {
     stringIntern_.clear(clearUsageTracker);
     emitDictClear();
@@ -797,12 +990,31 @@ public:
   auto getStats() const {
     auto stats = stringIntern_.getStats();
     stats["Records"] = static_cast<int>(records_);
+    stats["SyncPoints"] = static_cast<int>(syncPoints_);
     return stats;
   }
 
+  size_t syncPoints() const { return syncPoints_; }
+  /// The bytes written for sync points so far. See SyncConfig.
+  size_t syncBytes() const { return syncBytes_; }
+
 private:
+  /// Writes a sync point: the dictionary is cleared and re-indexed, keeping
+  /// its most used entries, which are written again with the next record.
+  void sync() {
+    auto before = dictBuf_.tellp();
+    reIndexDictionary(syncConfig_.keepThreshold);
+    // so the next sync point carries over what's been used since this one,
+    // rather than everything which ever made it past the threshold
+    stringIntern_.resetCounts();
+    syncBytes_ += dictBuf_.tellp() - before;
+    carriedOver_ = stringIntern_.dict().size();
+    syncPoints_++;
+  }
+
   void emitDictClear() {
     lastDictSize_ = 0;
+    bytesSinceClear_ = 0;
     auto sor = dictBuf_.tellp();
     AuWriter af(dictBuf_, stringIntern_);
     af.raw('C');
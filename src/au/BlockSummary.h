@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace au {
+
+/// A summary record ('S') may precede a block of records written by
+/// AuEncoder. It holds a bloom filter of the scalar values (other than
+/// timestamps and atoms) in the block's value records, each both on its own
+/// and paired with the key it's under, so that a reader looking for an exact
+/// value can skip blocks which don't have it. See RecordParser::record().
+///
+/// The record is 'S', the length of the block after it (4 bytes), flags (1
+/// byte), the number of hashes per value (1 byte), the length of the filter (4
+/// bytes), the filter and the usual terminator. All summaries in a file are
+/// the same size, since AuEncoder has to leave room for one before it knows
+/// what goes in it.
+struct BlockSummary {
+  struct Config {
+    /// Write a summary ahead of every this many records. 0 means never.
+    size_t blockRecords = 0;
+    /// ...or of fewer, once the block gets this big.
+    size_t blockBytes = 1024 * 1024;
+    size_t filterBytes = 8192;
+    uint8_t numHashes = 4;
+  };
+
+  enum Flags : uint8_t {
+    /// The block has dictionary records, which a reader still has to parse
+    /// when it skips the block's value records.
+    HasDictRecords = 1,
+  };
+
+  /// The types of value in the filter, as decoded (so non-negative integers
+  /// are always Uint).
+  enum Type : char {
+    String = 's',
+    Uint = 'u',
+    Int = 'i',
+    Double = 'd',
+  };
+
+  static constexpr size_t HeaderSize = 1 + 4 + 1 + 1 + 4;
+
+  static constexpr size_t recordSize(size_t filterBytes) {
+    return HeaderSize + filterBytes + 2;
+  }
+
+  /// Hashes a value (given by its bytes: strings as they are, numbers as
+  /// their 8 bytes, with -0.0 as 0.0) under key, if there is one.
+  static uint64_t hash(const std::string_view *key,
+                       Type type,
+                       std::string_view bytes) {
+    constexpr uint64_t Prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto mix = [&](std::string_view sv) {
+      for (unsigned char c : sv) {
+        h ^= c;
+        h *= Prime;
+      }
+    };
+    if (key) {
+      mix(*key);
+      // not a byte, so it can't be mistaken for part of the key
+      h ^= 0x100;
+      h *= Prime;
+    }
+    h ^= static_cast<unsigned char>(type);
+    h *= Prime;
+    mix(bytes);
+    // fnv's low bits are weak, so finish as splitmix64 does
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+  }
+
+  template <typename T>
+  static std::string_view bytesOf(const T &t) {
+    return std::string_view(reinterpret_cast<const char *>(&t), sizeof(t));
+  }
+
+  static void add(char *filter, size_t len, uint8_t numHashes, uint64_t h) {
+    if (!len) return;
+    forEachBit(len, numHashes, h, [&](size_t bit) {
+      filter[bit / 8] = static_cast<char>(filter[bit / 8] | (1 << (bit % 8)));
+      return true;
+    });
+  }
+
+  size_t blockLen = 0;
+  uint8_t flags = 0;
+  uint8_t numHashes = 0;
+  std::string_view filter;
+
+  bool hasDictRecords() const { return flags & HasDictRecords; }
+
+  /// False if the block certainly has no value with the given hash.
+  bool mayContain(uint64_t h) const {
+    if (filter.empty() || !numHashes) return true;
+    return forEachBit(filter.size(), numHashes, h, [&](size_t bit) {
+      return (static_cast<unsigned char>(filter[bit / 8]) >> (bit % 8)) & 1;
+    });
+  }
+
+private:
+  template <typename F>
+  static bool forEachBit(size_t len, uint8_t numHashes, uint64_t h, F &&f) {
+    auto bits = len * 8;
+    auto h2 = ((h >> 32) | (h << 32)) | 1;
+    for (uint8_t i = 0; i < numHashes; i++) {
+      if (!f(static_cast<size_t>((h + i * h2) % bits))) return false;
+    }
+    return true;
+  }
+};
+
+}
@@ -7,7 +7,7 @@
 
 namespace au {
 
-class BufferByteSource : public AuByteSource {
+class BufferByteSource final : public AuByteSource {
   const char *buf_; //< Underlying source buffer
   size_t bufLen_;   //< Underlying source buffer length
   size_t pos_ = 0;  //< Current position (this may be 1 past the end of buf_)
@@ -39,6 +39,11 @@ public:
   }
 
   void readFunc(size_t len, Fn &&func) override {
+    readFunc<Fn>(len, std::move(func));
+  }
+
+  template <typename F>
+  void readFunc(size_t len, F &&func) {
     size_t sz = std::min(len, bufLen_ - pos_);
     func(std::string_view(buf_ + pos_, sz));
     pos_ += sz;
@@ -54,9 +59,9 @@ public:
   bool isSeekable() const override { return true; }
 
   void seek(size_t abspos) override {
-    // i think we could allow a seek to eof (abspos == bufLen_), but in practice
-    // nothing has ever tried to do that, and it isn't needed for now.
-    if (abspos >= bufLen_) {
+    // seeking to exactly eof is allowed, as it is for the other sources. a
+    // skipped block of records can end there.
+    if (abspos > bufLen_) {
       THROW_RT("failed to seek to desired location: " << abspos);
     }
     pos_ = abspos;
@@ -64,6 +69,10 @@ public:
 
   void skip(size_t len) override { seek(pos_ + len); }
 
+  std::string_view buffered() const override {
+    return std::string_view(buf_ + pos_, bufLen_ - pos_);
+  }
+
   bool scanTo(std::string_view needle) override {
     char *found = static_cast<char *>(memmem(buf_ + pos_, bufLen_ - pos_,
                         needle.data(), needle.length()));
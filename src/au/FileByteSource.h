@@ -1,6 +1,8 @@
 #pragma once
 
 #include "au/AuByteSource.h"
+#include "au/FileWatcher.h"
+#include "au/MappedFile.h"
 #include "au/ParseError.h"
 
 #include <cassert>
@@ -9,6 +11,7 @@
 #include <memory>
 #include <optional>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 namespace au {
@@ -27,6 +30,7 @@ protected:
   std::optional<size_t> pinPos_;
 
   bool waitForData_;
+  FileWatcher watcher_; //< Tells us when there may be more data to follow
 
 public:
   explicit FileByteSource(const std::string &fname,
@@ -34,8 +38,10 @@ public:
       : INIT_BUFFER_SIZE(bufferSizeInK * 1024),
         name_(fname == "-" ? "<stdin>" : fname),
         bufSize_(INIT_BUFFER_SIZE),
-        buf_(static_cast<char *>(malloc(bufSize_))),
-        pos_(0), cur_(buf_), limit_(buf_), waitForData_(false) {}
+        // subclasses which don't use the working buffer pass a size of 0
+        buf_(bufSize_ ? static_cast<char *>(malloc(bufSize_)) : nullptr),
+        pos_(0), cur_(buf_), limit_(buf_), waitForData_(false),
+        watcher_(fname == "-" ? "" : fname) {}
 
   FileByteSource(const FileByteSource &) = delete;
   FileByteSource(FileByteSource &&) = delete;
@@ -69,16 +75,7 @@ public:
   }
 
   void readFunc(size_t len, Fn &&func) override {
-    while (len) {
-      while (cur_ == limit_)
-        if (!read())
-          AU_THROW("reached eof while trying to read " << len << " bytes");
-      auto first = std::min(len, buffAvail());
-      func(std::string_view(cur_, first));
-      pos_ += first;
-      cur_ += first;
-      len -= first;
-    }
+    readBuffered(len, std::move(func));
   }
 
   void skip(size_t len) override {
@@ -94,14 +91,18 @@ public:
     }
   }
 
-  void setPin(size_t abspos) override final {
+  std::string_view buffered() const override {
+    return std::string_view(cur_, buffAvail());
+  }
+
+  void setPin(size_t abspos) override {
     // pin should be within the current buffer, but certainly ahead of the
     // current start of buffer
     assert(abspos >= pos_ - static_cast<size_t>(cur_ - buf_));
     pinPos_ = abspos;
   }
 
-  void clearPin() override final {
+  void clearPin() override {
     pinPos_.reset();
   }
 
@@ -157,6 +158,25 @@ public:
     }
   }
 
+protected:
+  /// The working-buffer implementation of readFunc. The final subclasses
+  /// which read through the buffer expose this as a template readFunc, so the
+  /// parsers can pass a lambda without wrapping it in a std::function.
+  template <typename F>
+  void readBuffered(size_t len, F &&func) {
+    while (len) {
+      while (cur_ == limit_)
+        if (!read())
+          AU_THROW("reached eof while trying to read " << len << " bytes");
+      auto first = std::min(len, buffAvail());
+      func(std::string_view(cur_, first));
+      pos_ += first;
+      cur_ += first;
+      len -= first;
+    }
+  }
+
+
 private:
   virtual size_t doRead(char *buf, size_t len) = 0;
   virtual void doSeek(size_t abspos) = 0;
@@ -208,11 +228,8 @@ private:
     }
 
     size_t bytesRead = 0;
-    do {
-      bytesRead = doRead(limit_, buffFree());
-      if (bytesRead == 0 && waitForData_)
-        sleep(1);
-    } while (!bytesRead && waitForData_);
+    while (!(bytesRead = doRead(limit_, buffFree())) && waitForData_)
+      watcher_.wait();
 
     if (!bytesRead) return false;
     limit_ += bytesRead;
@@ -229,8 +246,9 @@ struct Closer {
 // A File is a self-closing FILE *.
 using File = std::unique_ptr<FILE, Closer>;
 
-class FileByteSourceImpl : public FileByteSource {
+class FileByteSourceImpl final : public FileByteSource {
   friend class ZipByteSource;
+  friend class ZstdByteSource;
   File file_;
 
 public:
@@ -263,8 +281,24 @@ public:
     return ::fseek(file_.get(), 0, SEEK_CUR) != -1;
   }
 
+  using FileByteSource::readFunc;
+  template <typename F>
+  void readFunc(size_t len, F &&func) {
+    readBuffered(len, std::forward<F>(func));
+  }
+
+  /// True if the underlying file is a regular file, and could therefore be
+  /// read via an MmapByteSource instead.
+  bool isMappable() const {
+    struct stat stat;
+    if (fstat(fileno(file_.get()), &stat) < 0) return false;
+    return S_ISREG(stat.st_mode);
+  }
+
 private:
   size_t doRead(char *buf, size_t len) override {
+    // eof is sticky, but when following there may be more data by now
+    ::clearerr(file_.get());
     return ::fread(buf, 1, len, file_.get());
   }
 
@@ -276,4 +310,136 @@ private:
   }
 };
 
+/// Serves a regular file directly out of a read-only memory mapping of the
+/// whole file. There's no working buffer: reads, scans and seeks are just
+/// pointer arithmetic, so random access (bisect, tail sync) costs at most a few
+/// page faults rather than an fseek() and a buffer refill. Pins are
+/// meaningless here since all of the data is always available.
+class MmapByteSource final : public FileByteSource {
+  int fd_;
+  MappedFile mapping_;
+  const char *data_ = nullptr; //< Start of the mapping
+  size_t len_ = 0;             //< Length of the mapping (i.e., the file)
+
+public:
+  explicit MmapByteSource(const std::string &fname)
+      : FileByteSource(fname, 0),
+        fd_(::open(fname.c_str(), O_RDONLY)) {
+    if (fd_ < 0)
+      THROW_RT("open: " << strerror(errno) << " (" << fname << ")");
+    remap(); // an empty file has nothing to map (yet), and that's fine
+  }
+
+  ~MmapByteSource() override { ::close(fd_); }
+
+  size_t endPos() const override { return len_; }
+
+  bool isSeekable() const override { return true; }
+
+  Byte next() override {
+    if (pos_ == len_ && !grow()) return Byte::Eof();
+    return Byte(data_[pos_++]);
+  }
+
+  Byte peek() override {
+    if (pos_ == len_ && !grow()) return Byte::Eof();
+    return Byte(data_[pos_]);
+  }
+
+  void readFunc(size_t len, Fn &&func) override {
+    readFunc<Fn>(len, std::move(func));
+  }
+
+  template <typename F>
+  void readFunc(size_t len, F &&func) {
+    while (len) {
+      if (pos_ == len_ && !grow())
+        AU_THROW("reached eof while trying to read " << len << " bytes");
+      auto first = std::min(len, len_ - pos_);
+      func(std::string_view(data_ + pos_, first));
+      pos_ += first;
+      len -= first;
+    }
+  }
+
+  void skip(size_t len) override {
+    while (pos_ + len > len_)
+      if (!grow()) THROW_RT("failed to read from new location while skipping");
+    pos_ += len;
+  }
+
+  std::string_view buffered() const override {
+    return std::string_view(data_ + pos_, len_ - pos_);
+  }
+
+  void setPin(size_t) override {}
+  void clearPin() override {}
+
+  void seek(size_t abspos) override {
+    // unlike the buffered sources, seeking to exactly eof is allowed. there's
+    // nothing to read there, but it's a perfectly good place to wait for more
+    // data when following.
+    while (abspos > len_)
+      if (!grow()) THROW_RT("failed to seek to desired location: " << abspos);
+    pos_ = abspos;
+  }
+
+  bool scanTo(std::string_view needle) override {
+    while (true) {
+      if (len_ - pos_ >= needle.length()) {
+        auto found = static_cast<const char *>(
+            memmem(data_ + pos_, len_ - pos_, needle.data(), needle.length()));
+        if (found) {
+          assert(found >= data_ + pos_);
+          pos_ = static_cast<size_t>(found - data_);
+          return true;
+        }
+        // leave ourselves positioned just where a match might still begin if
+        // more data arrives, as the buffered version does.
+        pos_ = len_ - (needle.length() - 1);
+      }
+      if (!grow()) return false;
+    }
+  }
+
+private:
+  size_t doRead(char *buf, size_t len) override {
+    auto n = std::min(len, len_ - pos_);
+    ::memcpy(buf, data_ + pos_, n);
+    return n;
+  }
+
+  void doSeek(size_t abspos) override { seek(abspos); }
+
+  /// Called at eof: picks up any data appended to the file since it was
+  /// mapped, waiting for it if we're following.
+  /// @return true if more data is now available.
+  bool grow() {
+    while (true) {
+      if (remap()) return true;
+      if (!waitForData_) return false;
+      watcher_.wait();
+    }
+  }
+
+  /// The old mapping stays in place until the new one has been made, so a
+  /// failure leaves this as it was.
+  /// @return true if the file has grown since the last mapping.
+  bool remap() {
+    if (mapping_.truncated())
+      THROW_RT(name_ << " was truncated while it was being read");
+    struct stat stat;
+    if (fstat(fd_, &stat) < 0)
+      THROW_RT("failed to stat file: " << strerror(errno));
+    auto size = static_cast<size_t>(stat.st_size);
+    if (size <= len_) return false;
+    // the kernel's usual readahead suits us. MADV_SEQUENTIAL would drop pages
+    // as soon as they've been read, which bisects, slices and tac come back to
+    mapping_ = MappedFile(fd_, size, name_);
+    data_ = mapping_.data();
+    len_ = size;
+    return true;
+  }
+};
+
 }
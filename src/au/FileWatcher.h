@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+namespace au {
+
+/// Waits for a file which is being followed to change. Where there's inotify,
+/// a wait ends as soon as the file is written to, so appended data is picked
+/// up straight away without waking up every so often to check an idle file.
+/// Elsewhere, or if the file can't be watched (stdin, or inotify has run out
+/// of watches), a wait just sleeps for a moment.
+class FileWatcher {
+  /// How long a wait sleeps when there's no watch.
+  static constexpr auto POLL_INTERVAL = std::chrono::milliseconds(100);
+  /// Some filesystems (nfs, fuse) don't tell inotify about writes made
+  /// elsewhere, so even with a watch, a wait doesn't go on for longer than
+  /// this.
+  static constexpr int MAX_WAIT_MILLIS = 1000;
+
+  std::string path_;
+  int fd_ = -1;
+#ifdef __linux__
+  bool started_ = false;
+#endif
+
+public:
+  /// An empty path is never watched.
+  explicit FileWatcher(std::string path) : path_(std::move(path)) {}
+
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+  ~FileWatcher() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  /// Waits until the file may have changed. The first call only starts
+  /// watching it and returns straight away, since it may have changed before
+  /// the watch was in place, so the caller should look for new data after
+  /// every call.
+  void wait() {
+#ifdef __linux__
+    if (!started_) {
+      started_ = true;
+      if (watch()) return;
+    }
+    if (fd_ >= 0) {
+      pollfd pfd{fd_, POLLIN, 0};
+      if (::poll(&pfd, 1, MAX_WAIT_MILLIS) > 0) drain();
+      return;
+    }
+#endif
+    std::this_thread::sleep_for(POLL_INTERVAL);
+  }
+
+private:
+#ifdef __linux__
+  bool watch() {
+    if (path_.empty()) return false;
+    fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) return false;
+    constexpr uint32_t Events =
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+    if (::inotify_add_watch(fd_, path_.c_str(), Events) < 0) {
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    return true;
+  }
+
+  /// Discards the pending events: all that matters is that there were some.
+  void drain() {
+    alignas(inotify_event) char buf[4096];
+    while (::read(fd_, buf, sizeof(buf)) > 0) {}
+  }
+#endif
+};
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "au/ParseError.h"
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace au {
+
+/// A read-only mapping of the first len bytes of a file, which survives the
+/// file being truncated under it.
+///
+/// Touching a page of a mapping which lies wholly past the end of its file
+/// raises SIGBUS, which would kill the process. While a MappedFile is alive,
+/// a SIGBUS handler catches faults in it, maps zeros over the rest of it and
+/// carries on, and truncated() says so. Faults anywhere else go to whatever
+/// handled SIGBUS before. Only so many mappings can be guarded at once; any
+/// beyond that are mapped unguarded, as before.
+class MappedFile {
+  static constexpr size_t MAX_GUARDED = 4096;
+
+  /// Only ever static, so all zeros to begin with.
+  struct Slot {
+    std::atomic<uintptr_t> start; //< 0 when the slot is free
+    std::atomic<size_t> len;      //< rounded up to whole pages
+    std::atomic<bool> truncated;
+    std::atomic<int> handling;    //< faults being handled in it right now
+  };
+
+  inline static Slot slots_[MAX_GUARDED];
+  inline static size_t pageSize_ = 0;
+  inline static struct sigaction previous_;
+
+  const char *data_ = nullptr;
+  size_t len_ = 0;
+  Slot *slot_ = nullptr;
+
+  static void onSigbus(int sig, siginfo_t *info, void *context) {
+    auto addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (auto &slot : slots_) {
+      slot.handling++;
+      auto start = slot.start.load();
+      auto end = start + slot.len.load();
+      if (start && addr >= start && addr < end) {
+        // from the faulting page on, the file has gone. zeros read past the
+        // end of a file just as they would from a sparse one, and the reader
+        // asks truncated() before believing them.
+        auto page = addr & ~(pageSize_ - 1);
+        ::mmap(reinterpret_cast<void *>(page), end - page, PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        slot.truncated = true;
+        slot.handling--;
+        return;
+      }
+      slot.handling--;
+    }
+    if (previous_.sa_flags & SA_SIGINFO) {
+      previous_.sa_sigaction(sig, info, context);
+    } else if (previous_.sa_handler != SIG_DFL
+               && previous_.sa_handler != SIG_IGN) {
+      previous_.sa_handler(sig);
+    } else {
+      // returning runs the faulting instruction again, and this time it
+      // isn't caught
+      ::sigaction(SIGBUS, &previous_, nullptr);
+    }
+  }
+
+  static bool installHandler() {
+    pageSize_ = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onSigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    return ::sigaction(SIGBUS, &action, &previous_) == 0;
+  }
+
+  static Slot *guard(const char *data, size_t len) {
+    static const bool installed = installHandler();
+    if (!installed) return nullptr;
+    auto rounded = (len + pageSize_ - 1) & ~(pageSize_ - 1);
+    for (auto &slot : slots_) {
+      uintptr_t free = 0;
+      // claim the slot with a start which can't match a fault, until its
+      // length is in place
+      if (!slot.start.compare_exchange_strong(free, UINTPTR_MAX)) continue;
+      slot.len = rounded;
+      slot.truncated = false;
+      slot.start = reinterpret_cast<uintptr_t>(data);
+      return &slot;
+    }
+    return nullptr;
+  }
+
+  void release() {
+    if (slot_) {
+      slot_->start = 0;
+      // a fault being handled in it might otherwise map zeros over whatever
+      // is mapped there next
+      while (slot_->handling) std::this_thread::yield();
+      slot_ = nullptr;
+    }
+    if (data_) ::munmap(const_cast<char *>(data_), len_);
+    data_ = nullptr;
+    len_ = 0;
+  }
+
+public:
+  MappedFile() = default;
+
+  /// Maps the first len bytes of fd, which must be more than none.
+  /// @throws std::runtime_error, naming name, if it can't be mapped.
+  MappedFile(int fd, size_t len, const std::string &name) {
+    auto *addr = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+      THROW_RT("mmap: " << strerror(errno) << " (" << name << ")");
+    data_ = static_cast<const char *>(addr);
+    len_ = len;
+    slot_ = guard(data_, len_);
+  }
+
+  ~MappedFile() { release(); }
+
+  MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+      release();
+      std::swap(data_, other.data_);
+      std::swap(len_, other.len_);
+      std::swap(slot_, other.slot_);
+    }
+    return *this;
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return len_; }
+
+  /// Whether some of the mapping has been found to be past the end of the
+  /// file, and reads as zeros.
+  bool truncated() const { return slot_ && slot_->truncated; }
+};
+
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+namespace au {
+
+/// The LEB128-style varint codec shared by AuWriter and BaseParser: 7 bits per
+/// byte, least significant group first, high bit set on all but the last byte.
+namespace varint {
+
+/// A 64-bit value never needs more than this many bytes. BaseParser also uses
+/// it as the amount of buffered input needed to take the fast decode path.
+constexpr size_t MAX_LEN = 10;
+
+/// The number of bytes needed to encode i.
+inline size_t length(uint64_t i) {
+  auto bits = 64u - static_cast<unsigned>(__builtin_clzll(i | 1u));
+  return (bits + 6u) / 7u;
+}
+
+/// Encodes i to out, which must have room for MAX_LEN bytes. Bytes past the
+/// returned length may be overwritten. The inverse of decode: on little endian
+/// machines values below 2^56 are spread into 7-bit groups as a single word.
+/// @return the number of bytes in the encoding, which is always length(i)
+inline size_t encode(uint64_t i, char *out) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (i < (1ull << 56)) {
+    constexpr uint64_t highBits = 0x8080808080808080ull;
+    auto len = length(i);
+#ifdef __BMI2__
+    uint64_t word = _pdep_u64(i, ~highBits);
+#else
+    uint64_t word = (i & 0x000000000fffffffull) | ((i & 0x00fffffff0000000ull) << 4);
+    word = (word & 0x00003fff00003fffull) | ((word & 0x0fffc0000fffc000ull) << 2);
+    word = (word & 0x007f007f007f007full) | ((word & 0x3f803f803f803f80ull) << 1);
+#endif
+    // continuation bits on all but the last byte
+    word |= highBits & ((1ull << (8 * (len - 1))) - 1);
+    ::memcpy(out, &word, sizeof(word));
+    return len;
+  }
+#endif
+  auto *start = out;
+  while (i >= 0x80u) {
+    *out++ = static_cast<char>((i & 0x7fu) | 0x80u);
+    i >>= 7;
+  }
+  *out++ = static_cast<char>(i);
+  return static_cast<size_t>(out - start);
+}
+
+/// Decodes a varint from a buffer of at least MAX_LEN bytes. On little endian
+/// machines the first 8 bytes are handled as a single word: the terminator is
+/// the lowest byte with its high bit clear, and the 7-bit groups are squeezed
+/// together with pext (if available) or a few shift/mask steps.
+/// @return the number of bytes consumed, or 0 if no terminator was found
+///   within MAX_LEN bytes.
+inline size_t decode(const char *p, uint64_t &result) {
+  // by far the most common case: small string lengths and dictionary refs
+  if (!(p[0] & 0x80)) {
+    result = static_cast<uint8_t>(p[0]);
+    return 1;
+  }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  constexpr uint64_t highBits = 0x8080808080808080ull;
+  uint64_t word;
+  ::memcpy(&word, p, sizeof(word));
+  auto stops = ~word & highBits;
+  size_t len = 8;
+  if (stops) {
+    // everything up to and including the high bit of the terminating byte
+    word &= stops ^ (stops - 1);
+    len = static_cast<size_t>(__builtin_ctzll(stops)) / 8 + 1;
+  }
+  word &= ~highBits;
+#ifdef __BMI2__
+  result = _pext_u64(word, ~highBits);
+#else
+  word = (word & 0x007f007f007f007full) | ((word & 0x7f007f007f007f00ull) >> 1);
+  word = (word & 0x00003fff00003fffull) | ((word & 0x3fff00003fff0000ull) >> 2);
+  word = (word & 0x000000000fffffffull) | ((word & 0x0fffffff00000000ull) >> 4);
+  result = word;
+#endif
+  if (stops) return len;
+  size_t shift = 56;
+#else
+  result = 0;
+  size_t len = 0;
+  size_t shift = 0;
+#endif
+  // any remaining bytes (only the 9th and 10th on little endian). like the
+  // byte-at-a-time decoder, bits past the 64th are silently dropped.
+  for (; len < MAX_LEN; len++, shift += 7) {
+    auto byte = static_cast<uint8_t>(p[len]);
+    result |= static_cast<uint64_t>(byte & 0x7fu) << shift;
+    if (!(byte & 0x80u)) return len + 1;
+  }
+  return 0;
+}
+
+}
+
+}
@@ -121,7 +121,7 @@ struct KeyValueHandler : public au::NoopValueHandler {
     if (isKey()) {
       context_.back().key = dict_->at(dictIdx);
     } else {
-      callback(dict_->at(dictIdx));
+      callback(std::string(dict_->at(dictIdx)));
     }
     incrCounter();
   }
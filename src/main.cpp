@@ -27,12 +27,24 @@ int help(int, char **) {
   std::cout << "\nCommands:\n"
     << "   cat      Decode listed files to stdout (alias au2json)\n"
     << "   tail     Decode and/or follow file\n"
+    << "   tac      Decode file, last record first\n"
     << "   grep     Find records matching pattern\n"
+    << "   slice    Extract the records in a range of values of an ordered key\n"
+    << "   merge    Merge files which are in order by a key into one stream\n"
     << "   enc      Encode listed files to stdout (alias json2au)\n"
     << "   stats    Display file statistics\n"
     << "   zindex   Build an index of a gzipped file (to support grep -o)\n"
     << "            Works for .json and .au files. Index will be written to <file>.auzx\n"
     << "            unless specified with -x <index>\n"
+    << "   index    Sample an ordered key (to speed up grep -o on that key)\n"
+    << "            Samples will be written to <file>.<key>.auki\n"
+    << "   serve    Keep searched files ready for repeated greps (see grep --server)\n"
+    << "   gzip     Compress a file on all cores into gzip members, and index it as it\n"
+    << "            goes. Writes <file>.gz and <file>.gz.auzx\n"
+#ifdef AU_ZSTD
+    << "   zstd     Compress a file on all cores into seekable zstd, which needs no\n"
+    << "            index. Writes <file>.zst\n"
+#endif
     << "\n"
     << "   zcat     cat gzipped au file (deprecated, just use cat)\n"
     << "   zgrep    grep in gzipped file (deprecated, just use grep)\n"
@@ -55,11 +67,20 @@ int main(int argc, char **argv) {
   commands["cat"] = au::cat;
   commands["au2json"] = au::cat;
   commands["tail"] = au::tail;
+  commands["tac"] = au::tac;
   commands["grep"] = au::grep;
+  commands["slice"] = au::slice;
+  commands["merge"] = au::merge;
   commands["enc"] = au::json2au;
   commands["json2au"] = au::json2au;
   commands["stats"] = au::stats;
   commands["zindex"] = au::zindex;
+  commands["index"] = au::keyIndex;
+  commands["serve"] = au::serve;
+  commands["gzip"] = au::gzip;
+#ifdef AU_ZSTD
+  commands["zstd"] = au::zstd;
+#endif
   commands["zgrep"] = au::zgrep;
   commands["zcat"] = au::zcat;
   commands["ztail"] = au::ztail;
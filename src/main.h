@@ -6,10 +6,17 @@ int json2au(int argc, const char * const *argv);
 int stats(int argc, const char * const *argv);
 int grep(int argc, const char * const *argv);
 int zgrep(int argc, const char * const *argv);
+int slice(int argc, const char * const *argv);
+int merge(int argc, const char * const *argv);
 int tail(int argc, const char * const *argv);
+int tac(int argc, const char * const *argv);
 int ztail(int argc, const char * const *argv);
 int cat(int argc, const char * const *argv);
 int zcat(int argc, const char * const *argv);
 int zindex(int argc, const char * const *argv);
+int keyIndex(int argc, const char * const *argv);
+int serve(int argc, const char * const *argv);
+int gzip(int argc, const char * const *argv);
+int zstd(int argc, const char * const *argv);
 
 }
@@ -4,6 +4,7 @@
 
 #include "gtest/gtest.h"
 
+#include <algorithm>
 #include <vector>
 
 namespace au {
@@ -170,4 +171,155 @@ TEST_F(AuEncoderTest, MultiRecord) {
             R"_({"2nd":"record","transcends":2.71828})_", getJson());
 }
 
+
+namespace {
+
+/// Outputs only the blocks whose summaries might have a string value under a
+/// given key.
+struct BlockSkippingJson : JsonOutputHandler {
+  uint64_t hash;
+  size_t skipped = 0;
+
+  BlockSkippingJson(std::ostream &out, std::string_view key,
+                    std::string_view value)
+      : JsonOutputHandler(out),
+        hash(BlockSummary::hash(&key, BlockSummary::String, value)) {}
+
+  bool skipBlock(const BlockSummary &summary) {
+    if (summary.mayContain(hash)) return false;
+    skipped++;
+    return true;
+  }
+};
+
+BlockSummary::Config summaryConfig(size_t blockRecords) {
+  BlockSummary::Config config;
+  config.blockRecords = blockRecords;
+  config.filterBytes = 64;
+  return config;
+}
+
+}
+
+TEST_F(AuEncoderTest, SummariesAreTransparent) {
+  AuEncoder summarized("", 250'000, 50, 500'000, AuStringIntern::Config{},
+                       summaryConfig(2));
+  for (auto v : {"alpha", "beta", "gamma", "alpha", "beta"}) {
+    summarized.encode([&](AuWriter &writer) {
+      writer.map("k", writer.arrayVals([&]() { writer.value(v, true); }));
+    }, AuEncoderTest::write);
+  }
+  // the first two blocks are written as they fill up...
+  ASSERT_EQ(R"_({"k":["alpha"]})_" "\n"
+            R"_({"k":["beta"]})_" "\n"
+            R"_({"k":["gamma"]})_" "\n"
+            R"_({"k":["alpha"]})_", getJson());
+  // ...and the last one when flushed
+  summarized.flush(AuEncoderTest::write);
+  ASSERT_EQ(R"_({"k":["alpha"]})_" "\n"
+            R"_({"k":["beta"]})_" "\n"
+            R"_({"k":["gamma"]})_" "\n"
+            R"_({"k":["alpha"]})_" "\n"
+            R"_({"k":["beta"]})_", getJson());
+}
+
+TEST_F(AuEncoderTest, SkipsBlocksBySummary) {
+  AuEncoder summarized("", 250'000, 50, 500'000, AuStringIntern::Config{},
+                       summaryConfig(2));
+  for (auto v : {"alpha", "beta", "gamma", "alpha", "beta"}) {
+    summarized.encode([&](AuWriter &writer) {
+      writer.startMap();
+      writer.key("k");
+      writer.value(v, true);
+      writer.key("other");
+      writer.value("gamma");
+      writer.key("n");
+      writer.value(7);
+      writer.endMap();
+    }, AuEncoderTest::write);
+  }
+  summarized.flush(AuEncoderTest::write);
+
+  auto grep = [&](std::string_view key, std::string_view value) {
+    std::stringstream ss;
+    BlockSkippingJson handler(ss, key, value);
+    Dictionary dictionary;
+    AuRecordHandler recordHandler(dictionary, handler);
+    BufferByteSource source(storage.data(), storage.size());
+    RecordParser(source, recordHandler).parseStream();
+    return std::make_pair(ss.str(), handler.skipped);
+  };
+
+  // the last block's records refer to a dictionary record in the middle one
+  auto [json, skipped] = grep("k", "beta");
+  EXPECT_EQ(R"_({"k":"alpha","other":"gamma","n":7})_" "\n"
+            R"_({"k":"beta","other":"gamma","n":7})_" "\n"
+            R"_({"k":"beta","other":"gamma","n":7})_" "\n", json);
+  EXPECT_EQ(1, skipped);
+
+  std::tie(json, skipped) = grep("k", "gamma");
+  EXPECT_EQ(R"_({"k":"gamma","other":"gamma","n":7})_" "\n"
+            R"_({"k":"alpha","other":"gamma","n":7})_" "\n", json);
+  EXPECT_EQ(2, skipped);
+
+  std::tie(json, skipped) = grep("other", "gamma");
+  EXPECT_EQ(0, skipped);
+}
+
+namespace {
+
+/// Notes how far each value record is from the last dictionary clear before
+/// it, i.e., how far back a reader which seeks to it has to read.
+struct ClearDistance : NoopRecordHandler {
+  size_t sor = 0;
+  size_t lastClear = 0;
+  size_t maxDistance = 0;
+
+  void onRecordStart(size_t absPos) override { sor = absPos; }
+  void onDictClear() override { lastClear = sor; }
+  void onValue(size_t, size_t len, AuByteSource &source) override {
+    maxDistance = std::max(maxDistance, sor - lastClear);
+    source.skip(len);
+  }
+};
+
+}
+
+TEST_F(AuEncoderTest, SyncPointsBoundDictionaries) {
+  auto encode = [&](AuEncoder &encoder) {
+    storage.clear();
+    for (size_t i = 0; i < 2000; i++) {
+      encoder.encode([&](AuWriter &writer) {
+        writer.map("seq", i, "msg", "message " + std::to_string(i % 40),
+                   "rare", "rare " + std::to_string(i / 5));
+      }, AuEncoderTest::write);
+    }
+    ClearDistance handler;
+    BufferByteSource source(storage.data(), storage.size());
+    RecordParser(source, handler).parseStream();
+    return std::make_pair(getJson(), handler.maxDistance);
+  };
+
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  AuEncoder plain("", 250'000, 1, 500'000, config);
+  auto [expected, unbounded] = encode(plain);
+
+  AuEncoder::SyncConfig syncConfig;
+  syncConfig.everyBytes = 2048;
+  syncConfig.keepThreshold = 10;
+  AuEncoder synced("", 250'000, 1, 500'000, config, BlockSummary::Config{},
+                   syncConfig);
+  auto [json, bounded] = encode(synced);
+
+  EXPECT_EQ(expected, json);
+  EXPECT_LT(4 * syncConfig.everyBytes, unbounded);
+  // the last record before each sync point may take it past everyBytes
+  EXPECT_GT(syncConfig.everyBytes + 256, bounded);
+  EXPECT_LT(10u, synced.syncPoints());
+  EXPECT_LT(0u, synced.syncBytes());
+  EXPECT_EQ(0u, plain.syncPoints());
+  EXPECT_EQ(0u, plain.syncBytes());
+}
+
 }
@@ -1,5 +1,6 @@
 #include "au/AuEncoder.h"
 #include "au/AuDecoder.h"
+#include "au/BufferByteSource.h"
 
 #include <gmock/gmock.h>
 
@@ -275,4 +276,60 @@ TEST_F(AuFormatterTest, NestedArray) {
   EXPECT_EQ(std::string("\x0b\x61\x62\x0b\x63\x64\x0c\x0c"), buf.str());
 }
 
-}
\ No newline at end of file
+namespace {
+
+struct UintHandler : NoopValueHandler {
+  uint64_t val = 0;
+  void onUint(size_t, uint64_t v) override { val = v; }
+};
+
+uint64_t parseUint(std::string_view encoded) {
+  BufferByteSource source(encoded);
+  UintHandler handler;
+  ValueParser(source, handler).value();
+  EXPECT_EQ(source.pos(), encoded.rfind('!'));
+  return handler.val;
+}
+
+}
+
+TEST(Varint, RoundTrip) {
+  std::vector<uint64_t> vals{0, std::numeric_limits<uint64_t>::max()};
+  for (auto shift = 0u; shift < 64; shift++) {
+    vals.push_back((1ull << shift) - 1);
+    vals.push_back(1ull << shift);
+    vals.push_back((1ull << shift) + 1);
+  }
+  for (auto val : vals) {
+    char buf[varint::MAX_LEN * 2];
+    auto len = varint::encode(val, buf);
+    EXPECT_EQ(varint::length(val), len) << val;
+    // junk with the high bit set after the varint, to make sure the decoder
+    // finds the right terminator
+    memset(buf + len, 0xff, sizeof(buf) - len);
+    uint64_t decoded = 0;
+    EXPECT_EQ(len, varint::decode(buf, decoded)) << val;
+    EXPECT_EQ(val, decoded);
+
+    // once with plenty of data after it (in-place decode), and once right at
+    // the end of the buffer (byte at a time)
+    std::string encoded{marker::Varint};
+    encoded.append(buf, len);
+    encoded += '!';
+    EXPECT_EQ(val, parseUint(encoded));
+    EXPECT_EQ(val, parseUint(encoded + std::string(varint::MAX_LEN, '\0')));
+  }
+}
+
+TEST(Varint, BadEncoding) {
+  std::string tooLong(varint::MAX_LEN, C(0x80));
+  uint64_t decoded;
+  EXPECT_EQ(0, varint::decode(tooLong.data(), decoded));
+
+  std::string encoded = C(marker::Varint) + tooLong + "\x01!";
+  EXPECT_THROW(parseUint(encoded), parse_error);
+  EXPECT_THROW(parseUint(encoded + std::string(varint::MAX_LEN, '\0')),
+               parse_error);
+}
+
+}
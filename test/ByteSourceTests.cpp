@@ -0,0 +1,126 @@
+#include "au/FileByteSource.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace au {
+
+namespace {
+
+std::string readAll(AuByteSource &source, size_t len) {
+  std::string result;
+  source.readFunc(len, [&](std::string_view frag) { result += frag; });
+  return result;
+}
+
+}
+
+TEST(MmapByteSource, ReadsLikeAFile) {
+  TempFile file("hello, world\nsecond line\n");
+  MmapByteSource source(file.path);
+  EXPECT_TRUE(source.isSeekable());
+  EXPECT_EQ(25, source.endPos());
+  EXPECT_EQ('h', source.peek().charValue());
+  EXPECT_EQ('h', source.next().charValue());
+  EXPECT_EQ(1, source.pos());
+  EXPECT_EQ("ello", readAll(source, 4));
+  source.skip(2);
+  EXPECT_EQ('w', source.next().charValue());
+  EXPECT_THROW(readAll(source, 100), parse_error);
+  EXPECT_TRUE(source.peek().isEof());
+}
+
+TEST(MmapByteSource, SeekAndScan) {
+  TempFile file("abc\ndef\nghi");
+  MmapByteSource source(file.path);
+  ASSERT_TRUE(source.scanTo("\n"));
+  EXPECT_EQ(3, source.pos());
+  source.next();
+  ASSERT_TRUE(source.scanTo("\n"));
+  EXPECT_EQ(7, source.pos());
+  source.next();
+  EXPECT_FALSE(source.scanTo("\n"));
+  source.seek(4);
+  EXPECT_EQ("def", readAll(source, 3));
+  source.seek(11); // eof is a valid place to be
+  EXPECT_TRUE(source.next().isEof());
+  EXPECT_THROW(source.seek(12), std::runtime_error);
+}
+
+TEST(MmapByteSource, PicksUpAppendedData) {
+  TempFile file("abc");
+  MmapByteSource source(file.path);
+  source.skip(3);
+  EXPECT_TRUE(source.peek().isEof());
+  file.append("def");
+  EXPECT_EQ('d', source.next().charValue());
+  EXPECT_EQ("ef", readAll(source, 2));
+}
+
+TEST(MmapByteSource, ReadFuncThroughBaseClass) {
+  // the parsers call the template readFunc on whatever type they were
+  // instantiated with. make sure that doesn't bypass the mmap implementation
+  // when that type is only the FileByteSource base.
+  TempFile file("abcdef");
+  MmapByteSource source(file.path);
+  FileByteSource &base = source;
+  std::string result;
+  base.readFunc(4, [&](std::string_view frag) { result += frag; });
+  EXPECT_EQ("abcd", result);
+  EXPECT_EQ(4, base.pos());
+}
+
+TEST(MmapByteSource, EmptyFile) {
+  TempFile file("");
+  MmapByteSource source(file.path);
+  EXPECT_EQ(0, source.endPos());
+  EXPECT_TRUE(source.peek().isEof());
+  EXPECT_FALSE(source.scanTo("x"));
+}
+
+TEST(MmapByteSource, TruncatedUnderTheMapping) {
+  // as copytruncate log rotation does. the pages which have gone read as
+  // zeros rather than raising SIGBUS, and the source fails once it notices
+  TempFile file(std::string(64 * 1024, 'x'));
+  MmapByteSource source(file.path);
+  EXPECT_EQ("xxxx", readAll(source, 4));
+  fs::resize_file(file.path, 100);
+  source.seek(32 * 1024);
+  EXPECT_EQ(std::string(4, '\0'), readAll(source, 4));
+  EXPECT_THROW(source.scanTo("x"), std::runtime_error);
+
+  // and a new source sees what's left
+  MmapByteSource reopened(file.path);
+  EXPECT_EQ(100, reopened.endPos());
+}
+
+TEST(FileByteSource, FollowsAppendedData) {
+  // both the buffered and the mapped sources wait at eof for the data to be
+  // written, rather than returning eof
+  for (auto mapped : {false, true}) {
+    TempFile file("abc");
+    std::unique_ptr<FileByteSource> source;
+    if (mapped) source = std::make_unique<MmapByteSource>(file.path);
+    else source = std::make_unique<FileByteSourceImpl>(file.path);
+    source->setFollow(true);
+    EXPECT_EQ("abc", readAll(*source, 3));
+    std::thread writer([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      file.append("de");
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      file.append("f");
+    });
+    EXPECT_EQ("def", readAll(*source, 3)) << "mapped: " << mapped;
+    writer.join();
+  }
+}
+
+}
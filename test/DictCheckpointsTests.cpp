@@ -0,0 +1,180 @@
+#include "au/AuEncoder.h"
+#include "au/FileByteSource.h"
+#include "DictCheckpoints.h"
+#include "KeyIndex.h"
+#include "Tail.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// Records whose strings are mostly interned, with a dictionary which is
+/// cleared every few hundred records.
+std::string encodeRecords(size_t num) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  config.clearThreshold = 200;
+  return encodeWith(num, [&](AuWriter &writer, size_t i) {
+    writer.map("seq", i, "msg", "message " + std::to_string(i / 3 % 500));
+  }, config);
+}
+
+/// The positions of the value records in source.
+std::vector<size_t> valuePositions(MmapByteSource &source) {
+  std::vector<size_t> result;
+  Dictionary dictionary;
+  DictTracker tracker;
+  AuRecordHandler<DictTracker> handler(dictionary, tracker);
+  auto parser = RecordParser(source, handler);
+  for (auto c = source.peek(); !c.isEof(); c = source.peek()) {
+    if (c == 'V') result.push_back(source.pos());
+    parser.record();
+  }
+  return result;
+}
+
+/// The msg of the value record at pos, decoded after syncing there with a
+/// fresh dictionary.
+std::optional<KeyValue> msgAt(MmapByteSource &source, size_t pos,
+                              const DictCheckpoints *checkpoints) {
+  Dictionary dictionary;
+  TailHandler(dictionary, source, checkpoints).syncAt(pos);
+  KeyCapture capture("msg");
+  AuRecordHandler<KeyCapture> handler(dictionary, capture);
+  auto parser = RecordParser(source, handler);
+  if (!parser.parseUntilValue()) return std::nullopt;
+  return capture.value();
+}
+
+}
+
+TEST(DictCheckpointsTest, CheckpointsAuRecords) {
+  TempFile file(encodeRecords(5000));
+  MmapByteSource source(file.path);
+  DictCheckpoints checkpoints;
+  checkpointAu(source, checkpoints, 4096);
+
+  auto &cps = checkpoints.checkpoints();
+  ASSERT_LT(10u, cps.size());
+  for (size_t i = 1; i < cps.size(); i++) {
+    EXPECT_LE(cps[i - 1].pos + 4096, cps[i].pos);
+    EXPECT_LE(cps[i - 1].dictPos, cps[i].dictPos);
+  }
+  for (auto &cp : cps) {
+    EXPECT_LE(cp.dictStart, cp.dictPos);
+    EXPECT_LT(cp.dictPos, cp.pos);
+  }
+}
+
+TEST(DictCheckpointsTest, RestoresDictionaries) {
+  TempFile file(encodeRecords(5000));
+  MmapByteSource source(file.path);
+  DictCheckpoints checkpoints;
+  checkpointAu(source, checkpoints, 4096);
+
+  // every record decodes the same with the checkpoints as without
+  source.seek(0);
+  auto positions = valuePositions(source);
+  ASSERT_EQ(5000u, positions.size());
+  for (size_t i = 0; i < positions.size(); i += 7) {
+    auto expected = msgAt(source, positions[i], nullptr);
+    ASSERT_TRUE(expected);
+    EXPECT_EQ(*expected, msgAt(source, positions[i], &checkpoints))
+        << "at " << positions[i];
+  }
+}
+
+TEST(DictCheckpointsTest, RoundTrips) {
+  TempFile file(encodeRecords(2000));
+  MmapByteSource source(file.path);
+  DictCheckpoints checkpoints;
+  checkpointAu(source, checkpoints, 2048);
+  ASSERT_FALSE(checkpoints.checkpoints().empty());
+
+  TempFile sidecar("");
+  struct stat fileStat;
+  ASSERT_EQ(0, ::stat(file.path.c_str(), &fileStat));
+  checkpoints.write(sidecar.path, fileStat);
+
+  auto loaded = DictCheckpoints::load(sidecar.path, fileStat);
+  ASSERT_TRUE(loaded);
+  auto &expected = checkpoints.checkpoints();
+  auto &actual = loaded->checkpoints();
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(expected[i].pos, actual[i].pos);
+    EXPECT_EQ(expected[i].dictStart, actual[i].dictStart);
+    EXPECT_EQ(expected[i].dictPos, actual[i].dictPos);
+    EXPECT_EQ(expected[i].size, actual[i].size);
+
+    // the restored dictionaries are the same, too
+    Dictionary fromOriginal, fromLoaded;
+    checkpoints.restore(fromOriginal, expected[i].dictPos);
+    loaded->restore(fromLoaded, expected[i].dictPos);
+    auto &a = fromOriginal.findDictionary(expected[i].dictPos, 0);
+    auto &b = fromLoaded.findDictionary(expected[i].dictPos, 0);
+    ASSERT_EQ(expected[i].size, a.size());
+    ASSERT_EQ(a.size(), b.size());
+    for (size_t j = 0; j < a.size(); j++) EXPECT_EQ(a.at(j), b.at(j));
+  }
+
+  auto changed = fileStat;
+  changed.st_size++;
+  EXPECT_FALSE(DictCheckpoints::load(sidecar.path, changed));
+  EXPECT_FALSE(DictCheckpoints::load(sidecar.path + ".missing", fileStat));
+}
+
+TEST(DictCheckpointsTest, IgnoresCorruptSidecars) {
+  TempFile file(encodeRecords(2000));
+  MmapByteSource source(file.path);
+  DictCheckpoints checkpoints;
+  checkpointAu(source, checkpoints, 2048);
+  struct stat fileStat;
+  ASSERT_EQ(0, ::stat(file.path.c_str(), &fileStat));
+  std::string written;
+  {
+    TempFile sidecar("");
+    checkpoints.write(sidecar.path, fileStat);
+    std::ifstream in(sidecar.path, std::ios_base::binary);
+    written.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+  ASSERT_GT(written.size(), 100u);
+
+  auto loads = [&](const std::string &contents) {
+    TempFile sidecar(contents);
+    std::unique_ptr<const DictCheckpoints> loaded;
+    EXPECT_NO_THROW(loaded = DictCheckpoints::load(sidecar.path, fileStat));
+    return loaded != nullptr;
+  };
+  ASSERT_TRUE(loads(written));
+  for (auto len : {size_t(0), size_t(3), size_t(31), size_t(32), size_t(40),
+                   written.size() / 2, written.size() - 1})
+    EXPECT_FALSE(loads(written.substr(0, len))) << "truncated to " << len;
+
+  auto foreign = written;
+  foreign[0] = 'X';
+  EXPECT_FALSE(loads(foreign));
+  auto newer = written;
+  newer[4]++;
+  EXPECT_FALSE(loads(newer));
+  // the first checkpoint's dictPos, which is past the second's
+  auto outOfOrder = written;
+  ASSERT_LE(2u, checkpoints.checkpoints().size());
+  uint64_t past = checkpoints.checkpoints()[1].dictPos + 1;
+  memcpy(outOfOrder.data() + 32 + 2 * sizeof(uint64_t), &past, sizeof(past));
+  EXPECT_FALSE(loads(outOfOrder));
+}
+
+}
@@ -0,0 +1,69 @@
+#include "Dictionary.h"
+
+#include "gtest/gtest.h"
+
+namespace au {
+
+TEST(Dictionary, EntriesAreViewsIntoTheArena) {
+  Dictionary dictionary;
+  auto &dict = dictionary.clear(0);
+  dict.add(10, "a string well past the small string optimization limit");
+  dict.add(20, "");
+  dict.add(30, "short");
+  EXPECT_EQ(3, dict.size());
+  EXPECT_EQ("a string well past the small string optimization limit",
+            dict.at(0));
+  EXPECT_EQ("", dict.at(1));
+  EXPECT_EQ("short", dict.at(2));
+  EXPECT_THROW(dict.at(3), parse_error);
+  EXPECT_TRUE(dict.includes(30));
+  EXPECT_FALSE(dict.includes(31));
+}
+
+TEST(Dictionary, SearchByPosition) {
+  Dictionary dictionary(3);
+  // added out of order, as happens when bisecting
+  dictionary.clear(200).add(250, "b");
+  dictionary.clear(0).add(50, "a");
+  dictionary.clear(400).add(450, "c");
+
+  EXPECT_EQ("a", dictionary.search(0)->at(0));
+  EXPECT_EQ("a", dictionary.search(50)->at(0));
+  EXPECT_EQ(nullptr, dictionary.search(51));
+  EXPECT_EQ("b", dictionary.search(225)->at(0));
+  EXPECT_EQ("c", dictionary.search(450)->at(0));
+  EXPECT_EQ(nullptr, dictionary.search(451));
+  EXPECT_THROW(dictionary.clear(25), parse_error);
+  EXPECT_EQ(dictionary.search(200), &dictionary.clear(200));
+
+  // recycles the oldest (starting at 200), which was cleared (but not added)
+  auto &recycled = dictionary.clear(100);
+  EXPECT_EQ(0, recycled.size());
+  EXPECT_EQ(&recycled, dictionary.search(100));
+  EXPECT_EQ(nullptr, dictionary.search(225));
+  EXPECT_EQ("a", dictionary.search(25)->at(0));
+  EXPECT_EQ("c", dictionary.search(425)->at(0));
+}
+
+TEST(Dictionary, Classifier) {
+  Dictionary dictionary;
+  auto &dict = dictionary.clear(0);
+  dict.add(10, "one");
+  EXPECT_FALSE(dict.classified());
+
+  dictionary.setClassifier([](std::string_view entry) {
+    return static_cast<uint8_t>(entry.size());
+  });
+  ASSERT_TRUE(dict.classified());
+  EXPECT_EQ(3, dict.flags(0));
+  dict.add(20, "four");
+  EXPECT_EQ(4, dict.flags(1));
+  EXPECT_EQ(7, dict.allFlags());
+  EXPECT_THROW(dict.flags(2), parse_error);
+
+  dictionary.clear(30).add(40, "xx");
+  EXPECT_EQ(2, dictionary.search(40)->flags(0));
+  EXPECT_EQ(2, dictionary.search(40)->allFlags());
+}
+
+}
@@ -0,0 +1,81 @@
+#include "GrepCache.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace au {
+
+TEST(GrepCacheTest, KeepsFilesBetweenGreps) {
+  TempFile file("some records");
+  GrepCache cache;
+  auto *first = cache.open(file.path, std::nullopt, false);
+  ASSERT_TRUE(first);
+  auto learned = first->learned("ts");
+  first->source->seek(5);
+
+  auto *second = cache.open(file.path, std::nullopt, false);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(learned, second->learned("ts"));
+  EXPECT_EQ(0u, second->source->pos());
+  EXPECT_EQ(1u, cache.size());
+
+  // the same file by another name is the same file, but not if it's opened
+  // differently
+  auto relative = fs::relative(file.path).string();
+  EXPECT_EQ(first, cache.open(relative, std::nullopt, false));
+  EXPECT_NE(first, cache.open(file.path, std::string("other.auzx"), false));
+}
+
+TEST(GrepCacheTest, ForgetsChangedFiles) {
+  TempFile file("some records");
+  GrepCache cache;
+  auto learned = cache.open(file.path, std::nullopt, false)->learned("ts");
+
+  file.write("some other records");
+  auto *changed = cache.open(file.path, std::nullopt, false);
+  ASSERT_TRUE(changed);
+  EXPECT_NE(learned, changed->learned("ts"));
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST(GrepCacheTest, KeepsOnlyTheMostRecentlySearched) {
+  std::vector<std::unique_ptr<TempFile>> files;
+  for (auto i = 0; i < 4; i++)
+    files.push_back(std::make_unique<TempFile>("some records"));
+  GrepCache cache(3);
+  std::vector<std::shared_ptr<KeyIndex>> learned;
+  for (auto &file : files) {
+    learned.push_back(
+        cache.open(file->path, std::nullopt, false)->learned("ts"));
+    EXPECT_GE(3u, cache.size());
+  }
+  EXPECT_EQ(3u, cache.size());
+
+  // the first went to make room for the last, the rest are still there
+  auto learnedFor = [&](size_t i) {
+    return cache.open(files[i]->path, std::nullopt, false)->learned("ts");
+  };
+  EXPECT_EQ(learned[3], learnedFor(3));
+  EXPECT_EQ(learned[1], learnedFor(1));
+  EXPECT_EQ(learned[2], learnedFor(2));
+  // searching the first again forgets 3, the least recently searched
+  EXPECT_NE(learned[0], learnedFor(0));
+  EXPECT_NE(learned[3], learnedFor(3));
+  EXPECT_EQ(learned[2], learnedFor(2));
+}
+
+TEST(GrepCacheTest, KeepsNothingForStdinOrMissingFiles) {
+  GrepCache cache;
+  EXPECT_FALSE(cache.open("-", std::nullopt, false));
+  EXPECT_FALSE(cache.open("/no/such/au/file", std::nullopt, false));
+  EXPECT_EQ(0u, cache.size());
+}
+
+}
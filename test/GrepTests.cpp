@@ -0,0 +1,509 @@
+#include "au/AuEncoder.h"
+#include "au/FileByteSource.h"
+#include "GrepHandler.h"
+#include "main.h"
+#include "TestHelpers.h"
+#include "Zindex.h"
+
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace au {
+
+namespace {
+
+/// Records with their index "i" and an ordered "ts" of tsOf(i), if it has one,
+/// padded out so that there are a few MB of them. Records with a padTo are
+/// padded to that many bytes instead.
+std::string encodeRecords(size_t num,
+                          std::function<std::optional<uint64_t>(size_t)> tsOf,
+                          std::function<size_t(size_t)> padTo = nullptr) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  config.clearThreshold = 200;
+  return encodeWith(num, [&](AuWriter &writer, size_t i) {
+    std::string pad(padTo ? padTo(i) : 0, 'x');
+    if (pad.empty()) pad = "padding " + std::to_string(i * 7919 % 100000);
+    auto ts = tsOf(i);
+    if (ts)
+      writer.map("i", i, "ts", *ts, "pad", pad);
+    else
+      writer.map("i", i, "pad", pad);
+  }, config);
+}
+
+/// Writes {"i": i, "name": name}, with name interned or inline as intern says.
+void writeNamed(AuWriter &writer, size_t i, const std::string &name,
+                std::optional<bool> intern) {
+  writer.startMap();
+  writer.key("i");
+  writer.value(i);
+  writer.key("name");
+  writer.value(name, intern);
+  writer.endMap();
+}
+
+/// Collects each record's i.
+struct IndexCapture : NoopValueHandler {
+  std::vector<uint64_t> found;
+  size_t uints = 0;
+
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &) {
+    uints = 0;
+    ValueParser<IndexCapture, Source>(source, *this).value();
+  }
+
+  void onUint(size_t, uint64_t v) override {
+    if (uints++ == 0) found.push_back(v);
+  }
+};
+
+struct Result {
+  std::vector<uint64_t> found;
+  size_t probes;
+};
+
+/// The first record with a "ts" of ts (or above, with orGreater), found by a
+/// bisect, and how many probes it took to find it.
+Result bisect(MmapByteSource &source, uint64_t ts, bool orGreater = false) {
+  Pattern pattern;
+  pattern.keyPattern = "ts";
+  pattern.uintPattern = ts;
+  pattern.bisect = true;
+  pattern.matchOrGreater = orGreater;
+  pattern.numMatches = 1;
+  // each probe lands on a record, which is added to this
+  pattern.learnedIndex = std::make_shared<KeyIndex>("ts");
+  source.seek(0);
+  IndexCapture capture;
+  EXPECT_EQ(0, AuGrepper(pattern, source, capture).doGrep());
+  return {capture.found, pattern.learnedIndex->samples().size()};
+}
+
+/// The records which match pattern, found by grepping all of source. Without
+/// classify, dictionary entries aren't classified, so every record is parsed.
+std::vector<uint64_t> grep(MmapByteSource &source, Pattern &pattern,
+                           bool classify = true) {
+  source.seek(0);
+  Dictionary dictionary(32);
+  IndexCapture capture;
+  AuGrepper grepper(pattern, source, capture, dictionary);
+  if (!classify) dictionary.setClassifier(nullptr);
+  grepper.doGrep();
+  return capture.found;
+}
+
+/// Greps for records containing needle both with the prefilter (see
+/// GrepHandler::skipValue()) and without it, and checks that both find
+/// expected.
+void expectNeedleFound(const std::string &encoded,
+                       const std::vector<uint64_t> &expected) {
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+  for (auto classify : {true, false}) {
+    Pattern pattern;
+    pattern.strPattern = Pattern::StrPattern{"needle", false};
+    EXPECT_EQ(expected, grep(source, pattern, classify))
+        << "classify: " << classify;
+  }
+}
+
+/// The records with a "ts" in [from, to), as au slice finds them.
+std::vector<uint64_t> slice(MmapByteSource &source, uint64_t from,
+                            uint64_t to,
+                            std::optional<uint32_t> matches = std::nullopt) {
+  // as sliceCmd() has it
+  Pattern pattern;
+  pattern.keyPattern = "ts";
+  pattern.uintPattern = from;
+  pattern.bisect = true;
+  pattern.matchOrGreater = true;
+  auto upperBound = std::make_shared<Pattern>();
+  upperBound->keyPattern = "ts";
+  upperBound->uintPattern = to;
+  upperBound->matchOrGreater = true;
+  pattern.upperBound = std::move(upperBound);
+  pattern.numMatches = matches;
+  source.seek(0);
+  IndexCapture capture;
+  EXPECT_EQ(0, AuGrepper(pattern, source, capture).doGrep());
+  return capture.found;
+}
+
+/// first, first + step... up to but not including last.
+std::vector<uint64_t> range(uint64_t first, uint64_t last, uint64_t step = 1) {
+  std::vector<uint64_t> result;
+  for (auto i = first; i < last; i += step) result.push_back(i);
+  return result;
+}
+
+/// What au grep prints given args, and what it returns.
+std::pair<int, std::string> grepCmd(std::vector<const char *> args) {
+  args.insert(args.begin(), {"au", "grep"});
+  CaptureCout capture;
+  auto code = au::grep(static_cast<int>(args.size()), args.data());
+  return {code, capture.str()};
+}
+
+/// How many probes a plain bisect of size bytes takes, before scanning.
+size_t bisectProbes(size_t size) {
+  return static_cast<size_t>(
+      std::ceil(std::log2(static_cast<double>(size) / (256 * 1024))));
+}
+
+}
+
+TEST(GrepTest, BisectsLinearTimestamps) {
+  // three records to each ts, so that the first of them has to be found
+  constexpr size_t Num = 200'000;
+  auto tsOf = [](size_t i) { return 1000 + i / 3 * 10; };
+  auto encoded = encodeRecords(Num, tsOf);
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+
+  // a bisect, a probe at the far end to find the values there, then one
+  // either side of the estimate
+  size_t limit = 4;
+  ASSERT_LT(limit, bisectProbes(encoded.size()));
+  for (size_t i = 0; i < Num; i += 997) {
+    auto first = i - i % 3;
+    auto exact = bisect(source, tsOf(i));
+    EXPECT_EQ(std::vector<uint64_t>{first}, exact.found) << "i = " << i;
+    EXPECT_GE(limit, exact.probes) << "i = " << i;
+
+    auto next = first + 3;
+    auto above = bisect(source, tsOf(i) + 5, true);
+    EXPECT_EQ(next < Num ? std::vector<uint64_t>{next}
+                         : std::vector<uint64_t>{},
+              above.found) << "i = " << i;
+  }
+
+  EXPECT_EQ(std::vector<uint64_t>{0}, bisect(source, 0, true).found);
+  EXPECT_TRUE(bisect(source, 999).found.empty());
+  EXPECT_TRUE(bisect(source, tsOf(Num - 1) + 1).found.empty());
+}
+
+TEST(GrepTest, BisectsSkewedTimestamps) {
+  // nine tenths of the file has the first thousandth of the values, so the
+  // estimates are way off, and it has to fall back to bisecting. that takes
+  // no more than a pair of estimates for each bisect it does
+  constexpr size_t Num = 200'000;
+  constexpr size_t Knee = Num / 10 * 9;
+  auto tsOf = [](size_t i) {
+    return i < Knee ? i : Knee + (i - Knee) * 5000;
+  };
+  auto encoded = encodeRecords(Num, tsOf);
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+
+  auto limit = 2 * bisectProbes(encoded.size()) + 4;
+  for (size_t i = 0; i < Num; i += 1999) {
+    auto found = bisect(source, tsOf(i));
+    EXPECT_EQ(std::vector<uint64_t>{i}, found.found) << "i = " << i;
+    EXPECT_GE(limit, found.probes) << "i = " << i;
+  }
+  for (auto i : {Knee - 1, Knee, Knee + 1, Num - 1}) {
+    auto found = bisect(source, tsOf(i));
+    EXPECT_EQ(std::vector<uint64_t>{i}, found.found) << "i = " << i;
+    EXPECT_GE(limit, found.probes) << "i = " << i;
+  }
+}
+
+TEST(GrepTest, BisectsPastHugeRecords) {
+  // a probe which lands in one of these only finds a record after it, maybe
+  // past the end of the range it's narrowing down
+  constexpr size_t Num = 50'000;
+  auto tsOf = [](size_t i) { return 1000 + i * 10; };
+  auto padTo = [](size_t i) -> size_t {
+    return i % 5000 == 2499 ? 1024 * 1024 : 0;
+  };
+  TempFile file(encodeRecords(Num, tsOf, padTo));
+  MmapByteSource source(file.path);
+
+  for (size_t huge = 2499; huge < Num; huge += 5000) {
+    for (auto i : {huge - 1, huge, huge + 1}) {
+      EXPECT_EQ(std::vector<uint64_t>{i}, bisect(source, tsOf(i)).found)
+          << "i = " << i;
+      EXPECT_EQ(std::vector<uint64_t>{i},
+                bisect(source, tsOf(i) - 5, true).found) << "i = " << i;
+    }
+  }
+}
+
+TEST(GrepTest, FindsKeysWrittenInline) {
+  // the encoder interns keys, but a writer needn't. every third record has
+  // the key inline rather than by reference, some of them before it's ever
+  // been interned.
+  auto encoded = encodeWith(3000, [](AuWriter &writer, size_t i) {
+    writer.startMap();
+    writer.key("i");
+    writer.value(i);
+    if (i % 3 == 0 || i < 10)
+      writer.value("hostname", false);
+    else
+      writer.key("hostname");
+    writer.value(i % 2 ? "webserver1" : "webserver2");
+    writer.endMap();
+  });
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+
+  std::vector<uint64_t> expected;
+  for (uint64_t i = 1; i < 3000; i += 2) expected.push_back(i);
+  for (auto classify : {true, false}) {
+    Pattern pattern;
+    pattern.keyPattern = "hostname";
+    pattern.strPattern = Pattern::StrPattern{"webserver1", true};
+    EXPECT_EQ(expected, grep(source, pattern, classify))
+        << "classify: " << classify;
+  }
+}
+
+TEST(GrepTest, PrefiltersInlineStrings) {
+  auto encoded = encodeWith(3000, [](AuWriter &writer, size_t i) {
+    auto name = (i % 5 ? "hay " : "a needle in hay ") + std::to_string(i);
+    writeNamed(writer, i, name, false);
+  });
+  expectNeedleFound(encoded, range(0, 3000, 5));
+}
+
+TEST(GrepTest, PrefiltersRefsPastTheFirst128) {
+  // entries past the first 128 are referred to by a marker and a varint,
+  // rather than a single byte
+  auto matches = [](size_t j) { return j == 5 || j == 140 || j == 299; };
+  auto encoded = encodeWith(3000, [&](AuWriter &writer, size_t i) {
+    auto j = i % 300;
+    auto name = "name " + std::to_string(j) + (matches(j) ? " needle" : "");
+    writeNamed(writer, i, name, true);
+  });
+  std::vector<uint64_t> expected;
+  for (uint64_t i = 0; i < 3000; i++)
+    if (matches(i % 300)) expected.push_back(i);
+  expectNeedleFound(encoded, expected);
+}
+
+TEST(GrepTest, PrefiltersManyMatchingEntries) {
+  // more matching entries than the prefilter looks for refs to
+  auto nameOf = [](size_t j) {
+    return (j % 2 ? "hay " : "needle ") + std::to_string(j);
+  };
+  auto encoded = encodeWith(3000, [&](AuWriter &writer, size_t i) {
+    writeNamed(writer, i, nameOf(i % 40), true);
+  });
+  expectNeedleFound(encoded, range(0, 3000, 2));
+}
+
+TEST(GrepTest, PrefiltersAcrossDictionaryResets) {
+  // the dictionary is cleared every 50 entries, so the same ref means a
+  // different entry from one dictionary to the next. each record adds a few
+  // entries, so a new dictionary is first seen with some in it already.
+  AuStringIntern::Config config;
+  config.clearThreshold = 50;
+  auto matches = [](size_t j) { return j % 37 == 0; };
+  auto nameOf = [&](size_t j) {
+    return "name " + std::to_string(j) + (matches(j) ? " needle" : "");
+  };
+  std::vector<uint64_t> expected;
+  auto encoded = encodeWith(3000, [&](AuWriter &writer, size_t i) {
+    writer.startMap();
+    writer.key("i");
+    writer.value(i);
+    writer.key("names");
+    writer.startArray();
+    auto matched = false;
+    for (auto j = i * 4 % 1000; j < i * 4 % 1000 + 4; j++) {
+      writer.value(nameOf(j), true);
+      matched |= matches(j);
+    }
+    writer.endArray();
+    writer.endMap();
+    if (matched) expected.push_back(i);
+  }, config);
+  expectNeedleFound(encoded, expected);
+}
+
+TEST(GrepTest, SkipsBlocksBySummary) {
+  // each block of ten records has one host, tag and zone, the tag in an
+  // array under its key and the zone in an object in that array
+  auto writeRecord = [](AuWriter &writer, size_t i) {
+    auto block = i / 10;
+    writer.startMap();
+    writer.key("i");
+    writer.value(i);
+    writer.key("host");
+    writer.value("host" + std::to_string(block % 5));
+    writer.key("tags");
+    writer.startArray();
+    writer.value("tag" + std::to_string(block % 7));
+    writer.map("zone", "zone" + std::to_string(block % 3));
+    writer.endArray();
+    writer.key("note");
+    writer.value("plain", false);
+    writer.endMap();
+  };
+  BlockSummary::Config summaries;
+  summaries.blockRecords = 10;
+  summaries.filterBytes = 64;
+  auto summarized = encodeWith(300, writeRecord, {}, summaries);
+
+  auto inBlocks = [](auto blockMatches) {
+    std::vector<uint64_t> result;
+    for (uint64_t i = 0; i < 300; i++)
+      if (blockMatches(i / 10)) result.push_back(i);
+    return result;
+  };
+  auto pattern = [](std::optional<std::string> key, std::string value) {
+    Pattern result;
+    result.keyPattern = std::move(key);
+    result.strPattern = Pattern::StrPattern{std::move(value), true};
+    return result;
+  };
+  {
+    TempFile file(summarized);
+    MmapByteSource source(file.path);
+    auto expectFound = [&](Pattern pattern,
+                           const std::vector<uint64_t> &expected) {
+      EXPECT_FALSE(pattern.summaryHashes().empty());
+      EXPECT_EQ(expected, grep(source, pattern));
+    };
+    expectFound(pattern("host", "host2"),
+                inBlocks([](size_t b) { return b % 5 == 2; }));
+    expectFound(pattern("tags", "tag3"),
+                inBlocks([](size_t b) { return b % 7 == 3; }));
+    expectFound(pattern("zone", "zone1"),
+                inBlocks([](size_t b) { return b % 3 == 1; }));
+    expectFound(pattern(std::nullopt, "tag3"),
+                inBlocks([](size_t b) { return b % 7 == 3; }));
+    Pattern number;
+    number.keyPattern = "i";
+    number.uintPattern = 57;
+    expectFound(number, {57});
+
+    expectFound(pattern("host", "host9"), {});
+    expectFound(pattern("host", "tag3"), {});
+    expectFound(pattern("zone", "tag3"), {});
+  }
+
+  // a value in the first block which its summary doesn't know about isn't
+  // found, as the block is skipped...
+  auto patched = summarized;
+  auto note = patched.find("plain");
+  ASSERT_NE(std::string::npos, note);
+  patched.replace(note, 5, "fancy");
+  TempFile file(patched);
+  MmapByteSource source(file.path);
+  auto fancy = pattern("note", "fancy");
+  EXPECT_TRUE(grep(source, fancy).empty());
+  // ...unless every record has to be seen
+  fancy.beforeContext = 1;
+  EXPECT_EQ(std::vector<uint64_t>{0}, grep(source, fancy));
+}
+
+TEST(GrepTest, BisectsGzippedFilesWithAutoIndexes) {
+  auto tsOf = [](size_t i) { return 1000 + i / 3 * 10; };
+  TempFile file(encodeRecords(100'000, tsOf));
+  auto gzipped = file.path + ".gz";
+  auto index = gzipped + ".auzx";
+  // gzipFile() always indexes what it writes
+  ASSERT_EQ(0, gzipFile(file.path, gzipped, std::nullopt));
+  fs::remove(index);
+
+  auto ts = std::to_string(tsOf(76543));
+  auto bisect = [&](const char *autoIndex) {
+    std::vector<const char *> args{"-c", "-o", "ts", ts.c_str(),
+                                   gzipped.c_str()};
+    if (autoIndex) args.insert(args.begin(), autoIndex);
+    return grepCmd(args);
+  };
+  const std::pair<int, std::string> found{0, "3\n"};
+
+  EXPECT_EQ(found, bisect("--auto-index"));
+  EXPECT_FALSE(fs::exists(index));
+  EXPECT_EQ(found, bisect("--save-index"));
+  ASSERT_TRUE(fs::exists(index));
+  // the saved index is used from then on
+  EXPECT_TRUE(ZipByteSource(gzipped, std::nullopt).isSeekable());
+  EXPECT_EQ(found, bisect(nullptr));
+  // and left alone by the next --save-index
+  auto saved = fs::last_write_time(index);
+  EXPECT_EQ(found, bisect("--save-index"));
+  EXPECT_EQ(saved, fs::last_write_time(index));
+}
+
+TEST(GrepTest, SlicesFromAndTo) {
+  constexpr size_t Num = 100'000;
+  auto tsOf = [](size_t i) { return 1000 + i * 10; };
+  TempFile file(encodeRecords(Num, tsOf));
+  MmapByteSource source(file.path);
+
+  // from is in the slice, to isn't
+  EXPECT_EQ(range(5000, 70000), slice(source, tsOf(5000), tsOf(70000)));
+  EXPECT_EQ(range(5001, 70001), slice(source, tsOf(5000) + 1, tsOf(70000) + 1));
+  EXPECT_EQ(range(0, Num), slice(source, 0, tsOf(Num)));
+  EXPECT_EQ(range(90000, Num), slice(source, tsOf(90000), tsOf(Num) + 1000));
+  EXPECT_TRUE(slice(source, tsOf(500), tsOf(500)).empty());
+  EXPECT_TRUE(slice(source, tsOf(500) + 1, tsOf(501)).empty());
+  EXPECT_TRUE(slice(source, tsOf(Num), tsOf(Num) + 1000).empty());
+
+  // -m
+  EXPECT_EQ(range(5000, 5010), slice(source, tsOf(5000), tsOf(70000), 10));
+  EXPECT_EQ(range(5000, 5100), slice(source, tsOf(5000), tsOf(5100), 1000));
+}
+
+TEST(GrepTest, SlicesOutOfOrderRecords) {
+  // records in the slice turn up a little after it, and a long way after it
+  constexpr size_t Num = 200'000;
+  constexpr size_t Near = 21'000;
+  constexpr size_t Far = 150'000;
+  auto tsOf = [](size_t i) -> uint64_t {
+    if (i == Near) return 1000 + 15'000 * 10;
+    if (i == Far) return 1000 + 16'000 * 10;
+    return 1000 + i * 10;
+  };
+  auto encoded = encodeRecords(Num, tsOf);
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+  // a little after is well within SUFFIX_AMOUNT, a long way isn't
+  ASSERT_LT(encoded.size() / Num * (Near - 20'000), 256 * 1024u);
+  ASSERT_GT(encoded.size() / Num * (Far - 20'000), 4 * 1024 * 1024u);
+
+  auto expected = range(10'000, 20'000);
+  expected.push_back(Near);
+  EXPECT_EQ(expected, slice(source, tsOf(10'000), tsOf(20'000)));
+}
+
+TEST(GrepTest, SlicesRecordsMissingTheKey) {
+  // every seventh record has no ts, which neither matches nor ends the slice
+  constexpr size_t Num = 100'000;
+  auto tsOf = [](size_t i) -> std::optional<uint64_t> {
+    if (i % 7 == 3) return std::nullopt;
+    return 1000 + i * 10;
+  };
+  TempFile file(encodeRecords(Num, tsOf));
+  MmapByteSource source(file.path);
+
+  auto keyed = [&](uint64_t first, uint64_t last) {
+    std::vector<uint64_t> result;
+    for (auto i : range(first, last))
+      if (tsOf(i)) result.push_back(i);
+    return result;
+  };
+  auto ts = [](size_t i) { return 1000 + i * 10; };
+  EXPECT_EQ(keyed(5000, 70000), slice(source, ts(5000), ts(70000)));
+  // with ends where the records without the key would have been
+  ASSERT_FALSE(tsOf(5001) || tsOf(69996));
+  EXPECT_EQ(keyed(5002, 69996), slice(source, ts(5001), ts(69996)));
+  EXPECT_EQ(keyed(5000, 5007), slice(source, ts(5000), ts(70000), 6));
+}
+
+}
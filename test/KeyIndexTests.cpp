@@ -0,0 +1,217 @@
+#include "au/AuEncoder.h"
+#include "au/FileByteSource.h"
+#include "KeyIndex.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// Records with an ordered "seq" key, nested one level down in every other
+/// record, plus the occasional record without it.
+std::string encodeRecords(size_t num) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  config.clearThreshold = 20;
+  return encodeWith(num, [&](AuWriter &writer, size_t i) {
+    if (i % 10 == 5) {
+      writer.map("other", i);
+    } else if (i % 2) {
+      writer.map("msg", "message " + std::to_string(i),
+                 "inner", [&]() { writer.map("seq", i * 10); });
+    } else {
+      writer.map("seq", i * 10, "msg", "message " + std::to_string(i));
+    }
+  }, config);
+}
+
+uint64_t seqOf(const KeyIndex::Sample &sample) {
+  return std::get<uint64_t>(sample.value);
+}
+
+}
+
+TEST(KeyIndexTest, SamplesAuRecords) {
+  TempFile file(encodeRecords(1000));
+  MmapByteSource source(file.path);
+  KeyIndex index("seq");
+  sampleAuKey(source, index, 100);
+
+  auto &samples = index.samples();
+  ASSERT_EQ(10u, samples.size());
+  EXPECT_EQ(0u, seqOf(samples[0]));
+  for (size_t i = 1; i < samples.size(); i++) {
+    EXPECT_LT(samples[i - 1].pos, samples[i].pos);
+    EXPECT_LE(seqOf(samples[i - 1]) + 1000, seqOf(samples[i]));
+  }
+
+  // the samples are some of those we get when sampling every record
+  source.seek(0);
+  KeyIndex all("seq");
+  sampleAuKey(source, all, 1);
+  EXPECT_EQ(900u, all.samples().size());
+  for (auto &sample : samples) {
+    auto it = std::find_if(
+        all.samples().begin(), all.samples().end(),
+        [&](auto &s) { return s.pos == sample.pos; });
+    ASSERT_NE(all.samples().end(), it);
+    EXPECT_EQ(seqOf(sample), seqOf(*it));
+  }
+}
+
+TEST(KeyIndexTest, SamplesTheValuesGrepMatches) {
+  // as grep -k does, look through arrays under the key, but not objects
+  std::string encoded;
+  AuEncoder encoder;
+  auto write = [&](std::string_view dict, std::string_view value) {
+    encoded.append(dict);
+    encoded.append(value);
+    return dict.size() + value.size();
+  };
+  std::vector<std::function<void(AuWriter &)>> records{
+      [](AuWriter &w) { w.map("seq", [&] { w.array(nullptr, 5u); }); },
+      [](AuWriter &w) { w.map("seq", [&] { w.map("a", 1u); }, "b", 2u); },
+      [](AuWriter &w) { w.map("x", [&] { w.map("seq", 7u); }); },
+      [](AuWriter &w) {
+        w.map("seq", [&] { w.array([&] { w.array(3u); }); });
+      },
+      [](AuWriter &w) {
+        w.map("seq", [&] { w.array([&] { w.map("a", 1u); }, 4u); });
+      },
+      [](AuWriter &w) { w.map("seq", [&] { w.map("seq", 6u); }); },
+      [](AuWriter &w) { w.map("a", [&] { w.array(1u); }, "seq", 8u); },
+      [](AuWriter &w) {
+        w.map("seq", [&] { w.array(); }, "y", [&] { w.map("seq", 9u); });
+      },
+  };
+  for (auto &record : records) encoder.encode(record, write);
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+  KeyIndex index("seq");
+  sampleAuKey(source, index, 1);
+
+  std::vector<uint64_t> sampled;
+  for (auto &sample : index.samples()) sampled.push_back(seqOf(sample));
+  EXPECT_EQ((std::vector<uint64_t>{5, 7, 3, 4, 6, 8, 9}), sampled);
+}
+
+TEST(KeyIndexTest, RoundTrips) {
+  KeyIndex index("t");
+  index.add(0, KeyValue(int64_t(-5)));
+  index.add(10, KeyValue(uint64_t(7)));
+  index.add(20, KeyValue(1.5));
+  index.add(30, KeyValue(time_point(std::chrono::nanoseconds(123456789))));
+  index.add(40, KeyValue(std::string("hello")));
+
+  TempFile data("whatever");
+  TempFile sidecar("");
+  struct stat fileStat;
+  ASSERT_EQ(0, ::stat(data.path.c_str(), &fileStat));
+  index.write(sidecar.path, fileStat);
+
+  auto loaded = KeyIndex::load(sidecar.path, fileStat);
+  ASSERT_TRUE(loaded);
+  EXPECT_EQ("t", loaded->key());
+  ASSERT_EQ(index.samples().size(), loaded->samples().size());
+  for (size_t i = 0; i < index.samples().size(); i++) {
+    EXPECT_EQ(index.samples()[i].pos, loaded->samples()[i].pos);
+    EXPECT_EQ(index.samples()[i].value, loaded->samples()[i].value);
+  }
+
+  auto changed = fileStat;
+  changed.st_size++;
+  EXPECT_FALSE(KeyIndex::load(sidecar.path, changed));
+  EXPECT_FALSE(KeyIndex::load(sidecar.path + ".missing", fileStat));
+}
+
+TEST(KeyIndexTest, IgnoresCorruptSidecars) {
+  KeyIndex index("t");
+  index.add(0, KeyValue(uint64_t(7)));
+  index.add(10, KeyValue(std::string("hello")));
+  index.add(20, KeyValue(uint64_t(9)));
+  TempFile data("whatever");
+  struct stat fileStat;
+  ASSERT_EQ(0, ::stat(data.path.c_str(), &fileStat));
+  std::string written;
+  {
+    TempFile sidecar("");
+    index.write(sidecar.path, fileStat);
+    std::ifstream in(sidecar.path, std::ios_base::binary);
+    written.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+
+  auto loads = [&](const std::string &contents) {
+    TempFile sidecar(contents);
+    std::unique_ptr<const KeyIndex> loaded;
+    EXPECT_NO_THROW(loaded = KeyIndex::load(sidecar.path, fileStat));
+    return loaded != nullptr;
+  };
+  ASSERT_TRUE(loads(written));
+  for (size_t len = 0; len < written.size(); len += 3)
+    EXPECT_FALSE(loads(written.substr(0, len))) << "truncated to " << len;
+
+  auto foreign = written;
+  foreign[0] = 'X';
+  EXPECT_FALSE(loads(foreign));
+  auto newer = written;
+  newer[4]++;
+  EXPECT_FALSE(loads(newer));
+  // the header, the key, then the first sample's position and type
+  constexpr size_t FirstSample = 40 + 1;
+  auto unknownType = written;
+  unknownType[FirstSample + 8] = 9;
+  EXPECT_FALSE(loads(unknownType));
+  auto outOfOrder = written;
+  uint64_t past = 15;
+  memcpy(outOfOrder.data() + FirstSample, &past, sizeof(past));
+  EXPECT_FALSE(loads(outOfOrder));
+}
+
+TEST(KeyIndexTest, Narrows) {
+  KeyIndex index("seq");
+  for (uint64_t i = 0; i < 10; i++) index.add(100 * (i + 1), KeyValue(i));
+  auto atLeast = [](uint64_t v) {
+    return [v](const KeyValue &val) { return std::get<uint64_t>(val) >= v; };
+  };
+
+  size_t start = 0, end = 5000;
+  index.narrow(atLeast(4), start, end);
+  EXPECT_EQ(400u, start);
+  EXPECT_EQ(500u, end);
+
+  start = 0, end = 5000;
+  index.narrow(atLeast(0), start, end);
+  EXPECT_EQ(0u, start);
+  EXPECT_EQ(100u, end);
+
+  start = 0, end = 5000;
+  index.narrow(atLeast(100), start, end);
+  EXPECT_EQ(1000u, start);
+  EXPECT_EQ(5000u, end);
+}
+
+TEST(KeyIndexTest, InsertsInPositionOrder) {
+  KeyIndex index("seq");
+  for (uint64_t pos : {500, 100, 300, 100, 700})
+    index.insert(pos, KeyValue(pos / 100));
+  auto &samples = index.samples();
+  ASSERT_EQ(4u, samples.size());
+  for (size_t i = 0; i < samples.size(); i++) {
+    EXPECT_EQ(100 + 200 * i, samples[i].pos);
+    EXPECT_EQ(samples[i].pos / 100, seqOf(samples[i]));
+  }
+}
+
+}
@@ -0,0 +1,146 @@
+#include "au/AuEncoder.h"
+#include "au/BufferByteSource.h"
+#include "Merge.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// Collects each record's values, as text.
+struct RecordCapture : NoopValueHandler {
+  std::vector<std::string> records;
+  const Dictionary::Dict *dict = nullptr;
+  std::string str;
+
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dictionary) {
+    dict = &dictionary;
+    records.emplace_back();
+    ValueParser<RecordCapture, Source>(source, *this).value();
+  }
+
+  void onUint(size_t, uint64_t v) override {
+    records.back() += std::to_string(v) + " ";
+  }
+  void onDictRef(size_t, size_t idx) override {
+    records.back() += std::string(dict->at(idx)) + " ";
+  }
+  void onStringStart(size_t, size_t) override { str.clear(); }
+  void onStringFragment(std::string_view frag) override { str += frag; }
+  void onStringEnd() override { records.back() += str + " "; }
+};
+
+struct Input {
+  std::string encoded;
+  /// What RecordCapture makes of each record, with the key it's merged by.
+  std::vector<std::pair<std::optional<KeyValue>, std::string>> records;
+};
+
+/// Records from src with a "ts" which goes up by a pseudo-random step, except
+/// for every seventh record, which has no "ts" at all.
+Input encodeInput(const std::string &src, size_t num, uint64_t seed) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  config.clearThreshold = 20;
+  AuEncoder encoder("", 250'000, 1, 500'000, config);
+  Input result;
+  auto write = [&](std::string_view dict, std::string_view value) {
+    result.encoded.append(dict);
+    result.encoded.append(value);
+    return dict.size() + value.size();
+  };
+  std::optional<KeyValue> key;
+  uint64_t ts = 100;
+  for (size_t i = 0; i < num; i++) {
+    seed = seed * 6364136223846793005u + 1442695040888963407u;
+    ts += seed >> 61;
+    auto n = std::to_string(i % 30);
+    if (i % 7 == 3) {
+      encoder.encode([&](AuWriter &writer) {
+        writer.map("src", src, "n", n);
+      }, write);
+      result.records.emplace_back(key, "src " + src + " n " + n + " ");
+    } else {
+      encoder.encode([&](AuWriter &writer) {
+        writer.map("src", src, "n", n, "ts", ts);
+      }, write);
+      key = KeyValue(ts);
+      result.records.emplace_back(
+          key, "src " + src + " n " + n + " ts " + std::to_string(ts) + " ");
+    }
+  }
+  return result;
+}
+
+}
+
+TEST(MergeTest, KeyOrder) {
+  auto less = [](KeyValue a, KeyValue b) { return keyLess(a, b); };
+  EXPECT_TRUE(less(int64_t(-1), uint64_t(0)));
+  EXPECT_FALSE(less(uint64_t(0), int64_t(-1)));
+  EXPECT_TRUE(less(int64_t(5), uint64_t(1ull << 63)));
+  EXPECT_FALSE(less(uint64_t(1ull << 63), int64_t(5)));
+  EXPECT_FALSE(less(uint64_t(3), int64_t(3)));
+  EXPECT_FALSE(less(int64_t(3), uint64_t(3)));
+  EXPECT_TRUE(less(int64_t(1), 1.5));
+  EXPECT_TRUE(less(1.5, uint64_t(2)));
+  EXPECT_TRUE(less(1e300, time_point()));
+  EXPECT_TRUE(less(time_point(), std::string("a")));
+  EXPECT_TRUE(less(std::string("a"), std::string("b")));
+  EXPECT_FALSE(less(std::string("a"), time_point()));
+
+  std::optional<KeyValue> none;
+  std::optional<KeyValue> some(int64_t(-100));
+  EXPECT_TRUE(keyLess(none, some));
+  EXPECT_FALSE(keyLess(some, none));
+  EXPECT_FALSE(keyLess(none, none));
+}
+
+TEST(MergeTest, MergesByKey) {
+  std::vector<Input> inputs{
+      encodeInput("a", 500, 1), encodeInput("b", 800, 2),
+      encodeInput("c", 50, 3), encodeInput("d", 0, 4)};
+
+  std::vector<std::unique_ptr<BufferByteSource>> sources;
+  std::vector<std::unique_ptr<MergeInput>> auInputs;
+  RecordCapture capture;
+  for (auto &input : inputs) {
+    auto &source = *sources.emplace_back(
+        std::make_unique<BufferByteSource>(input.encoded));
+    auInputs.push_back(
+        std::make_unique<AuMergeInput<BufferByteSource, RecordCapture>>(
+            source, "ts", capture));
+  }
+  mergeInputs(auInputs);
+
+  // the records of each input stay in order, and ties go to earlier inputs
+  struct Expected {
+    std::optional<KeyValue> key;
+    size_t input;
+    std::string record;
+  };
+  std::vector<Expected> expected;
+  for (size_t i = 0; i < inputs.size(); i++)
+    for (auto &[key, record] : inputs[i].records)
+      expected.push_back(Expected{key, i, record});
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const Expected &a, const Expected &b) {
+                     if (keyLess(a.key, b.key)) return true;
+                     if (keyLess(b.key, a.key)) return false;
+                     return a.input < b.input;
+                   });
+
+  ASSERT_EQ(expected.size(), capture.records.size());
+  for (size_t i = 0; i < expected.size(); i++)
+    EXPECT_EQ(expected[i].record, capture.records[i]) << "record " << i;
+}
+
+}
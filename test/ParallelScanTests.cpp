@@ -0,0 +1,157 @@
+#include "au/AuEncoder.h"
+#include "GrepHandler.h"
+#include "JsonOutputHandler.h"
+#include "ParallelScan.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <sstream>
+#include <string>
+
+namespace au {
+
+namespace {
+
+/// Lots of small records, with a dictionary that's cleared often, and the
+/// occasional string that looks like the end of a record.
+std::string encodeRecords(size_t num) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  config.clearThreshold = 20;
+  const std::string lookalike{marker::RecordEnd, '\n', 'V', 'x'};
+  return encodeWith(num, [&](AuWriter &writer, size_t i) {
+    writer.map("i", i,
+               "kind", "kind" + std::to_string(i % 7),
+               "tag", "tag" + std::to_string(i * 7919 % 53),
+               "msg", (i % 11 ? "message " : lookalike) + std::to_string(i));
+  }, config);
+}
+
+std::string serialCat(MmapByteSource &source) {
+  std::ostringstream out;
+  Dictionary dictionary;
+  JsonOutputHandler handler(out);
+  AuRecordHandler recordHandler(dictionary, handler);
+  RecordParser(source, recordHandler).parseStream();
+  return out.str();
+}
+
+std::string catInParallel(MmapByteSource &source, size_t chunkSize) {
+  std::string result;
+  parallelScan<std::ostringstream>(
+      source, 3,
+      [](MmapByteSource &src, ChunkRange &range, std::ostringstream &out) {
+        Dictionary dictionary;
+        JsonOutputHandler handler(out);
+        AuRecordHandler recordHandler(dictionary, handler);
+        if (!range.sync(src, dictionary)) return;
+        RecordParser parser(src, recordHandler);
+        while (range.nextValue(src, recordHandler)) parser.record();
+      },
+      [&](std::ostringstream &out) { result += out.str(); },
+      chunkSize);
+  return result;
+}
+
+Pattern stringPattern(const std::string &str, uint32_t before, uint32_t after) {
+  Pattern pattern;
+  pattern.strPattern = Pattern::StrPattern{str, false};
+  pattern.beforeContext = before;
+  pattern.afterContext = after;
+  return pattern;
+}
+
+std::string serialGrep(Pattern pattern, MmapByteSource &source) {
+  CaptureCout capture;
+  source.seek(0);
+  JsonOutputHandler handler;
+  EXPECT_EQ(0, AuGrepper(pattern, source, handler).doGrep());
+  return capture.str();
+}
+
+std::string grepInParallel(Pattern pattern, MmapByteSource &source,
+                           size_t chunkSize) {
+  CaptureCout capture;
+  EXPECT_EQ(0, parallelGrep(pattern, source, 3, chunkSize));
+  return capture.str();
+}
+
+}
+
+TEST(ParallelScan, CatMatchesSerial) {
+  TempFile file(encodeRecords(2000));
+  MmapByteSource source(file.path);
+  auto expected = serialCat(source);
+  ASSERT_EQ(2000, std::count(expected.begin(), expected.end(), '\n'));
+  for (size_t chunkSize : {64, 500, 4096, 1 << 20})
+    EXPECT_EQ(expected, catInParallel(source, chunkSize)) << chunkSize;
+}
+
+TEST(ParallelScan, GrepMatchesSerial) {
+  TempFile file(encodeRecords(2000));
+  MmapByteSource source(file.path);
+  for (auto &str : {"kind3", "message 1", "tag17", "message 1999"}) {
+    for (auto [before, after] : {std::pair{0u, 0u}, {2u, 0u}, {0u, 3u},
+                                 {4u, 5u}, {40u, 1u}, {1u, 90u}}) {
+      auto pattern = stringPattern(str, before, after);
+      auto expected = serialGrep(pattern, source);
+      for (size_t chunkSize : {64, 700, 1 << 20}) {
+        EXPECT_EQ(expected, grepInParallel(pattern, source, chunkSize))
+            << str << " -B " << before << " -A " << after
+            << " chunk size " << chunkSize;
+      }
+    }
+    auto pattern = stringPattern(str, 0, 0);
+    pattern.count = true;
+    EXPECT_EQ(serialGrep(pattern, source), grepInParallel(pattern, source, 500));
+  }
+}
+
+TEST(ParallelScan, RescansChunkAfterFalseSync) {
+  // a string containing a complete, valid value record, whose backref
+  // points at the dictionary reset at the start of the file.
+  const std::string placeholder = "PLACEHOLDERPLACEHOLDER";
+  auto encode = [&](const std::string &str) {
+    AuEncoder encoder;
+    std::string result;
+    auto write = [&](std::string_view dict, std::string_view value) {
+      result.append(dict);
+      result.append(value);
+      return dict.size() + value.size();
+    };
+    for (int i = 0; i < 100; i++) {
+      encoder.encode([&](AuWriter &writer) {
+        writer.map("i", i, "str", i == 50 ? str : std::to_string(i));
+      }, write);
+    }
+    return result;
+  };
+  auto contents = encode(placeholder);
+  auto fakeStart = contents.find(placeholder);
+  ASSERT_NE(std::string::npos, fakeStart);
+  auto clearPos = contents.find(std::string{marker::RecordEnd, '\n', 'C'}) + 2;
+  uint32_t backref = static_cast<uint32_t>(fakeStart + 2 - clearPos);
+  std::string fake{marker::RecordEnd, '\n', 'V'};
+  fake.append(reinterpret_cast<const char *>(&backref), sizeof(backref));
+  fake += {3, static_cast<char>(marker::SmallInt::Positive | 5),
+           marker::RecordEnd, '\n'};
+  fake.resize(placeholder.size(), ' ');
+  contents.replace(fakeStart, fake.size(), fake);
+
+  TempFile file(contents);
+  MmapByteSource source(file.path);
+  // make sure the fake record really would fool sync()
+  {
+    Dictionary dictionary;
+    source.seek(fakeStart - 1);
+    ASSERT_TRUE(TailHandler(dictionary, source).sync(true));
+    ASSERT_EQ(fakeStart + 2, source.pos());
+  }
+  source.seek(0);
+  auto expected = serialCat(source);
+  EXPECT_EQ(expected, catInParallel(source, fakeStart + 1));
+}
+
+}
@@ -0,0 +1,218 @@
+#include "au/AuEncoder.h"
+#include "GrepCache.h"
+#include "Serve.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+using namespace std::chrono_literals;
+
+namespace au {
+
+namespace {
+
+/// Sets an environment variable (or unsets it, with no value) for as long as
+/// it's in scope.
+class ScopedEnv {
+  std::string name_;
+  std::optional<std::string> orig_;
+
+  static void set(const std::string &name,
+                  const std::optional<std::string> &value) {
+    if (value)
+      ::setenv(name.c_str(), value->c_str(), 1);
+    else
+      ::unsetenv(name.c_str());
+  }
+
+public:
+  ScopedEnv(std::string name, const std::optional<std::string> &value)
+      : name_(std::move(name)) {
+    if (auto *orig = ::getenv(name_.c_str())) orig_ = orig;
+    set(name_, value);
+  }
+
+  ~ScopedEnv() { set(name_, orig_); }
+};
+
+/// A socket for grep --server to find, for as long as it's in scope.
+struct TempSocket {
+  TempDir dir;
+  std::string path = dir.file("au.sock");
+  ScopedEnv env{"AU_SOCKET", path};
+  int listener = listenForGreps(path);
+
+  ~TempSocket() { ::close(listener); }
+
+  /// Serves the next connection, on another thread.
+  std::future<void> serveOne(GrepCache &cache) {
+    return std::async(std::launch::async, [this, &cache] {
+      int conn = ::accept(listener, nullptr, nullptr);
+      ASSERT_LE(0, conn) << strerror(errno);
+      serveConnection(conn, cache);
+      ::close(conn);
+    });
+  }
+};
+
+/// Records with a sequence number and a message shared by every three.
+std::string encodeRecords(size_t num) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  return encodeWith(num, [&](AuWriter &writer, size_t i) {
+    writer.map("seq", i, "msg", "message " + std::to_string(i / 3 % 500));
+  }, config);
+}
+
+struct Result {
+  int code;
+  std::string out;
+  std::string err;
+};
+
+Result viaServer(std::vector<const char *> args) {
+  args.insert(args.begin(), {"au", "grep", "--server"});
+  std::ostringstream out;
+  std::ostringstream err;
+  auto code = grepViaServer(static_cast<int>(args.size()), args.data(), out,
+                            err);
+  return {code, out.str(), err.str()};
+}
+
+/// A request, as grep --server would send it.
+std::string request(const std::vector<std::string> &args) {
+  std::string result(sizeof(uint32_t), '\0');
+  result.append(fs::current_path().string());
+  result.push_back('\0');
+  for (auto &arg : args) {
+    result.append(arg);
+    result.push_back('\0');
+  }
+  auto len = static_cast<uint32_t>(result.size() - sizeof(uint32_t));
+  memcpy(result.data(), &len, sizeof(len));
+  return result;
+}
+
+}
+
+TEST(ServeTest, RunsGrepsAndKeepsTheirFiles) {
+  TempFile file(encodeRecords(1000));
+  TempSocket socket;
+  GrepCache cache;
+
+  for (auto i = 0; i < 2; i++) {
+    auto served = socket.serveOne(cache);
+    auto result =
+        viaServer({"-c", "-k", "msg", "message 7", file.path.c_str()});
+    served.get();
+    EXPECT_EQ(0, result.code) << result.err;
+    EXPECT_EQ("3\n", result.out);
+    EXPECT_EQ("", result.err);
+  }
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST(ServeTest, RelaysErrors) {
+  TempSocket socket;
+  GrepCache cache;
+
+  auto served = socket.serveOne(cache);
+  auto result = viaServer({"-c", "message 7", "/no/such/au/file"});
+  served.get();
+  EXPECT_EQ(1, result.code);
+  EXPECT_EQ("", result.out);
+  EXPECT_NE(std::string::npos, result.err.find("/no/such/au/file"))
+      << result.err;
+
+  served = socket.serveOne(cache);
+  result = viaServer({"--not-an-option", "message 7", "file"});
+  served.get();
+  EXPECT_NE(0, result.code);
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(ServeTest, ListensOnlyForTheCurrentUser) {
+  TempSocket socket;
+  struct stat socketStat;
+  ASSERT_EQ(0, ::stat(socket.path.c_str(), &socketStat));
+  EXPECT_TRUE(S_ISSOCK(socketStat.st_mode));
+  EXPECT_EQ(0u, socketStat.st_mode & 0077);
+
+  // there can only be one server
+  EXPECT_THROW(listenForGreps(socket.path), std::runtime_error);
+}
+
+TEST(ServeTest, ReplacesSocketsLeftBehind) {
+  TempDir dir;
+  auto path = dir.file("au.sock");
+  ::close(listenForGreps(path));
+  ASSERT_TRUE(fs::exists(path));
+  auto listener = listenForGreps(path);
+  EXPECT_LE(0, listener);
+  ::close(listener);
+}
+
+TEST(ServeTest, HangsUpOnClientsWhichSendNothing) {
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  GrepCache cache;
+  auto start = std::chrono::steady_clock::now();
+  serveConnection(fds[0], cache, {100ms, 100ms});
+  EXPECT_GT(5s, std::chrono::steady_clock::now() - start);
+  ::close(fds[0]);
+
+  // with no reply
+  char buf[1];
+  EXPECT_EQ(0, ::read(fds[1], buf, sizeof(buf)));
+  ::close(fds[1]);
+}
+
+TEST(ServeTest, GivesUpOnClientsWhichStopReading) {
+  // enough matches to fill up the socket's buffers many times over
+  TempFile file(encodeRecords(100'000));
+  int fds[2];
+  ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  auto req = request({"grep", "-u", "-k", "msg", "message", file.path});
+  ASSERT_EQ(static_cast<ssize_t>(req.size()),
+            ::write(fds[1], req.data(), req.size()));
+
+  GrepCache cache;
+  auto served = std::async(std::launch::async, [&] {
+    serveConnection(fds[0], cache, {100ms, 100ms});
+  });
+  if (served.wait_for(30s) != std::future_status::ready)
+    ADD_FAILURE() << "Still sending to a client which isn't reading";
+  // which lets it finish, if it hadn't
+  ::close(fds[1]);
+  served.get();
+  ::close(fds[0]);
+}
+
+TEST(ServeTest, DefaultSocket) {
+  ScopedEnv runtimeDir("XDG_RUNTIME_DIR", "/run/user/1234");
+  {
+    ScopedEnv socket("AU_SOCKET", "/some/where.sock");
+    EXPECT_EQ("/some/where.sock", defaultServeSocket());
+  }
+  ScopedEnv socket("AU_SOCKET", std::nullopt);
+  EXPECT_EQ("/run/user/1234/au.sock", defaultServeSocket());
+  ScopedEnv noRuntimeDir("XDG_RUNTIME_DIR", std::nullopt);
+  EXPECT_EQ("/tmp/au-" + std::to_string(::getuid()) + ".sock",
+            defaultServeSocket());
+}
+
+}
@@ -0,0 +1,140 @@
+#include "au/AuEncoder.h"
+#include "au/FileByteSource.h"
+#include "Tail.h"
+#include "TestHelpers.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace au {
+
+namespace {
+
+/// Records with a sequence number and a mostly interned string, with the
+/// dictionary cleared every few hundred records.
+std::string encodeRecords(size_t num) {
+  AuStringIntern::Config config;
+  config.internThresh = 2;
+  config.clearThreshold = 200;
+  return encodeWith(num, [&](AuWriter &writer, size_t i) {
+    writer.map("seq", i, "msg", "message " + std::to_string(i / 3 % 500));
+  }, config);
+}
+
+/// Collects the seq and msg of each record.
+struct SeqCapture : NoopValueHandler {
+  std::vector<std::string> records;
+  const Dictionary::Dict *dict = nullptr;
+  std::string str;
+
+  template <typename Source>
+  void onValue(Source &source, const Dictionary::Dict &dictionary) {
+    dict = &dictionary;
+    records.emplace_back();
+    ValueParser<SeqCapture, Source>(source, *this).value();
+  }
+
+  void onUint(size_t, uint64_t v) override {
+    records.back() += std::to_string(v) + " ";
+  }
+  void onDictRef(size_t, size_t idx) override {
+    records.back() += std::string(dict->at(idx)) + " ";
+  }
+  void onStringStart(size_t, size_t) override { str.clear(); }
+  void onStringFragment(std::string_view frag) override { str += frag; }
+  void onStringEnd() override { records.back() += str + " "; }
+};
+
+std::vector<std::string> expected(size_t num) {
+  std::vector<std::string> result;
+  for (size_t i = 0; i < num; i++) {
+    result.push_back("seq " + std::to_string(i) + " msg message "
+                     + std::to_string(i / 3 % 500) + " ");
+  }
+  return result;
+}
+
+}
+
+TEST(TailTest, LastRecords) {
+  TempFile file(encodeRecords(5000));
+  auto all = expected(5000);
+  for (size_t n : {1u, 2u, 10u, 1000u, 4999u, 5000u, 6000u}) {
+    MmapByteSource source(file.path);
+    Dictionary dictionary;
+    TailHandler handler(dictionary, source);
+    ASSERT_TRUE(handler.seekLast(n));
+    SeqCapture capture;
+    handler.parseRecords(capture);
+    std::vector<std::string> last(
+        all.end() - static_cast<ptrdiff_t>(std::min<size_t>(n, all.size())),
+        all.end());
+    EXPECT_EQ(last, capture.records) << "n = " << n;
+  }
+
+  MmapByteSource source(file.path);
+  Dictionary dictionary;
+  TailHandler handler(dictionary, source);
+  ASSERT_TRUE(handler.seekLast(0));
+  SeqCapture capture;
+  handler.parseRecords(capture);
+  EXPECT_TRUE(capture.records.empty());
+}
+
+TEST(TailTest, Reversed) {
+  // enough for a few windows
+  TempFile file(encodeRecords(150000));
+  MmapByteSource source(file.path);
+  Dictionary dictionary(4);
+  TailHandler handler(dictionary, source);
+  SeqCapture capture;
+  handler.parseReversed(capture);
+  auto all = expected(150000);
+  std::reverse(all.begin(), all.end());
+  EXPECT_EQ(all, capture.records);
+}
+
+TEST(TailTest, PartlyWrittenLastRecord) {
+  auto encoded = encodeRecords(5000);
+  encoded.resize(encoded.size() - 5);
+  TempFile file(encoded);
+  auto all = expected(4999);
+  MmapByteSource source(file.path);
+  Dictionary dictionary;
+  TailHandler handler(dictionary, source);
+  ASSERT_TRUE(handler.seekLast(10));
+  SeqCapture capture;
+  // the partly written record is still there to trip over when not following
+  EXPECT_THROW(handler.parseRecords(capture), std::exception);
+  ASSERT_LE(10u, capture.records.size());
+  capture.records.resize(10);
+  EXPECT_EQ(std::vector<std::string>(all.end() - 10, all.end()),
+            capture.records);
+}
+
+TEST(TailTest, BadRecordBeforeGoodOnes) {
+  // a value record a few from the end which doesn't parse
+  auto encoded = encodeRecords(5000);
+  const char start[] = {marker::RecordEnd, '\n', 'V', 0};
+  auto pos = encoded.size();
+  for (int i = 0; i < 5; i++) pos = encoded.rfind(start, pos - 1);
+  encoded[pos + 2] = 'X';
+  TempFile file(encoded);
+  MmapByteSource source(file.path);
+  Dictionary dictionary;
+  TailHandler handler(dictionary, source);
+  EXPECT_THROW(handler.seekLast(10), std::exception);
+}
+
+TEST(TailTest, NoRecords) {
+  TempFile file(encodeRecords(0));
+  MmapByteSource source(file.path);
+  Dictionary dictionary;
+  TailHandler handler(dictionary, source);
+  EXPECT_FALSE(handler.seekLast(10));
+}
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "au/AuEncoder.h"
+#include "au/ParseError.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+namespace au {
+
+/// A directory of a test's own, so that tests running at the same time (or
+/// left over from one that crashed) can't trip over each other's files.
+/// Everything in it goes when it goes out of scope.
+class TempDir {
+  std::string path_;
+
+public:
+  TempDir() {
+    auto pattern =
+        (std::filesystem::temp_directory_path() / "au_test_XXXXXX").string();
+    if (!::mkdtemp(pattern.data()))
+      THROW_RT("mkdtemp: " << strerror(errno) << " (" << pattern << ")");
+    path_ = pattern;
+  }
+
+  ~TempDir() {
+    std::error_code ignored;
+    std::filesystem::remove_all(path_, ignored);
+  }
+
+  TempDir(const TempDir &) = delete;
+  TempDir &operator=(const TempDir &) = delete;
+
+  const std::string &path() const { return path_; }
+
+  /// Where a file called name would go in here. It isn't created.
+  std::string file(std::string_view name) const {
+    return (std::filesystem::path(path_) / name).string();
+  }
+};
+
+/// A file holding contents, in a TempDir of its own, so any files written
+/// next to it (indexes and the like) are cleaned up with it.
+struct TempFile {
+  TempDir dir;
+  std::string path;
+
+  explicit TempFile(std::string_view contents, std::string_view name = "file")
+      : path(dir.file(name)) {
+    write(contents);
+  }
+
+  void write(std::string_view contents) const {
+    std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+    out << contents;
+  }
+
+  void append(std::string_view contents) const {
+    std::ofstream out(path, std::ios_base::binary | std::ios_base::app);
+    out << contents;
+  }
+};
+
+/// Redirects std::cout for as long as it's alive.
+struct CaptureCout {
+  std::ostringstream captured;
+  std::streambuf *orig;
+
+  CaptureCout() : orig(std::cout.rdbuf(captured.rdbuf())) {}
+  ~CaptureCout() { std::cout.rdbuf(orig); }
+
+  std::string str() { return captured.str(); }
+};
+
+/// num records, each written by writeRecord(writer, i), encoded as a file
+/// would have them.
+inline std::string encodeWith(
+    size_t num,
+    const std::function<void(AuWriter &, size_t)> &writeRecord,
+    AuStringIntern::Config config = {},
+    BlockSummary::Config summaries = {}) {
+  AuEncoder encoder("", 250'000, 1, 500'000, config, summaries);
+  std::string result;
+  auto write = [&](std::string_view dict, std::string_view value) {
+    result.append(dict);
+    result.append(value);
+    return dict.size() + value.size();
+  };
+  for (size_t i = 0; i < num; i++)
+    encoder.encode([&](AuWriter &writer) { writeRecord(writer, i); }, write);
+  encoder.flush(write);
+  return result;
+}
+
+/// Lines of text, which compress well but not so well that a deflate block
+/// covers very much of them.
+inline std::string compressibleText(size_t len) {
+  std::string result;
+  uint64_t seed = 1;
+  for (size_t i = 0; result.size() < len; i++) {
+    seed = seed * 6364136223846793005u + 1442695040888963407u;
+    result += "record " + std::to_string(i) + " value "
+              + std::to_string(seed >> 54) + "\n";
+  }
+  result.resize(len);
+  return result;
+}
+
+}
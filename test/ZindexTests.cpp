@@ -0,0 +1,259 @@
+#include "au/FileByteSource.h"
+#include "TestHelpers.h"
+#include "Zindex.h"
+
+#include "gtest/gtest.h"
+
+#include <zlib.h>
+
+#include <filesystem>
+#include <string>
+#include <sys/time.h>
+
+namespace fs = std::filesystem;
+
+namespace au {
+
+namespace {
+
+/// data as a single gzip member.
+std::string gzip(std::string_view data) {
+  z_stream zs{};
+  EXPECT_EQ(Z_OK, deflateInit2(&zs, 6, Z_DEFLATED, 16 + 15, 8,
+                               Z_DEFAULT_STRATEGY));
+  std::string result(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  zs.avail_in = static_cast<uInt>(data.size());
+  zs.next_out = reinterpret_cast<Bytef *>(result.data());
+  zs.avail_out = static_cast<uInt>(result.size());
+  EXPECT_EQ(Z_STREAM_END, deflate(&zs, Z_FINISH));
+  result.resize(zs.total_out);
+  deflateEnd(&zs);
+  return result;
+}
+
+/// data decompressed by zlib itself, which reads on through any number of
+/// gzip members.
+std::string gunzip(const std::string &path) {
+  auto *file = gzopen(path.c_str(), "rb");
+  EXPECT_NE(nullptr, file);
+  std::string result;
+  char buf[65536];
+  int len;
+  while ((len = gzread(file, buf, sizeof(buf))) > 0)
+    result.append(buf, static_cast<size_t>(len));
+  gzclose(file);
+  return result;
+}
+
+std::string readAll(FileByteSource &source) {
+  std::string result;
+  for (auto c = source.next(); !c.isEof(); c = source.next())
+    result.push_back(c.charValue());
+  return result;
+}
+
+/// Seeks to positions all over source (backwards, too), checking what's read
+/// there against data.
+void expectSeeksMatch(FileByteSource &source, const std::string &data) {
+  ASSERT_TRUE(source.isSeekable());
+  constexpr size_t Len = 1000;
+  for (size_t i = 0; i < 50; i++) {
+    auto pos = (i * 7919 * 104729) % (data.size() - Len);
+    source.seek(pos);
+    std::string read;
+    source.readFunc(Len, [&](std::string_view frag) { read += frag; });
+    ASSERT_EQ(data.substr(pos, Len), read) << "at " << pos;
+  }
+}
+
+}
+
+TEST(ZindexTest, IndexesManyCheckpointsPerRead) {
+  // each read of the compressed file holds a lot of checkpoints, many more
+  // than a single window compressor is allowed to have queued
+  auto data = compressibleText(16 * 1024 * 1024);
+  TempFile file(gzip(data), "file.gz");
+  auto index = file.path + ".auzx";
+  ASSERT_EQ(0, zindexFile(file.path, index, 1, 4096));
+
+  ZipByteSource source(file.path, index);
+  expectSeeksMatch(source, data);
+}
+
+TEST(ZindexTest, GzipRoundTrips) {
+  // several times as many members as the compressors are allowed to have
+  // queued
+  auto data = compressibleText(25 * 1024 * 1024 + 12345);
+  TempFile input(data);
+  for (size_t threads : {1u, 2u}) {
+    TempDir dir;
+    auto file = dir.file("file.gz");
+    auto index = file + ".auzx";
+    ASSERT_EQ(0, gzipFile(input.path, file, index, threads));
+    EXPECT_EQ(data, gunzip(file));
+
+    ZipByteSource source(file, index);
+    EXPECT_EQ(data, readAll(source));
+    expectSeeksMatch(source, data);
+  }
+}
+
+TEST(ZindexTest, GzipRemovesPartialOutput) {
+  // a directory opens, but can't be read
+  TempDir dir;
+  auto file = dir.file("file.gz");
+  EXPECT_THROW(gzipFile(dir.path(), file, file + ".auzx"),
+               std::runtime_error);
+  EXPECT_FALSE(fs::exists(file));
+}
+
+TEST(ZindexTest, ReadsMultipleMembers) {
+  auto data = compressibleText(3 * 1024 * 1024);
+  auto split1 = 100'000u;
+  auto split2 = 2'000'000u;
+  // an empty member, too, as au gzip writes for an empty file
+  TempFile file(gzip(data.substr(0, split1)) + gzip("")
+                    + gzip(data.substr(split1, split2 - split1))
+                    + gzip(data.substr(split2)),
+                "file.gz");
+  ASSERT_EQ(data, gunzip(file.path));
+
+  // unindexed, it's read straight through
+  {
+    ZipByteSource source(file.path, std::nullopt);
+    EXPECT_EQ(data, readAll(source));
+  }
+
+  // and the index has checkpoints in every member, at their starts or within
+  auto index = file.path + ".auzx";
+  ASSERT_EQ(0, zindexFile(file.path, index, 2, 64 * 1024));
+  ZipByteSource source(file.path, index);
+  expectSeeksMatch(source, data);
+  for (auto pos : {split1 - 1, split1, split2 - 1, split2}) {
+    source.seek(pos);
+    std::string read;
+    source.readFunc(10, [&](std::string_view frag) { read += frag; });
+    EXPECT_EQ(data.substr(pos, 10), read) << "at " << pos;
+  }
+}
+
+TEST(ZindexTest, SeeksWithV1Index) {
+  // an index as au zindex used to write them, as a series of au records, with
+  // checkpoints at 36000 and 72000 (where the file has deflate blocks which
+  // end part way through a byte)
+  constexpr time_t ModTime = 1792202720;
+  // the index has the file's name in it
+  TempDir dir;
+  auto file = dir.file("v1.txt.gz");
+  auto index = file + ".auzx";
+  fs::copy_file("zindex/v1.txt.gz", file);
+  fs::copy_file("zindex/v1.txt.gz.auzx", index);
+  // and checks the file hasn't changed since it was written
+  timeval times[2] = {{ModTime, 0}, {ModTime, 0}};
+  ASSERT_EQ(0, ::utimes(file.c_str(), times));
+  auto data = gunzip(file);
+  ASSERT_EQ(102'411u, data.size());
+
+  ZipByteSource source(file, index);
+  EXPECT_EQ(data.size(), source.endPos());
+  expectSeeksMatch(source, data);
+  // all of that fits in the source's buffer, so each of these starts afresh
+  // to be sure of inflating from the checkpoint before it
+  for (size_t pos : {36'000, 36'001, 71'999, 72'000, 102'400}) {
+    ZipByteSource fresh(file, index);
+    fresh.seek(pos);
+    std::string read;
+    fresh.readFunc(11, [&](std::string_view frag) { read += frag; });
+    EXPECT_EQ(data.substr(pos, 11), read) << "at " << pos;
+  }
+}
+
+TEST(ZindexTest, SeeksBackAndForthBetweenCheckpoints) {
+  // as a bisect does, going back to checkpoints it's been to before, where
+  // it can carry on from a context set aside there or start again from the
+  // checkpoint's window. each read fills the 256KB source buffer, so every
+  // seek here goes past it.
+  constexpr size_t MB = 1024 * 1024;
+  constexpr size_t Checkpoints = 24;
+  auto data = compressibleText(Checkpoints * MB);
+  TempFile file(gzip(data), "file.gz");
+  auto index = file.path + ".auzx";
+  ASSERT_EQ(0, zindexFile(file.path, index, 1, MB));
+
+  ZipByteSource source(file.path, index);
+  auto expectAt = [&](size_t pos) {
+    constexpr size_t Len = 1000;
+    source.seek(pos);
+    std::string read;
+    source.readFunc(Len, [&](std::string_view frag) { read += frag; });
+    ASSERT_EQ(data.substr(pos, Len), read) << "at " << pos;
+  };
+
+  // between a few checkpoints, a little further on in each every time
+  for (size_t step = 0; step < 3; step++)
+    for (size_t checkpoint : {2, 17, 9, 20})
+      expectAt(checkpoint * MB + 100 + step * 300 * 1024);
+  // and back
+  for (size_t checkpoint : {17, 2, 20, 9}) expectAt(checkpoint * MB + 5000);
+  // to more checkpoints than there's room to keep windows for, and back
+  for (size_t checkpoint = 0; checkpoint < Checkpoints; checkpoint++)
+    expectAt(checkpoint * MB + 7777);
+  for (size_t checkpoint = Checkpoints; checkpoint-- > 0;)
+    expectAt(checkpoint * MB + 3333);
+
+  // and bisects themselves
+  for (size_t target : {12345u, 5'000'000u, 5'100'000u, 23'000'000u}) {
+    size_t lo = 0;
+    size_t hi = data.size() - 1000;
+    while (hi - lo > 1000) {
+      auto mid = lo + (hi - lo) / 2;
+      expectAt(mid);
+      (mid < target ? lo : hi) = mid;
+    }
+  }
+}
+
+TEST(ZindexTest, InflatesAheadAsSerialReadsDo) {
+  // segments are around 150KB, and no more than 1MB of them is inflated
+  // ahead, so a seek 6MB on is past any that are
+  auto data = compressibleText(8 * 1024 * 1024);
+  TempFile file(gzip(data), "file.gz");
+  auto index = file.path + ".auzx";
+  ASSERT_EQ(0, zindexFile(file.path, index, 1, 256 * 1024));
+
+  // reads 64KB at each of positions in turn, both serially (-j1) and
+  // inflating ahead (-j4)
+  auto expectReadsMatch = [&](std::vector<size_t> positions,
+                              size_t maxBytesAhead = 1024 * 1024) {
+    ZipByteSource serial(file.path, index);
+    ZipByteSource ahead(file.path, index);
+    ahead.inflateAhead(4, maxBytesAhead);
+    constexpr size_t Len = 64 * 1024;
+    for (auto pos : positions) {
+      std::string fromSerial, fromAhead;
+      serial.seek(pos);
+      serial.readFunc(Len, [&](std::string_view frag) { fromSerial += frag; });
+      ahead.seek(pos);
+      ahead.readFunc(Len, [&](std::string_view frag) { fromAhead += frag; });
+      ASSERT_EQ(data.substr(pos, Len), fromSerial) << "at " << pos;
+      ASSERT_EQ(fromSerial, fromAhead) << "at " << pos;
+    }
+  };
+
+  // within the segment being read, and on across the end of it
+  expectReadsMatch({0, 1000, 70'000, 20'000, 140'000});
+  // into the segments inflated ahead, then past them
+  expectReadsMatch({0, 400'000, 900'000, 6'000'000, 6'100'000});
+  // behind the segment being read, and then on again
+  expectReadsMatch({300'000, 10, 5'000, 3'000'000, 2'000'000});
+
+  // all of it, and with room for only one segment ahead at a time
+  for (size_t maxBytesAhead : {DefaultInflateAheadBytes, size_t{1}}) {
+    ZipByteSource ahead(file.path, index);
+    ahead.inflateAhead(4, maxBytesAhead);
+    EXPECT_EQ(data, readAll(ahead)) << "ahead: " << maxBytesAhead;
+  }
+}
+
+}
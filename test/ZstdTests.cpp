@@ -0,0 +1,125 @@
+#include "au/FileByteSource.h"
+#include "TestHelpers.h"
+#include "Zstd.h"
+
+#include "gtest/gtest.h"
+
+#include <zstd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace au {
+
+namespace {
+
+std::string slurp(const std::string &path) {
+  std::ifstream in(path, std::ios_base::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+/// The contents of path decompressed by zstd itself, which reads on through
+/// any number of frames and skips skippable ones, such as the seek table.
+std::string unzstd(const std::string &path, size_t len) {
+  auto compressed = slurp(path);
+  std::string result(len + 1, '\0');
+  auto size = ZSTD_decompress(result.data(), result.size(), compressed.data(),
+                              compressed.size());
+  EXPECT_FALSE(ZSTD_isError(size)) << ZSTD_getErrorName(size);
+  result.resize(ZSTD_isError(size) ? 0 : size);
+  return result;
+}
+
+std::string readAll(FileByteSource &source) {
+  std::string result;
+  for (auto c = source.next(); !c.isEof(); c = source.next())
+    result.push_back(c.charValue());
+  return result;
+}
+
+std::string readAt(FileByteSource &source, size_t pos, size_t len) {
+  source.seek(pos);
+  std::string result;
+  source.readFunc(len, [&](std::string_view frag) { result += frag; });
+  return result;
+}
+
+}
+
+TEST(ZstdTest, RoundTrips) {
+  // many frames, several times as many as the compressors are allowed to
+  // have queued, and a short one at the end
+  auto data = compressibleText(25 * 1024 * 1024 + 12345);
+  TempFile input(data);
+  for (size_t threads : {1u, 2u}) {
+    TempDir dir;
+    auto file = dir.file("file.zst");
+    ASSERT_EQ(0, zstdFile(input.path, file, threads));
+    EXPECT_EQ(data, unzstd(file, data.size()));
+
+    ZstdByteSource source(file);
+    ASSERT_TRUE(source.isSeekable());
+    EXPECT_EQ(data.size(), source.endPos());
+    EXPECT_EQ(data, readAll(source));
+
+    // seeks all over, backwards too, and either side of frame boundaries
+    constexpr size_t Len = 1000;
+    for (size_t i = 0; i < 50; i++) {
+      auto pos = (i * 7919 * 104729) % (data.size() - Len);
+      ASSERT_EQ(data.substr(pos, Len), readAt(source, pos, Len))
+          << "at " << pos;
+    }
+    constexpr size_t Frame = 1024 * 1024;
+    for (auto pos : {Frame - 1, Frame, 3 * Frame - 5, 25 * Frame,
+                     data.size() - 10}) {
+      EXPECT_EQ(data.substr(pos, 10), readAt(source, pos, 10))
+          << "at " << pos;
+    }
+  }
+}
+
+TEST(ZstdTest, EmptyFile) {
+  TempFile input("");
+  auto file = input.path + ".zst";
+  ASSERT_EQ(0, zstdFile(input.path, file));
+  ZstdByteSource source(file);
+  EXPECT_EQ("", readAll(source));
+}
+
+TEST(ZstdTest, RemovesPartialOutput) {
+  // a directory opens, but can't be read
+  TempDir dir;
+  auto file = dir.file("file.zst");
+  try {
+    zstdFile(dir.path(), file);
+    ADD_FAILURE() << "compressing a directory didn't fail";
+  } catch (const std::runtime_error &e) {
+    EXPECT_NE(std::string::npos,
+              std::string(e.what()).find(strerror(EISDIR)));
+  }
+  EXPECT_FALSE(fs::exists(file));
+}
+
+TEST(ZstdTest, ReadsPlainZstd) {
+  // a single frame with no seek table can only be read straight through
+  auto data = compressibleText(3 * 1024 * 1024);
+  std::string compressed(ZSTD_compressBound(data.size()), '\0');
+  auto size = ZSTD_compress(compressed.data(), compressed.size(), data.data(),
+                            data.size(), 3);
+  ASSERT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  TempFile file(compressed, "file.zst");
+
+  ZstdByteSource source(file.path);
+  EXPECT_FALSE(source.isSeekable());
+  EXPECT_EQ(data, readAll(source));
+}
+
+}